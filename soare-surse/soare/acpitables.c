@@ -1,10 +1,16 @@
 #include "defs.h"
+#include "memdefs.h"
 #include "ntstatus.h"
 #include "varargs.h"
 #include "log.h"
 #include "string.h"
+#include "memory.h"
 #include "acpitables.h"
 #include "virtmemmgr.h"
+#include "pooltag.h"
+#include "slab.h"
+#include "rcu.h"
+#include "winlists.h"
 
 /// TODO: integrate ACPICA lib to make this simpler
 
@@ -18,6 +24,75 @@
 #define RSDP_STD_CHECKSUM_SIZE      20
 #define RSDP_EXT_CHECKSUM_SIZE      36
 
+#define ACPI_MAX_LOCAL_APICS        256         // the xAPIC IDs are 8 bits wide
+
+// What the MADT says about the local APICs. A parse builds a new one and publishes it as a whole, the old one is
+// freed after an RCU grace period; the readers never see a half parsed table.
+typedef struct _ACPI_LAPIC_INFO
+{
+    RCU_HEAD    Rcu;
+    QWORD       Address;
+    DWORD       Count;
+    BYTE        Ids[ACPI_MAX_LOCAL_APICS];
+} ACPI_LAPIC_INFO;
+
+static ACPI_LAPIC_INFO *gAcpiLapics;
+
+
+static
+VOID
+_AcpiFreeLapicInfo(
+    _In_ PRCU_HEAD Head
+)
+{
+    ACPI_LAPIC_INFO *pInfo = CONTAINING_RECORD(Head, ACPI_LAPIC_INFO, Rcu);
+    NTSTATUS status;
+
+    status = KmFreeAndNull((PVOID *)&pInfo, TAG_ACPI);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KmFreeAndNull failed: 0x%08x\n", status);
+    }
+}
+
+
+// The firmware owns the frames, only the mapped range is charged to TAG_ACPI
+static
+NTSTATUS
+_AcpiMapTable(
+    _In_ QWORD PhysicalAddress,
+    _In_ DWORD Size,
+    _Out_ PVOID *Ptr
+)
+{
+    NTSTATUS status = MmMapPhysicalPages(PhysicalAddress, Size, Ptr, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    if (!NT_SUCCESS(status))
+    {
+        MmTagFailure(TAG_ACPI);
+        return status;
+    }
+
+    MmTagCharge(TAG_ACPI, ROUND_UP(PhysicalAddress + Size, PAGE_SIZE_4K) - ROUND_DOWN(PhysicalAddress, PAGE_SIZE_4K));
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+_AcpiUnmapTableAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Size
+)
+{
+    QWORD va = (QWORD)*Ptr;
+
+    if (NT_SUCCESS(MmUnmapRangeAndNull(Ptr, Size, MAP_FLG_SKIP_PHYPAGE_CHECK)))
+    {
+        MmTagCredit(TAG_ACPI, ROUND_UP(va + Size, PAGE_SIZE_4K) - ROUND_DOWN(va, PAGE_SIZE_4K));
+    }
+}
+
 
 UINT8
 AcpiGetTableChecksum(
@@ -95,10 +170,10 @@ AcpiFindRootPointer(
     DWORD paTable;
     NTSTATUS status;
 
-    status = MmMapPhysicalPages(EBDA_PTR_PA_LOCATION, EBDA_PTR_SIZE, &pTable, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    status = _AcpiMapTable(EBDA_PTR_PA_LOCATION, EBDA_PTR_SIZE, &pTable);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p:0x%08x: 0x%08x\n", 
+        LogWithInfo("[ERROR] _AcpiMapTable failed for %018p:0x%08x: 0x%08x\n", 
             EBDA_PTR_PA_LOCATION, EBDA_PTR_SIZE, status);
         return status;
     }
@@ -107,20 +182,20 @@ AcpiFindRootPointer(
     paTable = *(WORD *)(pTable);
     paTable <<= 4;
 
-    MmUnmapRangeAndNull(&pTable, EBDA_PTR_SIZE, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    _AcpiUnmapTableAndNull(&pTable, EBDA_PTR_SIZE);
 
     if (paTable > 0x400)
     {
-        status = MmMapPhysicalPages(paTable, EBDA_RANGE, &pTable, MAP_FLG_SKIP_PHYPAGE_CHECK);
+        status = _AcpiMapTable(paTable, EBDA_RANGE, &pTable);
         if (!NT_SUCCESS(status))
         {
-            LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p:0x%08x: 0x%08x\n",
+            LogWithInfo("[ERROR] _AcpiMapTable failed for %018p:0x%08x: 0x%08x\n",
                 paTable, EBDA_RANGE, status);
             return status;
         }
 
         pIterator = AcpiSearchRsdp(pTable, EBDA_RANGE);
-        MmUnmapRangeAndNull(&pTable, EBDA_RANGE, MAP_FLG_SKIP_PHYPAGE_CHECK);
+        _AcpiUnmapTableAndNull(&pTable, EBDA_RANGE);
 
         if (pIterator)
         {
@@ -131,16 +206,16 @@ AcpiFindRootPointer(
         }
     }
 
-    status = MmMapPhysicalPages(RSDP_BASE_PA, RSDP_RANGE, &pTable, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    status = _AcpiMapTable(RSDP_BASE_PA, RSDP_RANGE, &pTable);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p:0x%08x: 0x%08x\n",
+        LogWithInfo("[ERROR] _AcpiMapTable failed for %018p:0x%08x: 0x%08x\n",
             RSDP_BASE_PA, RSDP_RANGE, status);
         return status;
     }
 
     pIterator = AcpiSearchRsdp(pTable, RSDP_RANGE);    
-    MmUnmapRangeAndNull(&pTable, RSDP_RANGE, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    _AcpiUnmapTableAndNull(&pTable, RSDP_RANGE);
 
     if (pIterator)
     {
@@ -194,10 +269,10 @@ AcpiParseXRsdt(
     PXSDT_TABLE pXsdt = NULL;
     PACPI_TABLE_HEADER pCommonHeader = NULL;
 
-    status = MmMapPhysicalPages(TablePhysicalAddress, tableSize, &pSdt, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    status = _AcpiMapTable(TablePhysicalAddress, tableSize, &pSdt);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] MmMapPhysicalPages failed for %p: 0x%x\n", TablePhysicalAddress, status);
+        LogWithInfo("[ERROR] _AcpiMapTable failed for %p: 0x%x\n", TablePhysicalAddress, status);
         goto _cleanup_and_exit;
     }
 
@@ -237,10 +312,10 @@ AcpiParseXRsdt(
         PACPI_TABLE_HEADER pHeader = NULL;
 
         Log("[ACPI] %s[%d] = %018p\n", Extended ? "XSDT" : "RSDT", i, headerPa);
-        status = MmMapPhysicalPages(headerPa, sizeof(ACPI_TABLE_HEADER), &pHeader, MAP_FLG_SKIP_PHYPAGE_CHECK);
+        status = _AcpiMapTable(headerPa, sizeof(ACPI_TABLE_HEADER), &pHeader);
         if (!NT_SUCCESS(status))
         {
-            LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p: 0x%08x\n", headerPa, status);
+            LogWithInfo("[ERROR] _AcpiMapTable failed for %018p: 0x%08x\n", headerPa, status);
             goto _cleanup_and_exit;
         }
 
@@ -259,7 +334,7 @@ AcpiParseXRsdt(
                 pHeader->Signature[0], pHeader->Signature[1], pHeader->Signature[2], pHeader->Signature[3]);
         }
 
-        MmUnmapRangeAndNull(&pHeader, sizeof(ACPI_TABLE_HEADER), MAP_FLG_SKIP_PHYPAGE_CHECK);
+        _AcpiUnmapTableAndNull(&pHeader, sizeof(ACPI_TABLE_HEADER));
         if (!NT_SUCCESS(status))
         {
             // propagate the error returned by AcpiParseApicMadt
@@ -270,7 +345,7 @@ AcpiParseXRsdt(
 _cleanup_and_exit:
     if (NULL != pSdt)
     {
-        MmUnmapRangeAndNull(&pSdt, tableSize, MAP_FLG_SKIP_PHYPAGE_CHECK);
+        _AcpiUnmapTableAndNull(&pSdt, tableSize);
     }
 
     return status;
@@ -325,15 +400,24 @@ AcpiParseMadt(
 {
     PACPI_TABLE_HEADER pHeader = NULL;
     PMADT_LOCAL_APIC_TABLE pMadt;
+    ACPI_LAPIC_INFO *pInfo = NULL;
+    ACPI_LAPIC_INFO *pOld;
     QWORD apicAddress;
     NTSTATUS status;
 
-    status = MmMapPhysicalPages(MadtPhysicalAddress, 
-        sizeof(ACPI_TABLE_HEADER) + sizeof(MADT_LOCAL_APIC_TABLE), 
-        &pHeader, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    status = KmAlloc(sizeof(ACPI_LAPIC_INFO), TAG_ACPI, (PVOID *)&pInfo);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KmAlloc failed: 0x%08x\n", status);
+        goto _cleanup_and_exit;
+    }
+    memset(pInfo, 0, sizeof(ACPI_LAPIC_INFO));
+
+    // the entries are walked up to Size, so map all of them
+    status = _AcpiMapTable(MadtPhysicalAddress, (DWORD)Size, &pHeader);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p: 0x%08x\n", MadtPhysicalAddress, status);
+        LogWithInfo("[ERROR] _AcpiMapTable failed for %018p: 0x%08x\n", MadtPhysicalAddress, status);
         goto _cleanup_and_exit;
     }
 
@@ -353,6 +437,17 @@ AcpiParseMadt(
             Log("\t\t Local APIC ID:     %d\n", pMadt->Id);
             Log("\t\t LAPIC Flags:       0x%x\n", pMadt->LapicFlags);
 
+            // disabled processors can't be started
+            if ((pMadt->LapicFlags & MADT_LAPIC_FLG_ENABLED) && pInfo->Count < ACPI_MAX_LOCAL_APICS)
+            {
+                pInfo->Ids[pInfo->Count++] = pMadt->Id;
+            }
+
+            break;
+
+        case MADT_TYPE_LOCAL_APIC_OVERRIDE:
+            apicAddress = ((PMADT_LOCAL_APIC_OVERRIDE_TABLE)pMadt)->Address;
+            Log("[ACPI] Local APIC address overridden to %p\n", apicAddress);
             break;
 
         default:
@@ -363,12 +458,75 @@ AcpiParseMadt(
         pMadt = (PMADT_LOCAL_APIC_TABLE)((SIZE_T)pMadt + pMadt->Header.Length);
     }
 
+    pInfo->Address = apicAddress;
+    Log("[ACPI] %d enabled processors\n", pInfo->Count);
+
+    // only the boot flow parses the MADT, there is no other updater to race with
+    pOld = gAcpiLapics;
+    RcuAssignPointer(gAcpiLapics, pInfo);
+    pInfo = NULL;
+
+    if (pOld)
+    {
+        RcuCall(&pOld->Rcu, _AcpiFreeLapicInfo);
+    }
+
 _cleanup_and_exit:
     if (NULL != pHeader)
     {
-        MmUnmapRangeAndNull(&pHeader, sizeof(ACPI_TABLE_HEADER) + sizeof(MADT_LOCAL_APIC_TABLE), MAP_FLG_SKIP_PHYPAGE_CHECK);
+        _AcpiUnmapTableAndNull(&pHeader, (DWORD)Size);
         pMadt = NULL;
     }
 
+    if (NULL != pInfo)
+    {
+        KmFreeAndNull((PVOID *)&pInfo, TAG_ACPI);
+    }
+
     return status;
 }
+
+
+NTSTATUS
+AcpiGetLocalApics(
+    _Out_ QWORD *LapicAddress,
+    _Out_writes_to_(MaxCount, *Count) BYTE *ApicIds,
+    _In_ DWORD MaxCount,
+    _Out_ DWORD *Count
+)
+{
+    const ACPI_LAPIC_INFO *pInfo;
+    QWORD rcu;
+
+    if (!LapicAddress)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!ApicIds)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Count)
+    {
+        return STATUS_INVALID_PARAMETER_4;
+    }
+
+    rcu = RcuReadLock();
+
+    pInfo = RcuDereference(gAcpiLapics);
+    if (!pInfo || !pInfo->Count)
+    {
+        RcuReadUnlock(rcu);
+        return STATUS_NOT_FOUND;
+    }
+
+    *Count = MIN(pInfo->Count, MaxCount);
+    memcpy(ApicIds, pInfo->Ids, *Count);
+    *LapicAddress = pInfo->Address;
+
+    RcuReadUnlock(rcu);
+
+    return STATUS_SUCCESS;
+}
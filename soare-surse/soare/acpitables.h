@@ -105,6 +105,16 @@ typedef struct _MADT_LOCAL_APIC_TABLE
     DWORD                   LapicFlags;
 } MADT_LOCAL_APIC_TABLE, *PMADT_LOCAL_APIC_TABLE;
 
+#define MADT_LAPIC_FLG_ENABLED              0x01
+#define MADT_LAPIC_FLG_ONLINE_CAPABLE       0x02
+
+typedef struct _MADT_LOCAL_APIC_OVERRIDE_TABLE
+{
+    SUBTABLE_HEADER         Header;
+    WORD                    Reserved;
+    QWORD                   Address;                    // 64-bit physical address of the local APICs
+} MADT_LOCAL_APIC_OVERRIDE_TABLE, *PMADT_LOCAL_APIC_OVERRIDE_TABLE;
+
 #pragma pack(pop)
 
 
@@ -135,6 +145,15 @@ AcpiParseMadt(
     _In_ SIZE_T Size
 );
 
+// The local APICs of the enabled processors, in MADT order; valid after the MADT was parsed
+NTSTATUS
+AcpiGetLocalApics(
+    _Out_ QWORD *LapicAddress,
+    _Out_writes_to_(MaxCount, *Count) BYTE *ApicIds,
+    _In_ DWORD MaxCount,
+    _Out_ DWORD *Count
+);
+
 NTSTATUS
 AcpiParseXRsdt(
     _In_ QWORD TablePhysicalAddress,
@@ -0,0 +1,700 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "allocprof.h"
+#include "virtmemmgr.h"
+#include "kernel.h"
+#include "dtr.h"
+#include "log.h"
+#include "kpool.h"
+#include "slab.h"
+#include "physmemmgr.h"
+
+/*
+
+    Sampling allocation profiler.
+    Every CPU counts down the bytes allocated on it. When the count drops to zero a sample is taken and the count is
+    reloaded with a random interval in [Rate / 2, Rate * 3 / 2), so allocation patterns that repeat with the same
+    period as the rate are not always (or never) sampled. A sample stands for Rate bytes of allocations, so the bytes
+    allocated by a call site are estimated as the sum of the rates in effect when its samples were taken.
+
+    The kernel is built without frame pointers, so the stack is unwound with the x64 unwind data of the image (the
+    RUNTIME_FUNCTION table of its exception directory), the way RtlVirtualUnwind does it: the unwind codes of the
+    function that contains RIP undo its prolog, which leaves RSP on the return address. Only RSP and the non volatile
+    registers saved by the prologs are tracked; a function that addresses its frame through a register whose value
+    is not known, an interrupt frame, code without unwind data (assembly) or an unmapped stack page end the walk.
+    The frames of the profiler, of the allocator that called MmProfAccount and of the allocators in gMmProfSkipped
+    are not recorded, so a call site is keyed on the return addresses of its callers.
+
+    Samples with the same frames are aggregated in a call site table. The table is only updated with interrupts
+    disabled and with gMmProfBusy taken; a sample that finds it busy (another CPU is updating it) is dropped and
+    counted, never waited for, since the allocators that call us may run in any context.
+
+    The countdown is decremented without disabling interrupts. An interrupt that allocates in between may lose its
+    decrement, which only moves the next sample by a few bytes.
+
+    Dump format, one record per line, fields separated by spaces:
+        PROF-BEGIN <rate> <samples> <dropped> <sites>
+        PROF <samples> <sampled bytes> <estimated bytes> <return address> ...
+        PROF-END
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+#define MM_PROF_ROWS            (MAX_CPU_COUNT + 1)
+#define MM_PROF_MAX_UNWIND      32          // frames unwound, the skipped ones included
+
+// x64 unwind data, see 'x64 exception handling' in the MSVC documentation
+typedef struct _MM_RUNTIME_FUNCTION
+{
+    DWORD       BeginAddress;
+    DWORD       EndAddress;
+    DWORD       UnwindData;
+} MM_RUNTIME_FUNCTION;
+
+#define MM_IMAGE_DIRECTORY_EXCEPTION    3
+#define MM_UNW_FLAG_CHAININFO           0x04
+
+#define MM_UWOP_PUSH_NONVOL             0
+#define MM_UWOP_ALLOC_LARGE             1
+#define MM_UWOP_ALLOC_SMALL             2
+#define MM_UWOP_SET_FPREG               3
+#define MM_UWOP_SAVE_NONVOL             4
+#define MM_UWOP_SAVE_NONVOL_FAR         5
+#define MM_UWOP_EPILOG                  6
+#define MM_UWOP_SAVE_XMM128             8
+#define MM_UWOP_SAVE_XMM128_FAR         9
+
+typedef struct _MM_PROF_UNWIND
+{
+    QWORD       Rip;
+    QWORD       Rsp;
+    QWORD       Regs[16];                       // in the encoding of the unwind codes, RAX = 0
+    DWORD       KnownRegs;                      // bit mask of the valid Regs
+    QWORD       ReadablePage;                   // the last stack page found mapped
+} MM_PROF_UNWIND;
+
+typedef __declspec(align(64)) struct _MM_PROF_CPU
+{
+    INT64       Countdown;
+    QWORD       Seed;
+} MM_PROF_CPU;
+
+typedef struct _MM_PROF_SITE
+{
+    QWORD       Hash;                           // 0 if the slot is free
+    QWORD       Samples;
+    QWORD       Bytes;                          // sum of the sizes of the sampled allocations
+    QWORD       Estimated;                      // sum of the rates in effect for every sample
+    DWORD       Depth;
+    QWORD       Frames[MM_PROF_MAX_FRAMES];
+} MM_PROF_SITE;
+
+volatile QWORD gMmProfRate;
+
+static MM_PROF_CPU gMmProfCpu[MM_PROF_ROWS];
+static MM_PROF_SITE gMmProfSites[MM_PROF_MAX_SITES];
+static volatile INT32 gMmProfBusy;
+static QWORD gMmProfSamples;
+static volatile QWORD gMmProfDropped;
+static DWORD gMmProfSiteCount;
+
+static const MM_RUNTIME_FUNCTION *gMmProfFunctions;
+static DWORD gMmProfFunctionCount;
+
+// allocators that call each other: the call site is the caller of the outermost one
+static QWORD const gMmProfAllocators[] =
+{
+    (QWORD)KpAlloc, (QWORD)KpAllocBatch, (QWORD)KmAlloc, (QWORD)KmCacheAlloc, (QWORD)MmAllocVirtual,
+    (QWORD)MmAllocPhysicalPage, (QWORD)MmAllocPhysicalPages, (QWORD)MmAllocPhysicalPageColoured,
+    (QWORD)MmAllocPhysicalPagesColoured, (QWORD)MmAllocPhysicalRange,
+};
+
+// the starts of the profiler functions, then of gMmProfAllocators
+#define MM_PROF_SKIP_RECORD     0
+#define MM_PROF_SKIP_ACCOUNT    1
+static DWORD gMmProfSkipped[sizeof(gMmProfAllocators) / sizeof(gMmProfAllocators[0]) + 2];
+
+
+static __forceinline
+MM_PROF_CPU *
+_MmProfGetCpu(
+    VOID
+)
+{
+    return &gMmProfCpu[gKernelGlobalData.Phase >= KE_PHASE_PCPU_READY ? GetCurrentCpu()->Number + 1 : 0];
+}
+
+
+static
+INT64
+_MmProfNextInterval(
+    _Inout_ MM_PROF_CPU *Cpu,
+    _In_ QWORD Rate
+)
+{
+    QWORD x = Cpu->Seed ? Cpu->Seed : (__rdtsc() | 1);
+
+    // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    Cpu->Seed = x;
+
+    return (INT64)(Rate / 2 + x % (Rate ? Rate : 1));
+}
+
+
+// Finds the exception directory of the kernel image; the image is loaded as it is in the file, RVAs are offsets
+static
+VOID
+_MmProfFindUnwindData(
+    VOID
+)
+{
+    const QWORD base = gKernelGlobalData.VirtualBase;
+    const BYTE *pNt;
+    DWORD rva;
+    DWORD size;
+
+    if (0x5A4D != *(const WORD *)base)
+    {
+        return;
+    }
+
+    // 'PE\0\0', then the file header and the PE32+ optional header
+    pNt = (const BYTE *)(base + *(const DWORD *)(base + 0x3C));
+    if (0x00004550 != *(const DWORD *)pNt || 0x20B != *(const WORD *)(pNt + 24) ||
+        *(const DWORD *)(pNt + 24 + 108) <= MM_IMAGE_DIRECTORY_EXCEPTION)
+    {
+        return;
+    }
+
+    rva = *(const DWORD *)(pNt + 24 + 112 + MM_IMAGE_DIRECTORY_EXCEPTION * 8);
+    size = *(const DWORD *)(pNt + 24 + 112 + MM_IMAGE_DIRECTORY_EXCEPTION * 8 + 4);
+    if (!rva || (QWORD)rva + size > gKernelGlobalData.KernelSize)
+    {
+        return;
+    }
+
+    gMmProfFunctions = (const MM_RUNTIME_FUNCTION *)(base + rva);
+    gMmProfFunctionCount = size / sizeof(MM_RUNTIME_FUNCTION);
+}
+
+
+// The table is sorted by BeginAddress
+static
+const MM_RUNTIME_FUNCTION *
+_MmProfLookupFunction(
+    _In_ QWORD Rip
+)
+{
+    DWORD low = 0;
+    DWORD high = gMmProfFunctionCount;
+    QWORD rva = Rip - gKernelGlobalData.VirtualBase;
+
+    if (Rip < gKernelGlobalData.VirtualBase || rva >= gKernelGlobalData.KernelSize)
+    {
+        return NULL;
+    }
+
+    while (low < high)
+    {
+        DWORD mid = (low + high) / 2;
+
+        if (rva < gMmProfFunctions[mid].BeginAddress)
+        {
+            high = mid;
+        }
+        else if (rva >= gMmProfFunctions[mid].EndAddress)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            return &gMmProfFunctions[mid];
+        }
+    }
+
+    return NULL;
+}
+
+
+static __forceinline
+const BYTE *
+_MmProfUnwindInfo(
+    _In_ const MM_RUNTIME_FUNCTION *Function
+)
+{
+    return (const BYTE *)(gKernelGlobalData.VirtualBase + Function->UnwindData);
+}
+
+
+// The chained entries of a function split by the optimizer lead to the one with its prolog
+static
+DWORD
+_MmProfFunctionStart(
+    _In_ QWORD Rip
+)
+{
+    const MM_RUNTIME_FUNCTION *pFunction = _MmProfLookupFunction(Rip);
+
+    while (pFunction && 0 != ((_MmProfUnwindInfo(pFunction)[0] >> 3) & MM_UNW_FLAG_CHAININFO))
+    {
+        const BYTE *pInfo = _MmProfUnwindInfo(pFunction);
+
+        pFunction = (const MM_RUNTIME_FUNCTION *)(pInfo + 4 + ROUND_UP(pInfo[2], 2) * sizeof(WORD));
+    }
+
+    return pFunction ? pFunction->BeginAddress : 0;
+}
+
+
+static
+BOOLEAN
+_MmProfRead(
+    _Inout_ MM_PROF_UNWIND *Unwind,
+    _In_ QWORD Va,
+    _Out_ QWORD *Value
+)
+{
+    QWORD page = ROUND_DOWN(Va, PAGE_SIZE_4K);
+
+    // the bounds of the stack are not known here, a QWORD may also straddle two pages
+    if (page != Unwind->ReadablePage || ROUND_DOWN(Va + sizeof(QWORD) - 1, PAGE_SIZE_4K) != page)
+    {
+        QWORD pa;
+        DWORD pageSize;
+
+        if (!NT_SUCCESS(MmTranslateVa((PVOID)page, &pa, &pageSize)) ||
+            !NT_SUCCESS(MmTranslateVa((PVOID)(Va + sizeof(QWORD) - 1), &pa, &pageSize)))
+        {
+            return FALSE;
+        }
+
+        Unwind->ReadablePage = page;
+    }
+
+    *Value = *(const QWORD *)Va;
+
+    return TRUE;
+}
+
+
+// Moves Unwind from a function to its caller
+static
+BOOLEAN
+_MmProfUnwindFrame(
+    _Inout_ MM_PROF_UNWIND *Unwind
+)
+{
+    const MM_RUNTIME_FUNCTION *pFunction = _MmProfLookupFunction(Unwind->Rip);
+    QWORD offset;
+    QWORD rsp = Unwind->Rsp;
+
+    if (!pFunction)
+    {
+        return FALSE;
+    }
+
+    offset = Unwind->Rip - gKernelGlobalData.VirtualBase - pFunction->BeginAddress;
+
+    for (;;)
+    {
+        const BYTE *pInfo = _MmProfUnwindInfo(pFunction);
+        const BYTE *pCodes = pInfo + 4;
+        DWORD count = pInfo[2];
+
+        for (DWORD i = 0; i < count; )
+        {
+            BYTE op = pCodes[i * 2 + 1] & 0xF;
+            BYTE info = pCodes[i * 2 + 1] >> 4;
+            BOOLEAN done = pCodes[i * 2] <= offset;   // the prolog got past this code
+            QWORD value;
+            DWORD slots;
+
+            switch (op)
+            {
+            case MM_UWOP_PUSH_NONVOL:
+                slots = 1;
+                if (done)
+                {
+                    if (!_MmProfRead(Unwind, rsp, &value))
+                    {
+                        return FALSE;
+                    }
+
+                    Unwind->Regs[info] = value;
+                    Unwind->KnownRegs |= 1 << info;
+                    rsp += sizeof(QWORD);
+                }
+                break;
+
+            case MM_UWOP_ALLOC_LARGE:
+                slots = info ? 3 : 2;
+                if (done)
+                {
+                    rsp += info ? *(const DWORD *)&pCodes[(i + 1) * 2] : *(const WORD *)&pCodes[(i + 1) * 2] * 8ULL;
+                }
+                break;
+
+            case MM_UWOP_ALLOC_SMALL:
+                slots = 1;
+                if (done)
+                {
+                    rsp += info * 8ULL + 8;
+                }
+                break;
+
+            case MM_UWOP_SET_FPREG:
+                slots = 1;
+                if (done)
+                {
+                    DWORD frameRegister = pInfo[3] & 0xF;
+
+                    if (0 == (Unwind->KnownRegs & (1 << frameRegister)))
+                    {
+                        return FALSE;
+                    }
+
+                    rsp = Unwind->Regs[frameRegister] - (pInfo[3] >> 4) * 16ULL;
+                }
+                break;
+
+            case MM_UWOP_SAVE_NONVOL:
+            case MM_UWOP_SAVE_NONVOL_FAR:
+                slots = MM_UWOP_SAVE_NONVOL == op ? 2 : 3;
+                if (done)
+                {
+                    QWORD at = MM_UWOP_SAVE_NONVOL == op ? *(const WORD *)&pCodes[(i + 1) * 2] * 8ULL :
+                        *(const DWORD *)&pCodes[(i + 1) * 2];
+
+                    if (!_MmProfRead(Unwind, rsp + at, &value))
+                    {
+                        return FALSE;
+                    }
+
+                    Unwind->Regs[info] = value;
+                    Unwind->KnownRegs |= 1 << info;
+                }
+                break;
+
+            case MM_UWOP_EPILOG:
+            case MM_UWOP_SAVE_XMM128:
+                slots = 2;
+                break;
+
+            case MM_UWOP_SAVE_XMM128_FAR:
+                slots = 3;
+                break;
+
+            default:
+                // UWOP_PUSH_MACHFRAME: an interrupt or exception frame, the walk ends there
+                return FALSE;
+            }
+
+            i += slots;
+        }
+
+        if (0 == ((pInfo[0] >> 3) & MM_UNW_FLAG_CHAININFO))
+        {
+            break;
+        }
+
+        // the primary entry holds the prolog, which ran completely
+        pFunction = (const MM_RUNTIME_FUNCTION *)(pCodes + ROUND_UP(count, 2) * sizeof(WORD));
+        offset = (QWORD)-1;
+    }
+
+    if (!_MmProfRead(Unwind, rsp, &Unwind->Rip))
+    {
+        return FALSE;
+    }
+
+    Unwind->Rsp = rsp + sizeof(QWORD);
+
+    return TRUE;
+}
+
+
+// An incrementally linked image calls functions through a JMP rel32 thunk
+static
+QWORD
+_MmProfResolveThunk(
+    _In_ QWORD Function
+)
+{
+    const BYTE *pCode = (const BYTE *)Function;
+
+    if (0xE9 == pCode[0])
+    {
+        return (QWORD)(pCode + 5 + *(const INT32 *)(pCode + 1));
+    }
+
+    return (QWORD)pCode;
+}
+
+
+static
+BOOLEAN
+_MmProfIsSkipped(
+    _In_ DWORD FunctionStart
+)
+{
+    for (DWORD i = 0; i < sizeof(gMmProfSkipped) / sizeof(gMmProfSkipped[0]); i++)
+    {
+        if (FunctionStart && FunctionStart == gMmProfSkipped[i])
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static __declspec(noinline)
+DWORD
+_MmProfCaptureStack(
+    _Out_writes_(MM_PROF_MAX_FRAMES) QWORD *Frames
+)
+{
+    MM_PROF_UNWIND unwind = { 0 };
+    DWORD depth = 0;
+    BOOLEAN accountingFrame = TRUE;
+
+    if (!gMmProfFunctions)
+    {
+        return 0;
+    }
+
+    // start in our caller, RSP right above our return address
+    unwind.Rsp = (QWORD)_AddressOfReturnAddress();
+    unwind.Rip = *(QWORD *)unwind.Rsp;
+    unwind.Rsp += sizeof(QWORD);
+
+    for (DWORD i = 0; i < MM_PROF_MAX_UNWIND && depth < MM_PROF_MAX_FRAMES; i++)
+    {
+        DWORD start;
+
+        if (!_MmProfUnwindFrame(&unwind))
+        {
+            break;
+        }
+
+        // Rip is now a return address into the caller of the function that was just unwound
+        start = _MmProfFunctionStart(unwind.Rip);
+        if (!start)
+        {
+            break;
+        }
+
+        if (start == gMmProfSkipped[MM_PROF_SKIP_RECORD] || start == gMmProfSkipped[MM_PROF_SKIP_ACCOUNT])
+        {
+            continue;
+        }
+
+        // the first frame past the profiler belongs to the allocator that accounted the bytes
+        if (accountingFrame)
+        {
+            accountingFrame = FALSE;
+            continue;
+        }
+
+        // and the allocators below the call site
+        if (0 == depth && _MmProfIsSkipped(start))
+        {
+            continue;
+        }
+
+        Frames[depth++] = unwind.Rip;
+    }
+
+    return depth;
+}
+
+
+static __declspec(noinline)
+VOID
+_MmProfRecord(
+    _In_ QWORD Bytes,
+    _In_ QWORD Rate
+)
+{
+    QWORD frames[MM_PROF_MAX_FRAMES] = { 0 };
+    DWORD depth = _MmProfCaptureStack(frames);
+    QWORD hash = 0xCBF29CE484222325ULL;
+    DWORD slot;
+
+    // FNV-1a over the frames
+    for (DWORD i = 0; i < depth; i++)
+    {
+        hash = (hash ^ frames[i]) * 0x100000001B3ULL;
+    }
+
+    hash |= 1;
+
+    if (0 != _InterlockedCompareExchange((volatile long *)&gMmProfBusy, TRUE, FALSE))
+    {
+        _InterlockedIncrement64((volatile INT64 *)&gMmProfDropped);
+        return;
+    }
+
+    slot = (DWORD)(hash % MM_PROF_MAX_SITES);
+    for (DWORD probe = 0; probe < MM_PROF_MAX_SITES; probe++, slot = (slot + 1) % MM_PROF_MAX_SITES)
+    {
+        MM_PROF_SITE *pSite = &gMmProfSites[slot];
+
+        if (0 == pSite->Hash)
+        {
+            pSite->Hash = hash;
+            pSite->Depth = depth;
+            memcpy(pSite->Frames, frames, sizeof(frames));
+            gMmProfSiteCount++;
+        }
+        else if (pSite->Hash != hash || pSite->Depth != depth || memcmp(pSite->Frames, frames, sizeof(frames)))
+        {
+            continue;
+        }
+
+        pSite->Samples++;
+        pSite->Bytes += Bytes;
+        pSite->Estimated += Rate;
+        gMmProfSamples++;
+
+        gMmProfBusy = FALSE;
+        return;
+    }
+
+    // the table is full
+    _InterlockedIncrement64((volatile INT64 *)&gMmProfDropped);
+    gMmProfBusy = FALSE;
+}
+
+
+VOID
+MmProfAccount(
+    _In_ QWORD Bytes
+)
+{
+    MM_PROF_CPU *pCpu;
+    QWORD rate = gMmProfRate;
+    QWORD flags;
+
+    if (!rate)
+    {
+        return;
+    }
+
+    pCpu = _MmProfGetCpu();
+    pCpu->Countdown -= (INT64)Bytes;
+    if (pCpu->Countdown > 0)
+    {
+        return;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pCpu->Countdown = _MmProfNextInterval(pCpu, rate);
+    _MmProfRecord(Bytes, rate);
+
+    __writeeflags(flags);
+}
+
+
+NTSTATUS
+MmProfSetRate(
+    _In_ QWORD BytesPerSample
+)
+{
+    // the stack walk needs MmTranslateVa
+    if (BytesPerSample && gKernelGlobalData.Phase < KE_PHASE_MM_READY)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (BytesPerSample && !gMmProfFunctions)
+    {
+        DWORD skipped = MM_PROF_SKIP_ACCOUNT + 1;
+
+        _MmProfFindUnwindData();
+        if (!gMmProfFunctions)
+        {
+            LogWithInfo("[PROF] The kernel image has no unwind data, the samples will have no call stacks\n");
+        }
+
+        gMmProfSkipped[MM_PROF_SKIP_RECORD] = _MmProfFunctionStart(_MmProfResolveThunk((QWORD)_MmProfRecord));
+        gMmProfSkipped[MM_PROF_SKIP_ACCOUNT] = _MmProfFunctionStart(_MmProfResolveThunk((QWORD)MmProfAccount));
+
+        for (DWORD i = 0; i < sizeof(gMmProfAllocators) / sizeof(gMmProfAllocators[0]); i++)
+        {
+            gMmProfSkipped[skipped++] = _MmProfFunctionStart(_MmProfResolveThunk(gMmProfAllocators[i]));
+        }
+    }
+
+    for (DWORD i = 0; i < MM_PROF_ROWS; i++)
+    {
+        gMmProfCpu[i].Countdown = BytesPerSample ? _MmProfNextInterval(&gMmProfCpu[i], BytesPerSample) : 0;
+    }
+
+    gMmProfRate = BytesPerSample;
+
+    LogWithInfo("[PROF] Sampling %s, one sample every %llu bytes\n", BytesPerSample ? "enabled" : "disabled",
+        BytesPerSample);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+MmProfReset(
+    VOID
+)
+{
+    QWORD flags = __readeflags();
+    _disable();
+
+    while (0 != _InterlockedCompareExchange((volatile long *)&gMmProfBusy, TRUE, FALSE))
+    {
+        _mm_pause();
+    }
+
+    memset(gMmProfSites, 0, sizeof(gMmProfSites));
+    gMmProfSamples = 0;
+    gMmProfDropped = 0;
+    gMmProfSiteCount = 0;
+
+    gMmProfBusy = FALSE;
+    __writeeflags(flags);
+}
+
+
+VOID
+MmProfDump(
+    VOID
+)
+{
+    NLog("PROF-BEGIN %llu %llu %llu %d\n", gMmProfRate, gMmProfSamples, gMmProfDropped, gMmProfSiteCount);
+
+    for (DWORD i = 0; i < MM_PROF_MAX_SITES; i++)
+    {
+        const MM_PROF_SITE *pSite = &gMmProfSites[i];
+
+        if (!pSite->Hash)
+        {
+            continue;
+        }
+
+        NLog("PROF %llu %llu %llu", pSite->Samples, pSite->Bytes, pSite->Estimated);
+        for (DWORD f = 0; f < pSite->Depth; f++)
+        {
+            NLog(" %018p", pSite->Frames[f]);
+        }
+        NLog("\n");
+    }
+
+    NLog("PROF-END\n");
+}
@@ -0,0 +1,40 @@
+#ifndef _ALLOCPROF_H_
+#define _ALLOCPROF_H_
+
+//
+// Sampling allocation profiler. Roughly one sample is taken for every gMmProfRate bytes allocated through the pool,
+// the slab allocator and the physical memory manager; a sample records the call stack of the allocation.
+//
+#define MM_PROF_MAX_FRAMES      8
+#define MM_PROF_MAX_SITES       256
+#define MM_PROF_BOOT_RATE       (64 * ONE_KB)
+#define MM_PROF_DEFAULT_RATE    (512 * ONE_KB)
+
+extern volatile QWORD gMmProfRate;      // 0 if the profiler is disabled
+
+// The allocators call this on every successful allocation; when the profiler is disabled it costs a load and a branch
+#define MmProfOnAlloc(Bytes)    do { if (gMmProfRate) { MmProfAccount(Bytes); } } while (0)
+
+VOID
+MmProfAccount(
+    _In_ QWORD Bytes
+);
+
+// BytesPerSample = 0 disables the profiler; the call sites recorded so far are kept
+NTSTATUS
+MmProfSetRate(
+    _In_ QWORD BytesPerSample
+);
+
+VOID
+MmProfReset(
+    VOID
+);
+
+// Dumps the call site table over serial; see allocprof.c for the format
+VOID
+MmProfDump(
+    VOID
+);
+
+#endif // !_ALLOCPROF_H_
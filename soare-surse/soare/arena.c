@@ -0,0 +1,199 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "kpool.h"
+#include "arena.h"
+#include "pooltag.h"
+#include "kernel.h"
+#include "log.h"
+
+/*
+
+    Arena allocator.
+    An allocation only moves Current forward. When the current chunk is exhausted a new kernel pool entry is linked
+    in front of the chunk list, so an allocation that doesn't fit in what is left of the current chunk (or of the
+    initial buffer) can't be larger than a pool entry minus the chunk header.
+    A mark remembers the chunk and the position in it; rewinding frees the chunks created after the mark and moves
+    Current back. Releasing the arena frees every chunk and goes back to the initial buffer.
+
+    The boot arena lives in a static buffer, so it can be used before the physical and virtual memory managers are
+    initialized. It grows with pool entries only after the memory manager is ready.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+#define ARENA_ALIGNMENT         16
+#define ARENA_CHUNK_SIZE        PAGE_SIZE_4K
+#define ARENA_CHUNK_HEADER      ROUND_UP(sizeof(ARENA_CHUNK), ARENA_ALIGNMENT)
+
+#define BOOT_ARENA_SIZE         (16 * ONE_KB)
+
+static __declspec(align(16)) BYTE gBootArenaBuffer[BOOT_ARENA_SIZE];
+ARENA gBootArena = { "boot", gBootArenaBuffer, gBootArenaBuffer + BOOT_ARENA_SIZE, NULL,
+                     gBootArenaBuffer, gBootArenaBuffer + BOOT_ARENA_SIZE };
+
+
+static
+VOID
+_MmArenaFreeChunksUntil(
+    _Inout_ PARENA Arena,
+    _In_opt_ PARENA_CHUNK Last
+)
+{
+    while (Arena->Chunks != Last)
+    {
+        PVOID pChunk = Arena->Chunks;
+
+        Arena->Chunks = Arena->Chunks->Next;
+        KpFreeAndNull(&pChunk, TAG_ARENA);
+    }
+}
+
+
+NTSTATUS
+MmArenaInit(
+    _Out_ PARENA Arena,
+    _In_ PCHAR Name,
+    _In_opt_ PVOID Buffer,
+    _In_ DWORD BufferSize
+)
+{
+    PBYTE pStart;
+
+    if (!Arena)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Name)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    memset(Arena, 0, sizeof(ARENA));
+    Arena->Name = Name;
+
+    if (Buffer && BufferSize)
+    {
+        pStart = (PBYTE)ROUND_UP((QWORD)Buffer, ARENA_ALIGNMENT);
+        if (pStart >= (PBYTE)Buffer + BufferSize)
+        {
+            return STATUS_INVALID_PARAMETER_4;
+        }
+
+        Arena->Buffer = pStart;
+        Arena->BufferLimit = (PBYTE)Buffer + BufferSize;
+    }
+
+    Arena->Current = Arena->Buffer;
+    Arena->Limit = Arena->BufferLimit;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+MmArenaAlloc(
+    _Inout_ PARENA Arena,
+    _In_ DWORD Size,
+    _Out_ PVOID *Ptr
+)
+{
+    QWORD size = ROUND_UP(Size, ARENA_ALIGNMENT);
+
+    if (!Arena)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Size)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    if ((QWORD)(Arena->Limit - Arena->Current) < size)
+    {
+        PARENA_CHUNK pChunk = NULL;
+        NTSTATUS status;
+
+        // only a new chunk is limited to a pool entry, the initial buffer may serve larger requests
+        if (size > ARENA_CHUNK_SIZE - ARENA_CHUNK_HEADER)
+        {
+            return STATUS_INVALID_PARAMETER_2;
+        }
+
+        if (gKernelGlobalData.Phase < KE_PHASE_MM_READY)
+        {
+            LogWithInfo("[ERROR] Arena %s is exhausted and the pool is not available\n", Arena->Name);
+            return STATUS_NO_MEMORY;
+        }
+
+        status = KpAlloc(TAG_ARENA, &pChunk);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KpAlloc failed: 0x%08x\n", status);
+            return status;
+        }
+
+        pChunk->Next = Arena->Chunks;
+        pChunk->Limit = (PBYTE)pChunk + ARENA_CHUNK_SIZE;
+        Arena->Chunks = pChunk;
+        Arena->Current = (PBYTE)pChunk + ARENA_CHUNK_HEADER;
+        Arena->Limit = pChunk->Limit;
+    }
+
+    *Ptr = Arena->Current;
+    Arena->Current += size;
+    Arena->Allocated += size;
+    Arena->Peak = MAX(Arena->Peak, Arena->Allocated);
+
+    memzero(*Ptr, size);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+MmArenaMark(
+    _In_ PARENA Arena,
+    _Out_ PARENA_MARK Mark
+)
+{
+    Mark->Chunk = Arena->Chunks;
+    Mark->Current = Arena->Current;
+    Mark->Allocated = Arena->Allocated;
+}
+
+
+VOID
+MmArenaRewind(
+    _Inout_ PARENA Arena,
+    _In_ PARENA_MARK Mark
+)
+{
+    _MmArenaFreeChunksUntil(Arena, Mark->Chunk);
+
+    Arena->Current = Mark->Current;
+    Arena->Limit = Mark->Chunk ? Mark->Chunk->Limit : Arena->BufferLimit;
+    Arena->Allocated = Mark->Allocated;
+}
+
+
+VOID
+MmArenaRelease(
+    _Inout_ PARENA Arena
+)
+{
+    _MmArenaFreeChunksUntil(Arena, NULL);
+
+    Arena->Current = Arena->Buffer;
+    Arena->Limit = Arena->BufferLimit;
+    Arena->Allocated = 0;
+}
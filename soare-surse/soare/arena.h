@@ -0,0 +1,69 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+//
+// Bump pointer allocator for memory that is released all at once
+//
+typedef struct _ARENA_CHUNK
+{
+    struct _ARENA_CHUNK *   Next;       // the previous chunk of the arena
+    PBYTE                   Limit;
+} ARENA_CHUNK, *PARENA_CHUNK;
+
+typedef struct _ARENA
+{
+    PCHAR                   Name;
+    PBYTE                   Current;    // next free byte in the current chunk
+    PBYTE                   Limit;      // end of the current chunk
+    PARENA_CHUNK            Chunks;     // most recent chunk first; NULL while the initial buffer is in use
+    PBYTE                   Buffer;     // initial buffer, owned by the caller
+    PBYTE                   BufferLimit;
+    QWORD                   Allocated;  // bytes handed out since the last release
+    QWORD                   Peak;
+} ARENA, *PARENA;
+
+typedef struct _ARENA_MARK
+{
+    PARENA_CHUNK            Chunk;
+    PBYTE                   Current;
+    QWORD                   Allocated;
+} ARENA_MARK, *PARENA_MARK;
+
+// Buffer is optional; without it, or when it is exhausted, the arena grows with kernel pool entries
+NTSTATUS
+MmArenaInit(
+    _Out_ PARENA Arena,
+    _In_ PCHAR Name,
+    _In_opt_ PVOID Buffer,
+    _In_ DWORD BufferSize
+);
+
+NTSTATUS
+MmArenaAlloc(
+    _Inout_ PARENA Arena,
+    _In_ DWORD Size,
+    _Out_ PVOID *Ptr
+);                                      // memory is zeroed and 16 bytes aligned
+
+VOID
+MmArenaMark(
+    _In_ PARENA Arena,
+    _Out_ PARENA_MARK Mark
+);
+
+// Frees everything allocated after Mark was taken
+VOID
+MmArenaRewind(
+    _Inout_ PARENA Arena,
+    _In_ PARENA_MARK Mark
+);
+
+// Frees everything; the arena can be used again
+VOID
+MmArenaRelease(
+    _Inout_ PARENA Arena
+);
+
+extern ARENA gBootArena;
+
+#endif // !_ARENA_H_
@@ -4,8 +4,22 @@
 //
 // MSRs
 //
+#define IA32_APIC_BASE          (DWORD)(0x0000001B)
+#define IA32_TSC_DEADLINE       (DWORD)(0x000006E0)
+#define IA32_EFER               (DWORD)(0xC0000080)
 #define IA32_FS_BASE            (DWORD)(0xC0000100)
 #define IA32_GS_BASE            (DWORD)(0xC0000101)
 #define IA32_KERNEL_GS_BASE     (DWORD)(0xC0000102)
 
+#define IA32_APIC_BASE_BSP      0x100
+#define IA32_APIC_BASE_ENABLE   0x800
+#define IA32_APIC_BASE_MASK     0x000FFFFFFFFFF000ULL
+
+#define IA32_EFER_LMA           0x400
+
+//
+// RFLAGS
+//
+#define RFLAGS_IF               0x200   // interrupts enabled
+
 #endif // !_CPUDEFS_H_
@@ -0,0 +1,179 @@
+#include "defs.h"
+#include "dpc.h"
+#include "dtr.h"
+#include "rcu.h"
+#include "kernel.h"
+
+/*
+
+    DPCs.
+    The queue is a FIFO list in the PCPU. KeInsertQueueDpc appends with interrupts disabled, so it is safe from an IRQ
+    handler and from a thread. The drain takes the whole list with interrupts disabled, then runs it with interrupts
+    enabled; an IRQ that comes in meanwhile sees Active, queues its DPCs and leaves them to the drain loop, so the
+    nesting is never deeper than one interrupt on top of the drain.
+
+    KeIrqExit runs on the stack of the interrupted thread, inside its TRAP_FRAME, and doesn't preempt it while a
+    drain is active further down that stack: the switch waits for the outer KeIrqExit, which finds NeedResched set
+    once its drain is done.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+VOID KePreemptIfNeeded(VOID);
+
+
+VOID
+KeInitializeDpc(
+    _Out_ PKDPC Dpc,
+    _In_ PFN_KeDpcRoutine Routine,
+    _In_opt_ PVOID Context
+)
+{
+    Dpc->Next = NULL;
+    Dpc->Routine = Routine;
+    Dpc->Context = Context;
+    Dpc->Queued = FALSE;
+}
+
+
+BOOLEAN
+KeInsertQueueDpc(
+    _Inout_ PKDPC Dpc
+)
+{
+    PPCPU pCpu;
+    QWORD flags;
+
+    if (_InterlockedExchange8((volatile char *)&Dpc->Queued, TRUE))
+    {
+        return FALSE;
+    }
+
+    // no queue yet, run it right away like the handler used to
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        Dpc->Queued = FALSE;
+        Dpc->Routine(Dpc, Dpc->Context);
+        return TRUE;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pCpu = GetCurrentCpu();
+
+    Dpc->Next = NULL;
+    if (pCpu->DpcQueue.Tail)
+    {
+        pCpu->DpcQueue.Tail->Next = Dpc;
+    }
+    else
+    {
+        pCpu->DpcQueue.Head = Dpc;
+    }
+    pCpu->DpcQueue.Tail = Dpc;
+
+    __writeeflags(flags);
+
+    return TRUE;
+}
+
+
+BOOLEAN
+KeDpcsPending(
+    VOID
+)
+{
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return FALSE;
+    }
+
+    return NULL != GetCurrentCpu()->DpcQueue.Head;
+}
+
+
+VOID
+KeRetireDpcs(
+    VOID
+)
+{
+    PPCPU pCpu;
+    QWORD flags;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pCpu = GetCurrentCpu();
+    if (pCpu->DpcQueue.Active)
+    {
+        __writeeflags(flags);
+        return;
+    }
+
+    pCpu->DpcQueue.Active = TRUE;
+
+    while (pCpu->DpcQueue.Head)
+    {
+        PKDPC pDpc = pCpu->DpcQueue.Head;
+
+        pCpu->DpcQueue.Head = NULL;
+        pCpu->DpcQueue.Tail = NULL;
+
+        _enable();
+
+        while (pDpc)
+        {
+            PKDPC pNext = pDpc->Next;
+
+            pDpc->Queued = FALSE;
+            pDpc->Routine(pDpc, pDpc->Context);
+            pCpu->DpcQueue.Retired++;
+
+            pDpc = pNext;
+        }
+
+        _disable();
+    }
+
+    pCpu->DpcQueue.Active = FALSE;
+
+    __writeeflags(flags);
+}
+
+
+VOID
+KeIrqExit(
+    VOID
+)
+{
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    // the interrupted code had interrupts enabled, it wasn't in an RCU read-side section
+    RcuQuiescentState();
+
+    // interrupted a drain, it picks up whatever this interrupt queued
+    if (GetCurrentCpu()->DpcQueue.Active)
+    {
+        return;
+    }
+
+    KeRetireDpcs();
+
+    // interrupted the wait of an idle loop: it switches to the readied threads itself, after the wait is accounted
+    if (GetCurrentCpu()->Idle.Waiting)
+    {
+        return;
+    }
+
+    KePreemptIfNeeded();
+}
@@ -0,0 +1,66 @@
+#ifndef _DPC_H_
+#define _DPC_H_
+
+#include "defs.h"
+
+//
+// Deferred procedure calls. An IRQ handler does only what can't wait (reads the device, counts the tick) and queues
+// a DPC for the rest; the queue of the CPU is drained with interrupts enabled once the handler returned, before the
+// IRETQ, or by the idle loop.
+//
+
+struct _KDPC;
+
+typedef VOID(*PFN_KeDpcRoutine)(_In_ struct _KDPC *Dpc, _In_opt_ PVOID Context);
+
+typedef struct _KDPC
+{
+    struct _KDPC *          Next;           // in the queue of a CPU
+    PFN_KeDpcRoutine        Routine;
+    PVOID                   Context;
+    volatile BOOLEAN        Queued;         // cleared right before Routine is called, so it may queue itself again
+} KDPC, *PKDPC;
+
+// Per CPU, in the PCPU; touched only by its CPU, with interrupts disabled
+typedef struct _KE_DPC_QUEUE
+{
+    PKDPC                   Head;
+    PKDPC                   Tail;
+    volatile BOOLEAN        Active;         // being drained, a nested interrupt leaves the new DPCs to the drain loop
+    BYTE                    _ActivePadding[7];
+    QWORD                   Retired;        // DPCs run by this CPU
+} KE_DPC_QUEUE;
+
+VOID
+KeInitializeDpc(
+    _Out_ PKDPC Dpc,
+    _In_ PFN_KeDpcRoutine Routine,
+    _In_opt_ PVOID Context
+);
+
+// Queues the DPC on the current CPU; FALSE if it was already queued (on any CPU), it runs only once then
+BOOLEAN
+KeInsertQueueDpc(
+    _Inout_ PKDPC Dpc
+);
+
+// TRUE if the current CPU has DPCs queued; for the idle loops, which check it with interrupts disabled
+BOOLEAN
+KeDpcsPending(
+    VOID
+);
+
+// Runs the DPCs queued on the current CPU with interrupts enabled, until none is left
+VOID
+KeRetireDpcs(
+    VOID
+);
+
+// Called with interrupts disabled by the IRQ stubs after the EOI: retires the DPCs, then preempts the current thread
+// if the scheduler asked for it, unless the interrupt ended a KeIdleWait
+VOID
+KeIrqExit(
+    VOID
+);
+
+#endif // !_DPC_H_
@@ -2,6 +2,9 @@
 #include "ntstatus.h"
 #include "dtr.h"
 #include "kpool.h"
+#include "virtmemmgr.h"
+#include "pooltag.h"
+#include "lapic.h"
 #include "kernel.h"
 #include "log.h"
 
@@ -35,7 +38,7 @@ _DtrInstallSpuriousHandlers(
     _In_ PPCPU Cpu
 )
 {
-    BYTE spuriousVectors[] = { 0x27 };
+    BYTE spuriousVectors[] = { 0x27, LAPIC_SPURIOUS_VECTOR };
     QWORD qwHandler = (QWORD)IsrHndSpurious;
 
     for (BYTE i = 0; i < sizeof(spuriousVectors) / sizeof(spuriousVectors[0]); i++)
@@ -150,18 +153,40 @@ DtrInitAndLoadAll(
 
 
 static PCPU gBsp;
+static BOOLEAN gBspCreated;
 
 NTSTATUS
 DtrCreatePcpu(
     _Out_ PPCPU *Cpu
 )
 {
+    PPCPU pCpu = NULL;
+    NTSTATUS status;
+
     if (!Cpu)
     {
         return STATUS_INVALID_PARAMETER_1;
     }
 
-    *Cpu = &gBsp;
+    if (!gBspCreated)
+    {
+        gBspCreated = TRUE;
+        *Cpu = &gBsp;
+        return STATUS_SUCCESS;
+    }
+
+    // page aligned, so are the IDT and the GDT inside it
+    status = MmAllocVirtual(sizeof(PCPU), TAG_PCPU, (PVOID *)&pCpu);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] MmAllocVirtual failed: 0x%08x\n", status);
+        return status;
+    }
+
+    memset(pCpu, 0, sizeof(PCPU));
+    pCpu->Self = pCpu;
+
+    *Cpu = pCpu;
     return STATUS_SUCCESS;
 }
 
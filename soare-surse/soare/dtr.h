@@ -3,6 +3,14 @@
 
 #include "cpudefs.h"
 #include "winlists.h"
+#include "slab.h"
+#include "thread.h"
+#include "task.h"
+#include "dpc.h"
+#include "idle.h"
+#include "rcu.h"
+#include "ktimer.h"
+#include "timer.h"
 
 #pragma pack(push)
 #pragma pack(1)
@@ -113,6 +121,9 @@ typedef struct _GDT_LAYOUT
     SYSTEM_DESCRIPTOR   Tss;            // 0x30
 } GDT_LAYOUT, *PGDT_LAYOUT;
 
+// Work handed to a CPU through its PCPU, see KeRunOnCpu
+typedef VOID(*PFN_CpuWorkRoutine)(_In_opt_ PVOID Context);
+
 typedef struct _PCPU
 {
     struct _PCPU *  Self;
@@ -130,6 +141,31 @@ typedef struct _PCPU
     INTERRUPT_GATE  Idt[IDT_ENTRIES];
     GDT_LAYOUT      Gdt;
     TSS64           Tss;
+
+    KM_CPU_CACHE    KmCache[KM_SIZE_CLASS_COUNT];
+
+    QWORD                           StackTop;
+    volatile BOOLEAN                Online;         // set by the CPU once it runs on its own tables and stack
+    BYTE                            _OnlinePadding[3];
+    volatile INT32                  WorkBusy;       // the work slot is owned by a caller
+    volatile QWORD                  WorkSequence;   // routines completed
+    PVOID                           WorkContext;
+    volatile PFN_CpuWorkRoutine     WorkRoutine;    // cleared by the CPU once the routine returned
+
+    PKTHREAD                        CurrentThread;
+    PKTHREAD                        IdleThread;
+    PKTHREAD                        PreviousThread; // switched away from, until the switch is finished
+    volatile BOOLEAN                NeedResched;    // switch at the end of the current interrupt
+    BYTE                            _NeedReschedPadding[7];
+    QWORD                           ContextSwitches;
+    KE_RUN_QUEUE                    RunQueue;
+    KE_DPC_QUEUE                    DpcQueue;
+    KE_IDLE_STATE                   Idle;
+    RCU_CPU                         Rcu;
+    KE_TIMER_WHEEL                  Timers;
+    TMR_CLOCK_EVENT                 ClockEvent;
+
+    KE_TASK_DEQUE                   TaskDeque;
 } PCPU, *PPCPU;
 
 #pragma pack(pop)
@@ -165,6 +201,7 @@ DtrInitAndLoadAll(
     _Inout_ PCPU *Cpu
 );
 
+// The first call returns the BSP, the following ones allocate a zeroed PCPU for an AP
 NTSTATUS
 DtrCreatePcpu(
     _Out_ PPCPU *Cpu
@@ -0,0 +1,218 @@
+#include "defs.h"
+#include "ntstatus.h"
+#include "idle.h"
+#include "dtr.h"
+#include "smp.h"
+#include "lapic.h"
+#include "rcu.h"
+#include "timer.h"
+#include "kernel.h"
+#include "log.h"
+
+/*
+
+    Idle.
+    The waker publishes the work, then looks at Mwait; the idle CPU sets Mwait, then looks at Wake. A full fence on
+    both sides keeps one of them from missing the other (a store may pass a later load on x86):
+        - the waker sees Mwait clear: it sends an IPI, which stays pending until the STI in front of MWAIT or HLT
+        - the waker sees Mwait set: its store to Wake either lands before the idle CPU reads Wake again (and it
+          doesn't wait at all) or after the monitor is armed (and MWAIT returns)
+    Any other store to the line wakes the CPU as well; that costs one more trip through the idle loop.
+
+    The tick is stopped for the wait, only the timers of the CPU (and the IPIs) end it. It starts again right after,
+    the idle loop may switch to a thread that needs it.
+
+    The TSC runs at a constant rate on everything that has an invariant TSC, so idle and busy cycles compare directly.
+    The interrupt that ends a wait runs before KeIdleWait gets back, so it is counted as idle time. It doesn't switch
+    to the threads it readied (see KeIrqExit): the idle loop does, once the wait was accounted for and the tick runs.
+
+*/
+
+#define CPUID_ECX_MONITOR           (1 << 3)
+#define CPUID_5_ECX_EMX             (1 << 0)    // the MWAIT extensions are enumerated
+
+#define KE_MWAIT_HINT_C1            0x00
+
+extern KGLOBAL gKernelGlobalData;
+
+VOID HwEnableAndHalt(VOID);
+VOID HwEnableAndMwait(_In_ DWORD Hints);
+
+static BOOLEAN gKeIdleProbed;
+static BOOLEAN gKeIdleMwait;
+
+
+VOID
+KeIdleInitCpu(
+    VOID
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+
+    // every CPU has the same features, the BSP looks once for everybody
+    if (!gKeIdleProbed)
+    {
+        INT32 regs[4] = { 0 };
+
+        gKeIdleProbed = TRUE;
+
+        __cpuid(regs, 1);
+        if (regs[2] & CPUID_ECX_MONITOR)
+        {
+            __cpuid(regs, 0);
+            if (regs[0] >= 5)
+            {
+                __cpuid(regs, 5);
+                gKeIdleMwait = TRUE;
+
+                LogWithInfo("[IDLE] MWAIT supported, monitor line %d - %d bytes, extensions: %d\n",
+                    regs[0] & 0xFFFF, regs[1] & 0xFFFF, 0 != (regs[2] & CPUID_5_ECX_EMX));
+            }
+        }
+
+        if (!gKeIdleMwait)
+        {
+            LogWithInfo("[IDLE] MWAIT not supported, idle CPUs halt\n");
+        }
+    }
+
+    pCpu->Idle.Mwait = FALSE;
+    pCpu->Idle.IdleCycles = 0;
+    pCpu->Idle.Entries = 0;
+    pCpu->Idle.MwaitEntries = 0;
+    pCpu->Idle.StartTsc = __rdtsc();
+}
+
+
+VOID
+KeIdleWait(
+    _Inout_ PPCPU Cpu
+)
+{
+    QWORD start;
+
+    TmrStopTick();
+
+    start = __rdtsc();
+    Cpu->Idle.Entries++;
+    Cpu->Idle.Waiting = TRUE;
+
+    if (gKeIdleMwait)
+    {
+        INT64 wake = Cpu->Idle.Wake;
+
+        Cpu->Idle.Mwait = TRUE;
+        _mm_mfence();
+
+        _mm_monitor((const void *)&Cpu->Idle.Wake, 0, 0);
+
+        // a wake up between the read above and the MONITOR would be lost otherwise
+        if (wake == Cpu->Idle.Wake)
+        {
+            Cpu->Idle.MwaitEntries++;
+            HwEnableAndMwait(KE_MWAIT_HINT_C1);
+        }
+        else
+        {
+            _enable();
+        }
+
+        Cpu->Idle.Mwait = FALSE;
+    }
+    else
+    {
+        HwEnableAndHalt();
+    }
+
+    Cpu->Idle.Waiting = FALSE;
+    Cpu->Idle.IdleCycles += __rdtsc() - start;
+
+    TmrRestartTick();
+
+    // the idle loops are never in an RCU read-side section
+    RcuQuiescentState();
+}
+
+
+NTSTATUS
+KeWakeCpu(
+    _Inout_ PPCPU Cpu
+)
+{
+    if (!Cpu)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    // the work must be visible before we look at Mwait
+    _mm_mfence();
+
+    if (Cpu->Idle.Mwait)
+    {
+        _InterlockedIncrement64(&Cpu->Idle.Wake);
+        return STATUS_SUCCESS;
+    }
+
+    return LapicSendIpi(Cpu->ApicId, LAPIC_ICR_FIXED | LAPIC_IPI_VECTOR);
+}
+
+
+NTSTATUS
+KeGetIdleStatistics(
+    _In_ DWORD Number,
+    _Out_ KE_IDLE_STATISTICS *Statistics
+)
+{
+    PPCPU pCpu;
+
+    if (Number >= KeGetCpuCount())
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Statistics)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    pCpu = KeGetCpu(Number);
+
+    // the counters of another CPU move under us, the numbers are only as fresh as the last wait it finished
+    Statistics->IdleCycles = pCpu->Idle.IdleCycles;
+    Statistics->Entries = pCpu->Idle.Entries;
+    Statistics->MwaitEntries = pCpu->Idle.MwaitEntries;
+    Statistics->TotalCycles = __rdtsc() - pCpu->Idle.StartTsc;
+
+    Statistics->BusyPermille = 0;
+    if (Statistics->TotalCycles > Statistics->IdleCycles)
+    {
+        Statistics->BusyPermille = (DWORD)(((Statistics->TotalCycles - Statistics->IdleCycles) * 1000) /
+            Statistics->TotalCycles);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+KeDumpIdleStatistics(
+    VOID
+)
+{
+    NLog("[IDLE] %-3s %12s %12s %18s %18s %7s\n", "CPU", "ENTRIES", "MWAIT", "TOTAL CYCLES", "IDLE CYCLES", "BUSY");
+
+    for (DWORD i = 0; i < KeGetCpuCount(); i++)
+    {
+        KE_IDLE_STATISTICS stats;
+        NTSTATUS status = KeGetIdleStatistics(i, &stats);
+
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeGetIdleStatistics failed for CPU %d: 0x%08x\n", i, status);
+            continue;
+        }
+
+        NLog("[IDLE] %3d %12d %12d %18lld %18lld %3d.%d%%\n", i, stats.Entries, stats.MwaitEntries,
+            stats.TotalCycles, stats.IdleCycles, stats.BusyPermille / 10, stats.BusyPermille % 10);
+    }
+}
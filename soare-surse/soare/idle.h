@@ -0,0 +1,67 @@
+#ifndef _IDLE_H_
+#define _IDLE_H_
+
+#include "defs.h"
+
+//
+// Idle. A CPU with nothing to do waits in MWAIT on a line of its PCPU if the CPU supports MONITOR / MWAIT, else in
+// HLT. KeWakeCpu stores to the line of a CPU in MWAIT, which wakes it up without an interrupt; a CPU in HLT (or not
+// idle at all) gets an IPI.
+//
+
+struct _PCPU;
+
+// Per CPU, in the PCPU
+typedef struct _KE_IDLE_STATE
+{
+    volatile INT64          Wake;           // the monitored line, KeWakeCpu increments it
+    BYTE                    _WakePadding[56];
+    volatile BOOLEAN        Mwait;          // from before the monitor is armed until MWAIT returns
+    volatile BOOLEAN        Waiting;        // in KeIdleWait, from before interrupts are enabled until the wait ended
+    BYTE                    _MwaitPadding[6];
+    QWORD                   StartTsc;       // when the accounting started
+    QWORD                   IdleCycles;
+    QWORD                   Entries;
+    QWORD                   MwaitEntries;   // of those, waited in MWAIT
+} KE_IDLE_STATE;
+
+typedef struct _KE_IDLE_STATISTICS
+{
+    QWORD                   TotalCycles;    // TSC cycles since the CPU started its scheduler
+    QWORD                   IdleCycles;     // of those, in MWAIT or HLT (the interrupt that ends the wait included)
+    QWORD                   Entries;
+    QWORD                   MwaitEntries;
+    DWORD                   BusyPermille;   // (TotalCycles - IdleCycles) / TotalCycles, in 1/1000
+} KE_IDLE_STATISTICS;
+
+// Starts the accounting for the current CPU; the first call also looks for MONITOR / MWAIT
+VOID
+KeIdleInitCpu(
+    VOID
+);
+
+// Called by the idle loops with interrupts disabled, once they found nothing to do. Returns with interrupts enabled,
+// after an interrupt or a KeWakeCpu; the loop looks for work again.
+VOID
+KeIdleWait(
+    _Inout_ struct _PCPU *Cpu
+);
+
+// Makes Cpu look for work; to be called after the work was published
+NTSTATUS
+KeWakeCpu(
+    _Inout_ struct _PCPU *Cpu
+);
+
+NTSTATUS
+KeGetIdleStatistics(
+    _In_ DWORD Number,
+    _Out_ KE_IDLE_STATISTICS *Statistics
+);
+
+VOID
+KeDumpIdleStatistics(
+    VOID
+);
+
+#endif // !_IDLE_H_
@@ -14,5 +14,5 @@ KeInitGlobal(
     gKernelGlobalData.PhysicalBase = KBASE_PHYSICAL;
     gKernelGlobalData.VirtualBase = KBASE_VIRTUAL;
     gKernelGlobalData.KernelSize = 8 * ONE_MB;
-    gKernelGlobalData.Phase = 1;
+    gKernelGlobalData.Phase = KE_PHASE_EARLY;
 }
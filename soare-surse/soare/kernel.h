@@ -13,6 +13,10 @@ typedef struct _KGLOBAL
     WORD            Phase;
 } KGLOBAL, *PKGLOBAL;
 
+#define KE_PHASE_EARLY          1
+#define KE_PHASE_MM_READY       2   // memory manager initialized, BSP stack switched
+#define KE_PHASE_PCPU_READY     3   // the current PCPU is loaded, GetCurrentCpu() can be used
+
 VOID
 KeInitGlobal(
     VOID
@@ -6,6 +6,9 @@
 #include "log.h"
 #include "debugger.h"
 #include "panic.h"
+#include "spinlock.h"
+#include "dpc.h"
+#include "sync.h"
 
 //
 // This is a very simple keyboard "driver". It should probably be designed as a state machine with a command queue.
@@ -133,6 +136,7 @@
 //
 // Keyboard state
 //
+#define KB_BUFFER_SIZE              64      // typed and not read yet; what doesn't fit is dropped
 
 typedef enum _KB_STATE
 {
@@ -179,13 +183,25 @@ typedef struct _KB_CONTEXT
 
     BOOLEAN     Extended;
 
-    volatile CHAR   LastPrintableChar;
+    // printable characters, for KbGetCh
+    CHAR        Buffer[KB_BUFFER_SIZE];
+    BYTE        BufferHead;     // the next one to be read
+    BYTE        BufferCount;
 } KB_CONTEXT, *PKB_CONTEXT;
 
 #include "kbdcodes.h"
 
 static KB_CONTEXT gKbContext;
 
+// Guards gKbContext against the IRQ handler, which may run on another CPU than KbGetCh
+static KE_TICKET_LOCK gKbLock;
+
+// Sends the lock states to the LEDs; the exchange polls the controller, so it doesn't belong in the IRQ handler
+static KDPC gKbLedDpc;
+
+// One unit for every character in gKbContext.Buffer, KbGetCh blocks on it
+static KSEMAPHORE gKbChars;
+
 
 //
 // ASM handler
@@ -303,16 +319,45 @@ KbResetSystem(
 }
 
 
+static
+VOID
+_KbLedDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID Context
+)
+{
+    BOOLEAN scrollLock, numLock, capsLock;
+    QWORD flags;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Context);
+
+    flags = KeAcquireTicketLockIrqSave(&gKbLock);
+    scrollLock = gKbContext.ScrollLock;
+    numLock = gKbContext.NumLock;
+    capsLock = gKbContext.CapsLock;
+    KeReleaseTicketLockIrqRestore(&gKbLock, flags);
+
+    // the ACKs would raise IRQ 1 and KbHandler would take them for scan codes
+    PicDisableIrq(PIC_IRQ_KEYBOARD);
+    KbUpdateLeds(scrollLock, numLock, capsLock);
+    PicEnableIrq(PIC_IRQ_KEYBOARD);
+}
+
+
 VOID
 KbHandler(
     _In_ PVOID Context
 )
 {
     BYTE code;
+    QWORD flags;
+    BOOLEAN buffered = FALSE;
 
     UNREFERENCED_PARAMETER(Context);
 
-    gKbContext.LastPrintableChar = 0;
+    flags = KeAcquireTicketLockIrqSave(&gKbLock);
+
     code = _KbEncReadBuffer();
 
     // check for extended
@@ -332,17 +377,17 @@ KbHandler(
         if (scCaps == code && bIsBreak)
         {
             gKbContext.CapsLock = !gKbContext.CapsLock;
-            KbUpdateLeds(gKbContext.ScrollLock, gKbContext.NumLock, gKbContext.CapsLock);
+            KeInsertQueueDpc(&gKbLedDpc);
         }
         else if (scNum == code && bIsBreak)
         {
             gKbContext.NumLock = !gKbContext.NumLock;
-            KbUpdateLeds(gKbContext.ScrollLock, gKbContext.NumLock, gKbContext.CapsLock);
+            KeInsertQueueDpc(&gKbLedDpc);
         }
         else if (scScroll == code && bIsBreak)
         {
             gKbContext.ScrollLock = !gKbContext.ScrollLock;
-            KbUpdateLeds(gKbContext.ScrollLock, gKbContext.NumLock, gKbContext.CapsLock);
+            KeInsertQueueDpc(&gKbLedDpc);
         }
         // check ctrl
         else if (scLCtrl == code)
@@ -423,8 +468,12 @@ KbHandler(
 
             if (IsPrintable(key))
             {
-                //Log("%c", key);
-                gKbContext.LastPrintableChar = key;
+                if (gKbContext.BufferCount < KB_BUFFER_SIZE)
+                {
+                    gKbContext.Buffer[(gKbContext.BufferHead + gKbContext.BufferCount) % KB_BUFFER_SIZE] = key;
+                    gKbContext.BufferCount++;
+                    buffered = TRUE;
+                }
             }
             else
             {
@@ -435,6 +484,13 @@ KbHandler(
 
         gKbContext.Extended = FALSE;
     }
+
+    KeReleaseTicketLockIrqRestore(&gKbLock, flags);
+
+    if (buffered)
+    {
+        KeReleaseSemaphore(&gKbChars, 1);
+    }
 }
 
 
@@ -484,7 +540,7 @@ KbInit(
     gKbContext.BatFailed = gKbContext.DiagnosticFailed = gKbContext.Error = gKbContext.ResendRequested = FALSE;
     gKbContext.Enabled = TRUE;
     gKbContext.Extended = FALSE;
-    gKbContext.LastPrintableChar = 0;
+    gKbContext.BufferHead = gKbContext.BufferCount = 0;
 
     // play with the LEDs so the keyboard will know who is its new master!
     KbUpdateLeds(FALSE, FALSE, FALSE);
@@ -495,6 +551,9 @@ KbInit(
     _KbEncSendCommandAndGetResponse(ENC_CMD_KB_ID);
     LogWithInfo("[KB] ID: 0x%02x 0x%02x\n", _KbEncReadBuffer(), _KbEncReadBuffer());
 
+    KeInitializeDpc(&gKbLedDpc, _KbLedDpc, NULL);
+    KeInitializeSemaphore(&gKbChars, 0, KB_BUFFER_SIZE);
+
     // and let the IRQs come!
     PicEnableIrq(PIC_IRQ_KEYBOARD);
 
@@ -508,15 +567,19 @@ KbGetCh(
 )
 {
     CHAR ch;
+    QWORD flags;
 
-    // wait for a printable char
-    do 
-    {
-        ch = gKbContext.LastPrintableChar;
-    } while (ch == 0);
+    // blocks until KbHandler buffers a printable char
+    KeWaitForSemaphore(&gKbChars);
+
+    // and consume it
+    flags = KeAcquireTicketLockIrqSave(&gKbLock);
+
+    ch = gKbContext.Buffer[gKbContext.BufferHead];
+    gKbContext.BufferHead = (gKbContext.BufferHead + 1) % KB_BUFFER_SIZE;
+    gKbContext.BufferCount--;
 
-    // consume it
-    gKbContext.LastPrintableChar = 0;
+    KeReleaseTicketLockIrqRestore(&gKbLock, flags);
 
     return ch;
 }
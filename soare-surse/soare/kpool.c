@@ -2,94 +2,451 @@
 #include "memdefs.h"
 #include "ntstatus.h"
 #include "kpool.h"
-#include "winlists.h"
+#include "virtmemmgr.h"
+#include "pooltag.h"
+#include "allocprof.h"
 #include "log.h"
+#include "ktimer.h"
+#include "timer.h"
 
-#pragma pack(push)
-#pragma pack(1)
+/*
+
+    The free entries are kept in a lock-free LIFO, so the pool can be used from any context (including IRQ handlers
+    that interrupt an allocation) and from any CPU.
+    The head is a {Top, Tag} pair updated with CMPXCHG16B. The tag is incremented on every update, so a pop that read
+    Top->Next before another CPU popped Top, popped something else and pushed Top back will fail instead of installing
+    a stale Next (the ABA problem).
+
+    Only the VA range of the pool is reserved up front. It is committed in KP_CHUNK_SIZE chunks: a chunk is committed
+    when the number of free entries drops under KP_LOW_WATERMARK and fully free chunks are decommitted when the number
+    of free entries goes over KP_HIGH_WATERMARK.
+    Reading Top->Next is safe even if Top was allocated in the meantime (the value is discarded because the tag
+    changed), as long as Top is still mapped. The trimmer guarantees that by detaching the whole list before it
+    decides what to release and by giving up if a pop is in progress, since that pop may hold a pointer to an entry
+    of the chunk that would be unmapped.
+    While the list is detached it looks empty: an allocation that finds it so waits for the trimmer (or for the grow
+    in progress) to finish and pops again. Growing and trimming run with interrupts disabled, so the CPU that waits
+    is never the one that would have to finish them.
+
+*/
 
 typedef struct _KPOOL_HEADER
 {
-    LIST_ENTRY  Link;
+    struct _KPOOL_HEADER *  Next;
 } KPOOL_HEADER, *PKPOOL_HEADER;
 
-#pragma pack(pop)
+typedef __declspec(align(16)) struct _KPOOL_LIST_HEAD
+{
+    PKPOOL_HEADER           Top;
+    QWORD                   Tag;
+} KPOOL_LIST_HEAD, *PKPOOL_LIST_HEAD;
+
+#define CPUID_ECX_CMPXCHG16B    (1 << 13)
+
+#define KP_ENTRY_SIZE           PAGE_SIZE_4K
+#define KP_CHUNK_SIZE           PAGE_SIZE_2M
+#define KP_ENTRIES_PER_CHUNK    (KP_CHUNK_SIZE / KP_ENTRY_SIZE)
+#define KP_MAX_CHUNKS           512
+
+#define KP_LOW_WATERMARK        (KP_ENTRIES_PER_CHUNK / 2)
+#define KP_HIGH_WATERMARK       (KP_ENTRIES_PER_CHUNK * 4)
+
+static volatile KPOOL_LIST_HEAD gKpListHead;
+static volatile QWORD gKpFreeEntries;
+static volatile INT32 gKpActivePops;
+
+typedef struct _KPOOL_STATE
+{
+    QWORD               Base;
+    DWORD               MaxChunks;
+    volatile INT32      Committed;                  // number of committed chunks
+    volatile INT32      Busy;                       // a grow or a trim is in progress
+    volatile INT32      TrimHint;                   // a chunk may be fully free
+    volatile INT32      ChunkFree[KP_MAX_CHUNKS];   // free entries of each chunk; only a hint for the trimmer
+    BOOLEAN             ChunkCommitted[KP_MAX_CHUNKS];
+    QWORD               Grows;
+    QWORD               Trims;
+} KPOOL_STATE;
+
+static KPOOL_STATE gKpState;
+
+
+static __forceinline
+DWORD
+_KpChunkIndex(
+    _In_ PVOID Entry
+)
+{
+    return (DWORD)(((QWORD)Entry - gKpState.Base) / KP_CHUNK_SIZE);
+}
+
+
+static __forceinline
+VOID
+_KpLink(
+    _Inout_ PKPOOL_HEADER Header
+)
+{
+    __declspec(align(16)) QWORD old[2];
+
+    old[0] = (QWORD)gKpListHead.Top;
+    old[1] = gKpListHead.Tag;
+
+    do
+    {
+        Header->Next = (PKPOOL_HEADER)old[0];
+    } while (!_InterlockedCompareExchange128((volatile INT64 *)&gKpListHead, old[1] + 1, (INT64)Header, (INT64 *)old));
+}
+
+
+static __forceinline
+VOID
+_KpPush(
+    _Inout_ PKPOOL_HEADER Header
+)
+{
+    _KpLink(Header);
+
+    _InterlockedIncrement64((volatile INT64 *)&gKpFreeEntries);
+
+    if (KP_ENTRIES_PER_CHUNK == _InterlockedIncrement((volatile long *)&gKpState.ChunkFree[_KpChunkIndex(Header)]))
+    {
+        gKpState.TrimHint = TRUE;
+    }
+}
+
+
+static __forceinline
+PKPOOL_HEADER
+_KpPop(
+    VOID
+)
+{
+    __declspec(align(16)) QWORD old[2];
+    PKPOOL_HEADER pTop;
+
+    _InterlockedIncrement((volatile long *)&gKpActivePops);
+
+    old[0] = (QWORD)gKpListHead.Top;
+    old[1] = gKpListHead.Tag;
 
+    do
+    {
+        pTop = (PKPOOL_HEADER)old[0];
+        if (!pTop)
+        {
+            break;
+        }
+    } while (!_InterlockedCompareExchange128((volatile INT64 *)&gKpListHead, old[1] + 1, (INT64)pTop->Next, (INT64 *)old));
+
+    _InterlockedDecrement((volatile long *)&gKpActivePops);
+
+    if (pTop)
+    {
+        _InterlockedDecrement64((volatile INT64 *)&gKpFreeEntries);
+        _InterlockedDecrement((volatile long *)&gKpState.ChunkFree[_KpChunkIndex(pTop)]);
+    }
+
+    return pTop;
+}
+
+
+static
+PKPOOL_HEADER
+_KpDetachAll(
+    VOID
+)
+{
+    __declspec(align(16)) QWORD old[2];
+
+    old[0] = (QWORD)gKpListHead.Top;
+    old[1] = gKpListHead.Tag;
+
+    while (!_InterlockedCompareExchange128((volatile INT64 *)&gKpListHead, old[1] + 1, 0, (INT64 *)old));
+
+    return (PKPOOL_HEADER)old[0];
+}
 
-static LIST_HEAD gKpListHead;
+
+static __forceinline
+BOOLEAN
+_KpIsEntry(
+    _In_ PKPOOL_HEADER Header
+)
+{
+    QWORD entry = (QWORD)Header;
+
+    return entry >= gKpState.Base && entry < gKpState.Base + (QWORD)gKpState.MaxChunks * KP_CHUNK_SIZE &&
+        0 == entry % KP_ENTRY_SIZE && gKpState.ChunkCommitted[_KpChunkIndex(Header)];
+}
 
 
+// Pops up to Count entries with a single CMPXCHG16B and returns how many were popped
+static
+DWORD
+_KpPopChain(
+    _In_ DWORD Count,
+    _Out_writes_(Count) PVOID *Entries
+)
+{
+    __declspec(align(16)) QWORD old[2];
+    PKPOOL_HEADER pLast;
+    DWORD taken;
+
+    _InterlockedIncrement((volatile long *)&gKpActivePops);
+
+    old[0] = (QWORD)gKpListHead.Top;
+    old[1] = gKpListHead.Tag;
+
+    do
+    {
+        PKPOOL_HEADER pEntry = (PKPOOL_HEADER)old[0];
+
+        // the chain may change under us: an entry that was popped meanwhile holds user data instead of a link, so
+        // every link is checked before it is followed; the CMPXCHG16B fails anyway because the tag changed
+        taken = 0;
+        pLast = NULL;
+        while (taken < Count && pEntry && _KpIsEntry(pEntry))
+        {
+            Entries[taken++] = pEntry;
+            pLast = pEntry;
+            pEntry = pEntry->Next;
+        }
+
+        if (!taken)
+        {
+            break;
+        }
+    } while (!_InterlockedCompareExchange128((volatile INT64 *)&gKpListHead, old[1] + 1, (INT64)pLast->Next, (INT64 *)old));
+
+    _InterlockedDecrement((volatile long *)&gKpActivePops);
+
+    if (taken)
+    {
+        _InterlockedExchangeAdd64((volatile INT64 *)&gKpFreeEntries, -(INT64)taken);
+
+        for (DWORD i = 0; i < taken; i++)
+        {
+            _InterlockedDecrement((volatile long *)&gKpState.ChunkFree[_KpChunkIndex(Entries[i])]);
+        }
+    }
+
+    return taken;
+}
+
+
+// Pushes Count entries with a single CMPXCHG16B
+static
+VOID
+_KpPushChain(
+    _In_ DWORD Count,
+    _In_reads_(Count) PVOID *Entries
+)
+{
+    __declspec(align(16)) QWORD old[2];
+    PKPOOL_HEADER pFirst = (KPOOL_HEADER *)Entries[0];
+    PKPOOL_HEADER pLast = (KPOOL_HEADER *)Entries[Count - 1];
+
+    for (DWORD i = 0; i + 1 < Count; i++)
+    {
+        ((KPOOL_HEADER *)Entries[i])->Next = (KPOOL_HEADER *)Entries[i + 1];
+    }
+
+    old[0] = (QWORD)gKpListHead.Top;
+    old[1] = gKpListHead.Tag;
+
+    do
+    {
+        pLast->Next = (PKPOOL_HEADER)old[0];
+    } while (!_InterlockedCompareExchange128((volatile INT64 *)&gKpListHead, old[1] + 1, (INT64)pFirst, (INT64 *)old));
+
+    _InterlockedExchangeAdd64((volatile INT64 *)&gKpFreeEntries, Count);
+
+    for (DWORD i = 0; i < Count; i++)
+    {
+        if (KP_ENTRIES_PER_CHUNK == _InterlockedIncrement((volatile long *)&gKpState.ChunkFree[_KpChunkIndex(Entries[i])]))
+        {
+            gKpState.TrimHint = TRUE;
+        }
+    }
+}
+
+
+static
 NTSTATUS
-KpInit(
-    _In_ PVOID Base,
-    _In_ DWORD Length,
-    _In_ DWORD EntrySize
+_KpCommitChunk(
+    _In_ DWORD Chunk
 )
 {
-    DWORD pages;
+    NTSTATUS status;
+    QWORD base = gKpState.Base + (QWORD)Chunk * KP_CHUNK_SIZE;
 
-    if (PAGE_SIZE_4K == EntrySize)
+    status = MmCommitRange(base, KP_CHUNK_SIZE);
+    if (!NT_SUCCESS(status))
     {
-        pages = SMALL_PAGE_COUNT(Length);
+        LogWithInfo("[ERROR] MmCommitRange failed for %018p: 0x%08x\n", base, status);
+        return status;
     }
-    else if (PAGE_SIZE_2M == EntrySize)
+
+    gKpState.ChunkCommitted[Chunk] = TRUE;
+    _InterlockedIncrement((volatile long *)&gKpState.Committed);
+
+    // push them in reverse, so they are handed out in address order
+    for (QWORD entry = base + KP_CHUNK_SIZE; entry > base; entry -= KP_ENTRY_SIZE)
     {
-        pages = LARGE_PAGE_COUNT(Length);
+        _KpPush((KPOOL_HEADER *)(entry - KP_ENTRY_SIZE));
     }
-    else
+
+    return STATUS_SUCCESS;
+}
+
+
+// TRUE if the pool grew, or if a grow or a trim was in progress on another CPU (waited for, if Wait); either way there
+// may be something to pop now. FALSE if no chunk could be committed.
+static
+BOOLEAN
+_KpGrow(
+    _In_ BOOLEAN Wait
+)
+{
+    BOOLEAN grown = FALSE;
+    QWORD flags;
+
+    flags = __readeflags();
+    _disable();
+
+    if (0 != _InterlockedCompareExchange((volatile long *)&gKpState.Busy, TRUE, FALSE))
     {
-        return STATUS_INVALID_PARAMETER_1;
+        // someone else is already doing it, its entries are as good as ours
+        while (Wait && gKpState.Busy)
+        {
+            _mm_pause();
+        }
+
+        __writeeflags(flags);
+        return TRUE;
     }
 
-    if (Length < EntrySize)
+    for (DWORD chunk = 0; chunk < gKpState.MaxChunks; chunk++)
     {
-        return STATUS_NO_MEMORY;
+        if (!gKpState.ChunkCommitted[chunk])
+        {
+            if (NT_SUCCESS(_KpCommitChunk(chunk)))
+            {
+                gKpState.Grows++;
+                grown = TRUE;
+            }
+
+            // the pool grows when the demand peaks, a good moment to sample the usage
+            MmTagSamplePeaks();
+
+            break;
+        }
     }
 
-    if (!Base || (QWORD)Base % EntrySize)
+    gKpState.Busy = FALSE;
+
+    __writeeflags(flags);
+
+    return grown;
+}
+
+
+NTSTATUS
+KpInit(
+    _In_ PVOID Base,
+    _In_ QWORD ReservedLength,
+    _In_ DWORD InitialLength
+)
+{
+    INT32 regs[4] = { 0 };
+
+    __cpuid(regs, 1);
+    if (0 == (regs[2] & CPUID_ECX_CMPXCHG16B))
+    {
+        LogWithInfo("[ERROR] CMPXCHG16B is not supported\n");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if (!Base || (QWORD)Base % KP_CHUNK_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!ReservedLength || ReservedLength % KP_CHUNK_SIZE || ReservedLength / KP_CHUNK_SIZE > KP_MAX_CHUNKS)
     {
         return STATUS_INVALID_PARAMETER_2;
     }
 
-    if (Length % EntrySize)
+    if (InitialLength > ReservedLength)
     {
         return STATUS_INVALID_PARAMETER_3;
     }
 
-    InitializeListHead(&gKpListHead);
+    memset(&gKpState, 0, sizeof(gKpState));
+    gKpState.Base = (QWORD)Base;
+    gKpState.MaxChunks = (DWORD)(ReservedLength / KP_CHUNK_SIZE);
 
-    for (DWORD p = 0; p < pages; p++)
-    {
-        PKPOOL_HEADER pHeader = (KPOOL_HEADER *)((SIZE_T)Base + p * EntrySize);
+    gKpListHead.Top = NULL;
+    gKpListHead.Tag = 0;
+    gKpFreeEntries = 0;
 
-        memset(pHeader, 0, sizeof(KPOOL_HEADER));
-        InsertTailList(&gKpListHead, &pHeader->Link);
+    for (DWORD chunk = 0; chunk < ROUND_UP(InitialLength, KP_CHUNK_SIZE) / KP_CHUNK_SIZE; chunk++)
+    {
+        NTSTATUS status = _KpCommitChunk(chunk);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _KpCommitChunk failed: 0x%08x\n", status);
+            return status;
+        }
     }
 
+    LogWithInfo("[KPOOL] Reserved [%018p, %018p), %d KB committed\n",
+        Base, (QWORD)Base + ReservedLength, ByteToKb((QWORD)gKpState.Committed * KP_CHUNK_SIZE));
+
     return STATUS_SUCCESS;
 }
 
 
 NTSTATUS
 KpAlloc(
+    _In_ DWORD Tag,
     _Out_ PVOID *Ptr
 )
 {
     PKPOOL_HEADER pHeader;
 
-    if (!Ptr)
+    if (!Tag)
     {
         return STATUS_INVALID_PARAMETER_1;
     }
 
-    if (IsListEmpty(&gKpListHead))
+    if (!Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    // an empty list may only be detached by the trimmer for a moment, _KpGrow waits for it
+    pHeader = _KpPop();
+    while (!pHeader)
+    {
+        if (!_KpGrow(TRUE))
+        {
+            MmTagFailure(Tag);
+            return STATUS_NO_MEMORY;
+        }
+
+        pHeader = _KpPop();
+    }
+
+    if (gKpFreeEntries < KP_LOW_WATERMARK)
     {
-        return STATUS_NO_MEMORY;
+        _KpGrow(FALSE);
     }
 
-    pHeader = CONTAINING_RECORD(gKpListHead.Flink, KPOOL_HEADER, Link);
-    RemoveEntryList(&pHeader->Link);
     memset(pHeader, 0, sizeof(KPOOL_HEADER));
+    MmTagCharge(Tag, KP_ENTRY_SIZE);
+    MmProfOnAlloc(KP_ENTRY_SIZE);
 
     *Ptr = (VOID *)pHeader;
 
@@ -99,7 +456,8 @@ KpAlloc(
 
 NTSTATUS
 KpFreeAndNull(
-    _Inout_ PVOID *Ptr
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag
 )
 {
     PKPOOL_HEADER pHeader;
@@ -109,11 +467,403 @@ KpFreeAndNull(
         return STATUS_INVALID_PARAMETER_1;
     }
 
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
     pHeader = (KPOOL_HEADER *)*Ptr;
-    memset(pHeader, 0, sizeof(KPOOL_HEADER));
-    InsertTailList(&gKpListHead, &pHeader->Link);
+    _KpPush(pHeader);
+    MmTagCredit(Tag, KP_ENTRY_SIZE);
 
     *Ptr = NULL;
 
+    if (gKpState.TrimHint && gKpFreeEntries > KP_HIGH_WATERMARK)
+    {
+        KpTrim();
+    }
+
     return STATUS_SUCCESS;
 }
+
+
+NTSTATUS
+KpAllocBatch(
+    _In_ DWORD Count,
+    _In_ DWORD Tag,
+    _Out_writes_(Count) PVOID *Ptrs
+)
+{
+    DWORD taken = 0;
+
+    if (!Count)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Ptrs)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    while (taken < Count)
+    {
+        DWORD popped = _KpPopChain(Count - taken, &Ptrs[taken]);
+
+        // nothing could be added, give back what we have
+        if (!popped && !_KpGrow(TRUE))
+        {
+            if (taken)
+            {
+                _KpPushChain(taken, Ptrs);
+            }
+
+            MmTagFailure(Tag);
+            return STATUS_NO_MEMORY;
+        }
+
+        taken += popped;
+    }
+
+    if (gKpFreeEntries < KP_LOW_WATERMARK)
+    {
+        _KpGrow(FALSE);
+    }
+
+    for (DWORD i = 0; i < Count; i++)
+    {
+        memset(Ptrs[i], 0, sizeof(KPOOL_HEADER));
+    }
+
+    MmTagChargeMany(Tag, Count, (QWORD)Count * KP_ENTRY_SIZE);
+    MmProfOnAlloc((QWORD)Count * KP_ENTRY_SIZE);
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+KpFreeBatch(
+    _In_ DWORD Count,
+    _Inout_updates_(Count) PVOID *Ptrs,
+    _In_ DWORD Tag
+)
+{
+    if (!Count)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Ptrs)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    for (DWORD i = 0; i < Count; i++)
+    {
+        if (!Ptrs[i] || !_KpIsEntry((KPOOL_HEADER *)Ptrs[i]))
+        {
+            LogWithInfo("[ERROR] %018p at index %d is not a pool entry\n", Ptrs[i], i);
+            return STATUS_INVALID_PARAMETER_2;
+        }
+    }
+
+    _KpPushChain(Count, Ptrs);
+    MmTagCreditMany(Tag, Count, (QWORD)Count * KP_ENTRY_SIZE);
+
+    memset(Ptrs, 0, Count * sizeof(PVOID));
+
+    if (gKpState.TrimHint && gKpFreeEntries > KP_HIGH_WATERMARK)
+    {
+        KpTrim();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+DWORD
+KpTrim(
+    VOID
+)
+{
+    static DWORD found[KP_MAX_CHUNKS];
+    PKPOOL_HEADER pList;
+    PKPOOL_HEADER pEntry;
+    DWORD released = 0;
+    QWORD flags;
+
+    // an allocation that interrupted us here would wait for the list to come back forever
+    flags = __readeflags();
+    _disable();
+
+    if (0 != _InterlockedCompareExchange((volatile long *)&gKpState.Busy, TRUE, FALSE))
+    {
+        __writeeflags(flags);
+        return 0;
+    }
+
+    gKpState.TrimHint = FALSE;
+
+    // the detached list is the only source of truth about what is free
+    pList = _KpDetachAll();
+
+    memset(found, 0, sizeof(found));
+    for (pEntry = pList; pEntry; pEntry = pEntry->Next)
+    {
+        found[_KpChunkIndex(pEntry)]++;
+    }
+
+    // a pop that started before the detach may still dereference an entry from the old list, release nothing
+    if (0 == gKpActivePops)
+    {
+        for (DWORD chunk = 0; chunk < gKpState.MaxChunks; chunk++)
+        {
+            if (gKpFreeEntries < KP_HIGH_WATERMARK / 2 + KP_ENTRIES_PER_CHUNK)
+            {
+                break;
+            }
+
+            if (KP_ENTRIES_PER_CHUNK == found[chunk])
+            {
+                // mark the chunk, its entries are filtered out below
+                found[chunk] = (DWORD)-1;
+                _InterlockedExchangeAdd64((volatile INT64 *)&gKpFreeEntries, -(INT64)KP_ENTRIES_PER_CHUNK);
+                released++;
+            }
+        }
+    }
+
+    // give back everything that is not released; the counters already account for these entries
+    while (pList)
+    {
+        pEntry = pList;
+        pList = pList->Next;
+
+        if ((DWORD)-1 != found[_KpChunkIndex(pEntry)])
+        {
+            _KpLink(pEntry);
+        }
+    }
+
+    for (DWORD chunk = 0; chunk < gKpState.MaxChunks; chunk++)
+    {
+        if ((DWORD)-1 == found[chunk])
+        {
+            QWORD base = gKpState.Base + (QWORD)chunk * KP_CHUNK_SIZE;
+            NTSTATUS status = MmDecommitRange(base, KP_CHUNK_SIZE);
+            if (!NT_SUCCESS(status))
+            {
+                LogWithInfo("[ERROR] MmDecommitRange failed for %018p: 0x%08x\n", base, status);
+            }
+
+            gKpState.ChunkFree[chunk] = 0;
+            gKpState.ChunkCommitted[chunk] = FALSE;
+            _InterlockedDecrement((volatile long *)&gKpState.Committed);
+        }
+    }
+
+    if (released)
+    {
+        gKpState.Trims++;
+    }
+
+    gKpState.Busy = FALSE;
+
+    __writeeflags(flags);
+
+    return released;
+}
+
+
+QWORD
+KpGetFreeEntryCount(
+    VOID
+)
+{
+    return gKpFreeEntries;
+}
+
+
+VOID
+KpDumpStatistics(
+    VOID
+)
+{
+    NLog("[KPOOL] %d chunks committed (%d KB), %d free entries, %d grows, %d trims\n",
+        gKpState.Committed, ByteToKb((QWORD)gKpState.Committed * KP_CHUNK_SIZE), gKpFreeEntries,
+        gKpState.Grows, gKpState.Trims);
+}
+
+
+//
+// Stress test
+//
+// A periodic timer allocates and frees entries from its DPC, which runs on top of whatever the BSP was doing when the
+// tick came, while the caller does the same in a loop; the DPC regularly interrupts a pop or a push halfway. Every
+// entry held is stamped with its own address at both ends and checked before it is freed, an entry handed out twice
+// is overwritten by its second owner.
+//
+#define KP_STRESS_MS            200
+#define KP_STRESS_PERIOD_MS     1
+#define KP_STRESS_DPC_STEPS     16
+#define KP_STRESS_HELD          8
+#define KP_STRESS_BATCH_EVERY   64
+
+typedef struct _KP_STRESS_SIDE
+{
+    PVOID                   Held[KP_STRESS_HELD];
+    QWORD                   Ops;
+} KP_STRESS_SIDE;
+
+typedef struct _KP_STRESS_CONTEXT
+{
+    KP_STRESS_SIDE          Dpc;
+    KP_STRESS_SIDE          Caller;
+    volatile INT32          Failures;
+    volatile INT32          Corrupted;
+} KP_STRESS_CONTEXT;
+
+
+static
+VOID
+_KpStressRelease(
+    _Inout_ KP_STRESS_CONTEXT *Context,
+    _Inout_ PVOID *Entry
+)
+{
+    QWORD *pEntry = (QWORD *)*Entry;
+
+    if (pEntry[0] != (QWORD)pEntry || pEntry[KP_ENTRY_SIZE / sizeof(QWORD) - 1] != ~(QWORD)pEntry)
+    {
+        LogWithInfo("[ERROR] Pool entry %018p was changed by another owner\n", pEntry);
+        _InterlockedIncrement((volatile long *)&Context->Corrupted);
+    }
+
+    KpFreeAndNull(Entry, TAG_BENCHMARK);
+}
+
+
+static
+VOID
+_KpStressStep(
+    _Inout_ KP_STRESS_CONTEXT *Context,
+    _Inout_ KP_STRESS_SIDE *Side
+)
+{
+    PVOID *pHeld = &Side->Held[Side->Ops % KP_STRESS_HELD];
+    QWORD *pEntry;
+
+    if (*pHeld)
+    {
+        _KpStressRelease(Context, pHeld);
+    }
+
+    if (!NT_SUCCESS(KpAlloc(TAG_BENCHMARK, pHeld)))
+    {
+        _InterlockedIncrement((volatile long *)&Context->Failures);
+        return;
+    }
+
+    pEntry = (QWORD *)*pHeld;
+    pEntry[0] = (QWORD)pEntry;
+    pEntry[KP_ENTRY_SIZE / sizeof(QWORD) - 1] = ~(QWORD)pEntry;
+
+    Side->Ops++;
+}
+
+
+static
+VOID
+_KpStressDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID Context
+)
+{
+    KP_STRESS_CONTEXT *pCtx = (KP_STRESS_CONTEXT *)Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+
+    for (DWORD i = 0; i < KP_STRESS_DPC_STEPS; i++)
+    {
+        _KpStressStep(pCtx, &pCtx->Dpc);
+    }
+}
+
+
+VOID
+KpStressTest(
+    VOID
+)
+{
+    KP_STRESS_CONTEXT ctx = { 0 };
+    KTIMER timer;
+    KDPC dpc;
+    QWORD end;
+    NTSTATUS status;
+
+    KeInitializeTimer(&timer);
+    KeInitializeDpc(&dpc, _KpStressDpc, &ctx);
+
+    status = KeSetTimer(&timer, KP_STRESS_PERIOD_MS, KP_STRESS_PERIOD_MS, &dpc);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeSetTimer failed: 0x%08x\n", status);
+        return;
+    }
+
+    end = TmrGetTime() + KP_STRESS_MS;
+    while (TmrGetTime() < end)
+    {
+        _KpStressStep(&ctx, &ctx.Caller);
+
+        // the batch paths pop and push whole chains, a DPC in the middle of one sees a half updated list
+        if (0 == ctx.Caller.Ops % KP_STRESS_BATCH_EVERY)
+        {
+            PVOID batch[KP_STRESS_HELD];
+
+            if (NT_SUCCESS(KpAllocBatch(KP_STRESS_HELD, TAG_BENCHMARK, batch)))
+            {
+                KpFreeBatch(KP_STRESS_HELD, batch, TAG_BENCHMARK);
+            }
+            else
+            {
+                _InterlockedIncrement((volatile long *)&ctx.Failures);
+            }
+        }
+    }
+
+    KeCancelTimer(&timer);
+
+    // the DPC runs on this CPU, on top of us: once it is no longer queued it is done for good
+    while (dpc.Queued)
+    {
+        _mm_pause();
+    }
+
+    for (DWORD i = 0; i < KP_STRESS_HELD; i++)
+    {
+        if (ctx.Dpc.Held[i])
+        {
+            _KpStressRelease(&ctx, &ctx.Dpc.Held[i]);
+        }
+
+        if (ctx.Caller.Held[i])
+        {
+            _KpStressRelease(&ctx, &ctx.Caller.Held[i]);
+        }
+    }
+
+    NLog("[KPOOL] Stress test: %d allocations from the timer, %d from the caller, %d failures, %d corrupted entries\n",
+        ctx.Dpc.Ops, ctx.Caller.Ops, ctx.Failures, ctx.Corrupted);
+}
@@ -1,21 +1,63 @@
 #ifndef _KPOOL_H_
 #define _KPOOL_H_
 
+// Reserves [Base, Base + ReservedLength) for the pool and commits InitialLength bytes of it
 NTSTATUS
 KpInit(
     _In_ PVOID Base,
-    _In_ DWORD Length,
-    _In_ DWORD EntrySize
+    _In_ QWORD ReservedLength,
+    _In_ DWORD InitialLength
 );
 
 NTSTATUS
 KpAlloc(
+    _In_ DWORD Tag,                     // MM_TAG, the entry is charged to it
     _Out_ PVOID *Ptr
 );
 
 NTSTATUS
 KpFreeAndNull(
-    _Inout_ PVOID *Ptr
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag                      // must be the one given to KpAlloc
+);
+
+// Takes Count entries off the free list at once; either all of them or none
+NTSTATUS
+KpAllocBatch(
+    _In_ DWORD Count,
+    _In_ DWORD Tag,                     // MM_TAG, every entry is charged to it
+    _Out_writes_(Count) PVOID *Ptrs
+);
+
+// Gives back Count entries at once and sets every pointer in Ptrs to NULL
+NTSTATUS
+KpFreeBatch(
+    _In_ DWORD Count,
+    _Inout_updates_(Count) PVOID *Ptrs,
+    _In_ DWORD Tag                      // must be the one given to KpAllocBatch
+);
+
+QWORD
+KpGetFreeEntryCount(
+    VOID
+);
+
+// Decommits fully free chunks while there are more free entries than needed; returns the number of chunks released
+DWORD
+KpTrim(
+    VOID
+);
+
+VOID
+KpDumpStatistics(
+    VOID
+);
+
+// Allocates and frees from a timer DPC and from the caller at the same time for a while, checking that no entry is
+// handed out twice; must be called on the BSP, with interrupts enabled
+VOID
+KpStressTest(
+    VOID
 );
 
 #endif // !_KPOOL_H_
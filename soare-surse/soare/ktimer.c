@@ -0,0 +1,423 @@
+#include "defs.h"
+#include "ntstatus.h"
+#include "ktimer.h"
+#include "timer.h"
+#include "dtr.h"
+#include "smp.h"
+#include "idle.h"
+#include "kernel.h"
+#include "log.h"
+
+/*
+
+    Timing wheel.
+    The wheel counts milliseconds of TmrGetTime, a tick of the wheel is not a tick of the scheduler.
+    A timer that expires within 256 ms of the clock goes straight into the root slot of its ms. Later ones go
+    into the level whose range they fit in, indexed by their bits of that level. Whenever the root wraps around, the
+    clock reached the start of the next level 1 slot: its timers are inserted again, now all of them fit in the root.
+    Level 1 wrapping around does the same with level 2, and so on. A timer is moved at most KE_TIMER_LEVELS times,
+    and each ms only looks at one slot of the root and (every 256 ms) at one slot per level.
+
+    Anything past 2 ^ 32 ms (about 49 days) is clamped to the last slot and waits for another round.
+    A timer that is already due goes into the slot of the next ms.
+
+    KeTimerTick catches up with all the ms since the last call: 5 of them on a scheduler tick, as many as the CPU
+    slept for when the tick was stopped (at most up to the first timer, that is when the clock event fires). It only
+    stops on the root slots that hold timers and on the cascades; with nothing armed it jumps to the current ms.
+
+*/
+
+#define KE_TIMER_MAX_DELTA  ((1LL << (KE_TIMER_ROOT_BITS + KE_TIMER_LEVELS * KE_TIMER_LEVEL_BITS)) - 1)
+
+extern KGLOBAL gKernelGlobalData;
+
+
+// The wheel lock is held
+static
+VOID
+_KeInsertTimer(
+    _Inout_ KE_TIMER_WHEEL *Wheel,
+    _Inout_ PKTIMER Timer
+)
+{
+    QWORD expires = Timer->Expires;
+    INT64 delta = (INT64)(expires - Wheel->Clock);
+    PLIST_ENTRY pSlot;
+
+    if (delta < 0)
+    {
+        pSlot = &Wheel->Root[Wheel->Clock & (KE_TIMER_ROOT_SIZE - 1)];
+    }
+    else if (delta < KE_TIMER_ROOT_SIZE)
+    {
+        pSlot = &Wheel->Root[expires & (KE_TIMER_ROOT_SIZE - 1)];
+    }
+    else
+    {
+        DWORD level = 0;
+
+        if (delta > KE_TIMER_MAX_DELTA)
+        {
+            delta = KE_TIMER_MAX_DELTA;
+            expires = Wheel->Clock + delta;
+        }
+
+        while (delta >= (1LL << (KE_TIMER_ROOT_BITS + (level + 1) * KE_TIMER_LEVEL_BITS)))
+        {
+            level++;
+        }
+
+        pSlot = &Wheel->Levels[level][(expires >> (KE_TIMER_ROOT_BITS + level * KE_TIMER_LEVEL_BITS)) &
+            (KE_TIMER_LEVEL_SIZE - 1)];
+    }
+
+    InsertTailList(pSlot, &Timer->Link);
+    Timer->Wheel = Wheel;
+}
+
+
+// Spreads a slot over the levels below it; returns the index, 0 means the level wrapped around as well
+static
+DWORD
+_KeCascadeTimers(
+    _Inout_ KE_TIMER_WHEEL *Wheel,
+    _In_ DWORD Level
+)
+{
+    DWORD index = (Wheel->Clock >> (KE_TIMER_ROOT_BITS + Level * KE_TIMER_LEVEL_BITS)) & (KE_TIMER_LEVEL_SIZE - 1);
+    PLIST_ENTRY pSlot = &Wheel->Levels[Level][index];
+    LIST_ENTRY list;
+
+    // take the whole slot first, a timer clamped to it would be inserted right back
+    InitializeListHead(&list);
+    while (!IsListEmpty(pSlot))
+    {
+        InsertTailList(&list, RemoveHeadList(pSlot));
+    }
+
+    while (!IsListEmpty(&list))
+    {
+        PKTIMER pTimer = CONTAINING_RECORD(RemoveHeadList(&list), KTIMER, Link);
+
+        _KeInsertTimer(Wheel, pTimer);
+    }
+
+    return index;
+}
+
+
+// Unlinks the timer from the wheel it is armed on; TRUE if it was armed
+static
+BOOLEAN
+_KeRemoveTimer(
+    _Inout_ PKTIMER Timer
+)
+{
+    for (;;)
+    {
+        KE_TIMER_WHEEL *pWheel = Timer->Wheel;
+        QWORD flags;
+
+        if (!pWheel)
+        {
+            return FALSE;
+        }
+
+        flags = KeAcquireTicketLockIrqSave(&pWheel->Lock);
+
+        // the expiry may have taken it off meanwhile, and a periodic timer is put back on the same wheel
+        if (Timer->Wheel == pWheel)
+        {
+            RemoveEntryList(&Timer->Link);
+            Timer->Wheel = NULL;
+            pWheel->Armed--;
+
+            KeReleaseTicketLockIrqRestore(&pWheel->Lock, flags);
+            return TRUE;
+        }
+
+        KeReleaseTicketLockIrqRestore(&pWheel->Lock, flags);
+    }
+}
+
+
+VOID
+KeTimerInitCpu(
+    VOID
+)
+{
+    KE_TIMER_WHEEL *pWheel = &GetCurrentCpu()->Timers;
+
+    KeInitializeTicketLock(&pWheel->Lock);
+
+    for (DWORD i = 0; i < KE_TIMER_ROOT_SIZE; i++)
+    {
+        InitializeListHead(&pWheel->Root[i]);
+    }
+
+    for (DWORD level = 0; level < KE_TIMER_LEVELS; level++)
+    {
+        for (DWORD i = 0; i < KE_TIMER_LEVEL_SIZE; i++)
+        {
+            InitializeListHead(&pWheel->Levels[level][i]);
+        }
+    }
+
+    pWheel->Clock = TmrGetTime();
+    pWheel->Armed = 0;
+    pWheel->Expired = 0;
+    pWheel->Ticking = FALSE;
+}
+
+
+VOID
+KeInitializeTimer(
+    _Out_ PKTIMER Timer
+)
+{
+    Timer->Link.Flink = Timer->Link.Blink = NULL;
+    Timer->Expires = 0;
+    Timer->Period = 0;
+    Timer->Dpc = NULL;
+    Timer->Wheel = NULL;
+}
+
+
+NTSTATUS
+KeSetTimer(
+    _Inout_ PKTIMER Timer,
+    _In_ DWORD DueTime,
+    _In_ DWORD Period,
+    _In_ PKDPC Dpc
+)
+{
+    KE_TIMER_WHEEL *pWheel;
+    PPCPU pCpu;
+    QWORD flags;
+
+    if (!Timer)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Dpc)
+    {
+        return STATUS_INVALID_PARAMETER_4;
+    }
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    _KeRemoveTimer(Timer);
+
+    Timer->Dpc = Dpc;
+    Timer->Period = Period;
+
+    flags = __readeflags();
+    _disable();
+
+    // the BSP gets the ticks of the system timer, even before the first one came
+    pCpu = GetCurrentCpu();
+    pWheel = &pCpu->Timers;
+    if (!pWheel->Ticking && !pCpu->IsBsp)
+    {
+        pWheel = &KeGetCpu(0)->Timers;
+    }
+
+    KeAcquireTicketLock(&pWheel->Lock);
+
+    // the current ms is partly gone, one more makes sure at least DueTime goes by
+    Timer->Expires = TmrGetTime() + DueTime + 1;
+    _KeInsertTimer(pWheel, Timer);
+    pWheel->Armed++;
+
+    KeReleaseTicketLock(&pWheel->Lock);
+
+    // the clock event may be programmed for later than that
+    if (pWheel == &pCpu->Timers)
+    {
+        TmrUpdateClockEvent(Timer->Expires);
+    }
+    else
+    {
+        KeWakeCpu(CONTAINING_RECORD(pWheel, PCPU, Timers));
+    }
+
+    __writeeflags(flags);
+
+    return STATUS_SUCCESS;
+}
+
+
+BOOLEAN
+KeCancelTimer(
+    _Inout_ PKTIMER Timer
+)
+{
+    if (!Timer)
+    {
+        return FALSE;
+    }
+
+    return _KeRemoveTimer(Timer);
+}
+
+
+QWORD
+KeTimerNextExpiry(
+    _In_ QWORD Limit
+)
+{
+    KE_TIMER_WHEEL *pWheel = &GetCurrentCpu()->Timers;
+    QWORD next = Limit;
+
+    KeAcquireTicketLock(&pWheel->Lock);
+
+    if (!pWheel->Armed)
+    {
+        goto _exit;
+    }
+
+    // a root slot holds the timers of a single ms, the first one that isn't empty is the earliest of the root
+    for (QWORD time = pWheel->Clock; time < pWheel->Clock + KE_TIMER_ROOT_SIZE && time < next; time++)
+    {
+        if (!IsListEmpty(&pWheel->Root[time & (KE_TIMER_ROOT_SIZE - 1)]))
+        {
+            next = time;
+            break;
+        }
+    }
+
+    // nothing on the levels expires before the root wraps around; that is all a ticking CPU needs to know
+    if (next <= ROUND_UP(pWheel->Clock, KE_TIMER_ROOT_SIZE))
+    {
+        goto _exit;
+    }
+
+    // a level slot covers a range, its timers have to be looked at one by one. The current slot holds either the
+    // earliest range (not cascaded yet) or the one furthest away (wrapped around), so it is always looked at.
+    for (DWORD level = 0; level < KE_TIMER_LEVELS; level++)
+    {
+        DWORD shift = KE_TIMER_ROOT_BITS + level * KE_TIMER_LEVEL_BITS;
+        DWORD index = (pWheel->Clock >> shift) & (KE_TIMER_LEVEL_SIZE - 1);
+
+        for (DWORD i = 0; i < KE_TIMER_LEVEL_SIZE; i++)
+        {
+            PLIST_ENTRY pSlot = &pWheel->Levels[level][(index + i) & (KE_TIMER_LEVEL_SIZE - 1)];
+
+            if (IsListEmpty(pSlot))
+            {
+                continue;
+            }
+
+            for (PLIST_ENTRY pEntry = pSlot->Flink; pEntry != pSlot; pEntry = pEntry->Flink)
+            {
+                next = MIN(next, CONTAINING_RECORD(pEntry, KTIMER, Link)->Expires);
+            }
+
+            if (i)
+            {
+                break;
+            }
+        }
+    }
+
+_exit:
+    KeReleaseTicketLock(&pWheel->Lock);
+
+    return next;
+}
+
+
+VOID
+KeTimerTick(
+    VOID
+)
+{
+    KE_TIMER_WHEEL *pWheel;
+    QWORD now;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pWheel = &GetCurrentCpu()->Timers;
+    pWheel->Ticking = TRUE;
+
+    now = TmrGetTime();
+
+    KeAcquireTicketLock(&pWheel->Lock);
+
+    while ((INT64)(now - pWheel->Clock) >= 0)
+    {
+        DWORD index = pWheel->Clock & (KE_TIMER_ROOT_SIZE - 1);
+        LIST_ENTRY expired;
+
+        // every slot is empty, no cascade would move anything either
+        if (!pWheel->Armed)
+        {
+            pWheel->Clock = now + 1;
+            break;
+        }
+
+        // nothing to do up to the next root slot that holds timers or the next cascade, whichever comes first
+        if (0 != index && IsListEmpty(&pWheel->Root[index]))
+        {
+            QWORD stop = MIN(ROUND_UP(pWheel->Clock, KE_TIMER_ROOT_SIZE), now + 1);
+
+            do
+            {
+                pWheel->Clock++;
+            } while (pWheel->Clock < stop && IsListEmpty(&pWheel->Root[pWheel->Clock & (KE_TIMER_ROOT_SIZE - 1)]));
+
+            continue;
+        }
+
+        if (0 == index)
+        {
+            for (DWORD level = 0; level < KE_TIMER_LEVELS; level++)
+            {
+                if (_KeCascadeTimers(pWheel, level))
+                {
+                    break;
+                }
+            }
+        }
+
+        pWheel->Clock++;
+
+        // a period of 256 ticks lands in the same slot again
+        InitializeListHead(&expired);
+        while (!IsListEmpty(&pWheel->Root[index]))
+        {
+            InsertTailList(&expired, RemoveHeadList(&pWheel->Root[index]));
+        }
+
+        while (!IsListEmpty(&expired))
+        {
+            PKTIMER pTimer = CONTAINING_RECORD(RemoveHeadList(&expired), KTIMER, Link);
+
+            pTimer->Wheel = NULL;
+            pWheel->Expired++;
+
+            if (pTimer->Period)
+            {
+                // on the ms it was due, the period doesn't drift with the latency of the DPC
+                pTimer->Expires += pTimer->Period;
+                _KeInsertTimer(pWheel, pTimer);
+            }
+            else
+            {
+                pWheel->Armed--;
+            }
+
+            // no lock behind it, the queue is per CPU
+            KeInsertQueueDpc(pTimer->Dpc);
+        }
+    }
+
+    KeReleaseTicketLock(&pWheel->Lock);
+}
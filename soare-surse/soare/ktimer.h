@@ -0,0 +1,90 @@
+#ifndef _KTIMER_H_
+#define _KTIMER_H_
+
+#include "defs.h"
+#include "winlists.h"
+#include "spinlock.h"
+#include "dpc.h"
+
+//
+// Kernel timers. Every CPU has a hierarchical timing wheel; a timer is armed on the wheel of the CPU that sets it
+// (or of the BSP, while that CPU gets no ticks), and its DPC is queued on the same CPU when it expires. Setting,
+// cancelling and expiring a timer are O(1), a timer far in the future is moved down one level at a time.
+// The wheel turns in ms, the clock event of the CPU fires for the earliest timer even when its tick is stopped.
+//
+
+#define KE_TIMER_ROOT_BITS          8
+#define KE_TIMER_ROOT_SIZE          (1 << KE_TIMER_ROOT_BITS)
+#define KE_TIMER_LEVEL_BITS         6
+#define KE_TIMER_LEVEL_SIZE         (1 << KE_TIMER_LEVEL_BITS)
+#define KE_TIMER_LEVELS             4       // above the root, 8 + 4 * 6 = 32 bits of ms
+
+#define KE_TIMER_NO_EXPIRY          0xFFFFFFFFFFFFFFFFULL
+
+struct _KE_TIMER_WHEEL;
+
+typedef struct _KTIMER
+{
+    LIST_ENTRY              Link;           // in a slot of the wheel it is armed on
+    QWORD                   Expires;        // TmrGetTime
+    DWORD                   Period;         // ms, 0 for a one shot timer
+    PKDPC                   Dpc;
+    struct _KE_TIMER_WHEEL * volatile Wheel;    // NULL while the timer is not armed
+} KTIMER, *PKTIMER;
+
+// Per CPU, in the PCPU. The root has a slot for each of the next 256 ms, a slot of level N covers
+// 2 ^ (8 + N * 6) ms and is spread over the level below once the clock gets to it.
+typedef struct _KE_TIMER_WHEEL
+{
+    KE_TICKET_LOCK          Lock;           // taken by the tick, IrqSave everywhere
+    volatile BOOLEAN        Ticking;        // the CPU gets ticks, it can take timers
+    BYTE                    _TickingPadding[7];
+    QWORD                   Clock;          // the next ms to be processed
+    QWORD                   Armed;
+    QWORD                   Expired;        // timers expired on this wheel so far
+    LIST_ENTRY              Root[KE_TIMER_ROOT_SIZE];
+    LIST_ENTRY              Levels[KE_TIMER_LEVELS][KE_TIMER_LEVEL_SIZE];
+} KE_TIMER_WHEEL;
+
+// Sets up the wheel of the current CPU
+VOID
+KeTimerInitCpu(
+    VOID
+);
+
+VOID
+KeInitializeTimer(
+    _Out_ PKTIMER Timer
+);
+
+// Arms the timer to queue Dpc in DueTime ms, then every Period ms if Period isn't 0; an armed timer is cancelled
+// first. Two CPUs must not set or cancel the same timer at the same time; the expiry can race with both.
+NTSTATUS
+KeSetTimer(
+    _Inout_ PKTIMER Timer,
+    _In_ DWORD DueTime,
+    _In_ DWORD Period,
+    _In_ PKDPC Dpc
+);
+
+// TRUE if the timer was armed. A DPC that was already queued by the expiry still runs.
+BOOLEAN
+KeCancelTimer(
+    _Inout_ PKTIMER Timer
+);
+
+// Called by the tick and by the clock event of the current CPU with interrupts disabled; queues the DPCs of the
+// timers that expired since the last call
+VOID
+KeTimerTick(
+    VOID
+);
+
+// When the first timer of the current CPU expires, or Limit if that is earlier; interrupts disabled. Cheap for a
+// Limit less than a few ms away, a walk over the whole wheel for KE_TIMER_NO_EXPIRY.
+QWORD
+KeTimerNextExpiry(
+    _In_ QWORD Limit
+);
+
+#endif // !_KTIMER_H_
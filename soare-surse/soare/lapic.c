@@ -0,0 +1,231 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "cpudefs.h"
+#include "lapic.h"
+#include "virtmemmgr.h"
+#include "log.h"
+
+#define LAPIC_ICR_SPINS             1000000     // a pending IPI is normally accepted in less than a microsecond
+
+#define CPUID_ECX_TSC_DEADLINE      (1 << 24)
+
+static volatile BYTE *gLapic;
+static BOOLEAN gLapicTscDeadline;       // every CPU uses the same mode
+
+
+static __forceinline
+DWORD
+_LapicRead(
+    _In_ DWORD Register
+)
+{
+    return *(volatile DWORD *)(gLapic + Register);
+}
+
+
+static __forceinline
+VOID
+_LapicWrite(
+    _In_ DWORD Register,
+    _In_ DWORD Value
+)
+{
+    *(volatile DWORD *)(gLapic + Register) = Value;
+}
+
+
+static
+NTSTATUS
+_LapicWaitIcrIdle(
+    VOID
+)
+{
+    for (DWORD i = 0; i < LAPIC_ICR_SPINS; i++)
+    {
+        if (0 == (_LapicRead(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING))
+        {
+            return STATUS_SUCCESS;
+        }
+
+        _mm_pause();
+    }
+
+    return STATUS_IO_TIMEOUT;
+}
+
+
+NTSTATUS
+LapicInit(
+    _In_ QWORD PhysicalBase
+)
+{
+    QWORD apicBase;
+    PVOID pLapic = NULL;
+    NTSTATUS status;
+
+    if (gLapic)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    apicBase = __readmsr(IA32_APIC_BASE);
+    if ((apicBase & IA32_APIC_BASE_MASK) != PhysicalBase)
+    {
+        LogWithInfo("[LAPIC] The MADT says %018p, IA32_APIC_BASE says %018p\n",
+            PhysicalBase, apicBase & IA32_APIC_BASE_MASK);
+    }
+
+    // the firmware owns the page; the MTRRs already make it uncacheable
+    status = MmMapPhysicalPages(PhysicalBase, PAGE_SIZE_4K, &pLapic, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] MmMapPhysicalPages failed for %018p: 0x%08x\n", PhysicalBase, status);
+        return status;
+    }
+
+    gLapic = pLapic;
+
+    LogWithInfo("[LAPIC] %018p mapped @ %018p, version 0x%08x\n", PhysicalBase, gLapic, _LapicRead(LAPIC_REG_VERSION));
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+LapicEnable(
+    VOID
+)
+{
+    QWORD apicBase = __readmsr(IA32_APIC_BASE);
+
+    if (0 == (apicBase & IA32_APIC_BASE_ENABLE))
+    {
+        __writemsr(IA32_APIC_BASE, apicBase | IA32_APIC_BASE_ENABLE);
+    }
+
+    // accept every priority
+    _LapicWrite(LAPIC_REG_TPR, 0);
+    _LapicWrite(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+
+DWORD
+LapicGetId(
+    VOID
+)
+{
+    return _LapicRead(LAPIC_REG_ID) >> 24;
+}
+
+
+NTSTATUS
+LapicSendIpi(
+    _In_ DWORD ApicId,
+    _In_ DWORD Command
+)
+{
+    QWORD flags;
+    NTSTATUS status;
+
+    if (ApicId > 0xFF)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    // the two halves of the ICR must be written without another IPI from this CPU in between
+    flags = __readeflags();
+    _disable();
+
+    status = _LapicWaitIcrIdle();
+    if (NT_SUCCESS(status))
+    {
+        _LapicWrite(LAPIC_REG_ESR, 0);
+        _LapicWrite(LAPIC_REG_ICR_HIGH, ApicId << LAPIC_ICR_DEST_SHIFT);
+        _LapicWrite(LAPIC_REG_ICR_LOW, Command);
+
+        status = _LapicWaitIcrIdle();
+    }
+
+    __writeeflags(flags);
+
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] IPI 0x%08x to %d not accepted, ESR = 0x%08x\n", Command, ApicId, _LapicRead(LAPIC_REG_ESR));
+    }
+
+    return status;
+}
+
+
+VOID
+LapicEoi(
+    VOID
+)
+{
+    _LapicWrite(LAPIC_REG_EOI, 0);
+}
+
+
+BOOLEAN
+LapicTimerHasTscDeadline(
+    VOID
+)
+{
+    INT32 regs[4] = { 0 };
+
+    __cpuid(regs, 1);
+
+    return 0 != (regs[2] & CPUID_ECX_TSC_DEADLINE);
+}
+
+
+VOID
+LapicTimerSetup(
+    _In_ BYTE Vector,
+    _In_ BOOLEAN TscDeadline
+)
+{
+    gLapicTscDeadline = TscDeadline;
+
+    if (TscDeadline)
+    {
+        _LapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_TSC_DEADLINE | Vector);
+
+        // the SDM asks for a fence, or the WRMSR to IA32_TSC_DEADLINE may pass the switch to TSC-deadline mode
+        _mm_mfence();
+        __writemsr(IA32_TSC_DEADLINE, 0);
+    }
+    else
+    {
+        _LapicWrite(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_BY_16);
+        _LapicWrite(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_ONE_SHOT | Vector);
+        _LapicWrite(LAPIC_REG_TIMER_INITIAL, 0);
+    }
+}
+
+
+VOID
+LapicTimerArm(
+    _In_ QWORD Value
+)
+{
+    if (gLapicTscDeadline)
+    {
+        // a deadline that already passed fires right away
+        __writemsr(IA32_TSC_DEADLINE, Value);
+    }
+    else
+    {
+        _LapicWrite(LAPIC_REG_TIMER_INITIAL, (DWORD)MIN(Value, 0xFFFFFFFF));
+    }
+}
+
+
+DWORD
+LapicTimerGetCount(
+    VOID
+)
+{
+    return _LapicRead(LAPIC_REG_TIMER_CURRENT);
+}
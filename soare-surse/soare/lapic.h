@@ -0,0 +1,107 @@
+#ifndef _LAPIC_H_
+#define _LAPIC_H_
+
+// See 'Chapter 10 Advanced Programmable Interrupt Controller (APIC)' from Intel docs, volume 3
+
+//
+// Registers (offsets inside the 4K MMIO page)
+//
+#define LAPIC_REG_ID                0x020
+#define LAPIC_REG_VERSION           0x030
+#define LAPIC_REG_TPR               0x080   // Task Priority Register
+#define LAPIC_REG_EOI               0x0B0
+#define LAPIC_REG_SVR               0x0F0   // Spurious Interrupt Vector Register
+#define LAPIC_REG_ESR               0x280   // Error Status Register
+#define LAPIC_REG_ICR_LOW           0x300   // Interrupt Command Register [31:0]
+#define LAPIC_REG_ICR_HIGH          0x310   // Interrupt Command Register [63:32], destination in [31:24]
+#define LAPIC_REG_LVT_TIMER         0x320
+#define LAPIC_REG_TIMER_INITIAL     0x380   // Initial Count Register, writing it starts the one shot count down
+#define LAPIC_REG_TIMER_CURRENT     0x390   // Current Count Register
+#define LAPIC_REG_TIMER_DIVIDE      0x3E0   // Divide Configuration Register
+
+#define LAPIC_SVR_ENABLE            0x100   // APIC software enable
+
+//
+// ICR low
+//
+#define LAPIC_ICR_VECTOR_MASK       0x000FF
+#define LAPIC_ICR_FIXED             0x00000 // Delivery mode
+#define LAPIC_ICR_NMI               0x00400
+#define LAPIC_ICR_INIT              0x00500
+#define LAPIC_ICR_STARTUP           0x00600
+#define LAPIC_ICR_PENDING           0x01000 // Delivery status, read-only
+#define LAPIC_ICR_ASSERT            0x04000 // Level
+#define LAPIC_ICR_LEVEL_TRIGGER     0x08000 // Trigger mode
+#define LAPIC_ICR_DEST_SHIFT        24      // in ICR high
+
+//
+// LVT timer
+//
+#define LAPIC_LVT_MASKED            0x10000
+#define LAPIC_LVT_TIMER_ONE_SHOT    0x00000 // Timer mode
+#define LAPIC_LVT_TIMER_PERIODIC    0x20000
+#define LAPIC_LVT_TIMER_TSC_DEADLINE 0x40000
+#define LAPIC_TIMER_DIVIDE_BY_16    0x3
+
+//
+// Vectors
+//
+#define LAPIC_SPURIOUS_VECTOR       0xFF    // the low 4 bits must be set on P6 family processors
+#define LAPIC_IPI_VECTOR            0xF0    // wakes up a CPU and makes it look at its PCPU
+#define LAPIC_TIMER_VECTOR          0xEF    // the clock events, a class below the IPIs
+
+// Maps the local APIC page; the physical address is the same for every CPU
+NTSTATUS
+LapicInit(
+    _In_ QWORD PhysicalBase
+);
+
+// Software enables the local APIC of the current CPU
+VOID
+LapicEnable(
+    VOID
+);
+
+DWORD
+LapicGetId(
+    VOID
+);
+
+// Command: LAPIC_ICR_* delivery mode, level and vector; returns once the IPI was accepted
+NTSTATUS
+LapicSendIpi(
+    _In_ DWORD ApicId,
+    _In_ DWORD Command
+);
+
+VOID
+LapicEoi(
+    VOID
+);
+
+// TRUE if the timer can be armed with a TSC value (CPUID.01H:ECX.TSC_Deadline)
+BOOLEAN
+LapicTimerHasTscDeadline(
+    VOID
+);
+
+// Sets up the timer of the current CPU, disarmed: in TSC-deadline mode, or in one shot mode counting bus clocks / 16
+VOID
+LapicTimerSetup(
+    _In_ BYTE Vector,
+    _In_ BOOLEAN TscDeadline
+);
+
+// Value is a TSC value in TSC-deadline mode, a count in one shot mode; 0 disarms the timer
+VOID
+LapicTimerArm(
+    _In_ QWORD Value
+);
+
+// What is left of the one shot count
+DWORD
+LapicTimerGetCount(
+    VOID
+);
+
+#endif // !_LAPIC_H_
@@ -19,6 +19,14 @@
 #include "buildinfo.h"
 #include "keyboard.h"
 #include "acpitables.h"
+#include "slab.h"
+#include "kpool.h"
+#include "pooltag.h"
+#include "allocprof.h"
+#include "smp.h"
+#include "thread.h"
+#include "task.h"
+#include "idle.h"
 
 extern KGLOBAL gKernelGlobalData;
 
@@ -33,6 +41,7 @@ void EntryPoint(
 #define GUARD_VALUE 'grd0'
     DWORD guard = GUARD_VALUE;
     PPCPU pBsp = NULL;
+    BOOLEAN trampolineReserved;
 
     // init logging mechanisms
     VgaInit(VGA_MEMORY_BUFFER, vgaColorWhite, vgaColorBlack, TRUE);
@@ -74,6 +83,14 @@ void EntryPoint(
         PANIC("Unable to reserve enough physical memory for the kernel\n");
     }
 
+    // the APs start in real mode, their trampoline must stay below 1M
+    status = MmReservePhysicalRange(KE_AP_TRAMPOLINE_PA, PAGE_SIZE_4K);
+    trampolineReserved = NT_SUCCESS(status);
+    if (!trampolineReserved)
+    {
+        LogWithInfo("[ERROR] MmReservePhysicalRange failed for the AP trampoline: 0x%08x\n", status);
+    }
+
     pmmgrStart = 0;
     pmmgEnd = 0;
     MmGetPmmgrReservedPhysicalRange(&pmmgrStart, &pmmgEnd);
@@ -99,7 +116,7 @@ void EntryPoint(
         PANIC("Stack guard value was corrupted!");
     }
 
-    gKernelGlobalData.Phase = 2;    // memory manager initialized, BSP stack switched
+    gKernelGlobalData.Phase = KE_PHASE_MM_READY;
     status = DtrCreatePcpu(&pBsp);
     if (!NT_SUCCESS(status))
     {
@@ -117,6 +134,19 @@ void EntryPoint(
         PANIC("Failed to initialize the BSP!");
     }
 
+    gKernelGlobalData.Phase = KE_PHASE_PCPU_READY;
+
+    // profile the boot allocations; MmProfSetRate(0) turns it off
+    MmProfSetRate(MM_PROF_BOOT_RATE);
+
+    // from here on the boot flow is the "main" thread of the BSP
+    status = KeInitScheduler(FALSE);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeInitScheduler failed: 0x%08x\n", status);
+        PANIC("Failed to initialize the scheduler!");
+    }
+
     Log("> Initializing PIC...");
     PicInitialize();
     Log(" Done!\n");
@@ -140,6 +170,12 @@ void EntryPoint(
     }
     Log(" Done!\n");
 
+    status = IoSerialEnableReceiveIrq();
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] IoSerialEnableReceiveIrq failed: 0x%08x\n", status);
+    }
+
     {
         QWORD rsdpPa = 0;
         status = AcpiFindRootPointer(&rsdpPa);
@@ -182,6 +218,57 @@ void EntryPoint(
         }
     }
 
+    // a migration copies the region while the other CPUs could still write to it, so it is done before they start
+    MmPromoteKernelRegions();
+
+    // needs the MADT; the trampoline page may belong to someone else if it could not be reserved
+    if (trampolineReserved)
+    {
+        status = KeStartProcessors();
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeStartProcessors failed: 0x%08x\n", status);
+        }
+    }
+    else
+    {
+        LogWithInfo("[SMP] The AP trampoline is not reserved, only the BSP is used\n");
+    }
+
+    // yield, preemption and exit, with the threads of the BSP
+    status = KeSelfTestThreads();
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeSelfTestThreads failed: 0x%08x\n", status);
+    }
+
+    MmDumpPagingStatistics();
+    MmDumpPhysicalMemoryStatistics();
+    KmDumpStatistics();
+    KpDumpStatistics();
+    MmDumpTagStatistics();
+    MmProfDump();
+
+    // the boot profile was dumped, sample at the default rate from now on
+    MmProfReset();
+    MmProfSetRate(MM_PROF_DEFAULT_RATE);
+
+    KeDumpThreads();
+    KeDumpTaskStatistics();
+    KeDumpIdleStatistics();
+    TmrDumpClockEvents();
+
+#ifdef DEBUG
+    // boot time benchmarks; they take seconds and churn the allocators, a release boot goes without them
+    MmBenchmarkPhysicalAllocs();
+    MmBenchmarkPageColouring();
+    MmBenchmarkLargePages();
+    KmBenchmarkThroughput();
+    KeBenchmarkTasks();
+    KeBenchmarkSpinlocks();
+    KpStressTest();
+#endif // DEBUG
+
     while (TRUE)
     {
         CHAR c;
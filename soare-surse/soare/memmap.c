@@ -4,8 +4,9 @@
 #include "multiboot.h"
 #include "memdefs.h"
 #include "log.h"
+#include "arena.h"
 
-MMAP_ENTRY gBootMemoryMap[MAX_MMAP_ENTRIES];
+PMMAP_ENTRY gBootMemoryMap;
 DWORD gBootMemoryMapEntries;
 SIZE_T gBootMemoryLimit;
 
@@ -49,12 +50,28 @@ MmInitMemoryMapFromMultiboot(
 )
 {
     DWORD parsedLength = 0;
+    DWORD maxEntries = MapLength / sizeof(MEMORY_MAP);
     PMEMORY_MAP pEntry = (MEMORY_MAP *)(SIZE_T)MapAddress;
+    NTSTATUS status;
 
-    memset(gBootMemoryMap, 0, sizeof(gBootMemoryMap));
     gBootMemoryMapEntries = 0;
     gBootMemoryLimit = 0;
 
+    // entries are at least sizeof(MEMORY_MAP) bytes long, so this is enough for all of them
+    status = MmArenaAlloc(&gBootArena, maxEntries * sizeof(MMAP_ENTRY), &gBootMemoryMap);
+    if (!NT_SUCCESS(status))
+    {
+        Log("[WARNING] MmArenaAlloc failed: 0x%08x, the memory map will be truncated\n", status);
+
+        maxEntries = MAX_MMAP_ENTRIES;
+        status = MmArenaAlloc(&gBootArena, maxEntries * sizeof(MMAP_ENTRY), &gBootMemoryMap);
+        if (!NT_SUCCESS(status))
+        {
+            Log("[ERROR] MmArenaAlloc failed: 0x%08x\n", status);
+            return;
+        }
+    }
+
     while (parsedLength < MapLength)
     {
         if (MapLength - parsedLength < sizeof(MEMORY_MAP))
@@ -62,7 +79,7 @@ MmInitMemoryMapFromMultiboot(
             break;
         }
 
-        if (gBootMemoryMapEntries >= MAX_MMAP_ENTRIES)
+        if (gBootMemoryMapEntries >= maxEntries)
         {
             Log("[WARNING] Too many memory map entries!\n");
             break;
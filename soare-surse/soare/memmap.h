@@ -19,7 +19,7 @@ typedef struct _MMAP_ENTRY
     MEM_TYPE    Type;
 } MMAP_ENTRY, *PMMAP_ENTRY;
 
-#define MAX_MMAP_ENTRIES    128
+#define MAX_MMAP_ENTRIES    128     // used only if the boot arena can't hold the whole map
 
 VOID
 MmDumpMemoryMap(
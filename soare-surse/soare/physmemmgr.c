@@ -5,6 +5,8 @@
 #include "mem.h"
 #include "physmemmgr.h"
 #include "log.h"
+#include "allocprof.h"
+#include "spinlock.h"
 
 /*
 
@@ -16,12 +18,19 @@
 
     Internally, a page is converted to an index (for example, when using 4K pages, the page 0x1000 is converted to index 1).
 
+    Pages are also grouped in colours: pages with the same colour map to the same sets of the largest physically
+    indexed cache. The colour of a page is its index modulo the number of colours. Callers that know the virtual
+    address at which a page will be mapped can ask for a page with the same colour as the VA, so that consecutive
+    virtual pages don't compete for the same cache sets.
+
 */
 
-extern MMAP_ENTRY gBootMemoryMap[MAX_MMAP_ENTRIES];
+extern PMMAP_ENTRY gBootMemoryMap;
 extern DWORD gBootMemoryMapEntries;
 extern SIZE_T gBootMemoryLimit;
 
+#define MM_MAX_PAGE_COLOURS     256
+
 typedef struct _PHYSMEM_STATE
 {
     PQWORD      Bitmap;     // we use PQWORD because it will be faster to do some checks
@@ -33,12 +42,26 @@ typedef struct _PHYSMEM_STATE
     QWORD       EndOfMemory;
     QWORD       ReservedPaStart;
     QWORD       ReservedPaEnd;
+
+    DWORD       Colours;                                // power of 2, 1 if the cache geometry is unknown
+    DWORD       ColourFree[MM_MAX_PAGE_COLOURS];        // free pages of each colour
+    DWORD       ColourCursor[MM_MAX_PAGE_COLOURS];      // every page of the colour below this row is reserved
+    QWORD       ColouredAllocs;
+    QWORD       ColourFallbacks;
 } PHYSMEM_STATE, *PPHYSMEM_STATE;
 
 static PHYSMEM_STATE gPhysMemState;
 
 #define BITS_PER_ENTRY      (sizeof(QWORD) * 8)
 
+#define PAGE_COLOUR(idx)    ((DWORD)((idx) & (gPhysMemState.Colours - 1)))
+#define PAGE_ROW(idx)       ((DWORD)((idx) / gPhysMemState.Colours))
+
+static KE_MCS_LOCK gPhysMemLock;
+
+static NTSTATUS _MmReservePhysicalPage(_In_ QWORD Page);
+static NTSTATUS _MmFreePhysicalPage(_In_ QWORD Page);
+
 
 static
 BOOLEAN
@@ -59,19 +82,19 @@ _MmChangeContigousPhysicalRangeState(
     {
         if (Reserve)
         {
-            NTSTATUS status = MmReservePhysicalPage(page);
+            NTSTATUS status = _MmReservePhysicalPage(page);
             if (!NT_SUCCESS(status) && STATUS_PAGE_ALREADY_RESERVED != status)
             {
-                LogWithInfo("[ERROR] MmReservePhysicalPage failed for %018p: 0x%08x\n", page, status);
+                LogWithInfo("[ERROR] _MmReservePhysicalPage failed for %018p: 0x%08x\n", page, status);
                 return FALSE;
             }
         }
         else
         {
-            NTSTATUS status = MmFreePhysicalPage(page);
+            NTSTATUS status = _MmFreePhysicalPage(page);
             if (!NT_SUCCESS(status) && STATUS_PAGE_ALREADY_FREE != status)
             {
-                LogWithInfo("[ERROR] MmFreePhysicalPage failed for %018p: 0x%08x\n", page, status);
+                LogWithInfo("[ERROR] _MmFreePhysicalPage failed for %018p: 0x%08x\n", page, status);
                 return FALSE;
             }
         }
@@ -113,30 +136,82 @@ _MmClearBit(
 }
 
 
+// The free pages described by the Q-th QWORD of the bitmap; the last one may describe fewer than 64 pages
+static __forceinline
+QWORD
+_MmGetFreeBits(
+    _In_ DWORD Q
+)
+{
+    QWORD freeBits = ~gPhysMemState.Bitmap[Q];
+
+    if ((QWORD)(Q + 1) * BITS_PER_ENTRY > gPhysMemState.PageCount)
+    {
+        freeBits &= (1ULL << (gPhysMemState.PageCount % BITS_PER_ENTRY)) - 1;
+    }
+
+    return freeBits;
+}
+
+
+// Marks a free page as reserved; FreePages is left to the caller
+static __forceinline
+VOID
+_MmTakePageIndex(
+    _In_ QWORD Index
+)
+{
+    DWORD colour = PAGE_COLOUR(Index);
+
+    _MmSetBit(Index);
+    gPhysMemState.ColourFree[colour]--;
+
+    if (PAGE_ROW(Index) == gPhysMemState.ColourCursor[colour])
+    {
+        gPhysMemState.ColourCursor[colour]++;
+    }
+}
+
+
+// Marks a reserved page as free; FreePages is left to the caller
+static __forceinline
+VOID
+_MmReleasePageIndex(
+    _In_ QWORD Index
+)
+{
+    DWORD colour = PAGE_COLOUR(Index);
+
+    _MmClearBit(Index);
+    gPhysMemState.ColourFree[colour]++;
+
+    if (PAGE_ROW(Index) < gPhysMemState.ColourCursor[colour])
+    {
+        gPhysMemState.ColourCursor[colour] = PAGE_ROW(Index);
+    }
+}
+
+
 static
 NTSTATUS
 _MmGetFreePhysicalPageIndex(
     _Out_ QWORD * PageIndex
 )
 {
-    for (DWORD q = 0; q < gPhysMemState.PageCount / BITS_PER_ENTRY; q++)
+    for (DWORD q = 0; q < ROUND_UP(gPhysMemState.PageCount, BITS_PER_ENTRY) / BITS_PER_ENTRY; q++)
     {
+        QWORD freeBits = _MmGetFreeBits(q);
+        unsigned long p;
+
         // if the entire QWORD is set it means that these 64 pages are already reserved
-        if ((QWORD)-1 == gPhysMemState.Bitmap[q])
+        if (!freeBits)
         {
             continue;
         }
 
-        // test each page
-        for (BYTE p = 0; p < BITS_PER_ENTRY; p++)
-        {
-            if (0 == (gPhysMemState.Bitmap[q] & (1ULL << p)))
-            {
-                // found it!
-                *PageIndex = (q * BITS_PER_ENTRY + p);
-                return STATUS_SUCCESS;
-            }
-        }
+        _BitScanForward64(&p, freeBits);
+        *PageIndex = (QWORD)q * BITS_PER_ENTRY + p;
+        return STATUS_SUCCESS;
     }
 
     return STATUS_NOT_FOUND;
@@ -200,6 +275,164 @@ _MmGetFreePhysicalRangeIndex(
 }
 
 
+static
+BOOLEAN
+_MmIsPhysicalIndexRangeFree(
+    _In_ QWORD StartIndex,
+    _In_ QWORD Count
+)
+{
+    QWORD idx = StartIndex;
+    QWORD end = StartIndex + Count;
+
+    while (idx < end)
+    {
+        // check 64 pages at once whenever possible
+        if (0 == idx % BITS_PER_ENTRY && end - idx >= BITS_PER_ENTRY)
+        {
+            if (0 != gPhysMemState.Bitmap[idx / BITS_PER_ENTRY])
+            {
+                return FALSE;
+            }
+
+            idx += BITS_PER_ENTRY;
+            continue;
+        }
+
+        if (_MmIsBitSet(idx))
+        {
+            return FALSE;
+        }
+
+        idx++;
+    }
+
+    return TRUE;
+}
+
+
+static
+NTSTATUS
+_MmGetFreeAlignedPhysicalRangeIndex(
+    _In_ QWORD PageCount,
+    _In_ QWORD AlignmentPages,
+    _Out_ QWORD *StartIndex
+)
+{
+    for (QWORD start = 0; start + PageCount <= gPhysMemState.PageCount; start += AlignmentPages)
+    {
+        if (_MmIsPhysicalIndexRangeFree(start, PageCount))
+        {
+            *StartIndex = start;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_NOT_FOUND;
+}
+
+
+static
+DWORD
+_MmDetectPageColours(
+    VOID
+)
+{
+    INT32 regs[4] = { 0 };
+    DWORD bestLevel = 0;
+    DWORD colours = 1;
+
+    // CPUID leaf 4 enumerates the deterministic cache parameters
+    __cpuid(regs, 0);
+    if (regs[0] < 4)
+    {
+        return 1;
+    }
+
+    for (INT32 i = 0; ; i++)
+    {
+        DWORD type;
+        DWORD level;
+        QWORD waySize;
+
+        __cpuidex(regs, 4, i);
+
+        type = regs[0] & 0x1F;
+        if (0 == type)
+        {
+            break;
+        }
+
+        // instruction caches are not interesting
+        if (2 == type)
+        {
+            continue;
+        }
+
+        level = (regs[0] >> 5) & 0x7;
+        if (level < bestLevel)
+        {
+            continue;
+        }
+
+        // partitions * line size * sets
+        waySize = (QWORD)((((DWORD)regs[1] >> 12) & 0x3FF) + 1) * (((DWORD)regs[1] & 0xFFF) + 1) * ((DWORD)regs[2] + 1);
+
+        bestLevel = level;
+        colours = (DWORD)(waySize / PAGE_SIZE_4K);
+    }
+
+    if (!colours)
+    {
+        return 1;
+    }
+
+    // keep only the highest bit, so the colour can be computed with a mask
+    while (colours & (colours - 1))
+    {
+        colours &= colours - 1;
+    }
+
+    return colours > MM_MAX_PAGE_COLOURS ? MM_MAX_PAGE_COLOURS : colours;
+}
+
+
+static
+NTSTATUS
+_MmGetFreeColouredPageIndex(
+    _In_ DWORD Colour,
+    _Out_ QWORD * PageIndex
+)
+{
+    DWORD row;
+
+    if (!gPhysMemState.ColourFree[Colour])
+    {
+        return STATUS_NOT_FOUND;
+    }
+
+    for (row = gPhysMemState.ColourCursor[Colour]; ; row++)
+    {
+        QWORD idx = (QWORD)row * gPhysMemState.Colours + Colour;
+        if (idx >= gPhysMemState.PageCount)
+        {
+            break;
+        }
+
+        if (!_MmIsBitSet(idx))
+        {
+            gPhysMemState.ColourCursor[Colour] = row;
+            *PageIndex = idx;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    gPhysMemState.ColourCursor[Colour] = row;
+
+    return STATUS_NOT_FOUND;
+}
+
+
 BOOLEAN
 MmA20IsEnabled(
     VOID
@@ -260,6 +493,7 @@ MmPhysicalManagerInit(
     gPhysMemState.EndOfMemory = endOfMemory;
     // safe cast
     gPhysMemState.PageCount = (DWORD)(endOfMemory / gPhysMemState.PageSize);
+    gPhysMemState.Colours = _MmDetectPageColours();
 
     if (gPhysMemState.PageCount > 4 * ONE_MB)
     {
@@ -267,7 +501,7 @@ MmPhysicalManagerInit(
         return FALSE;
     }
 
-    Log("[PHYSMEM] Page count: %d\n", gPhysMemState.PageCount);
+    Log("[PHYSMEM] Page count: %d, page colours: %d\n", gPhysMemState.PageCount, gPhysMemState.Colours);
 
     // reserve every page for now
     memset(gPhysMemState.Bitmap, 0xFF, gPhysMemState.PageCount);
@@ -320,14 +554,15 @@ MmPhysicalManagerInit(
 }
 
 
+static
 NTSTATUS
-MmReservePhysicalPage(
+_MmReservePhysicalPage(
     _In_ QWORD Page
 )
 {
     QWORD bit = 0;
 
-    if (Page > gPhysMemState.EndOfMemory)
+    if (Page >= gPhysMemState.EndOfMemory)
     {
         return STATUS_NOT_FOUND;
     }
@@ -340,32 +575,52 @@ MmReservePhysicalPage(
         return STATUS_PAGE_ALREADY_RESERVED;
     }
 
-    _MmSetBit(bit);
+    _MmTakePageIndex(bit);
     gPhysMemState.FreePages--;
 
     return STATUS_SUCCESS;
 }
 
 
+NTSTATUS
+MmReservePhysicalPage(
+    _In_ QWORD Page
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+    status = _MmReservePhysicalPage(Page);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
 NTSTATUS
 MmReservePhysicalRange(
     _In_ QWORD Base,
     _In_ QWORD Length
 )
 {
+    KE_MCS_HANDLE lock;
     NTSTATUS status;
 
     if (Base % gPhysMemState.PageSize || (Base + Length) % gPhysMemState.PageSize)
     {
         return STATUS_NOT_SUPPORTED;
     }
-    
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
     // first, make sure that the range is free
     for (QWORD page = Base; page < Base + Length; page += gPhysMemState.PageSize)
     {
         if (!MmIsPhysicalPageFree(page))
         {
-            return STATUS_PAGE_ALREADY_RESERVED;
+            status = STATUS_PAGE_ALREADY_RESERVED;
+            goto _cleanup_and_exit;
         }
     }
 
@@ -375,21 +630,27 @@ MmReservePhysicalRange(
     {
         LogWithInfo("[ERROR] _MmChangeContigousPhysicalRangeState failed for [%018p, %018p): 0x%08x\n",
             Base, Base + Length, status);
-        return status;
+        goto _cleanup_and_exit;
     }
 
-    return STATUS_SUCCESS;
+    status = STATUS_SUCCESS;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
 }
 
 
+static
 NTSTATUS
-MmFreePhysicalPage(
+_MmFreePhysicalPage(
     _In_ QWORD Page
 )
 {
     QWORD bit = 0;
 
-    if (Page > gPhysMemState.EndOfMemory)
+    if (Page >= gPhysMemState.EndOfMemory)
     {
         return STATUS_NOT_FOUND;
     }
@@ -402,7 +663,7 @@ MmFreePhysicalPage(
         return STATUS_PAGE_ALREADY_FREE;
     }
 
-    _MmClearBit(bit);
+    _MmReleasePageIndex(bit);
     gPhysMemState.FreePages++;
 
     return STATUS_SUCCESS;
@@ -410,18 +671,30 @@ MmFreePhysicalPage(
 
 
 NTSTATUS
-MmAllocPhysicalPage(
+MmFreePhysicalPage(
+    _In_ QWORD Page
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+    status = _MmFreePhysicalPage(Page);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+static
+NTSTATUS
+_MmAllocPhysicalPage(
     _Inout_ QWORD * Page
 )
 {
     NTSTATUS status;
     QWORD pageIndex = 0;
 
-    if (!Page)
-    {
-        return STATUS_INVALID_PARAMETER_1;
-    }
-
     if (!gPhysMemState.FreePages)
     {
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -436,7 +709,313 @@ MmAllocPhysicalPage(
 
     *Page = pageIndex * gPhysMemState.PageSize;
 
-    return MmReservePhysicalPage(*Page);
+    status = _MmReservePhysicalPage(*Page);
+    if (NT_SUCCESS(status))
+    {
+        MmProfOnAlloc(gPhysMemState.PageSize);
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+MmAllocPhysicalPage(
+    _Inout_ QWORD * Page
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    if (!Page)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+    status = _MmAllocPhysicalPage(Page);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+static
+NTSTATUS
+_MmFreePhysicalPages(
+    _In_ DWORD Count,
+    _In_reads_(Count) const QWORD *Pages
+)
+{
+    DWORD freed = 0;
+
+    // check everything first, so a bad array changes nothing
+    for (DWORD i = 0; i < Count; i++)
+    {
+        if (Pages[i] >= gPhysMemState.EndOfMemory || !_MmIsBitSet(PHYPAGE_ALIGN(Pages[i]) / gPhysMemState.PageSize))
+        {
+            LogWithInfo("[ERROR] Page %018p at index %d is not allocated\n", Pages[i], i);
+            return STATUS_PAGE_ALREADY_FREE;
+        }
+    }
+
+    for (DWORD i = 0; i < Count; i++)
+    {
+        QWORD bit = PHYPAGE_ALIGN(Pages[i]) / gPhysMemState.PageSize;
+
+        // the same page may be in the array twice
+        if (!_MmIsBitSet(bit))
+        {
+            continue;
+        }
+
+        _MmReleasePageIndex(bit);
+        freed++;
+    }
+
+    gPhysMemState.FreePages += freed;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+MmAllocPhysicalPages(
+    _In_ DWORD Count,
+    _Out_writes_(Count) QWORD *Pages
+)
+{
+    KE_MCS_HANDLE lock;
+    DWORD found = 0;
+    NTSTATUS status;
+
+    if (!Count)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Pages)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
+    if (gPhysMemState.FreePages < Count)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _cleanup_and_exit;
+    }
+
+    // the free pages are taken in a single pass over the bitmap, a whole QWORD of it at a time
+    for (DWORD q = 0; q < ROUND_UP(gPhysMemState.PageCount, BITS_PER_ENTRY) / BITS_PER_ENTRY && found < Count; q++)
+    {
+        QWORD freeBits = _MmGetFreeBits(q);
+
+        while (freeBits && found < Count)
+        {
+            unsigned long bit;
+            QWORD index;
+
+            _BitScanForward64(&bit, freeBits);
+            freeBits &= freeBits - 1;
+
+            index = (QWORD)q * BITS_PER_ENTRY + bit;
+            _MmTakePageIndex(index);
+
+            Pages[found++] = index * gPhysMemState.PageSize;
+        }
+    }
+
+    if (found < Count)
+    {
+        // FreePages said otherwise, the bitmap and the counters are out of sync; FreePages was not debited yet
+        LogWithInfo("[ERROR] Found only %d free pages out of %d\n", found, Count);
+        for (DWORD i = 0; i < found; i++)
+        {
+            _MmReleasePageIndex(Pages[i] / gPhysMemState.PageSize);
+        }
+
+        status = STATUS_INTERNAL_ERROR;
+        goto _cleanup_and_exit;
+    }
+
+    gPhysMemState.FreePages -= Count;
+
+    MmProfOnAlloc((QWORD)Count * gPhysMemState.PageSize);
+
+    status = STATUS_SUCCESS;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+NTSTATUS
+MmFreePhysicalPages(
+    _In_ DWORD Count,
+    _In_reads_(Count) const QWORD *Pages
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    if (!Pages)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+    status = _MmFreePhysicalPages(Count, Pages);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+NTSTATUS
+MmAllocPhysicalPagesColoured(
+    _In_ QWORD Va,
+    _In_ DWORD Count,
+    _Out_writes_(Count) QWORD *Pages
+)
+{
+    KE_MCS_HANDLE lock;
+    DWORD found = 0;
+    NTSTATUS status;
+
+    if (!Count)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Pages)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    if (1 == gPhysMemState.Colours)
+    {
+        return MmAllocPhysicalPages(Count, Pages);
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
+    if (gPhysMemState.FreePages < Count)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _cleanup_and_exit;
+    }
+
+    for (; found < Count; found++)
+    {
+        QWORD index = 0;
+
+        status = _MmGetFreeColouredPageIndex(MmGetPageColour(Va + (QWORD)found * PAGE_SIZE_4K), &index);
+        if (NT_SUCCESS(status))
+        {
+            gPhysMemState.ColouredAllocs++;
+        }
+        else
+        {
+            // any colour is better than no page at all
+            gPhysMemState.ColourFallbacks++;
+            status = _MmGetFreePhysicalPageIndex(&index);
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+        }
+
+        _MmTakePageIndex(index);
+        Pages[found] = index * gPhysMemState.PageSize;
+    }
+
+    if (found < Count)
+    {
+        // FreePages said otherwise, the bitmap and the counters are out of sync; FreePages was not debited yet
+        LogWithInfo("[ERROR] Found only %d free pages out of %d\n", found, Count);
+        for (DWORD i = 0; i < found; i++)
+        {
+            _MmReleasePageIndex(Pages[i] / gPhysMemState.PageSize);
+        }
+
+        status = STATUS_INTERNAL_ERROR;
+        goto _cleanup_and_exit;
+    }
+
+    gPhysMemState.FreePages -= Count;
+
+    MmProfOnAlloc((QWORD)Count * gPhysMemState.PageSize);
+
+    status = STATUS_SUCCESS;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+NTSTATUS
+MmAllocPhysicalPageColoured(
+    _In_ QWORD Va,
+    _Inout_ QWORD * Page
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+    QWORD pageIndex = 0;
+
+    if (!Page)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
+    status = _MmGetFreeColouredPageIndex(MmGetPageColour(Va), &pageIndex);
+    if (!NT_SUCCESS(status))
+    {
+        // any colour is better than no page at all
+        gPhysMemState.ColourFallbacks++;
+        status = _MmAllocPhysicalPage(Page);
+        goto _cleanup_and_exit;
+    }
+
+    gPhysMemState.ColouredAllocs++;
+    *Page = pageIndex * gPhysMemState.PageSize;
+
+    status = _MmReservePhysicalPage(*Page);
+    if (NT_SUCCESS(status))
+    {
+        MmProfOnAlloc(gPhysMemState.PageSize);
+    }
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+DWORD
+MmGetPageColour(
+    _In_ QWORD Address
+)
+{
+    return PAGE_COLOUR(Address / PAGE_SIZE_4K);
+}
+
+
+DWORD
+MmGetPageColourCount(
+    VOID
+)
+{
+    return gPhysMemState.Colours;
 }
 
 
@@ -447,7 +1026,7 @@ MmIsPhysicalPageFree(
 {
     QWORD bit = 0;
 
-    if (Page > gPhysMemState.EndOfMemory)
+    if (Page >= gPhysMemState.EndOfMemory)
     {
         return FALSE;
     }
@@ -493,3 +1072,224 @@ MmGetPmmgrReservedPhysicalRange(
         *End = gPhysMemState.ReservedPaEnd;
     }
 }
+
+
+NTSTATUS
+MmAllocPhysicalRange(
+    _In_ QWORD PageCount,
+    _In_ QWORD Alignment,
+    _Out_ QWORD *Base
+)
+{
+    NTSTATUS status;
+    QWORD startIndex = 0;
+    QWORD alignmentPages;
+    KE_MCS_HANDLE lock;
+
+    if (!PageCount)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Alignment || Alignment % gPhysMemState.PageSize)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Base)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    alignmentPages = Alignment / gPhysMemState.PageSize;
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
+    if (gPhysMemState.FreePages < PageCount)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto _cleanup_and_exit;
+    }
+
+    status = _MmGetFreeAlignedPhysicalRangeIndex(PageCount, alignmentPages, &startIndex);
+    if (!NT_SUCCESS(status))
+    {
+        goto _cleanup_and_exit;
+    }
+
+    for (QWORD i = startIndex; i < startIndex + PageCount; i++)
+    {
+        _MmTakePageIndex(i);
+    }
+
+    gPhysMemState.FreePages -= (DWORD)PageCount;
+    *Base = startIndex * gPhysMemState.PageSize;
+
+    MmProfOnAlloc(PageCount * gPhysMemState.PageSize);
+
+    status = STATUS_SUCCESS;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+NTSTATUS
+MmFreePhysicalRange(
+    _In_ QWORD Base,
+    _In_ QWORD Length
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (Base % gPhysMemState.PageSize || Length % gPhysMemState.PageSize)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    KeAcquireMcsLockIrqSave(&gPhysMemLock, &lock);
+
+    for (QWORD page = Base; page < Base + Length; page += gPhysMemState.PageSize)
+    {
+        status = _MmFreePhysicalPage(page);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _MmFreePhysicalPage failed for %018p: 0x%08x\n", page, status);
+            break;
+        }
+    }
+
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+VOID
+MmDumpPhysicalMemoryStatistics(
+    VOID
+)
+{
+    DWORD minFree = (DWORD)-1;
+    DWORD maxFree = 0;
+
+    for (DWORD c = 0; c < gPhysMemState.Colours; c++)
+    {
+        minFree = MIN(minFree, gPhysMemState.ColourFree[c]);
+        maxFree = MAX(maxFree, gPhysMemState.ColourFree[c]);
+    }
+
+    NLog("[PHYSMEM] %d free pages, %d colours with %d - %d free pages each\n",
+        gPhysMemState.FreePages, gPhysMemState.Colours, minFree, maxFree);
+    NLog("[PHYSMEM] Coloured allocations: %d, fallbacks to any colour: %d\n",
+        gPhysMemState.ColouredAllocs, gPhysMemState.ColourFallbacks);
+}
+
+
+//
+// Allocation benchmark
+//
+// The same number of frames is taken and given back one page at a time, in one first fit batch and in one coloured
+// batch, and the cycles spent per page are compared: a batch takes the lock once and scans the bitmap once.
+//
+
+#define MM_PHYS_BENCH_PAGES     512
+#define MM_PHYS_BENCH_ROUNDS    16
+
+typedef enum _MM_PHYS_BENCH_KIND
+{
+    mmPhysBenchSingle = 0,
+    mmPhysBenchBatch,
+    mmPhysBenchColoured,
+} MM_PHYS_BENCH_KIND;
+
+static QWORD gMmPhysBenchPages[MM_PHYS_BENCH_PAGES];
+
+
+static
+NTSTATUS
+_MmPhysBenchRound(
+    _In_ MM_PHYS_BENCH_KIND Kind,
+    _Inout_ QWORD *AllocCycles,
+    _Inout_ QWORD *FreeCycles
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    DWORD allocated = 0;
+    QWORD start = __rdtsc();
+
+    switch (Kind)
+    {
+    case mmPhysBenchSingle:
+        for (; allocated < MM_PHYS_BENCH_PAGES; allocated++)
+        {
+            status = MmAllocPhysicalPage(&gMmPhysBenchPages[allocated]);
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+        }
+        break;
+
+    case mmPhysBenchBatch:
+        status = MmAllocPhysicalPages(MM_PHYS_BENCH_PAGES, gMmPhysBenchPages);
+        allocated = NT_SUCCESS(status) ? MM_PHYS_BENCH_PAGES : 0;
+        break;
+
+    default:
+        status = MmAllocPhysicalPagesColoured(0, MM_PHYS_BENCH_PAGES, gMmPhysBenchPages);
+        allocated = NT_SUCCESS(status) ? MM_PHYS_BENCH_PAGES : 0;
+        break;
+    }
+
+    *AllocCycles += __rdtsc() - start;
+
+    start = __rdtsc();
+    if (mmPhysBenchSingle == Kind)
+    {
+        for (DWORD i = 0; i < allocated; i++)
+        {
+            MmFreePhysicalPage(gMmPhysBenchPages[i]);
+        }
+    }
+    else if (allocated)
+    {
+        MmFreePhysicalPages(allocated, gMmPhysBenchPages);
+    }
+
+    *FreeCycles += __rdtsc() - start;
+
+    return status;
+}
+
+
+VOID
+MmBenchmarkPhysicalAllocs(
+    VOID
+)
+{
+    static const PCHAR names[] = { "one by one", "batch", "coloured batch" };
+
+    for (DWORD kind = mmPhysBenchSingle; kind <= mmPhysBenchColoured; kind++)
+    {
+        QWORD allocCycles = 0;
+        QWORD freeCycles = 0;
+
+        for (DWORD round = 0; round < MM_PHYS_BENCH_ROUNDS; round++)
+        {
+            NTSTATUS status = _MmPhysBenchRound((MM_PHYS_BENCH_KIND)kind, &allocCycles, &freeCycles);
+            if (!NT_SUCCESS(status))
+            {
+                LogWithInfo("[ERROR] _MmPhysBenchRound failed for %s: 0x%08x\n", names[kind], status);
+                return;
+            }
+        }
+
+        NLog("[PHYSMEM] %d pages %-14s: %d cycles per page allocated, %d cycles per page freed\n",
+            MM_PHYS_BENCH_PAGES, names[kind], allocCycles / (MM_PHYS_BENCH_ROUNDS * MM_PHYS_BENCH_PAGES),
+            freeCycles / (MM_PHYS_BENCH_ROUNDS * MM_PHYS_BENCH_PAGES));
+    }
+}
@@ -27,6 +27,58 @@ MmAllocPhysicalPage(
     _Inout_ QWORD * Page
 );
 
+// Allocates Count pages, which are not necessarily contiguous, in one pass; either all of them or none
+NTSTATUS
+MmAllocPhysicalPages(
+    _In_ DWORD Count,
+    _Out_writes_(Count) QWORD *Pages
+);
+
+NTSTATUS
+MmFreePhysicalPages(
+    _In_ DWORD Count,
+    _In_reads_(Count) const QWORD *Pages
+);
+
+// Returns a page with the same cache colour as Va, or any page if no such page is free
+NTSTATUS
+MmAllocPhysicalPageColoured(
+    _In_ QWORD Va,
+    _Inout_ QWORD * Page
+);
+
+// MmAllocPhysicalPages for a range that will be mapped at Va: Pages[i] gets the colour of Va + i * 4K when possible
+NTSTATUS
+MmAllocPhysicalPagesColoured(
+    _In_ QWORD Va,
+    _In_ DWORD Count,
+    _Out_writes_(Count) QWORD *Pages
+);
+
+DWORD
+MmGetPageColour(
+    _In_ QWORD Address                  // physical or virtual
+);
+
+// 1 if the cache geometry is unknown and the pages are not coloured
+DWORD
+MmGetPageColourCount(
+    VOID
+);
+
+NTSTATUS
+MmAllocPhysicalRange(
+    _In_ QWORD PageCount,
+    _In_ QWORD Alignment,               // in bytes, multiple of the page size
+    _Out_ QWORD *Base
+);
+
+NTSTATUS
+MmFreePhysicalRange(
+    _In_ QWORD Base,
+    _In_ QWORD Length
+);
+
 QWORD
 MmGetTotalFreeMemory(
     VOID
@@ -48,4 +100,15 @@ MmGetPmmgrReservedPhysicalRange(
     _Out_opt_ QWORD *End
 );
 
+VOID
+MmDumpPhysicalMemoryStatistics(
+    VOID
+);
+
+// Boot time benchmark: per page vs batched frame allocations
+VOID
+MmBenchmarkPhysicalAllocs(
+    VOID
+);
+
 #endif // !_PHYSMEMMGR_H_
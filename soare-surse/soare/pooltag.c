@@ -0,0 +1,258 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "pooltag.h"
+#include "kernel.h"
+#include "dtr.h"
+#include "log.h"
+
+/*
+
+    Pool tags.
+    A tag is bound to a slot of gMmTags the first time it is charged; slots are never released, so the index of a tag
+    never changes. The counters of a slot are kept per CPU, in a row of gMmTagCounters that only its CPU writes, so
+    charging a tag costs a hash probe and a few increments with interrupts disabled: no lock and no shared cache line.
+    Row 0 is used before the PCPU is loaded.
+
+    The live bytes of a CPU row may go negative when memory is freed on a different CPU than the one that allocated
+    it; only the sum over every row is meaningful. For the same reason the peak can't be tracked on every charge, it
+    is sampled when the pool grows and when the statistics are dumped.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+#define MM_TAG_ROWS             (MAX_CPU_COUNT + 1)
+#define MM_TAG_OTHER_SLOT       0
+
+typedef struct _MM_TAG_COUNTERS
+{
+    QWORD       Allocs;
+    QWORD       Frees;
+    QWORD       Failures;
+    INT64       Bytes;          // live bytes charged on this CPU
+} MM_TAG_COUNTERS;
+
+typedef __declspec(align(64)) struct _MM_TAG_ROW
+{
+    MM_TAG_COUNTERS Counters[MM_TAG_COUNT];
+} MM_TAG_ROW;
+
+static volatile DWORD gMmTags[MM_TAG_COUNT] = { TAG_OTHER };
+static MM_TAG_ROW gMmTagCounters[MM_TAG_ROWS];
+static QWORD gMmTagPeaks[MM_TAG_COUNT];
+
+
+static
+DWORD
+_MmTagLookup(
+    _In_ DWORD Tag
+)
+{
+    DWORD slot = (DWORD)((Tag * 0x9E3779B1ULL) & 0xFFFFFFFF) >> 26;
+
+    static_assert(MM_TAG_COUNT == 64, "The hash gives 6 bits!");
+
+    for (DWORD probe = 0; probe < MM_TAG_COUNT; probe++, slot = (slot + 1) % MM_TAG_COUNT)
+    {
+        DWORD current = gMmTags[slot];
+
+        if (current == Tag)
+        {
+            return slot;
+        }
+
+        if (0 == current)
+        {
+            // claim it; if another CPU was faster, it may have claimed it for the same tag
+            current = (DWORD)_InterlockedCompareExchange((volatile long *)&gMmTags[slot], (long)Tag, 0);
+            if (0 == current || current == Tag)
+            {
+                return slot;
+            }
+        }
+    }
+
+    return MM_TAG_OTHER_SLOT;
+}
+
+
+static __forceinline
+MM_TAG_COUNTERS *
+_MmTagCounters(
+    _In_ DWORD Tag
+)
+{
+    DWORD row = gKernelGlobalData.Phase >= KE_PHASE_PCPU_READY ? GetCurrentCpu()->Number + 1 : 0;
+
+    return &gMmTagCounters[row].Counters[_MmTagLookup(Tag)];
+}
+
+
+VOID
+MmTagChargeMany(
+    _In_ DWORD Tag,
+    _In_ DWORD Count,
+    _In_ QWORD Bytes
+)
+{
+    QWORD flags = __readeflags();
+    MM_TAG_COUNTERS *pCounters;
+
+    _disable();
+
+    pCounters = _MmTagCounters(Tag);
+    pCounters->Allocs += Count;
+    pCounters->Bytes += Bytes;
+
+    __writeeflags(flags);
+}
+
+
+VOID
+MmTagCreditMany(
+    _In_ DWORD Tag,
+    _In_ DWORD Count,
+    _In_ QWORD Bytes
+)
+{
+    QWORD flags = __readeflags();
+    MM_TAG_COUNTERS *pCounters;
+
+    _disable();
+
+    pCounters = _MmTagCounters(Tag);
+    pCounters->Frees += Count;
+    pCounters->Bytes -= Bytes;
+
+    __writeeflags(flags);
+}
+
+
+VOID
+MmTagCharge(
+    _In_ DWORD Tag,
+    _In_ QWORD Bytes
+)
+{
+    MmTagChargeMany(Tag, 1, Bytes);
+}
+
+
+VOID
+MmTagCredit(
+    _In_ DWORD Tag,
+    _In_ QWORD Bytes
+)
+{
+    MmTagCreditMany(Tag, 1, Bytes);
+}
+
+
+VOID
+MmTagFailure(
+    _In_ DWORD Tag
+)
+{
+    QWORD flags = __readeflags();
+
+    _disable();
+    _MmTagCounters(Tag)->Failures++;
+    __writeeflags(flags);
+}
+
+
+static
+VOID
+_MmTagSum(
+    _In_ DWORD Slot,
+    _Out_ MM_TAG_COUNTERS *Total
+)
+{
+    memset(Total, 0, sizeof(MM_TAG_COUNTERS));
+
+    for (DWORD row = 0; row < MM_TAG_ROWS; row++)
+    {
+        const MM_TAG_COUNTERS *pCounters = &gMmTagCounters[row].Counters[Slot];
+
+        Total->Allocs += pCounters->Allocs;
+        Total->Frees += pCounters->Frees;
+        Total->Failures += pCounters->Failures;
+        Total->Bytes += pCounters->Bytes;
+    }
+}
+
+
+VOID
+MmTagSamplePeaks(
+    VOID
+)
+{
+    for (DWORD slot = 0; slot < MM_TAG_COUNT; slot++)
+    {
+        MM_TAG_COUNTERS total;
+
+        if (!gMmTags[slot])
+        {
+            continue;
+        }
+
+        _MmTagSum(slot, &total);
+        if (total.Bytes > 0 && (QWORD)total.Bytes > gMmTagPeaks[slot])
+        {
+            gMmTagPeaks[slot] = total.Bytes;
+        }
+    }
+}
+
+
+VOID
+MmDumpTagStatistics(
+    VOID
+)
+{
+    MM_TAG_COUNTERS totals[MM_TAG_COUNT];
+    BYTE order[MM_TAG_COUNT];
+    DWORD count = 0;
+
+    MmTagSamplePeaks();
+
+    // insertion sort by live bytes, there are only a few tags
+    for (DWORD slot = 0; slot < MM_TAG_COUNT; slot++)
+    {
+        DWORD pos;
+
+        if (!gMmTags[slot])
+        {
+            continue;
+        }
+
+        _MmTagSum(slot, &totals[slot]);
+        if (!totals[slot].Allocs && !totals[slot].Failures)
+        {
+            continue;
+        }
+
+        for (pos = count; pos > 0 && totals[order[pos - 1]].Bytes < totals[slot].Bytes; pos--)
+        {
+            order[pos] = order[pos - 1];
+        }
+
+        order[pos] = (BYTE)slot;
+        count++;
+    }
+
+    NLog("[POOLTAG] %-4s %10s %10s %10s %10s %6s\n", "TAG", "LIVE KB", "PEAK KB", "ALLOCS", "FREES", "FAILS");
+
+    for (DWORD i = 0; i < count; i++)
+    {
+        DWORD slot = order[i];
+        CHAR name[5] = { 0 };
+
+        memcpy(name, (PVOID)&gMmTags[slot], 4);
+
+        NLog("[POOLTAG] %-4s %10d %10d %10d %10d %6d\n", name, totals[slot].Bytes / (INT64)ONE_KB,
+            ByteToKb(gMmTagPeaks[slot]), totals[slot].Allocs, totals[slot].Frees, totals[slot].Failures);
+    }
+}
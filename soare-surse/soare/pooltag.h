@@ -0,0 +1,68 @@
+#ifndef _POOLTAG_H_
+#define _POOLTAG_H_
+
+//
+// Memory accounting by 4 characters tags. Every allocation of the kernel pool and of the slab allocator is charged
+// to the tag given by the caller, and the subsystems that take frames directly from the physical memory manager
+// charge them to their own tag.
+//
+#define MM_TAG(a, b, c, d)      ((DWORD)(BYTE)(a) | ((DWORD)(BYTE)(b) << 8) | ((DWORD)(BYTE)(c) << 16) | ((DWORD)(BYTE)(d) << 24))
+
+#define MM_TAG_COUNT            64      // distinct tags; the ones that don't fit are charged to TAG_OTHER
+
+#define TAG_OTHER               MM_TAG('?', '?', '?', '?')
+#define TAG_SLAB                MM_TAG('S', 'l', 'a', 'b')      // pool entries that back the slabs
+#define TAG_KM_CACHE            MM_TAG('K', 'm', 'C', 'a')      // named cache descriptors
+#define TAG_ARENA               MM_TAG('A', 'r', 'n', 'a')      // arena chunks
+#define TAG_PAGE_TABLES         MM_TAG('P', 'g', 'T', 'b')      // paging structures
+#define TAG_STACK               MM_TAG('S', 't', 'c', 'k')      // kernel stacks
+#define TAG_ACPI                MM_TAG('A', 'c', 'p', 'i')      // mappings of the ACPI tables
+#define TAG_PCPU                MM_TAG('P', 'c', 'p', 'u')      // PCPUs of the application processors
+#define TAG_THREAD              MM_TAG('T', 'h', 'r', 'd')      // KTHREADs
+#define TAG_BENCHMARK           MM_TAG('B', 'n', 'c', 'h')      // boot time benchmarks
+
+VOID
+MmTagCharge(
+    _In_ DWORD Tag,
+    _In_ QWORD Bytes
+);
+
+VOID
+MmTagCredit(
+    _In_ DWORD Tag,
+    _In_ QWORD Bytes
+);
+
+// Count allocations totalling Bytes
+VOID
+MmTagChargeMany(
+    _In_ DWORD Tag,
+    _In_ DWORD Count,
+    _In_ QWORD Bytes
+);
+
+VOID
+MmTagCreditMany(
+    _In_ DWORD Tag,
+    _In_ DWORD Count,
+    _In_ QWORD Bytes
+);
+
+VOID
+MmTagFailure(
+    _In_ DWORD Tag
+);
+
+// The peak usage of a tag is the highest sum of the per-CPU counters seen by a sample
+VOID
+MmTagSamplePeaks(
+    VOID
+);
+
+// Prints every tag, the ones with the most live bytes first
+VOID
+MmDumpTagStatistics(
+    VOID
+);
+
+#endif // !_POOLTAG_H_
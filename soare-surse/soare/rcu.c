@@ -0,0 +1,277 @@
+#include "defs.h"
+#include "rcu.h"
+#include "dtr.h"
+#include "smp.h"
+#include "idle.h"
+#include "sync.h"
+#include "spinlock.h"
+#include "kernel.h"
+#include "log.h"
+
+/*
+
+    RCU.
+    A read-side section runs with interrupts disabled, so it can't be preempted and it can't span an interrupt: any
+    interrupt taken by a CPU means the code it interrupted was outside of a section, and so does a thread switch or a
+    pass through the idle loop. Each of them bumps the Sequence of the CPU.
+
+    A grace period starts with a snapshot of every Sequence and ends once each of them moved. The callbacks queued
+    before the start wait for its end; the ones queued later wait for the next one. All of it is done by a DPC of the
+    BSP, queued on its timer ticks while there is anything to wait for, so there is only one updater of the state.
+
+    A CPU that sleeps in MWAIT or HLT, or runs one thread without being interrupted, doesn't report anything by
+    itself; after RCU_FORCE_QS_TICKS ticks the laggards are woken up with KeWakeCpu, and the wake up (the idle loop,
+    or the IPI for a busy CPU) is a quiescent state. The BSP keeps its tick while there is anything to wait for.
+
+    The PCPU is packed, Sequence may straddle two lines; the locked accesses keep it from being torn.
+
+*/
+
+#define RCU_FORCE_QS_TICKS      2
+
+extern KGLOBAL gKernelGlobalData;
+
+// RcuSynchronize waits on its stack for the callback
+typedef struct _RCU_SYNC
+{
+    RCU_HEAD                Head;
+    KEVENT                  Done;
+} RCU_SYNC;
+
+static
+VOID
+_RcuDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID Context
+);
+
+static KE_TICKET_LOCK gRcuLock;
+static PRCU_HEAD gRcuNextHead;          // queued since the current grace period started
+static PRCU_HEAD gRcuNextTail;
+static PRCU_HEAD gRcuWaiting;           // wait for the current grace period
+static BOOLEAN gRcuGpActive;
+static DWORD gRcuGpTicks;
+static DWORD gRcuGpCpuCount;
+static INT64 gRcuSnapshot[MAX_CPU_COUNT];
+static KDPC gRcuDpc = { NULL, _RcuDpc, NULL, FALSE };
+
+
+// The CPUs that still have to go through a quiescent state, gRcuLock held
+static
+DWORD
+_RcuLaggingCpus(
+    VOID
+)
+{
+    DWORD lagging = 0;
+
+    for (DWORD i = 0; i < gRcuGpCpuCount; i++)
+    {
+        PPCPU pCpu = KeGetCpu(i);
+
+        if (gRcuSnapshot[i] == _InterlockedCompareExchange64(&pCpu->Rcu.Sequence, 0, 0))
+        {
+            lagging |= (1UL << i);
+        }
+    }
+
+    return lagging;
+}
+
+
+static
+VOID
+_RcuDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID Context
+)
+{
+    PRCU_HEAD pDone = NULL;
+    DWORD lagging = 0;
+    QWORD flags;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Context);
+
+    flags = KeAcquireTicketLockIrqSave(&gRcuLock);
+
+    if (gRcuGpActive)
+    {
+        lagging = _RcuLaggingCpus();
+        if (!lagging)
+        {
+            pDone = gRcuWaiting;
+            gRcuWaiting = NULL;
+            gRcuGpActive = FALSE;
+        }
+        else if (++gRcuGpTicks % RCU_FORCE_QS_TICKS)
+        {
+            // give them a little longer to get there by themselves
+            lagging = 0;
+        }
+    }
+
+    if (!gRcuGpActive && gRcuNextHead)
+    {
+        gRcuWaiting = gRcuNextHead;
+        gRcuNextHead = gRcuNextTail = NULL;
+
+        // the lock was taken with a locked instruction, the callbacks were unlinked from the readers before it
+        gRcuGpCpuCount = KeGetCpuCount();
+        for (DWORD i = 0; i < gRcuGpCpuCount; i++)
+        {
+            gRcuSnapshot[i] = _InterlockedCompareExchange64(&KeGetCpu(i)->Rcu.Sequence, 0, 0);
+        }
+
+        gRcuGpTicks = 0;
+        gRcuGpActive = TRUE;
+    }
+
+    KeReleaseTicketLockIrqRestore(&gRcuLock, flags);
+
+    for (DWORD i = 0; lagging; i++, lagging >>= 1)
+    {
+        if (lagging & 1)
+        {
+            NTSTATUS status = KeWakeCpu(KeGetCpu(i));
+            if (!NT_SUCCESS(status))
+            {
+                LogWithInfo("[ERROR] KeWakeCpu failed for CPU %d: 0x%08x\n", i, status);
+            }
+        }
+    }
+
+    while (pDone)
+    {
+        PRCU_HEAD pNext = pDone->Next;
+
+        pDone->Callback(pDone);
+        pDone = pNext;
+    }
+}
+
+
+static
+VOID
+_RcuSyncCallback(
+    _In_ PRCU_HEAD Head
+)
+{
+    RCU_SYNC *pSync = CONTAINING_RECORD(Head, RCU_SYNC, Head);
+
+    KeSetEvent(&pSync->Done);
+}
+
+
+QWORD
+RcuReadLock(
+    VOID
+)
+{
+    QWORD flags = __readeflags();
+
+    _disable();
+
+    return flags;
+}
+
+
+VOID
+RcuReadUnlock(
+    _In_ QWORD Flags
+)
+{
+    __writeeflags(Flags);
+}
+
+
+VOID
+RcuCall(
+    _Inout_ PRCU_HEAD Head,
+    _In_ PFN_RcuCallback Callback
+)
+{
+    PPCPU pBsp;
+    BOOLEAN first;
+    QWORD flags;
+
+    Head->Next = NULL;
+    Head->Callback = Callback;
+
+    flags = KeAcquireTicketLockIrqSave(&gRcuLock);
+
+    first = !gRcuGpActive && !gRcuNextHead;
+    if (gRcuNextTail)
+    {
+        gRcuNextTail->Next = Head;
+    }
+    else
+    {
+        gRcuNextHead = Head;
+    }
+    gRcuNextTail = Head;
+
+    KeReleaseTicketLockIrqRestore(&gRcuLock, flags);
+
+    // an idle BSP may have stopped its tick, it starts it again on its way back to the idle loop
+    pBsp = KeGetCpu(0);
+    if (first && pBsp && gKernelGlobalData.Phase >= KE_PHASE_PCPU_READY && pBsp != GetCurrentCpu())
+    {
+        KeWakeCpu(pBsp);
+    }
+}
+
+
+VOID
+RcuSynchronize(
+    VOID
+)
+{
+    RCU_SYNC sync;
+
+    // with a single CPU every reader is on ours, and none of them can be in the middle of a section right now
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || KeGetCpuCount() < 2)
+    {
+        return;
+    }
+
+    KeInitializeEvent(&sync.Done, ketNotification, FALSE);
+    RcuCall(&sync.Head, _RcuSyncCallback);
+    KeWaitForEvent(&sync.Done);
+}
+
+
+VOID
+RcuQuiescentState(
+    VOID
+)
+{
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    _InterlockedIncrement64(&GetCurrentCpu()->Rcu.Sequence);
+}
+
+
+VOID
+RcuTick(
+    VOID
+)
+{
+    // racy, but a callback queued right now is seen on the next tick
+    if (gRcuGpActive || gRcuNextHead)
+    {
+        KeInsertQueueDpc(&gRcuDpc);
+    }
+}
+
+
+BOOLEAN
+RcuPending(
+    VOID
+)
+{
+    return gRcuGpActive || NULL != gRcuNextHead;
+}
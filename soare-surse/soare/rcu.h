@@ -0,0 +1,78 @@
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include "defs.h"
+
+//
+// Read-copy-update, for data that is read often and replaced rarely. A reader disables interrupts, follows the
+// pointer with RcuDereference and never takes a lock. An updater builds a new copy, publishes it with
+// RcuAssignPointer and gives the old one to RcuCall, which calls back once every CPU went through a quiescent state
+// (an interrupt, a thread switch, a trip through the idle loop), so no reader can still hold it.
+//
+
+struct _RCU_HEAD;
+
+typedef VOID(*PFN_RcuCallback)(_In_ struct _RCU_HEAD *Head);
+
+// Embedded in the object to be freed; CONTAINING_RECORD gets the object back in the callback
+typedef struct _RCU_HEAD
+{
+    struct _RCU_HEAD *      Next;
+    PFN_RcuCallback         Callback;
+} RCU_HEAD, *PRCU_HEAD;
+
+// Per CPU, in the PCPU
+typedef struct _RCU_CPU
+{
+    volatile INT64          Sequence;       // quiescent states so far; the grace periods compare it to a snapshot
+} RCU_CPU;
+
+// x86 doesn't reorder stores, so the compiler is the only one that could publish the pointer before the object
+#define RcuAssignPointer(Pointer, Value)    do { _ReadWriteBarrier(); *(PVOID volatile *)&(Pointer) = (PVOID)(Value); } while (0)
+
+// A single read of the pointer; the loads through it depend on it, x86 keeps them after it
+#define RcuDereference(Pointer)             (*(PVOID volatile *)&(Pointer))
+
+// Returns the RFLAGS for RcuReadUnlock; the section may nest, it must not block
+QWORD
+RcuReadLock(
+    VOID
+);
+
+VOID
+RcuReadUnlock(
+    _In_ QWORD Flags
+);
+
+// Calls Callback with interrupts enabled, in a DPC of the BSP, after a grace period; callable from anywhere
+VOID
+RcuCall(
+    _Inout_ PRCU_HEAD Head,
+    _In_ PFN_RcuCallback Callback
+);
+
+// Waits for a grace period; the caller must be able to block and must not be in a read-side section
+VOID
+RcuSynchronize(
+    VOID
+);
+
+// The current CPU is not in a read-side section; called on IRQ exit, on thread switches and by the idle loops
+VOID
+RcuQuiescentState(
+    VOID
+);
+
+// Called by the timer interrupt of the BSP on every tick; moves the grace periods forward
+VOID
+RcuTick(
+    VOID
+);
+
+// TRUE while callbacks wait for a grace period; the BSP doesn't stop its tick meanwhile
+BOOLEAN
+RcuPending(
+    VOID
+);
+
+#endif // !_RCU_H_
@@ -1,5 +1,6 @@
 #include "defs.h"
 #include "screen.h"
+#include "spinlock.h"
 
 // Private data
 typedef struct _SCREEN
@@ -17,6 +18,9 @@ typedef struct _SCREEN
 
 static SCREEN gScreen = { 0 };
 
+// The cursor, the style and the buffer; the timer IRQ updates the header, so it is always taken with IRQs disabled
+static KE_TICKET_LOCK gScreenLock;
+
 
 #define VGA_MAKE_STYLE(fg, bg)          ((BYTE)((fg) | ((bg) << 4)))
 #define VGA_MAKE_ENTRY(ch, st)          ((WORD)((ch) | ((st) << 8)))
@@ -104,6 +108,7 @@ VgaFillScreen(
 )
 {
     WORD entry = VGA_MAKE_ENTRY(Ch, VGA_MAKE_STYLE(Foreground, Background));
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
 
     for (WORD row = 0; row < VGA_LINES; row++)
     {
@@ -112,11 +117,13 @@ VgaFillScreen(
             gScreen.Buffer[VGA_MAKE_OFFSET(row, column)] = entry;
         }
     }
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
 }
 
 
-VOID
-VgaPutChar(
+static VOID
+_VgaPutChar(
     _In_ CHAR Ch
 )
 {
@@ -125,6 +132,19 @@ VgaPutChar(
 }
 
 
+VOID
+VgaPutChar(
+    _In_ CHAR Ch
+)
+{
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
+    _VgaPutChar(Ch);
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
+}
+
+
 #define CH_NEW_LINE     '\n'
 #define CH_RET          '\r'
 #define CH_TAB          '\t'
@@ -132,8 +152,8 @@ VgaPutChar(
 #define CH_BACKSPACE    '\b'
 
 
-VOID
-VgaPutString(
+static VOID
+_VgaPutString(
     _In_ const PCHAR Str
 )
 {
@@ -149,7 +169,7 @@ VgaPutString(
             break;
 
         case CH_TAB:
-            VgaPutString("    ");
+            _VgaPutString("    ");
             break;
 
         case CH_BACKSPACE:
@@ -158,13 +178,13 @@ VgaPutString(
             if (gScreen.CurrentColumn != 0)
             {
                 VGA_DECREMENT;
-                VgaPutChar(' ');
+                _VgaPutChar(' ');
                 VGA_DECREMENT;
             }
             break;
 
         default:
-            VgaPutChar(Str[index]);
+            _VgaPutChar(Str[index]);
             break;
         }
 
@@ -173,16 +193,34 @@ VgaPutString(
 }
 
 
+VOID
+VgaPutString(
+    _In_ const PCHAR Str
+)
+{
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
+    // a whole string at once, so the lines of two CPUs don't get mixed
+    _VgaPutString(Str);
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
+}
+
+
 VOID
 VgaSetForeground(
     _In_ VGA_COLOR Fg
 )
 {
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
     // clear the current foreground
     gScreen.CurrentColorStyle &= 0xF0;
 
     // set the new foreground
     gScreen.CurrentColorStyle |= (Fg & 0x0F);
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
 }
 
 
@@ -191,11 +229,15 @@ VgaSetBackground(
     _In_ VGA_COLOR Bg
 )
 {
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
     // clear the current background
     gScreen.CurrentColorStyle &= 0x0F;
 
     // set the new background
     gScreen.CurrentColorStyle |= (Bg << 4);
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
 }
 
 
@@ -204,6 +246,8 @@ VgaControlHeader(
     _In_ BOOLEAN Enable
 )
 {
+    QWORD flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
     if (Enable)
     {
         gScreen.StartRow = 1;
@@ -216,6 +260,8 @@ VgaControlHeader(
     {
         gScreen.StartRow = 0;
     }
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
 }
 
 
@@ -231,6 +277,7 @@ VgaUpdateHeader(
     BOOLEAN bRightToLeft = FALSE;
     WORD start = Position;
     WORD stop = VGA_COLUMNS;
+    QWORD flags;
 
     if (Position < 0)
     {
@@ -244,6 +291,8 @@ VgaUpdateHeader(
         return;
     }
 
+    flags = KeAcquireTicketLockIrqSave(&gScreenLock);
+
     for (WORD col = start; col < stop; col++)
     {
         if (Str[i] == '\0')
@@ -254,4 +303,6 @@ VgaUpdateHeader(
         gScreen.Buffer[VGA_MAKE_OFFSET(0, col)] = VGA_MAKE_ENTRY(Str[i], VGA_MAKE_STYLE(Foreground, Background));
         i++;
     }
+
+    KeReleaseTicketLockIrqRestore(&gScreenLock, flags);
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "defs.h"
 #include "ntstatus.h"
 #include "serial.h"
+#include "spinlock.h"
+#include "sync.h"
+#include "dtr.h"
+#include "pic.h"
+#include "log.h"
 
 #define NEW_LINE            '\n'
 #define CARRIAGE_RETURN     '\r'
@@ -8,34 +13,52 @@
 #define NULL_TERMINATOR     '\0'
 #define BACKSPACE           '\b'
 
+#define SERIAL_RX_BUFFER_SIZE   256     // received and not read yet; what doesn't fit is dropped
+
 typedef struct _COM_PORT
 {
-    WORD        Port;
-    BOOLEAN     Inited;
+    WORD            Port;
+    BOOLEAN         Inited;
+    BYTE            Irq;        // PIC_IRQ_SERIAL*
+    KE_TICKET_LOCK  Lock;       // the writers; every CPU logs, IRQ handlers included
+
+    // filled by SerialHandler once IoSerialEnableReceiveIrq ran, else the readers poll the port
+    BOOLEAN         RxIrq;
+    KE_TICKET_LOCK  RxLock;
+    KSEMAPHORE      RxChars;    // one unit for every character in RxBuffer
+    WORD            RxHead;     // the next one to be read
+    WORD            RxCount;
+    CHAR            RxBuffer[SERIAL_RX_BUFFER_SIZE];
 } COM_PORT, *PCOM_PORT;
 
 PCOM_PORT gDefaultPort = NULL;
 
+extern VOID IsrHndSerial(VOID);
+
 COM_PORT gSerialPorts[] = {
     // COM1
     {
         COM1,       // Port
-        FALSE       // Inited
+        FALSE,      // Inited
+        PIC_IRQ_SERIAL1 // Irq
     },
     // COM2
     {
         COM2,       // Port
-        FALSE       // Inited
+        FALSE,      // Inited
+        PIC_IRQ_SERIAL2 // Irq
     },
     // COM3
     {
         COM3,       // Port
-        FALSE       // Inited
+        FALSE,      // Inited
+        PIC_IRQ_SERIAL1 // Irq
     },
     // COM4
     {
         COM4,       // Port
-        FALSE       // Inited
+        FALSE,      // Inited
+        PIC_IRQ_SERIAL2 // Irq
     }
 };
 
@@ -120,12 +143,119 @@ SerialReadPort(
 }
 
 
+// Blocks on the receive buffer if the port has its IRQ enabled, else polls the line status register
+static
+CHAR
+_SerialReadChar(
+    _In_ WORD PortAddress
+)
+{
+    PCOM_PORT pPort = NULL;
+    CHAR ch;
+    QWORD flags;
+
+    for (DWORD i = 0; i <= PORT_COM_LAST; i++)
+    {
+        if (gSerialPorts[i].Port == PortAddress && gSerialPorts[i].RxIrq)
+        {
+            pPort = &gSerialPorts[i];
+            break;
+        }
+    }
+
+    if (!pPort)
+    {
+        return SerialReadPort(PortAddress);
+    }
+
+    KeWaitForSemaphore(&pPort->RxChars);
+
+    flags = KeAcquireTicketLockIrqSave(&pPort->RxLock);
+
+    ch = pPort->RxBuffer[pPort->RxHead];
+    pPort->RxHead = (pPort->RxHead + 1) % SERIAL_RX_BUFFER_SIZE;
+    pPort->RxCount--;
+
+    KeReleaseTicketLockIrqRestore(&pPort->RxLock, flags);
+
+    return ch;
+}
+
+
 CHAR
 SerialRead(
     VOID
 )
 {
-    return SerialReadPort(gDefaultPort->Port);
+    return _SerialReadChar(gDefaultPort->Port);
+}
+
+
+VOID
+SerialHandler(
+    _In_ PVOID Context
+)
+{
+    PCOM_PORT pPort = gDefaultPort;
+    INT32 received = 0;
+    QWORD flags;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    flags = KeAcquireTicketLockIrqSave(&pPort->RxLock);
+
+    // empty the FIFO, reading the data register acknowledges the interrupt
+    while (_SerRcvd(pPort->Port))
+    {
+        CHAR ch = __inbyte(pPort->Port);
+
+        if (pPort->RxCount < SERIAL_RX_BUFFER_SIZE)
+        {
+            pPort->RxBuffer[(pPort->RxHead + pPort->RxCount) % SERIAL_RX_BUFFER_SIZE] = ch;
+            pPort->RxCount++;
+            received++;
+        }
+    }
+
+    KeReleaseTicketLockIrqRestore(&pPort->RxLock, flags);
+
+    if (received)
+    {
+        KeReleaseSemaphore(&pPort->RxChars, received);
+    }
+}
+
+
+NTSTATUS
+IoSerialEnableReceiveIrq(
+    VOID
+)
+{
+    PCOM_PORT pPort = gDefaultPort;
+    NTSTATUS status;
+
+    if (!pPort)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    KeInitializeSemaphore(&pPort->RxChars, 0, SERIAL_RX_BUFFER_SIZE);
+    pPort->RxHead = pPort->RxCount = 0;
+
+    status = DtrInstallIrqHandler(IRQ2INTR(pPort->Irq), IsrHndSerial);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrInstallIrqHandler failed for 0x%04x -> %018p: 0x%08x\n", pPort->Irq, IsrHndSerial, status);
+        return status;
+    }
+
+    pPort->RxIrq = TRUE;
+
+    // received data available
+    __outbyte(pPort->Port + 1, 0x01);
+    PicEnableIrq(pPort->Irq);
+
+    return STATUS_SUCCESS;
 }
 
 
@@ -155,7 +285,11 @@ SerialWrite(
     _In_ CHAR Character
 )
 {
+    QWORD flags = KeAcquireTicketLockIrqSave(&gDefaultPort->Lock);
+
     SerialWritePort(gDefaultPort->Port, Character);
+
+    KeReleaseTicketLockIrqRestore(&gDefaultPort->Lock, flags);
 }
 
 
@@ -200,7 +334,12 @@ SerialPutString(
 {
     if (Str)
     {
+        // a whole string at once, so the lines of two CPUs don't get mixed
+        QWORD flags = KeAcquireTicketLockIrqSave(&gDefaultPort->Lock);
+
         SerialPutStringToPort(gDefaultPort->Port, Str, Elements);
+
+        KeReleaseTicketLockIrqRestore(&gDefaultPort->Lock, flags);
     }
 }
 
@@ -218,7 +357,7 @@ SerialReadStringFromPort(
 
     for (i = 0; i < BufferSize; i++)
     {
-        CHAR ch = SerialReadPort(PortAddress);
+        CHAR ch = _SerialReadChar(PortAddress);
 
         switch (ch)
         {
@@ -41,6 +41,12 @@ IoSerialPreInit(
     VOID
 );
 
+// Makes the default port fill a receive buffer from its IRQ; the reads block on it instead of polling the port
+NTSTATUS
+IoSerialEnableReceiveIrq(
+    VOID
+);
+
 SIZE_T
 SerialReadString(
     _Out_ CHAR * Buffer,
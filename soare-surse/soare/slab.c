@@ -0,0 +1,1100 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "winlists.h"
+#include "kpool.h"
+#include "slab.h"
+#include "pooltag.h"
+#include "allocprof.h"
+#include "log.h"
+#include "kernel.h"
+#include "dtr.h"
+#include "spinlock.h"
+#include "smp.h"
+
+/*
+
+    Slab allocator.
+    Every slab is one kernel pool entry (4K). The slab header lives at the start of the page and the rest of the page
+    is carved into objects of a single size class. Free objects are linked through their first QWORD, so allocating
+    is a pointer pop from the free list of the first partial slab.
+
+    Each size class keeps three lists of slabs:
+    - partial: some objects are free
+    - full: no object is free
+    - empty: every object is free; only KM_MAX_EMPTY_SLABS are kept, the others go back to the pool
+
+    Objects are never page aligned (the header is at the start of the page), so a page aligned pointer given to
+    KmFreeAndNull is a request that was served directly with a whole pool entry.
+
+    In front of the slabs, every CPU has a loaded and a previous magazine for every size class (see KM_CPU_CACHE in
+    the PCPU). Allocations pop from the loaded magazine and frees push to it; the two magazines are swapped when the
+    loaded one can't serve the request. Only when both are exhausted is a full (or empty) magazine exchanged with
+    the depot of the size class, so the slab lists are touched once every KM_MAGAZINE_ROUNDS operations at most.
+    Everything runs with interrupts disabled, which is all the exclusion a CPU needs for its own magazines. The
+    slab lists, the depots and the list of named caches are shared by all CPUs and guarded by gKmLock.
+
+    Besides the size classes, named caches can be created for a specific object type. Their constructor runs once for
+    every object when a slab is created and their destructor once for every object when the slab is released, so an
+    allocation returns an object that is already initialized. Both run without gKmLock and with the interrupts as the
+    caller of KmCacheAlloc / KmCacheFreeAndNull / KmCacheDestroy left them: a new slab is built before it is added to
+    its cache, a surplus one is taken out of its cache before it is torn down. Two CPUs may then build a slab for the
+    same cache at once; the extra one is simply released once it is empty again. Because a free object keeps its
+    constructed state, the free list link of these caches is stored right after the object instead of over its first
+    QWORD. Named caches have no magazines; their allocations are served directly by the slabs.
+
+    Every object is charged to a pool tag by the size of its slot class: the tag given by the caller for the size
+    classes, the tag of the cache for the named caches. The slabs themselves are charged to TAG_SLAB.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+#define KM_SLAB_MAGIC           0x42414C53  // 'SLAB'
+#define KM_SLAB_HEADER_SIZE     64
+#define KM_OBJECT_ALIGNMENT     16
+#define KM_MAX_EMPTY_SLABS      1
+
+struct _KM_CACHE
+{
+    PCHAR       Name;
+    DWORD       Tag;            // named caches only, the size classes charge the tag of the caller
+    DWORD       ObjectSize;
+    DWORD       ObjectsPerSlab;
+    DWORD       SlotSize;       // object, free list link (named caches only) and padding
+    DWORD       LinkOffset;     // where the free list link is stored inside a slot
+
+    PFN_KmObjectCallback    Constructor;
+    PFN_KmObjectCallback    Destructor;
+    PVOID                   Context;
+    BOOLEAN                 Named;
+    LIST_ENTRY              Link;           // in gKmNamedCaches
+    QWORD                   Constructed;
+    QWORD                   Destructed;
+
+    LIST_HEAD   Partial;
+    LIST_HEAD   Full;
+    LIST_HEAD   Empty;
+    DWORD       EmptyCount;
+
+    QWORD       Slabs;          // slabs currently owned by the cache
+    QWORD       InUse;          // objects currently allocated, including the ones cached in magazines
+    QWORD       Allocs;
+    QWORD       Frees;
+
+    PKM_MAGAZINE    DepotFull;
+    PKM_MAGAZINE    DepotEmpty;
+    DWORD           DepotFullCount;
+    DWORD           DepotEmptyCount;
+    QWORD           DepotExchanges;
+};
+
+typedef struct _KM_SLAB
+{
+    LIST_ENTRY  Link;
+    PKM_CACHE   Cache;
+    PVOID       FreeList;
+    WORD        InUse;
+    WORD        Capacity;
+    DWORD       Magic;
+} KM_SLAB, *PKM_SLAB;
+
+static_assert(sizeof(KM_SLAB) <= KM_SLAB_HEADER_SIZE, "Slab header too large!");
+
+// Besides the powers of 2, the sizes are tuned so that (4096 - header) is filled with as little waste as possible
+static KM_CACHE gKmCaches[] =
+{
+    { "km-16",   0, 16 },
+    { "km-32",   0, 32 },
+    { "km-48",   0, 48 },
+    { "km-64",   0, 64 },
+    { "km-96",   0, 96 },
+    { "km-128",  0, 128 },
+    { "km-192",  0, 192 },
+    { "km-256",  0, 256 },
+    { "km-336",  0, 336 },
+    { "km-448",  0, 448 },
+    { "km-672",  0, 672 },
+    { "km-1008", 0, 1008 },
+    { "km-2016", 0, 2016 },
+};
+
+#define KM_CACHE_COUNT          (sizeof(gKmCaches) / sizeof(gKmCaches[0]))
+#define KM_MAGAZINE_CACHE       5   // km-128
+
+static_assert(KM_CACHE_COUNT == KM_SIZE_CLASS_COUNT, "KM_SIZE_CLASS_COUNT is out of sync!");
+static_assert(sizeof(KM_MAGAZINE) == 128, "Magazines must fill a km-128 object!");
+
+// Size class for every multiple of KM_OBJECT_ALIGNMENT up to KM_MAX_SLAB_OBJECT_SIZE
+static BYTE gKmSizeToCache[KM_MAX_SLAB_OBJECT_SIZE / KM_OBJECT_ALIGNMENT + 1];
+
+static QWORD gKmPageAllocs;     // requests served with whole pool entries, currently allocated
+
+static LIST_HEAD gKmNamedCaches;
+
+// Taken with the interrupts already disabled, after a CPU found nothing in its magazines
+static KE_MCS_LOCK gKmLock;
+
+#define KM_FREE_LINK(Cache, Object)     (*(PVOID *)((PBYTE)(Object) + (Cache)->LinkOffset))
+
+
+static __forceinline
+PKM_SLAB
+_KmSlabFromObject(
+    _In_ PVOID Object
+)
+{
+    return (KM_SLAB *)ROUND_DOWN((QWORD)Object, PAGE_SIZE_4K);
+}
+
+
+static
+NTSTATUS
+_KmNewSlab(
+    _Inout_ PKM_CACHE Cache,
+    _Out_ PKM_SLAB *Slab
+)
+{
+    NTSTATUS status;
+    PVOID pPage = NULL;
+    PKM_SLAB pSlab;
+    PBYTE pObject;
+
+    status = KpAlloc(TAG_SLAB, &pPage);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    pSlab = (KM_SLAB *)pPage;
+    pSlab->Cache = Cache;
+    pSlab->InUse = 0;
+    pSlab->Capacity = (WORD)Cache->ObjectsPerSlab;
+    pSlab->Magic = KM_SLAB_MAGIC;
+    pSlab->FreeList = NULL;
+
+    // link the objects so that they are handed out in address order
+    pObject = (PBYTE)pPage + KM_SLAB_HEADER_SIZE + (QWORD)(Cache->ObjectsPerSlab - 1) * Cache->SlotSize;
+    for (DWORD i = 0; i < Cache->ObjectsPerSlab; i++)
+    {
+        if (Cache->Constructor)
+        {
+            Cache->Constructor(pObject, Cache->Context);
+        }
+
+        KM_FREE_LINK(Cache, pObject) = pSlab->FreeList;
+        pSlab->FreeList = pObject;
+        pObject -= Cache->SlotSize;
+    }
+
+    *Slab = pSlab;
+
+    return STATUS_SUCCESS;
+}
+
+
+// Hands a slab built by _KmNewSlab to its cache; with gKmLock held
+static
+VOID
+_KmAddSlab(
+    _Inout_ PKM_CACHE Cache,
+    _Inout_ PKM_SLAB Slab
+)
+{
+    InsertHeadList(&Cache->Partial, &Slab->Link);
+    Cache->Slabs++;
+
+    if (Cache->Constructor)
+    {
+        Cache->Constructed += Cache->ObjectsPerSlab;
+    }
+}
+
+
+// Takes an empty slab away from its cache, which must no longer list it; with gKmLock held
+static
+VOID
+_KmDetachSlab(
+    _Inout_ PKM_CACHE Cache,
+    _Inout_ PKM_SLAB Slab
+)
+{
+    Slab->Magic = 0;
+    Cache->Slabs--;
+
+    if (Cache->Destructor)
+    {
+        Cache->Destructed += Slab->Capacity;
+    }
+}
+
+
+// Tears down a detached slab; without gKmLock if the cache has a destructor
+static
+VOID
+_KmReleaseSlab(
+    _In_ PKM_CACHE Cache,
+    _Inout_ PKM_SLAB Slab
+)
+{
+    PVOID pPage = Slab;
+
+    if (Cache->Destructor)
+    {
+        for (PVOID pObject = Slab->FreeList; pObject; pObject = KM_FREE_LINK(Cache, pObject))
+        {
+            Cache->Destructor(pObject, Cache->Context);
+        }
+    }
+
+    KpFreeAndNull(&pPage, TAG_SLAB);
+}
+
+
+NTSTATUS
+KmInit(
+    VOID
+)
+{
+    DWORD cache = 0;
+
+    for (DWORD i = 0; i < KM_CACHE_COUNT; i++)
+    {
+        PKM_CACHE pCache = &gKmCaches[i];
+
+        pCache->SlotSize = pCache->ObjectSize;
+        pCache->ObjectsPerSlab = (PAGE_SIZE_4K - KM_SLAB_HEADER_SIZE) / pCache->SlotSize;
+        InitializeListHead(&pCache->Partial);
+        InitializeListHead(&pCache->Full);
+        InitializeListHead(&pCache->Empty);
+    }
+
+    InitializeListHead(&gKmNamedCaches);
+
+    for (DWORD i = 0; i < sizeof(gKmSizeToCache); i++)
+    {
+        while (gKmCaches[cache].ObjectSize < i * KM_OBJECT_ALIGNMENT)
+        {
+            cache++;
+        }
+
+        gKmSizeToCache[i] = (BYTE)cache;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+NTSTATUS
+_KmSlabAlloc(
+    _Inout_ PKM_CACHE Cache,
+    _Out_ PVOID *Ptr
+)
+{
+    PKM_SLAB pSlab;
+    PVOID pObject;
+
+    if (!IsListEmpty(&Cache->Partial))
+    {
+        pSlab = CONTAINING_RECORD(Cache->Partial.Flink, KM_SLAB, Link);
+    }
+    else if (!IsListEmpty(&Cache->Empty))
+    {
+        pSlab = CONTAINING_RECORD(RemoveHeadList(&Cache->Empty), KM_SLAB, Link);
+        Cache->EmptyCount--;
+
+        InsertHeadList(&Cache->Partial, &pSlab->Link);
+    }
+    else
+    {
+        NTSTATUS status;
+
+        // the constructors of a named cache must not run under gKmLock, KmCacheAlloc builds its slabs
+        if (Cache->Named)
+        {
+            return STATUS_NO_MORE_ENTRIES;
+        }
+
+        status = _KmNewSlab(Cache, &pSlab);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+
+        _KmAddSlab(Cache, pSlab);
+    }
+
+    pObject = pSlab->FreeList;
+    pSlab->FreeList = KM_FREE_LINK(Cache, pObject);
+    pSlab->InUse++;
+
+    if (!pSlab->FreeList)
+    {
+        RemoveEntryList(&pSlab->Link);
+        InsertHeadList(&Cache->Full, &pSlab->Link);
+    }
+
+    Cache->InUse++;
+    Cache->Allocs++;
+
+    *Ptr = pObject;
+
+    return STATUS_SUCCESS;
+}
+
+
+// Returns the slab if it became surplus and its cache has a destructor: the caller releases it after gKmLock
+static
+PKM_SLAB
+_KmSlabFree(
+    _Inout_ PKM_SLAB Slab,
+    _In_ PVOID Object
+)
+{
+    PKM_CACHE pCache = Slab->Cache;
+
+    // the slab was full, it can serve allocations again
+    if (!Slab->FreeList)
+    {
+        RemoveEntryList(&Slab->Link);
+        InsertHeadList(&pCache->Partial, &Slab->Link);
+    }
+
+    KM_FREE_LINK(pCache, Object) = Slab->FreeList;
+    Slab->FreeList = Object;
+    Slab->InUse--;
+
+    pCache->InUse--;
+    pCache->Frees++;
+
+    if (!Slab->InUse)
+    {
+        RemoveEntryList(&Slab->Link);
+
+        if (pCache->EmptyCount < KM_MAX_EMPTY_SLABS)
+        {
+            InsertHeadList(&pCache->Empty, &Slab->Link);
+            pCache->EmptyCount++;
+        }
+        else
+        {
+            _KmDetachSlab(pCache, Slab);
+
+            if (pCache->Destructor)
+            {
+                return Slab;
+            }
+
+            _KmReleaseSlab(pCache, Slab);
+        }
+    }
+
+    return NULL;
+}
+
+
+static
+PKM_MAGAZINE
+_KmNewMagazine(
+    VOID
+)
+{
+    PVOID pMagazine = NULL;
+
+    if (!NT_SUCCESS(_KmSlabAlloc(&gKmCaches[KM_MAGAZINE_CACHE], &pMagazine)))
+    {
+        return NULL;
+    }
+
+    memset(pMagazine, 0, sizeof(KM_MAGAZINE));
+
+    return (KM_MAGAZINE *)pMagazine;
+}
+
+
+static
+VOID
+_KmFreeMagazine(
+    _In_ PKM_MAGAZINE Magazine
+)
+{
+    for (DWORD i = 0; i < Magazine->Rounds; i++)
+    {
+        _KmSlabFree(_KmSlabFromObject(Magazine->Objects[i]), Magazine->Objects[i]);
+    }
+
+    _KmSlabFree(_KmSlabFromObject(Magazine), Magazine);
+}
+
+
+static
+PVOID
+_KmCpuAlloc(
+    _Inout_ PKM_CACHE Cache,
+    _Inout_ PKM_CPU_CACHE CpuCache
+)
+{
+    PKM_MAGAZINE pMagazine;
+    KE_MCS_HANDLE lock;
+
+    if (CpuCache->Loaded && CpuCache->Loaded->Rounds)
+    {
+        CpuCache->Allocs++;
+        return CpuCache->Loaded->Objects[--CpuCache->Loaded->Rounds];
+    }
+
+    if (CpuCache->Previous && CpuCache->Previous->Rounds)
+    {
+        pMagazine = CpuCache->Loaded;
+        CpuCache->Loaded = CpuCache->Previous;
+        CpuCache->Previous = pMagazine;
+
+        CpuCache->Allocs++;
+        return CpuCache->Loaded->Objects[--CpuCache->Loaded->Rounds];
+    }
+
+    // both are empty, trade the previous one for a full magazine from the depot
+    KeAcquireMcsLock(&gKmLock, &lock);
+
+    if (!Cache->DepotFull)
+    {
+        KeReleaseMcsLock(&lock);
+        return NULL;
+    }
+
+    pMagazine = Cache->DepotFull;
+    Cache->DepotFull = pMagazine->Next;
+    Cache->DepotFullCount--;
+    Cache->DepotExchanges++;
+
+    if (CpuCache->Previous)
+    {
+        CpuCache->Previous->Next = Cache->DepotEmpty;
+        Cache->DepotEmpty = CpuCache->Previous;
+        Cache->DepotEmptyCount++;
+    }
+
+    KeReleaseMcsLock(&lock);
+
+    CpuCache->Previous = CpuCache->Loaded;
+    CpuCache->Loaded = pMagazine;
+
+    CpuCache->Allocs++;
+    return CpuCache->Loaded->Objects[--CpuCache->Loaded->Rounds];
+}
+
+
+static
+BOOLEAN
+_KmCpuFree(
+    _Inout_ PKM_CACHE Cache,
+    _Inout_ PKM_CPU_CACHE CpuCache,
+    _In_ PVOID Object
+)
+{
+    PKM_MAGAZINE pMagazine;
+    KE_MCS_HANDLE lock;
+
+    if (CpuCache->Loaded && CpuCache->Loaded->Rounds < KM_MAGAZINE_ROUNDS)
+    {
+        CpuCache->Loaded->Objects[CpuCache->Loaded->Rounds++] = Object;
+        CpuCache->Frees++;
+        return TRUE;
+    }
+
+    if (CpuCache->Previous && CpuCache->Previous->Rounds < KM_MAGAZINE_ROUNDS)
+    {
+        pMagazine = CpuCache->Loaded;
+        CpuCache->Loaded = CpuCache->Previous;
+        CpuCache->Previous = pMagazine;
+
+        CpuCache->Loaded->Objects[CpuCache->Loaded->Rounds++] = Object;
+        CpuCache->Frees++;
+        return TRUE;
+    }
+
+    // both are full (or missing), trade the previous one for an empty magazine
+    KeAcquireMcsLock(&gKmLock, &lock);
+
+    if (Cache->DepotEmpty)
+    {
+        pMagazine = Cache->DepotEmpty;
+        Cache->DepotEmpty = pMagazine->Next;
+        Cache->DepotEmptyCount--;
+    }
+    else
+    {
+        pMagazine = _KmNewMagazine();
+        if (!pMagazine)
+        {
+            KeReleaseMcsLock(&lock);
+            return FALSE;
+        }
+    }
+
+    Cache->DepotExchanges++;
+
+    if (CpuCache->Previous)
+    {
+        CpuCache->Previous->Next = Cache->DepotFull;
+        Cache->DepotFull = CpuCache->Previous;
+        Cache->DepotFullCount++;
+    }
+
+    KeReleaseMcsLock(&lock);
+
+    CpuCache->Previous = CpuCache->Loaded;
+    CpuCache->Loaded = pMagazine;
+
+    CpuCache->Loaded->Objects[CpuCache->Loaded->Rounds++] = Object;
+    CpuCache->Frees++;
+    return TRUE;
+}
+
+
+NTSTATUS
+KmAlloc(
+    _In_ DWORD Size,
+    _In_ DWORD Tag,
+    _Out_ PVOID *Ptr
+)
+{
+    NTSTATUS status;
+    DWORD index;
+    QWORD flags;
+    KE_MCS_HANDLE lock;
+
+    if (!Size || Size > KM_MAX_ALLOC_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    if (Size > KM_MAX_SLAB_OBJECT_SIZE)
+    {
+        // charged by the pool
+        status = KpAlloc(Tag, Ptr);
+        if (NT_SUCCESS(status))
+        {
+            _InterlockedIncrement64((volatile INT64 *)&gKmPageAllocs);
+        }
+
+        goto _exit;
+    }
+
+    index = gKmSizeToCache[ROUND_UP(Size, KM_OBJECT_ALIGNMENT) / KM_OBJECT_ALIGNMENT];
+
+    if (gKernelGlobalData.Phase >= KE_PHASE_PCPU_READY)
+    {
+        PVOID pObject = _KmCpuAlloc(&gKmCaches[index], &GetCurrentCpu()->KmCache[index]);
+        if (pObject)
+        {
+            *Ptr = pObject;
+            status = STATUS_SUCCESS;
+            goto _charge;
+        }
+    }
+
+    KeAcquireMcsLock(&gKmLock, &lock);
+    status = _KmSlabAlloc(&gKmCaches[index], Ptr);
+    KeReleaseMcsLock(&lock);
+
+_charge:
+    if (NT_SUCCESS(status))
+    {
+        MmTagCharge(Tag, gKmCaches[index].ObjectSize);
+        MmProfOnAlloc(gKmCaches[index].ObjectSize);
+    }
+    else
+    {
+        MmTagFailure(Tag);
+    }
+
+_exit:
+    __writeeflags(flags);
+
+    return status;
+}
+
+
+NTSTATUS
+KmFreeAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PKM_SLAB pSlab;
+    DWORD index;
+    QWORD flags;
+    KE_MCS_HANDLE lock;
+
+    if (!Ptr || !*Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pSlab = _KmSlabFromObject(*Ptr);
+    if ((PVOID)pSlab == *Ptr)
+    {
+        _InterlockedDecrement64((volatile INT64 *)&gKmPageAllocs);
+        status = KpFreeAndNull(Ptr, Tag);
+        goto _exit;
+    }
+
+    if (KM_SLAB_MAGIC != pSlab->Magic || !pSlab->InUse)
+    {
+        LogWithInfo("[ERROR] %018p is not an allocated slab object\n", *Ptr);
+        status = STATUS_INVALID_PARAMETER_1;
+        goto _exit;
+    }
+
+    if (pSlab->Cache->Named)
+    {
+        LogWithInfo("[ERROR] %018p belongs to cache %s, use KmCacheFreeAndNull\n", *Ptr, pSlab->Cache->Name);
+        status = STATUS_INVALID_PARAMETER_1;
+        goto _exit;
+    }
+
+    index = (DWORD)(pSlab->Cache - gKmCaches);
+    MmTagCredit(Tag, pSlab->Cache->ObjectSize);
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY ||
+        !_KmCpuFree(pSlab->Cache, &GetCurrentCpu()->KmCache[index], *Ptr))
+    {
+        KeAcquireMcsLock(&gKmLock, &lock);
+        _KmSlabFree(pSlab, *Ptr);
+        KeReleaseMcsLock(&lock);
+    }
+
+    *Ptr = NULL;
+
+_exit:
+    __writeeflags(flags);
+
+    return status;
+}
+
+
+NTSTATUS
+KmCacheCreate(
+    _In_ PCHAR Name,
+    _In_ DWORD Tag,
+    _In_ DWORD ObjectSize,
+    _In_opt_ PFN_KmObjectCallback Constructor,
+    _In_opt_ PFN_KmObjectCallback Destructor,
+    _In_opt_ PVOID Context,
+    _Out_ PKM_CACHE *Cache
+)
+{
+    NTSTATUS status;
+    PKM_CACHE pCache = NULL;
+    DWORD slotSize = (DWORD)ROUND_UP(ObjectSize + sizeof(PVOID), KM_OBJECT_ALIGNMENT);
+    KE_MCS_HANDLE lock;
+
+    if (!Name)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!ObjectSize || slotSize > KM_MAX_SLAB_OBJECT_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    if (!Cache)
+    {
+        return STATUS_INVALID_PARAMETER_7;
+    }
+
+    status = KmAlloc(sizeof(KM_CACHE), TAG_KM_CACHE, &pCache);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KmAlloc failed: 0x%08x\n", status);
+        return status;
+    }
+
+    memset(pCache, 0, sizeof(KM_CACHE));
+    pCache->Name = Name;
+    pCache->Tag = Tag;
+    pCache->ObjectSize = ObjectSize;
+    pCache->SlotSize = slotSize;
+    pCache->LinkOffset = slotSize - sizeof(PVOID);
+    pCache->ObjectsPerSlab = (PAGE_SIZE_4K - KM_SLAB_HEADER_SIZE) / slotSize;
+    pCache->Constructor = Constructor;
+    pCache->Destructor = Destructor;
+    pCache->Context = Context;
+    pCache->Named = TRUE;
+    InitializeListHead(&pCache->Partial);
+    InitializeListHead(&pCache->Full);
+    InitializeListHead(&pCache->Empty);
+
+    KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+    InsertTailList(&gKmNamedCaches, &pCache->Link);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    *Cache = pCache;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+KmCacheDestroy(
+    _Inout_ PKM_CACHE *Cache
+)
+{
+    PKM_CACHE pCache;
+    KE_MCS_HANDLE lock;
+
+    if (!Cache || !*Cache || !(*Cache)->Named)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    pCache = *Cache;
+
+    if (pCache->InUse)
+    {
+        LogWithInfo("[ERROR] Cache %s still has %d objects in use\n", pCache->Name, pCache->InUse);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+    RemoveEntryList(&pCache->Link);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    // nobody else can reach the cache now, its destructor runs without the lock
+    while (!IsListEmpty(&pCache->Empty))
+    {
+        PKM_SLAB pSlab = CONTAINING_RECORD(RemoveHeadList(&pCache->Empty), KM_SLAB, Link);
+
+        _KmDetachSlab(pCache, pSlab);
+        _KmReleaseSlab(pCache, pSlab);
+    }
+
+    return KmFreeAndNull(Cache, TAG_KM_CACHE);
+}
+
+
+NTSTATUS
+KmCacheAlloc(
+    _In_ PKM_CACHE Cache,
+    _Out_ PVOID *Ptr
+)
+{
+    NTSTATUS status;
+    KE_MCS_HANDLE lock;
+
+    if (!Cache || !Cache->Named)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+    status = _KmSlabAlloc(Cache, Ptr);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    if (STATUS_NO_MORE_ENTRIES == status)
+    {
+        PKM_SLAB pSlab = NULL;
+
+        // the constructors may allocate or block, the slab is built before it is added to the cache
+        status = _KmNewSlab(Cache, &pSlab);
+        if (NT_SUCCESS(status))
+        {
+            KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+            _KmAddSlab(Cache, pSlab);
+            status = _KmSlabAlloc(Cache, Ptr);
+            KeReleaseMcsLockIrqRestore(&lock);
+        }
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        MmTagCharge(Cache->Tag, Cache->ObjectSize);
+        MmProfOnAlloc(Cache->ObjectSize);
+    }
+    else
+    {
+        MmTagFailure(Cache->Tag);
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+KmCacheFreeAndNull(
+    _In_ PKM_CACHE Cache,
+    _Inout_ PVOID *Ptr
+)
+{
+    PKM_SLAB pSlab;
+    KE_MCS_HANDLE lock;
+
+    if (!Cache || !Cache->Named)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Ptr || !*Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    pSlab = _KmSlabFromObject(*Ptr);
+    if (KM_SLAB_MAGIC != pSlab->Magic || pSlab->Cache != Cache || !pSlab->InUse)
+    {
+        LogWithInfo("[ERROR] %018p is not an allocated object of cache %s\n", *Ptr, Cache->Name);
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+    pSlab = _KmSlabFree(pSlab, *Ptr);
+    MmTagCredit(Cache->Tag, Cache->ObjectSize);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    // the destructors run without the lock
+    if (pSlab)
+    {
+        _KmReleaseSlab(Cache, pSlab);
+    }
+
+    *Ptr = NULL;
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+KmReclaim(
+    VOID
+)
+{
+    KE_MCS_HANDLE lock;
+
+    KeAcquireMcsLockIrqSave(&gKmLock, &lock);
+
+    for (DWORD i = 0; i < KM_CACHE_COUNT; i++)
+    {
+        PKM_CACHE pCache = &gKmCaches[i];
+
+        while (pCache->DepotFull)
+        {
+            PKM_MAGAZINE pMagazine = pCache->DepotFull;
+            pCache->DepotFull = pMagazine->Next;
+            pCache->DepotFullCount--;
+
+            _KmFreeMagazine(pMagazine);
+        }
+
+        while (pCache->DepotEmpty)
+        {
+            PKM_MAGAZINE pMagazine = pCache->DepotEmpty;
+            pCache->DepotEmpty = pMagazine->Next;
+            pCache->DepotEmptyCount--;
+
+            _KmFreeMagazine(pMagazine);
+        }
+    }
+
+    KeReleaseMcsLockIrqRestore(&lock);
+}
+
+
+VOID
+KmDumpStatistics(
+    VOID
+)
+{
+    QWORD totalUsed = 0;
+    QWORD totalBacked = 0;
+    DWORD cpus = MAX(KeGetCpuCount(), 1);
+
+    NLog("[SLAB] %-9s %6s %6s %8s %10s %10s %10s %10s %6s\n", "CACHE", "SIZE", "SLABS", "IN USE", "ALLOCS", "FREES",
+        "CPU ALLOC", "CPU FREE", "DEPOT");
+
+    for (DWORD i = 0; i < KM_CACHE_COUNT; i++)
+    {
+        PKM_CACHE pCache = &gKmCaches[i];
+        QWORD cpuAllocs = 0;
+        QWORD cpuFrees = 0;
+
+        // before the APs are started only the BSP is known, and only through its own PCPU
+        for (DWORD cpu = 0; cpu < cpus; cpu++)
+        {
+            PPCPU pCpu = KeGetCpu(cpu) ? KeGetCpu(cpu) : GetCurrentCpu();
+
+            cpuAllocs += pCpu->KmCache[i].Allocs;
+            cpuFrees += pCpu->KmCache[i].Frees;
+        }
+
+        NLog("[SLAB] %-9s %6d %6d %8d %10d %10d %10d %10d %6d\n", pCache->Name, pCache->ObjectSize,
+            pCache->Slabs, pCache->InUse, pCache->Allocs, pCache->Frees,
+            cpuAllocs, cpuFrees, pCache->DepotExchanges);
+
+        totalUsed += pCache->InUse * pCache->ObjectSize;
+        totalBacked += pCache->Slabs * PAGE_SIZE_4K;
+    }
+
+    NLog("[SLAB] %d bytes in objects backed by %d KB of slabs, %d whole pool entries\n",
+        totalUsed, ByteToKb(totalBacked), gKmPageAllocs);
+
+    // the magazines of the other CPUs are read without their owners stopping, the counts are only a snapshot
+    for (DWORD cpu = 0; cpu < cpus; cpu++)
+    {
+        PPCPU pCpu = KeGetCpu(cpu) ? KeGetCpu(cpu) : GetCurrentCpu();
+        QWORD allocs = 0;
+        QWORD frees = 0;
+        DWORD rounds = 0;
+
+        for (DWORD i = 0; i < KM_CACHE_COUNT; i++)
+        {
+            PKM_CPU_CACHE pCpuCache = &pCpu->KmCache[i];
+            PKM_MAGAZINE pLoaded = pCpuCache->Loaded;
+            PKM_MAGAZINE pPrevious = pCpuCache->Previous;
+
+            allocs += pCpuCache->Allocs;
+            frees += pCpuCache->Frees;
+            rounds += (pLoaded ? pLoaded->Rounds : 0) + (pPrevious ? pPrevious->Rounds : 0);
+        }
+
+        NLog("[SLAB] CPU %2d: %10d allocs and %10d frees served by the magazines, %4d objects cached\n",
+            pCpu->Number, allocs, frees, rounds);
+    }
+
+    for (PLIST_ENTRY pEntry = gKmNamedCaches.Flink; pEntry != &gKmNamedCaches; pEntry = pEntry->Flink)
+    {
+        PKM_CACHE pCache = CONTAINING_RECORD(pEntry, KM_CACHE, Link);
+
+        NLog("[SLAB] %-16s %6d %6d %8d %10d %10d ctor %d dtor %d\n", pCache->Name, pCache->ObjectSize,
+            pCache->Slabs, pCache->InUse, pCache->Allocs, pCache->Frees, pCache->Constructed, pCache->Destructed);
+    }
+}
+
+
+//
+// Throughput benchmark
+//
+// Every CPU allocates KM_BENCH_HELD objects and frees them again, KM_BENCH_ROUNDS times, first on the BSP alone and
+// then on all the online CPUs at once. With the magazines the per CPU cost should stay flat as CPUs are added, the
+// slab lists are only touched when a magazine is exchanged with the depot.
+//
+#define KM_BENCH_ROUNDS         4096
+#define KM_BENCH_HELD           32          // more than a magazine, so the depot is part of the picture
+#define KM_BENCH_OBJECT_SIZE    64
+
+typedef struct _KM_BENCH_CONTEXT
+{
+    volatile QWORD          Cycles[MAX_CPU_COUNT];
+    volatile INT32          Failures;
+} KM_BENCH_CONTEXT;
+
+
+static
+VOID
+_KmBenchWorker(
+    _In_opt_ PVOID Context
+)
+{
+    KM_BENCH_CONTEXT *pCtx = (KM_BENCH_CONTEXT *)Context;
+    PVOID objects[KM_BENCH_HELD];
+    QWORD start = __rdtsc();
+
+    for (DWORD round = 0; round < KM_BENCH_ROUNDS; round++)
+    {
+        for (DWORD i = 0; i < KM_BENCH_HELD; i++)
+        {
+            if (!NT_SUCCESS(KmAlloc(KM_BENCH_OBJECT_SIZE, TAG_BENCHMARK, &objects[i])))
+            {
+                _InterlockedIncrement((volatile long *)&pCtx->Failures);
+                objects[i] = NULL;
+            }
+        }
+
+        for (DWORD i = 0; i < KM_BENCH_HELD; i++)
+        {
+            if (objects[i])
+            {
+                KmFreeAndNull(&objects[i], TAG_BENCHMARK);
+            }
+        }
+    }
+
+    pCtx->Cycles[GetCurrentCpu()->Number] = __rdtsc() - start;
+}
+
+
+VOID
+KmBenchmarkThroughput(
+    VOID
+)
+{
+    DWORD counts[2];
+
+    counts[0] = 1;
+    counts[1] = KeGetCpuCount();
+
+    for (DWORD run = 0; run < sizeof(counts) / sizeof(counts[0]); run++)
+    {
+        KM_BENCH_CONTEXT ctx = { 0 };
+        QWORD slowest = 0;
+        QWORD total = 0;
+        NTSTATUS status;
+
+        if (run && counts[run] <= counts[0])
+        {
+            break;
+        }
+
+        status = KeRunOnCpus(counts[run], _KmBenchWorker, &ctx);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeRunOnCpus failed for %d CPUs: 0x%08x\n", counts[run], status);
+            continue;
+        }
+
+        for (DWORD cpu = 0; cpu < counts[run]; cpu++)
+        {
+            slowest = MAX(slowest, ctx.Cycles[cpu]);
+            total += ctx.Cycles[cpu];
+        }
+
+        // a pair is one KmAlloc and one KmFreeAndNull
+        NLog("[SLAB] %2d CPUs: %d cycles per alloc/free pair on each CPU, %d pairs per million cycles, %d failures\n",
+            counts[run], total / ((QWORD)counts[run] * KM_BENCH_ROUNDS * KM_BENCH_HELD),
+            (QWORD)counts[run] * KM_BENCH_ROUNDS * KM_BENCH_HELD * 1000000 / MAX(slowest, 1), ctx.Failures);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+//
+// Small object allocator built on top of the kernel pool
+//
+#define KM_MAX_SLAB_OBJECT_SIZE     2016    // larger requests get a whole pool entry
+#define KM_MAX_ALLOC_SIZE           PAGE_SIZE_4K
+#define KM_SIZE_CLASS_COUNT         13
+
+//
+// Per-CPU object caches. Every CPU keeps two magazines for every size class and exchanges full and empty magazines
+// with a global depot only when both are exhausted.
+//
+#define KM_MAGAZINE_ROUNDS          14      // a magazine fits exactly in a 128 bytes object
+
+typedef struct _KM_MAGAZINE
+{
+    struct _KM_MAGAZINE *   Next;           // link in the depot
+    DWORD                   Rounds;
+    DWORD                   _Reserved;
+    PVOID                   Objects[KM_MAGAZINE_ROUNDS];
+} KM_MAGAZINE, *PKM_MAGAZINE;
+
+typedef struct _KM_CPU_CACHE
+{
+    PKM_MAGAZINE            Loaded;
+    PKM_MAGAZINE            Previous;
+    QWORD                   Allocs;         // served from the magazines
+    QWORD                   Frees;          // absorbed by the magazines
+} KM_CPU_CACHE, *PKM_CPU_CACHE;
+
+//
+// Named object caches. The constructor runs when a slab is created and the destructor when it is released, so
+// objects stay in their constructed state while cached: KmCacheFreeAndNull must be given an object in that state.
+// Neither runs under a slab lock: the constructor runs in the context of KmCacheAlloc, the destructor in the context
+// of KmCacheFreeAndNull or KmCacheDestroy, so they may allocate or block whenever their caller could.
+//
+typedef struct _KM_CACHE KM_CACHE, *PKM_CACHE;
+
+typedef VOID(*PFN_KmObjectCallback)(_Inout_ PVOID Object, _In_opt_ PVOID Context);
+
+NTSTATUS
+KmInit(
+    VOID
+);
+
+NTSTATUS
+KmAlloc(
+    _In_ DWORD Size,
+    _In_ DWORD Tag,                                 // MM_TAG, the size of the object is charged to it
+    _Out_ PVOID *Ptr
+);
+
+NTSTATUS
+KmFreeAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag                                  // must be the one given to KmAlloc
+);
+
+NTSTATUS
+KmCacheCreate(
+    _In_ PCHAR Name,                                // must outlive the cache
+    _In_ DWORD Tag,                                 // every object of the cache is charged to it
+    _In_ DWORD ObjectSize,
+    _In_opt_ PFN_KmObjectCallback Constructor,
+    _In_opt_ PFN_KmObjectCallback Destructor,
+    _In_opt_ PVOID Context,                         // passed to the constructor and destructor
+    _Out_ PKM_CACHE *Cache
+);
+
+NTSTATUS
+KmCacheDestroy(
+    _Inout_ PKM_CACHE *Cache                        // every object must have been freed
+);
+
+NTSTATUS
+KmCacheAlloc(
+    _In_ PKM_CACHE Cache,
+    _Out_ PVOID *Ptr
+);
+
+NTSTATUS
+KmCacheFreeAndNull(
+    _In_ PKM_CACHE Cache,
+    _Inout_ PVOID *Ptr
+);
+
+// Gives the objects cached in the depot back to their slabs
+VOID
+KmReclaim(
+    VOID
+);
+
+VOID
+KmDumpStatistics(
+    VOID
+);
+
+// Times KmAlloc / KmFreeAndNull pairs on the BSP alone and on all the online CPUs at once
+VOID
+KmBenchmarkThroughput(
+    VOID
+);
+
+#endif // !_SLAB_H_
@@ -0,0 +1,697 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "cpudefs.h"
+#include "smp.h"
+#include "lapic.h"
+#include "acpitables.h"
+#include "virtmemmgr.h"
+#include "pooltag.h"
+#include "timer.h"
+#include "thread.h"
+#include "task.h"
+#include "dpc.h"
+#include "idle.h"
+#include "spinlock.h"
+#include "kernel.h"
+#include "panic.h"
+#include "log.h"
+
+/*
+
+    Application processor startup.
+    The APs are started one at a time with the INIT-SIPI-SIPI sequence from 'B.4 Multiple-Processor (MP)
+    Initialization Protocol Algorithm for Intel Processors' (Intel docs, volume 3), all of them from the same
+    trampoline page (see apboot.yasm). An AP gets its PCPU and its stack before the IPIs are sent; it loads its own
+    GDT, IDT and TSS with DtrInitAndLoadAll, sets Online and parks itself in _KeIdleLoop. The BSP waits for Online
+    before it reuses the trampoline for the next AP.
+
+    The idle loop is the idle thread of the AP (see KeInitScheduler); it gives the CPU to any thread created there.
+    Parked CPUs sleep in KeIdleWait. Work is handed to them through the work slot of their PCPU, followed by a
+    KeWakeCpu; the same wake up makes them steal the tasks of a KeParallelFor.
+
+    An AP that ran the trampoline but did not come online in time ends the startup: the trampoline and the boot data
+    are shared, the next AP could get them while the stalled one is still using them.
+
+    TLB shootdown. A CPU that unmaps or remaps kernel memory flushes its own TLB, then asks every other online CPU to
+    do the same with an NMI and waits for all of them to acknowledge it before the frames are freed. The memory
+    manager does this while it holds its lock with interrupts disabled, and so may the CPUs it waits for; a fixed
+    vector IPI would never be taken there, an NMI always is. One shootdown is in flight at a time.
+
+*/
+
+extern BYTE gApTrampoline[];
+extern BYTE gApTrampolineEnd[];
+extern BYTE gApBootData[];
+extern BYTE gTempPageTables[];
+
+extern VOID IsrHndIpi(VOID);
+
+extern KGLOBAL gKernelGlobalData;
+
+#define KE_INIT_WAIT_US         10000
+#define KE_SIPI_WAIT_US         200
+#define KE_ONLINE_POLL_US       100
+#define KE_ONLINE_TIMEOUT_US    1000000
+
+// Keep in sync with AP_BOOT_DATA from apboot.yasm!!
+typedef struct _KE_AP_BOOT_DATA
+{
+    QWORD           BootCr3;
+    QWORD           Cr3;
+    QWORD           Cr0;
+    QWORD           Cr4;
+    QWORD           Efer;
+    QWORD           Stack;
+    QWORD           Cpu;
+    QWORD           Entry;
+    volatile QWORD  Started;
+} KE_AP_BOOT_DATA;
+
+#define KE_TLB_FLUSH_ALL_PAGES  64                      // above this many pages a CR3 reload is cheaper
+
+static PPCPU gKeCpus[MAX_CPU_COUNT];
+static volatile DWORD gKeCpuCount;
+
+static KE_TICKET_LOCK gKeTlbLock;
+static volatile QWORD gKeTlbVa;
+static volatile QWORD gKeTlbPages;                      // 0 flushes the whole TLB
+static volatile INT32 gKeTlbPending;                    // the CPUs that did not acknowledge yet
+static volatile BOOLEAN gKeTlbRequested[MAX_CPU_COUNT];
+
+
+VOID
+KeIpiHandler(
+    _In_ PVOID Context
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    // the threads readied by other CPUs; besides that the IPI only ends the wait of the idle loop
+    KeCollectWakes();
+    LapicEoi();
+}
+
+
+VOID
+KeRunQueuedWork(
+    _Inout_ PPCPU Cpu
+)
+{
+    PFN_CpuWorkRoutine routine = Cpu->WorkRoutine;
+
+    if (!routine)
+    {
+        return;
+    }
+
+    routine(Cpu->WorkContext);
+
+    Cpu->WorkContext = NULL;
+    Cpu->WorkRoutine = NULL;
+    Cpu->WorkSequence++;
+    Cpu->WorkBusy = FALSE;
+}
+
+
+static
+VOID
+_KeIdleLoop(
+    _Inout_ PPCPU Cpu
+)
+{
+    while (TRUE)
+    {
+        _disable();
+        if (KeThreadsReady())
+        {
+            _enable();
+            KeYield();
+            continue;
+        }
+
+        if (KeDpcsPending())
+        {
+            KeRetireDpcs();
+            _enable();
+            continue;
+        }
+
+        if (Cpu->WorkRoutine)
+        {
+            _enable();
+            KeRunQueuedWork(Cpu);
+            continue;
+        }
+
+        if (KeTasksPending())
+        {
+            _enable();
+            KeHelpWithTasks();
+            continue;
+        }
+
+        // the wake up that announces new work can't be lost between the check and the wait
+        KeIdleWait(Cpu);
+    }
+}
+
+
+static
+VOID
+_KeApEntry(
+    _Inout_ PPCPU Cpu
+)
+{
+    NTSTATUS status;
+
+    status = DtrInitAndLoadAll(Cpu);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrInitAndLoadAll failed: 0x%08x\n", status);
+        goto _park_forever;
+    }
+
+    status = DtrInstallIrqHandler(LAPIC_IPI_VECTOR, IsrHndIpi);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrInstallIrqHandler failed: 0x%08x\n", status);
+        goto _park_forever;
+    }
+
+    LapicEnable();
+    if (LapicGetId() != Cpu->ApicId)
+    {
+        LogWithInfo("[SMP] CPU %d expected APIC ID %d, got %d\n", Cpu->Number, Cpu->ApicId, LapicGetId());
+    }
+
+    status = KeInitScheduler(TRUE);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeInitScheduler failed: 0x%08x\n", status);
+        goto _park_forever;
+    }
+
+    // without them the CPU gets no ticks, as before
+    status = TmrStartClockEvents();
+    if (!NT_SUCCESS(status) && STATUS_NOT_SUPPORTED != status)
+    {
+        LogWithInfo("[ERROR] TmrStartClockEvents failed: 0x%08x\n", status);
+    }
+
+    Cpu->Online = TRUE;
+    _KeIdleLoop(Cpu);
+
+_park_forever:
+    // never Online, the BSP gives up on us
+    _disable();
+    while (TRUE)
+    {
+        __halt();
+    }
+}
+
+
+static
+NTSTATUS
+_KeStartProcessor(
+    _In_ DWORD ApicId,
+    _Inout_ KE_AP_BOOT_DATA *BootData
+)
+{
+    PPCPU pCpu = NULL;
+    QWORD stackTop = 0;
+    NTSTATUS status;
+
+    status = DtrCreatePcpu(&pCpu);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrCreatePcpu failed: 0x%08x\n", status);
+        return status;
+    }
+
+    // stacks are never freed, a failed AP leaks its one
+    status = MmStackAlloc(KE_AP_STACK_SIZE, &stackTop);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] MmStackAlloc failed: 0x%08x\n", status);
+        goto _cleanup_and_exit;
+    }
+
+    pCpu->ApicId = ApicId;
+    pCpu->Number = gKeCpuCount;
+    pCpu->IsBsp = FALSE;
+    pCpu->StackTop = stackTop;
+
+    BootData->Stack = stackTop;
+    BootData->Cpu = (QWORD)pCpu;
+    BootData->Started = 0;
+
+    status = LapicSendIpi(ApicId, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL_TRIGGER);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] LapicSendIpi failed for INIT: 0x%08x\n", status);
+        goto _cleanup_and_exit;
+    }
+
+    TmrStallExecution(KE_INIT_WAIT_US);
+
+    // the second SIPI is only needed if the first one was lost
+    for (DWORD sipi = 0; sipi < 2 && !BootData->Started; sipi++)
+    {
+        status = LapicSendIpi(ApicId, LAPIC_ICR_STARTUP | (DWORD)(KE_AP_TRAMPOLINE_PA >> 12));
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] LapicSendIpi failed for SIPI: 0x%08x\n", status);
+            goto _cleanup_and_exit;
+        }
+
+        TmrStallExecution(KE_SIPI_WAIT_US);
+    }
+
+    for (DWORD waited = 0; !pCpu->Online && waited < KE_ONLINE_TIMEOUT_US; waited += KE_ONLINE_POLL_US)
+    {
+        TmrStallExecution(KE_ONLINE_POLL_US);
+    }
+
+    if (!pCpu->Online)
+    {
+        LogWithInfo("[SMP] APIC ID %d did not come online (started: %d)\n", ApicId, BootData->Started);
+        status = STATUS_IO_TIMEOUT;
+        goto _cleanup_and_exit;
+    }
+
+    gKeCpus[gKeCpuCount] = pCpu;
+    gKeCpuCount++;
+
+    status = STATUS_SUCCESS;
+
+_cleanup_and_exit:
+    // an AP that ran the trampoline may still be using its PCPU
+    if (!NT_SUCCESS(status) && !BootData->Started)
+    {
+        MmFreeVirtualAndNull((PVOID *)&pCpu, TAG_PCPU);
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+KeStartProcessors(
+    VOID
+)
+{
+    BYTE apicIds[MAX_CPU_COUNT];
+    DWORD count = 0;
+    QWORD lapicPa = 0;
+    QWORD bootCr3 = 0;
+    DWORD pageSize = 0;
+    PPCPU pBsp = GetCurrentCpu();
+    KE_AP_BOOT_DATA *pBootData;
+    NTSTATUS status;
+
+    status = AcpiGetLocalApics(&lapicPa, apicIds, MAX_CPU_COUNT, &count);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] AcpiGetLocalApics failed: 0x%08x\n", status);
+        return status;
+    }
+
+    status = LapicInit(lapicPa);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] LapicInit failed: 0x%08x\n", status);
+        return status;
+    }
+
+    status = DtrInstallIrqHandler(LAPIC_IPI_VECTOR, IsrHndIpi);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrInstallIrqHandler failed: 0x%08x\n", status);
+        return status;
+    }
+
+    LapicEnable();
+
+    // the PIT goes on ticking if the LAPIC timer can't take over
+    status = TmrStartClockEvents();
+    if (!NT_SUCCESS(status) && STATUS_NOT_SUPPORTED != status)
+    {
+        LogWithInfo("[ERROR] TmrStartClockEvents failed: 0x%08x\n", status);
+    }
+
+    pBsp->ApicId = LapicGetId();
+    pBsp->Online = TRUE;
+    gKeCpus[0] = pBsp;
+    gKeCpuCount = 1;
+
+    if ((QWORD)(gApTrampolineEnd - gApTrampoline) > PAGE_SIZE_4K)
+    {
+        LogWithInfo("[ERROR] The AP trampoline doesn't fit in a page: %d bytes\n", gApTrampolineEnd - gApTrampoline);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    // a 32 bit MOV CR3 can't load the kernel PML4 if it is above 4G, so the APs enable paging with the boot tables
+    status = MmTranslateVa(gTempPageTables, &bootCr3, &pageSize);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] MmTranslateVa failed for %018p: 0x%08x\n", gTempPageTables, status);
+        return status;
+    }
+
+    // low memory is identity mapped
+    memcpy((PVOID)KE_AP_TRAMPOLINE_PA, gApTrampoline, (DWORD)(gApTrampolineEnd - gApTrampoline));
+
+    pBootData = (KE_AP_BOOT_DATA *)(KE_AP_TRAMPOLINE_PA + (gApBootData - gApTrampoline));
+    pBootData->BootCr3 = bootCr3;
+    pBootData->Cr3 = __readcr3();
+    pBootData->Cr0 = __readcr0();
+    pBootData->Cr4 = __readcr4();
+    pBootData->Efer = __readmsr(IA32_EFER) & ~(QWORD)IA32_EFER_LMA;
+    pBootData->Entry = (QWORD)_KeApEntry;
+
+    for (DWORD i = 0; i < count; i++)
+    {
+        if (apicIds[i] == pBsp->ApicId)
+        {
+            continue;
+        }
+
+        LogWithInfo("[SMP] Starting APIC ID %d as CPU %d...\n", apicIds[i], gKeCpuCount);
+
+        // keep going, the other APs may still start
+        status = _KeStartProcessor(apicIds[i], pBootData);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _KeStartProcessor failed for APIC ID %d: 0x%08x\n", apicIds[i], status);
+
+            // unless this one ran the trampoline: it may still read the boot data the next AP would get
+            if (pBootData->Started)
+            {
+                LogWithInfo("[SMP] APIC ID %d may still be running, no more APs are started\n", apicIds[i]);
+                break;
+            }
+        }
+    }
+
+    LogWithInfo("[SMP] %d of %d CPUs online\n", gKeCpuCount, count);
+
+    return STATUS_SUCCESS;
+}
+
+
+DWORD
+KeGetCpuCount(
+    VOID
+)
+{
+    return gKeCpuCount;
+}
+
+
+PPCPU
+KeGetCpu(
+    _In_ DWORD Number
+)
+{
+    return Number < gKeCpuCount ? gKeCpus[Number] : NULL;
+}
+
+
+NTSTATUS
+KeRunOnCpu(
+    _In_ DWORD Number,
+    _In_ PFN_CpuWorkRoutine Routine,
+    _In_opt_ PVOID Context,
+    _In_ BOOLEAN Wait
+)
+{
+    PPCPU pCpu;
+    QWORD sequence;
+    NTSTATUS status;
+
+    if (Number >= gKeCpuCount)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Routine)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    pCpu = gKeCpus[Number];
+    if (pCpu == GetCurrentCpu())
+    {
+        Routine(Context);
+        return STATUS_SUCCESS;
+    }
+
+    if (0 != _InterlockedCompareExchange((volatile long *)&pCpu->WorkBusy, TRUE, FALSE))
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    // the slot is ours, the sequence only moves once the routine published below returns
+    sequence = pCpu->WorkSequence;
+    pCpu->WorkContext = Context;
+    _ReadWriteBarrier();
+    pCpu->WorkRoutine = Routine;
+
+    status = KeWakeCpu(pCpu);
+    if (!NT_SUCCESS(status))
+    {
+        // the routine stays queued, the CPU runs it the next time it wakes up
+        LogWithInfo("[ERROR] KeWakeCpu failed for CPU %d: 0x%08x\n", Number, status);
+        return status;
+    }
+
+    while (Wait && sequence == pCpu->WorkSequence)
+    {
+        _mm_pause();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+typedef struct _KE_RUN_TOGETHER
+{
+    PFN_CpuWorkRoutine      Routine;
+    PVOID                   Context;
+    volatile INT32          Arrived;
+    volatile BOOLEAN        Go;
+} KE_RUN_TOGETHER;
+
+
+static
+VOID
+_KeRunTogether(
+    _In_opt_ PVOID Context
+)
+{
+    KE_RUN_TOGETHER *pTogether = (KE_RUN_TOGETHER *)Context;
+
+    // the CPUs that were woken up first wait for the last one
+    _InterlockedIncrement((volatile long *)&pTogether->Arrived);
+    while (!pTogether->Go)
+    {
+        _mm_pause();
+    }
+
+    pTogether->Routine(pTogether->Context);
+}
+
+
+NTSTATUS
+KeRunOnCpus(
+    _In_ DWORD Count,
+    _In_ PFN_CpuWorkRoutine Routine,
+    _In_opt_ PVOID Context
+)
+{
+    KE_RUN_TOGETHER together = { 0 };
+    BOOLEAN started[MAX_CPU_COUNT] = { 0 };
+    PPCPU pCurrent = GetCurrentCpu();
+    BOOLEAN runHere = FALSE;
+    INT32 expected = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    if (!Count || Count > gKeCpuCount)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Routine)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    together.Routine = Routine;
+    together.Context = Context;
+
+    for (DWORD i = 0; i < Count; i++)
+    {
+        NTSTATUS runStatus;
+
+        if (gKeCpus[i] == pCurrent)
+        {
+            runHere = TRUE;
+            continue;
+        }
+
+        // anything but a busy CPU has the routine queued, even if the wake up failed
+        runStatus = KeRunOnCpu(i, _KeRunTogether, &together, FALSE);
+        if (STATUS_DEVICE_BUSY == runStatus)
+        {
+            status = runStatus;
+            continue;
+        }
+
+        started[i] = TRUE;
+        expected++;
+    }
+
+    while (together.Arrived < expected)
+    {
+        _mm_pause();
+    }
+
+    together.Go = TRUE;
+
+    if (runHere)
+    {
+        _KeRunTogether(&together);
+    }
+
+    // the work slot is released once the routine returned, the context on our stack is no longer used then
+    for (DWORD i = 0; i < Count; i++)
+    {
+        while (started[i] && gKeCpus[i]->WorkBusy)
+        {
+            _mm_pause();
+        }
+    }
+
+    return status;
+}
+
+
+static
+VOID
+_KeFlushLocalTlb(
+    _In_ QWORD Va,
+    _In_ QWORD Pages
+)
+{
+    if (!Pages || Pages > KE_TLB_FLUSH_ALL_PAGES)
+    {
+        // the kernel maps nothing global, the reload drops every entry
+        __writecr3(__readcr3());
+        return;
+    }
+
+    for (QWORD i = 0; i < Pages; i++)
+    {
+        __invlpg((PVOID)(Va + i * PAGE_SIZE_4K));
+    }
+}
+
+
+VOID
+KeFlushTlb(
+    _In_ QWORD Va,
+    _In_ QWORD Length
+)
+{
+    PPCPU pCurrent;
+    QWORD pages = 0;
+    QWORD flags;
+    INT32 targets = 0;
+
+    if (Length)
+    {
+        pages = (((Va + Length + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1)) - (Va & ~(PAGE_SIZE_4K - 1))) / PAGE_SIZE_4K;
+        Va &= ~(PAGE_SIZE_4K - 1);
+    }
+
+    _KeFlushLocalTlb(Va, pages);
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || gKeCpuCount < 2)
+    {
+        return;
+    }
+
+    pCurrent = GetCurrentCpu();
+
+    flags = KeAcquireTicketLockIrqSave(&gKeTlbLock);
+
+    gKeTlbVa = Va;
+    gKeTlbPages = pages;
+
+    for (DWORD i = 0; i < gKeCpuCount; i++)
+    {
+        if (gKeCpus[i] != pCurrent && gKeCpus[i]->Online)
+        {
+            gKeTlbRequested[i] = TRUE;
+            targets++;
+        }
+    }
+
+    // published before the first NMI can be taken
+    _InterlockedExchange((volatile long *)&gKeTlbPending, targets);
+
+    for (DWORD i = 0; i < gKeCpuCount; i++)
+    {
+        NTSTATUS status;
+
+        if (!gKeTlbRequested[i])
+        {
+            continue;
+        }
+
+        status = LapicSendIpi(gKeCpus[i]->ApicId, LAPIC_ICR_NMI);
+        if (!NT_SUCCESS(status))
+        {
+            // the frames would be reused under a stale translation
+            LogWithInfo("[ERROR] LapicSendIpi failed for the TLB shootdown of CPU %d: 0x%08x\n", i, status);
+            PANIC("TLB shootdown failed");
+        }
+    }
+
+    while (gKeTlbPending)
+    {
+        _mm_pause();
+    }
+
+    KeReleaseTicketLockIrqRestore(&gKeTlbLock, flags);
+}
+
+
+BOOLEAN
+KeTlbShootdownHandler(
+    VOID
+)
+{
+    DWORD number;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return FALSE;
+    }
+
+    number = GetCurrentCpu()->Number;
+    if (!gKeTlbRequested[number])
+    {
+        return FALSE;
+    }
+
+    _KeFlushLocalTlb(gKeTlbVa, gKeTlbPages);
+
+    gKeTlbRequested[number] = FALSE;
+    _InterlockedDecrement((volatile long *)&gKeTlbPending);
+
+    return TRUE;
+}
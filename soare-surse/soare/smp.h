@@ -0,0 +1,68 @@
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include "dtr.h"
+
+#define KE_AP_TRAMPOLINE_PA     0x8000ULL               // keep in sync with AP_TRAMPOLINE_BASE from apboot.yasm!!
+#define KE_AP_STACK_SIZE        (16 * PAGE_SIZE_4K)
+
+// Starts every enabled processor listed by the MADT; the APs are parked in an idle loop, see KeRunOnCpu
+NTSTATUS
+KeStartProcessors(
+    VOID
+);
+
+// Online CPUs; they are numbered from 0 (the BSP) to KeGetCpuCount() - 1
+DWORD
+KeGetCpuCount(
+    VOID
+);
+
+PPCPU
+KeGetCpu(
+    _In_ DWORD Number
+);
+
+// Runs Routine on an idle CPU (or inline, if Number is the current CPU); STATUS_DEVICE_BUSY if it already has work.
+// The idle thread of the target runs it: on the BSP that is only once the boot thread and every other ready thread
+// there blocked, until then a waiting caller waits as well
+NTSTATUS
+KeRunOnCpu(
+    _In_ DWORD Number,
+    _In_ PFN_CpuWorkRoutine Routine,
+    _In_opt_ PVOID Context,
+    _In_ BOOLEAN Wait                   // return only after Routine returned
+);
+
+// Runs Routine on CPUs 0 to Count - 1 at once (the current one included, if it is among them) and returns after all
+// of them returned; the ones that already have work are skipped, with STATUS_DEVICE_BUSY. Started from an AP, it
+// waits for the BSP to go idle, see KeRunOnCpu
+NTSTATUS
+KeRunOnCpus(
+    _In_ DWORD Count,
+    _In_ PFN_CpuWorkRoutine Routine,
+    _In_opt_ PVOID Context
+);
+
+// Runs the routine queued in the work slot of Cpu, the current one, and releases the slot; for the idle threads
+VOID
+KeRunQueuedWork(
+    _Inout_ PPCPU Cpu
+);
+
+// Invalidates [Va, Va + Length) in the TLB of every online CPU and returns once all of them did; a Length of 0
+// flushes the whole TLB. Sent as an NMI, so it also gets through to the CPUs that spin with interrupts disabled.
+// Frames that were mapped in the range can be reused only after it returned.
+VOID
+KeFlushTlb(
+    _In_ QWORD Va,
+    _In_ QWORD Length
+);
+
+// Called by the NMI handler; FALSE if the NMI was not a TLB shootdown
+BOOLEAN
+KeTlbShootdownHandler(
+    VOID
+);
+
+#endif // !_SMP_H_
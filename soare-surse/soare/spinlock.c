@@ -0,0 +1,291 @@
+#include "defs.h"
+#include "ntstatus.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "log.h"
+
+/*
+
+    Spinlocks.
+    Both kinds hand the lock over in the order it was asked for. A ticket lock is two counters: an acquire takes the
+    next ticket and waits until Owner reaches it, a release moves Owner. Cheap, but every waiter polls Owner, so each
+    release invalidates the line in the cache of every waiting CPU.
+
+    An MCS lock is a queue of nodes, one per waiter: an acquire swaps its node into Tail and waits on its own node
+    until the previous owner clears Waiting; a release hands the lock to the next node, or empties the queue with a
+    CAS on Tail if nobody is waiting. Only one CPU is touched by a release, however many are waiting.
+
+    x86 doesn't reorder stores with older stores or loads with older loads, so a compiler barrier in front of the
+    releasing store is all that keeps the critical section inside the lock.
+
+*/
+
+
+VOID
+KeInitializeTicketLock(
+    _Out_ KE_TICKET_LOCK *Lock
+)
+{
+    Lock->Next = 0;
+    Lock->Owner = 0;
+}
+
+
+VOID
+KeAcquireTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+)
+{
+    DWORD ticket = (DWORD)_InterlockedExchangeAdd((volatile long *)&Lock->Next, 1);
+
+    while (Lock->Owner != ticket)
+    {
+        _mm_pause();
+    }
+}
+
+
+BOOLEAN
+KeTryAcquireTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+)
+{
+    DWORD owner = Lock->Owner;
+
+    // only if nobody holds it or waits for it
+    return (long)owner == _InterlockedCompareExchange((volatile long *)&Lock->Next, owner + 1, owner);
+}
+
+
+VOID
+KeReleaseTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+)
+{
+    _ReadWriteBarrier();
+    Lock->Owner = Lock->Owner + 1;
+}
+
+
+QWORD
+KeAcquireTicketLockIrqSave(
+    _Inout_ KE_TICKET_LOCK *Lock
+)
+{
+    QWORD flags = __readeflags();
+
+    _disable();
+    KeAcquireTicketLock(Lock);
+
+    return flags;
+}
+
+
+VOID
+KeReleaseTicketLockIrqRestore(
+    _Inout_ KE_TICKET_LOCK *Lock,
+    _In_ QWORD Flags
+)
+{
+    KeReleaseTicketLock(Lock);
+    __writeeflags(Flags);
+}
+
+
+VOID
+KeInitializeMcsLock(
+    _Out_ KE_MCS_LOCK *Lock
+)
+{
+    Lock->Tail = NULL;
+}
+
+
+VOID
+KeAcquireMcsLock(
+    _Inout_ KE_MCS_LOCK *Lock,
+    _Out_ KE_MCS_HANDLE *Handle
+)
+{
+    KE_MCS_NODE *pPrevious;
+
+    Handle->Lock = Lock;
+    Handle->Node.Next = NULL;
+    Handle->Node.Waiting = TRUE;
+
+    pPrevious = (KE_MCS_NODE *)_InterlockedExchangePointer((PVOID volatile *)&Lock->Tail, &Handle->Node);
+    if (!pPrevious)
+    {
+        return;
+    }
+
+    // queued behind pPrevious, it clears Waiting when it releases the lock
+    pPrevious->Next = &Handle->Node;
+    while (Handle->Node.Waiting)
+    {
+        _mm_pause();
+    }
+}
+
+
+VOID
+KeReleaseMcsLock(
+    _Inout_ KE_MCS_HANDLE *Handle
+)
+{
+    KE_MCS_NODE *pNode = &Handle->Node;
+
+    _ReadWriteBarrier();
+
+    if (!pNode->Next)
+    {
+        // nobody is queued, unless someone swapped Tail and didn't link itself yet
+        if (pNode == _InterlockedCompareExchangePointer((PVOID volatile *)&Handle->Lock->Tail, NULL, pNode))
+        {
+            return;
+        }
+
+        while (!pNode->Next)
+        {
+            _mm_pause();
+        }
+    }
+
+    pNode->Next->Waiting = FALSE;
+}
+
+
+VOID
+KeAcquireMcsLockIrqSave(
+    _Inout_ KE_MCS_LOCK *Lock,
+    _Out_ KE_MCS_HANDLE *Handle
+)
+{
+    QWORD flags = __readeflags();
+
+    _disable();
+    KeAcquireMcsLock(Lock, Handle);
+
+    Handle->Flags = flags;
+}
+
+
+VOID
+KeReleaseMcsLockIrqRestore(
+    _Inout_ KE_MCS_HANDLE *Handle
+)
+{
+    QWORD flags = Handle->Flags;
+
+    KeReleaseMcsLock(Handle);
+    __writeeflags(flags);
+}
+
+
+//
+// Contention benchmark
+//
+// 1, 2, 4, ... and then all the online CPUs acquire the same lock KE_LOCK_BENCH_ACQUIRES times each, with a critical
+// section of one increment, once as a ticket lock and once as an MCS lock. Past a few CPUs the ticket lock should
+// fall behind, every release of it is a miss for each waiter.
+//
+#define KE_LOCK_BENCH_ACQUIRES  16384
+
+typedef struct _KE_LOCK_BENCH_CONTEXT
+{
+    BOOLEAN                 Mcs;
+    KE_TICKET_LOCK          TicketLock;
+    KE_MCS_LOCK             McsLock;
+    volatile QWORD          Counter;        // guarded by the lock under test
+    volatile QWORD          Cycles[MAX_CPU_COUNT];
+} KE_LOCK_BENCH_CONTEXT;
+
+
+static
+VOID
+_KeLockBenchWorker(
+    _In_opt_ PVOID Context
+)
+{
+    KE_LOCK_BENCH_CONTEXT *pCtx = (KE_LOCK_BENCH_CONTEXT *)Context;
+    QWORD start = __rdtsc();
+
+    for (DWORD i = 0; i < KE_LOCK_BENCH_ACQUIRES; i++)
+    {
+        if (pCtx->Mcs)
+        {
+            KE_MCS_HANDLE handle;
+
+            KeAcquireMcsLockIrqSave(&pCtx->McsLock, &handle);
+            pCtx->Counter++;
+            KeReleaseMcsLockIrqRestore(&handle);
+        }
+        else
+        {
+            QWORD flags = KeAcquireTicketLockIrqSave(&pCtx->TicketLock);
+            pCtx->Counter++;
+            KeReleaseTicketLockIrqRestore(&pCtx->TicketLock, flags);
+        }
+    }
+
+    pCtx->Cycles[GetCurrentCpu()->Number] = __rdtsc() - start;
+}
+
+
+VOID
+KeBenchmarkSpinlocks(
+    VOID
+)
+{
+    DWORD total = KeGetCpuCount();
+    DWORD cpus = 1;
+
+    if (!total)
+    {
+        NLog("[SPINLOCK] Contention benchmark skipped, the CPUs were not started\n");
+        return;
+    }
+
+    for (;;)
+    {
+        for (DWORD mcs = 0; mcs < 2; mcs++)
+        {
+            KE_LOCK_BENCH_CONTEXT ctx = { 0 };
+            QWORD slowest = 0;
+            QWORD sum = 0;
+            NTSTATUS status;
+
+            ctx.Mcs = (BOOLEAN)mcs;
+
+            status = KeRunOnCpus(cpus, _KeLockBenchWorker, &ctx);
+            if (!NT_SUCCESS(status))
+            {
+                LogWithInfo("[ERROR] KeRunOnCpus failed for %d CPUs: 0x%08x\n", cpus, status);
+                return;
+            }
+
+            if (ctx.Counter != (QWORD)cpus * KE_LOCK_BENCH_ACQUIRES)
+            {
+                LogWithInfo("[ERROR] %s lock: counted %d acquires instead of %d\n", mcs ? "MCS" : "Ticket",
+                    ctx.Counter, cpus * KE_LOCK_BENCH_ACQUIRES);
+            }
+
+            for (DWORD cpu = 0; cpu < cpus; cpu++)
+            {
+                slowest = MAX(slowest, ctx.Cycles[cpu]);
+                sum += ctx.Cycles[cpu];
+            }
+
+            NLog("[SPINLOCK] %2d CPUs, %-6s: %d cycles per acquire/release on each CPU, %d per million cycles\n",
+                cpus, mcs ? "MCS" : "ticket", sum / ((QWORD)cpus * KE_LOCK_BENCH_ACQUIRES),
+                (QWORD)cpus * KE_LOCK_BENCH_ACQUIRES * 1000000 / MAX(slowest, 1));
+        }
+
+        if (cpus == total)
+        {
+            break;
+        }
+
+        cpus = MIN(cpus * 2, total);
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include "defs.h"
+
+//
+// Spinlocks. Every lock is unlocked when zeroed, so the static ones need no initialization.
+// A lock that is also taken by an IRQ handler must be taken with the IrqSave variant everywhere else, or the handler
+// spins forever on the CPU that holds it.
+//
+
+// FIFO ticket lock: every waiter spins on the same line; for short critical sections that are rarely contended
+typedef struct _KE_TICKET_LOCK
+{
+    volatile DWORD          Next;           // the ticket of the next CPU that asks for the lock
+    volatile DWORD          Owner;          // the ticket being served
+} KE_TICKET_LOCK;
+
+// MCS queue lock: every waiter spins on its own node, so a contended lock doesn't bounce one line between them all
+typedef struct _KE_MCS_NODE
+{
+    struct _KE_MCS_NODE * volatile  Next;
+    volatile BOOLEAN                Waiting;
+} KE_MCS_NODE;
+
+typedef struct _KE_MCS_LOCK
+{
+    KE_MCS_NODE * volatile  Tail;           // the last waiter, NULL if the lock is free
+} KE_MCS_LOCK;
+
+// Kept by the owner (usually on its stack) from the acquire to the release
+typedef struct _KE_MCS_HANDLE
+{
+    KE_MCS_NODE             Node;
+    KE_MCS_LOCK *           Lock;
+    QWORD                   Flags;          // RFLAGS saved by the IrqSave variant
+} KE_MCS_HANDLE;
+
+VOID
+KeInitializeTicketLock(
+    _Out_ KE_TICKET_LOCK *Lock
+);
+
+VOID
+KeAcquireTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+);
+
+BOOLEAN
+KeTryAcquireTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+);
+
+VOID
+KeReleaseTicketLock(
+    _Inout_ KE_TICKET_LOCK *Lock
+);
+
+// Disables the interrupts and returns the RFLAGS to give to KeReleaseTicketLockIrqRestore
+QWORD
+KeAcquireTicketLockIrqSave(
+    _Inout_ KE_TICKET_LOCK *Lock
+);
+
+VOID
+KeReleaseTicketLockIrqRestore(
+    _Inout_ KE_TICKET_LOCK *Lock,
+    _In_ QWORD Flags
+);
+
+VOID
+KeInitializeMcsLock(
+    _Out_ KE_MCS_LOCK *Lock
+);
+
+VOID
+KeAcquireMcsLock(
+    _Inout_ KE_MCS_LOCK *Lock,
+    _Out_ KE_MCS_HANDLE *Handle
+);
+
+VOID
+KeReleaseMcsLock(
+    _Inout_ KE_MCS_HANDLE *Handle
+);
+
+VOID
+KeAcquireMcsLockIrqSave(
+    _Inout_ KE_MCS_LOCK *Lock,
+    _Out_ KE_MCS_HANDLE *Handle
+);
+
+VOID
+KeReleaseMcsLockIrqRestore(
+    _Inout_ KE_MCS_HANDLE *Handle
+);
+
+// Boot time benchmark: ticket vs MCS acquires of one contended lock, up to all the online CPUs
+VOID
+KeBenchmarkSpinlocks(
+    VOID
+);
+
+#endif // !_SPINLOCK_H_
@@ -0,0 +1,372 @@
+#include "defs.h"
+#include "ntstatus.h"
+#include "sync.h"
+#include "thread.h"
+#include "dtr.h"
+#include "cpudefs.h"
+#include "idle.h"
+#include "kernel.h"
+#include "log.h"
+
+/*
+
+    Wait objects.
+    Every object has a ticket lock (taken with interrupts disabled, the IRQ handlers signal them) and a FIFO list of
+    wait blocks. A signal never lets the waiters race for the object: it takes the wait block out of the list and
+    hands it what it waited for (an event, a unit of the semaphore, the mutex) under the lock, then wakes it up
+    once the lock is released. The waiter only has to check Satisfied, it never tries again.
+
+    A waiter that can block marks itself ktsBlocked and switches away before it enables the interrupts, so it can't
+    miss its wake up. One that can't block halts with interrupts enabled and looks at Satisfied after every interrupt;
+    a signal from another CPU wakes it up with KeWakeCpu.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+VOID HwEnableAndHalt(VOID);
+
+
+// Called with the lock of the object held and interrupts disabled; Flags are the RFLAGS from before the lock.
+// Returns once the object was handed over, with the lock released and the RFLAGS restored.
+static
+VOID
+_KeWait(
+    _Inout_ KE_TICKET_LOCK *Lock,
+    _In_ QWORD Flags,
+    _Inout_ PLIST_ENTRY Waiters,
+    _In_ BOOLEAN CanBlock,
+    _Out_ KE_WAIT_BLOCK *WaitBlock
+)
+{
+    WaitBlock->Thread = KeGetCurrentThread();
+    WaitBlock->Cpu = gKernelGlobalData.Phase >= KE_PHASE_PCPU_READY ? GetCurrentCpu() : NULL;
+    WaitBlock->Blocked = CanBlock;
+    WaitBlock->Satisfied = FALSE;
+    InsertTailList(Waiters, &WaitBlock->Link);
+
+    KeReleaseTicketLock(Lock);
+
+    if (CanBlock)
+    {
+        // the signaler readies us only after it set Satisfied
+        KeBlockCurrentThread();
+    }
+    else if (Flags & RFLAGS_IF)
+    {
+        while (!WaitBlock->Satisfied)
+        {
+            HwEnableAndHalt();
+            _disable();
+        }
+    }
+    else
+    {
+        // a caller with interrupts disabled can't be woken up by anything, it can only poll
+        while (!WaitBlock->Satisfied)
+        {
+            _mm_pause();
+        }
+    }
+
+    __writeeflags(Flags);
+}
+
+
+static
+VOID
+_KeUnwait(
+    _Inout_ KE_WAIT_BLOCK *WaitBlock
+)
+{
+    PKTHREAD pThread = WaitBlock->Thread;
+    PPCPU pCpu = WaitBlock->Cpu;
+    BOOLEAN blocked = WaitBlock->Blocked;
+    NTSTATUS status;
+
+    // a halting waiter may return as soon as it sees Satisfied, and the wait block goes away with its stack
+    _ReadWriteBarrier();
+    WaitBlock->Satisfied = TRUE;
+
+    if (blocked)
+    {
+        KeReadyThread(pThread);
+        return;
+    }
+
+    if (!pCpu || gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || pCpu == GetCurrentCpu())
+    {
+        return;
+    }
+
+    status = KeWakeCpu(pCpu);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeWakeCpu failed for CPU %d: 0x%08x\n", pCpu->Number, status);
+    }
+}
+
+
+// The wait blocks taken out of an object, once its lock is released
+static
+VOID
+_KeUnwaitList(
+    _Inout_ PLIST_ENTRY List
+)
+{
+    while (!IsListEmpty(List))
+    {
+        _KeUnwait(CONTAINING_RECORD(RemoveHeadList(List), KE_WAIT_BLOCK, Link));
+    }
+}
+
+
+VOID
+KeInitializeEvent(
+    _Out_ PKEVENT Event,
+    _In_ KEVENT_TYPE Type,
+    _In_ BOOLEAN Signaled
+)
+{
+    KeInitializeTicketLock(&Event->Lock);
+    Event->Type = (BYTE)Type;
+    Event->Signaled = Signaled;
+    InitializeListHead(&Event->Waiters);
+}
+
+
+VOID
+KeSetEvent(
+    _Inout_ PKEVENT Event
+)
+{
+    LIST_ENTRY ready;
+    QWORD flags;
+
+    InitializeListHead(&ready);
+
+    flags = KeAcquireTicketLockIrqSave(&Event->Lock);
+
+    if (ketNotification == Event->Type)
+    {
+        Event->Signaled = TRUE;
+
+        while (!IsListEmpty(&Event->Waiters))
+        {
+            InsertTailList(&ready, RemoveHeadList(&Event->Waiters));
+        }
+    }
+    else if (!IsListEmpty(&Event->Waiters))
+    {
+        // the signal goes to the first waiter, the event stays reset
+        InsertTailList(&ready, RemoveHeadList(&Event->Waiters));
+    }
+    else
+    {
+        Event->Signaled = TRUE;
+    }
+
+    KeReleaseTicketLockIrqRestore(&Event->Lock, flags);
+
+    _KeUnwaitList(&ready);
+}
+
+
+VOID
+KeResetEvent(
+    _Inout_ PKEVENT Event
+)
+{
+    QWORD flags = KeAcquireTicketLockIrqSave(&Event->Lock);
+
+    Event->Signaled = FALSE;
+
+    KeReleaseTicketLockIrqRestore(&Event->Lock, flags);
+}
+
+
+VOID
+KeWaitForEvent(
+    _Inout_ PKEVENT Event
+)
+{
+    KE_WAIT_BLOCK waitBlock;
+    BOOLEAN canBlock = KeCanBlock();
+    QWORD flags = KeAcquireTicketLockIrqSave(&Event->Lock);
+
+    if (Event->Signaled)
+    {
+        if (ketSynchronization == Event->Type)
+        {
+            Event->Signaled = FALSE;
+        }
+
+        KeReleaseTicketLockIrqRestore(&Event->Lock, flags);
+        return;
+    }
+
+    _KeWait(&Event->Lock, flags, &Event->Waiters, canBlock, &waitBlock);
+}
+
+
+VOID
+KeInitializeSemaphore(
+    _Out_ PKSEMAPHORE Semaphore,
+    _In_ INT32 Count,
+    _In_ INT32 Limit
+)
+{
+    KeInitializeTicketLock(&Semaphore->Lock);
+    Semaphore->Count = Count;
+    Semaphore->Limit = Limit;
+    InitializeListHead(&Semaphore->Waiters);
+}
+
+
+NTSTATUS
+KeReleaseSemaphore(
+    _Inout_ PKSEMAPHORE Semaphore,
+    _In_ INT32 Count
+)
+{
+    LIST_ENTRY ready;
+    QWORD flags;
+
+    if (Count <= 0)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    InitializeListHead(&ready);
+
+    flags = KeAcquireTicketLockIrqSave(&Semaphore->Lock);
+
+    if (Count > Semaphore->Limit - Semaphore->Count)
+    {
+        KeReleaseTicketLockIrqRestore(&Semaphore->Lock, flags);
+        return STATUS_SEMAPHORE_LIMIT_EXCEEDED;
+    }
+
+    // the waiters only exist while Count is 0
+    while (Count && !IsListEmpty(&Semaphore->Waiters))
+    {
+        InsertTailList(&ready, RemoveHeadList(&Semaphore->Waiters));
+        Count--;
+    }
+
+    Semaphore->Count += Count;
+
+    KeReleaseTicketLockIrqRestore(&Semaphore->Lock, flags);
+
+    _KeUnwaitList(&ready);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+KeWaitForSemaphore(
+    _Inout_ PKSEMAPHORE Semaphore
+)
+{
+    KE_WAIT_BLOCK waitBlock;
+    BOOLEAN canBlock = KeCanBlock();
+    QWORD flags = KeAcquireTicketLockIrqSave(&Semaphore->Lock);
+
+    if (Semaphore->Count > 0)
+    {
+        Semaphore->Count--;
+
+        KeReleaseTicketLockIrqRestore(&Semaphore->Lock, flags);
+        return;
+    }
+
+    _KeWait(&Semaphore->Lock, flags, &Semaphore->Waiters, canBlock, &waitBlock);
+}
+
+
+VOID
+KeInitializeMutex(
+    _Out_ PKMUTEX Mutex
+)
+{
+    KeInitializeTicketLock(&Mutex->Lock);
+    Mutex->Owner = NULL;
+    Mutex->Recursion = 0;
+    InitializeListHead(&Mutex->Waiters);
+}
+
+
+NTSTATUS
+KeAcquireMutex(
+    _Inout_ PKMUTEX Mutex
+)
+{
+    KE_WAIT_BLOCK waitBlock;
+    PKTHREAD pCurrent = KeGetCurrentThread();
+    BOOLEAN canBlock = KeCanBlock();
+    QWORD flags;
+
+    // the owner is a thread
+    if (!pCurrent)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    flags = KeAcquireTicketLockIrqSave(&Mutex->Lock);
+
+    if (!Mutex->Owner || pCurrent == Mutex->Owner)
+    {
+        Mutex->Owner = pCurrent;
+        Mutex->Recursion++;
+
+        KeReleaseTicketLockIrqRestore(&Mutex->Lock, flags);
+        return STATUS_SUCCESS;
+    }
+
+    // KeReleaseMutex makes us the owner before it wakes us up
+    _KeWait(&Mutex->Lock, flags, &Mutex->Waiters, canBlock, &waitBlock);
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+KeReleaseMutex(
+    _Inout_ PKMUTEX Mutex
+)
+{
+    LIST_ENTRY ready;
+    QWORD flags;
+
+    InitializeListHead(&ready);
+
+    flags = KeAcquireTicketLockIrqSave(&Mutex->Lock);
+
+    if (!Mutex->Owner || KeGetCurrentThread() != Mutex->Owner)
+    {
+        KeReleaseTicketLockIrqRestore(&Mutex->Lock, flags);
+        return STATUS_MUTANT_NOT_OWNED;
+    }
+
+    Mutex->Recursion--;
+    if (!Mutex->Recursion)
+    {
+        Mutex->Owner = NULL;
+
+        if (!IsListEmpty(&Mutex->Waiters))
+        {
+            KE_WAIT_BLOCK *pWaitBlock = CONTAINING_RECORD(RemoveHeadList(&Mutex->Waiters), KE_WAIT_BLOCK, Link);
+
+            Mutex->Owner = pWaitBlock->Thread;
+            Mutex->Recursion = 1;
+            InsertTailList(&ready, &pWaitBlock->Link);
+        }
+    }
+
+    KeReleaseTicketLockIrqRestore(&Mutex->Lock, flags);
+
+    _KeUnwaitList(&ready);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+#include "defs.h"
+#include "winlists.h"
+#include "spinlock.h"
+
+//
+// Wait objects. A thread that has to wait is blocked and the CPU goes on with other threads (or halts in its idle
+// thread); whoever can't block (the idle thread, the boot flow before the scheduler) halts until it is signaled.
+// Signaling is allowed from anywhere, IRQ handlers and DPCs included; waiting only from where interrupts are enabled.
+//
+
+struct _KTHREAD;
+struct _PCPU;
+
+// On the stack of the waiter, in the wait list of the object until the object is handed over to it
+typedef struct _KE_WAIT_BLOCK
+{
+    LIST_ENTRY              Link;
+    struct _KTHREAD *       Thread;         // NULL before the scheduler runs
+    struct _PCPU *          Cpu;            // NULL before the PCPU is ready
+    BOOLEAN                 Blocked;        // else the waiter halts until Satisfied is set
+    volatile BOOLEAN        Satisfied;
+} KE_WAIT_BLOCK;
+
+typedef enum _KEVENT_TYPE
+{
+    ketNotification = 0,        // stays signaled and releases every waiter, until it is reset
+    ketSynchronization,         // releases one waiter and resets itself
+} KEVENT_TYPE;
+
+typedef struct _KEVENT
+{
+    KE_TICKET_LOCK          Lock;
+    BYTE                    Type;           // KEVENT_TYPE
+    volatile BOOLEAN        Signaled;
+    LIST_ENTRY              Waiters;
+} KEVENT, *PKEVENT;
+
+typedef struct _KSEMAPHORE
+{
+    KE_TICKET_LOCK          Lock;
+    volatile INT32          Count;
+    INT32                   Limit;
+    LIST_ENTRY              Waiters;
+} KSEMAPHORE, *PKSEMAPHORE;
+
+// Owned by a thread, which may acquire it again; handed to the first waiter when released
+typedef struct _KMUTEX
+{
+    KE_TICKET_LOCK          Lock;
+    struct _KTHREAD *       Owner;
+    DWORD                   Recursion;
+    LIST_ENTRY              Waiters;
+} KMUTEX, *PKMUTEX;
+
+VOID
+KeInitializeEvent(
+    _Out_ PKEVENT Event,
+    _In_ KEVENT_TYPE Type,
+    _In_ BOOLEAN Signaled
+);
+
+VOID
+KeSetEvent(
+    _Inout_ PKEVENT Event
+);
+
+VOID
+KeResetEvent(
+    _Inout_ PKEVENT Event
+);
+
+VOID
+KeWaitForEvent(
+    _Inout_ PKEVENT Event
+);
+
+VOID
+KeInitializeSemaphore(
+    _Out_ PKSEMAPHORE Semaphore,
+    _In_ INT32 Count,
+    _In_ INT32 Limit
+);
+
+// Hands Count units to the waiters, in order, and keeps the rest; fails if the count would go over the limit
+NTSTATUS
+KeReleaseSemaphore(
+    _Inout_ PKSEMAPHORE Semaphore,
+    _In_ INT32 Count
+);
+
+VOID
+KeWaitForSemaphore(
+    _Inout_ PKSEMAPHORE Semaphore
+);
+
+VOID
+KeInitializeMutex(
+    _Out_ PKMUTEX Mutex
+);
+
+NTSTATUS
+KeAcquireMutex(
+    _Inout_ PKMUTEX Mutex
+);
+
+NTSTATUS
+KeReleaseMutex(
+    _Inout_ PKMUTEX Mutex
+);
+
+#endif // !_SYNC_H_
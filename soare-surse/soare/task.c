@@ -0,0 +1,487 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "task.h"
+#include "dtr.h"
+#include "smp.h"
+#include "idle.h"
+#include "kernel.h"
+#include "virtmemmgr.h"
+#include "pooltag.h"
+#include "log.h"
+
+/*
+
+    Work stealing.
+    The deques follow 'Dynamic Circular Work-Stealing Deque' (Chase, Lev) with a fixed size buffer: a full deque
+    makes the owner run the range itself instead of splitting it further. The owner works on its deque with
+    interrupts disabled, so two threads of the same CPU can't interleave their pushes and pops.
+
+    x86 keeps stores in order and loads in order, so the only fence needed is the one between the store to Bottom
+    and the load of Top in _KeTaskPop. A thief reads a task before it claims it with the CAS on Top; a torn read is
+    only possible if the owner reused the slot, and then Top moved and the CAS fails.
+
+    A job lives on the stack of its KeParallelFor. Remaining counts the indexes not yet done; decrementing it is the
+    last thing a CPU does with the job, so the job can go away as soon as it reaches 0.
+
+    While a job is in progress the idle CPUs keep stealing; when the last one ends they halt again. Only the CPUs
+    numbered below gKeTaskWorkers take part, which lets KeBenchmarkTasks measure how the jobs scale.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+typedef struct _KE_TASK_JOB
+{
+    PFN_KeTaskRoutine       Routine;
+    PVOID                   Context;
+    QWORD                   Grain;
+    volatile INT64          Remaining;
+} KE_TASK_JOB;
+
+static volatile long gKeTaskJobs;       // KeParallelFor calls in progress
+static volatile DWORD gKeTaskWorkers = MAX_CPU_COUNT;
+
+#define KE_TASK_BENCH_INDEXES   4096
+#define KE_TASK_BENCH_GRAIN     8
+#define KE_TASK_BENCH_ROUNDS    2048        // xorshift rounds per index
+#define KE_TASK_BENCH_COPY_SIZE (32 * ONE_MB)  // copied from one half to the other, well past the last level cache
+#define KE_TASK_BENCH_SLICE     (KE_TASK_BENCH_COPY_SIZE / 2 / KE_TASK_BENCH_INDEXES)
+
+
+static
+BOOLEAN
+_KeTaskPush(
+    _Inout_ KE_TASK_DEQUE *Deque,
+    _In_ KE_TASK_JOB *Job,
+    _In_ QWORD Begin,
+    _In_ QWORD End
+)
+{
+    INT64 bottom = Deque->Bottom;
+    INT64 top = Deque->Top;
+    KE_TASK *pTask;
+
+    if (bottom - top >= KE_TASK_DEQUE_SIZE)
+    {
+        return FALSE;
+    }
+
+    pTask = &Deque->Tasks[bottom & (KE_TASK_DEQUE_SIZE - 1)];
+    pTask->Job = Job;
+    pTask->Begin = Begin;
+    pTask->End = End;
+
+    // the task must be written before a thief can see it
+    _ReadWriteBarrier();
+    Deque->Bottom = bottom + 1;
+
+    return TRUE;
+}
+
+
+static
+BOOLEAN
+_KeTaskPop(
+    _Inout_ KE_TASK_DEQUE *Deque,
+    _Out_ KE_TASK *Task
+)
+{
+    INT64 bottom;
+    INT64 top;
+    BOOLEAN found = FALSE;
+    QWORD flags = __readeflags();
+
+    _disable();
+
+    bottom = Deque->Bottom - 1;
+    Deque->Bottom = bottom;
+
+    // a store may pass a later load, the thieves must see the smaller Bottom before we look at Top
+    _mm_mfence();
+    top = Deque->Top;
+
+    if (top <= bottom)
+    {
+        *Task = Deque->Tasks[bottom & (KE_TASK_DEQUE_SIZE - 1)];
+        found = TRUE;
+
+        if (top == bottom)
+        {
+            // the last task, race the thieves for it
+            found = (top == _InterlockedCompareExchange64(&Deque->Top, top + 1, top));
+            Deque->Bottom = bottom + 1;
+        }
+    }
+    else
+    {
+        Deque->Bottom = bottom + 1;
+    }
+
+    __writeeflags(flags);
+
+    return found;
+}
+
+
+static
+BOOLEAN
+_KeTaskSteal(
+    _Inout_ KE_TASK_DEQUE *Deque,
+    _Out_ KE_TASK *Task
+)
+{
+    INT64 top = Deque->Top;
+    INT64 bottom;
+
+    _ReadWriteBarrier();
+    bottom = Deque->Bottom;
+
+    if (top >= bottom)
+    {
+        return FALSE;
+    }
+
+    *Task = Deque->Tasks[top & (KE_TASK_DEQUE_SIZE - 1)];
+
+    return top == _InterlockedCompareExchange64(&Deque->Top, top + 1, top);
+}
+
+
+static
+BOOLEAN
+_KeTaskStealAny(
+    _Inout_ PPCPU Cpu,
+    _Out_ KE_TASK *Task
+)
+{
+    DWORD count = KeGetCpuCount();
+    QWORD x = Cpu->TaskDeque.Seed ? Cpu->TaskDeque.Seed : (__rdtsc() | 1);
+    DWORD first;
+
+    if (count < 2)
+    {
+        return FALSE;
+    }
+
+    // xorshift64; a random first victim keeps the thieves from all going after the same CPU
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    Cpu->TaskDeque.Seed = x;
+
+    first = (DWORD)(x % count);
+    for (DWORD i = 0; i < count; i++)
+    {
+        PPCPU pVictim = KeGetCpu((first + i) % count);
+
+        if (!pVictim || pVictim == Cpu)
+        {
+            continue;
+        }
+
+        if (_KeTaskSteal(&pVictim->TaskDeque, Task))
+        {
+            Cpu->TaskDeque.Stolen++;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+static
+VOID
+_KeTaskRun(
+    _Inout_ PPCPU Cpu,
+    _In_ const KE_TASK *Task
+)
+{
+    KE_TASK_JOB *pJob = Task->Job;
+    QWORD begin = Task->Begin;
+    QWORD end = Task->End;
+
+    // keep the lowest piece, the upper halves are there for the thieves
+    while (end - begin > pJob->Grain)
+    {
+        QWORD middle = begin + (end - begin) / 2;
+        QWORD flags = __readeflags();
+        BOOLEAN pushed;
+
+        _disable();
+        pushed = _KeTaskPush(&Cpu->TaskDeque, pJob, middle, end);
+        __writeeflags(flags);
+
+        if (!pushed)
+        {
+            break;
+        }
+
+        end = middle;
+    }
+
+    pJob->Routine(pJob->Context, begin, end);
+    Cpu->TaskDeque.Executed++;
+
+    // the last access to the job
+    _InterlockedExchangeAdd64(&pJob->Remaining, -(INT64)(end - begin));
+}
+
+
+static
+VOID
+_KeTaskWakeCpus(
+    _In_ PPCPU Cpu
+)
+{
+    for (DWORD i = 0; i < MIN(KeGetCpuCount(), gKeTaskWorkers); i++)
+    {
+        PPCPU pCpu = KeGetCpu(i);
+        NTSTATUS status;
+
+        if (!pCpu || pCpu == Cpu)
+        {
+            continue;
+        }
+
+        // the idle ones notice gKeTaskJobs once they are woken up; the busy ones when they get idle
+        status = KeWakeCpu(pCpu);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeWakeCpu failed for CPU %d: 0x%08x\n", i, status);
+        }
+    }
+}
+
+
+NTSTATUS
+KeParallelFor(
+    _In_ QWORD Begin,
+    _In_ QWORD End,
+    _In_ QWORD Grain,
+    _In_ PFN_KeTaskRoutine Routine,
+    _In_opt_ PVOID Context
+)
+{
+    KE_TASK_JOB job;
+    KE_TASK task;
+    PPCPU pCpu;
+
+    if (Begin > End)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Routine)
+    {
+        return STATUS_INVALID_PARAMETER_4;
+    }
+
+    if (Begin == End)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (!Grain)
+    {
+        Grain = 1;
+    }
+
+    // nobody to share with
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || KeGetCpuCount() < 2 || End - Begin <= Grain)
+    {
+        Routine(Context, Begin, End);
+        return STATUS_SUCCESS;
+    }
+
+    job.Routine = Routine;
+    job.Context = Context;
+    job.Grain = Grain;
+    job.Remaining = (INT64)(End - Begin);
+
+    pCpu = GetCurrentCpu();
+
+    _InterlockedIncrement(&gKeTaskJobs);
+    _KeTaskWakeCpus(pCpu);
+
+    task.Job = &job;
+    task.Begin = Begin;
+    task.End = End;
+    _KeTaskRun(pCpu, &task);
+
+    // our pieces may have been stolen, help with anything until the last one is done
+    while (job.Remaining)
+    {
+        if (_KeTaskPop(&pCpu->TaskDeque, &task) || _KeTaskStealAny(pCpu, &task))
+        {
+            _KeTaskRun(pCpu, &task);
+        }
+        else
+        {
+            _mm_pause();
+        }
+    }
+
+    _InterlockedDecrement(&gKeTaskJobs);
+
+    return STATUS_SUCCESS;
+}
+
+
+BOOLEAN
+KeTasksPending(
+    VOID
+)
+{
+    return 0 != gKeTaskJobs && GetCurrentCpu()->Number < gKeTaskWorkers;
+}
+
+
+VOID
+KeHelpWithTasks(
+    VOID
+)
+{
+    PPCPU pCpu;
+    KE_TASK task;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    while (_KeTaskPop(&pCpu->TaskDeque, &task) || _KeTaskStealAny(pCpu, &task))
+    {
+        _KeTaskRun(pCpu, &task);
+    }
+
+    // the last pieces of the job may still run elsewhere, the idle loop comes back while KeTasksPending()
+    _mm_pause();
+}
+
+
+VOID
+KeDumpTaskStatistics(
+    VOID
+)
+{
+    NLog("[TASK] %-3s %12s %12s\n", "CPU", "EXECUTED", "STOLEN");
+
+    for (DWORD i = 0; i < KeGetCpuCount(); i++)
+    {
+        PPCPU pCpu = KeGetCpu(i);
+
+        NLog("[TASK] %3d %12d %12d\n", i, pCpu->TaskDeque.Executed, pCpu->TaskDeque.Stolen);
+    }
+}
+
+
+static
+VOID
+_KeTaskBenchRoutine(
+    _In_opt_ PVOID Context,
+    _In_ QWORD Begin,
+    _In_ QWORD End
+)
+{
+    QWORD x = Begin | 1;
+
+    for (QWORD i = Begin; i < End; i++)
+    {
+        for (DWORD r = 0; r < KE_TASK_BENCH_ROUNDS; r++)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+    }
+
+    // so the work can't be optimized away
+    _InterlockedExchangeAdd64((volatile INT64 *)Context, (INT64)x);
+}
+
+
+static
+VOID
+_KeTaskBenchCopyRoutine(
+    _In_opt_ PVOID Context,
+    _In_ QWORD Begin,
+    _In_ QWORD End
+)
+{
+    BYTE *pSource = (BYTE *)Context;
+    BYTE *pDestination = pSource + KE_TASK_BENCH_COPY_SIZE / 2;
+
+    memcpy(pDestination + Begin * KE_TASK_BENCH_SLICE, pSource + Begin * KE_TASK_BENCH_SLICE,
+        (End - Begin) * KE_TASK_BENCH_SLICE);
+}
+
+
+static
+VOID
+_KeTaskBenchRun(
+    _In_ const CHAR *Name,
+    _In_ PFN_KeTaskRoutine Routine,
+    _In_opt_ PVOID Context
+)
+{
+    QWORD single = 0;
+
+    for (DWORD workers = 1; workers <= KeGetCpuCount(); workers++)
+    {
+        QWORD cycles;
+        NTSTATUS status;
+
+        gKeTaskWorkers = workers;
+
+        cycles = __rdtsc();
+        status = KeParallelFor(0, KE_TASK_BENCH_INDEXES, KE_TASK_BENCH_GRAIN, Routine, Context);
+        cycles = __rdtsc() - cycles;
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeParallelFor failed for %d workers: 0x%08x\n", workers, status);
+            break;
+        }
+
+        if (1 == workers)
+        {
+            single = cycles;
+        }
+
+        NLog("[TASK] %-7s %d tasks on %2d workers: %llu cycles, speedup %llu.%02llu\n", Name,
+            KE_TASK_BENCH_INDEXES / KE_TASK_BENCH_GRAIN, workers, cycles, single / cycles, single * 100 / cycles % 100);
+    }
+
+    gKeTaskWorkers = MAX_CPU_COUNT;
+}
+
+
+VOID
+KeBenchmarkTasks(
+    VOID
+)
+{
+    volatile INT64 sink = 0;
+    PVOID pBuffer = NULL;
+    NTSTATUS status;
+
+    _KeTaskBenchRun("compute", _KeTaskBenchRoutine, (PVOID)&sink);
+
+    // the copy is bound by the memory bandwidth, not by the cores: it shows where adding workers stops paying off
+    status = MmAllocVirtual((DWORD)KE_TASK_BENCH_COPY_SIZE, TAG_BENCHMARK, &pBuffer);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] MmAllocVirtual failed: 0x%08x\n", status);
+        return;
+    }
+
+    // touched once, so the run on a single worker doesn't pay alone for the cold TLB
+    memset(pBuffer, 0x5A, KE_TASK_BENCH_COPY_SIZE);
+
+    _KeTaskBenchRun("copy", _KeTaskBenchCopyRoutine, pBuffer);
+
+    MmFreeVirtualAndNull(&pBuffer, TAG_BENCHMARK);
+}
@@ -0,0 +1,73 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "defs.h"
+
+//
+// Fork-join tasks over index ranges. Every CPU owns a Chase-Lev deque: it pushes and pops at the bottom, the other
+// CPUs steal from the top. A range is split in halves until it is no larger than the grain; the upper halves are
+// pushed for the thieves, the lowest piece is run right away.
+//
+#define KE_TASK_DEQUE_SIZE      64      // power of 2; halving keeps at most log2(range / grain) tasks per range queued
+
+// Called for [Begin, End)
+typedef VOID(*PFN_KeTaskRoutine)(_In_opt_ PVOID Context, _In_ QWORD Begin, _In_ QWORD End);
+
+struct _KE_TASK_JOB;
+
+typedef struct _KE_TASK
+{
+    struct _KE_TASK_JOB *   Job;
+    QWORD                   Begin;
+    QWORD                   End;
+} KE_TASK;
+
+typedef struct _KE_TASK_DEQUE
+{
+    volatile INT64          Top;            // next task to steal, moved by the thieves (and by the owner for the last task)
+    BYTE                    _TopPadding[56];
+    volatile INT64          Bottom;         // next free slot, moved only by the owner
+    BYTE                    _BottomPadding[56];
+    KE_TASK                 Tasks[KE_TASK_DEQUE_SIZE];
+
+    QWORD                   Seed;           // picks the first victim
+    QWORD                   Executed;       // tasks run by this CPU
+    QWORD                   Stolen;         // of those, taken from another CPU
+} KE_TASK_DEQUE;
+
+// Calls Routine for disjoint sub-ranges of [Begin, End), no larger than Grain (except when a deque is full), on every
+// online CPU. The caller runs pieces too and returns once the whole range is done.
+NTSTATUS
+KeParallelFor(
+    _In_ QWORD Begin,
+    _In_ QWORD End,
+    _In_ QWORD Grain,
+    _In_ PFN_KeTaskRoutine Routine,
+    _In_opt_ PVOID Context
+);
+
+// TRUE while a KeParallelFor is in progress; the idle loops check it with interrupts disabled before they halt
+BOOLEAN
+KeTasksPending(
+    VOID
+);
+
+// Runs the queued or stealable tasks until none is left, for the idle loops
+VOID
+KeHelpWithTasks(
+    VOID
+);
+
+VOID
+KeDumpTaskStatistics(
+    VOID
+);
+
+// Boot time benchmark: the same KeParallelFor on 1, 2, ... KeGetCpuCount() CPUs, once with a compute bound routine
+// and once with a memory bound one
+VOID
+KeBenchmarkTasks(
+    VOID
+);
+
+#endif // !_TASK_H_
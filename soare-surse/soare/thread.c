@@ -0,0 +1,915 @@
+#include "defs.h"
+#include "memdefs.h"
+#include "ntstatus.h"
+#include "memory.h"
+#include "thread.h"
+#include "task.h"
+#include "dpc.h"
+#include "idle.h"
+#include "rcu.h"
+#include "ktimer.h"
+#include "cpudefs.h"
+#include "dtr.h"
+#include "slab.h"
+#include "virtmemmgr.h"
+#include "pooltag.h"
+#include "kernel.h"
+#include "smp.h"
+#include "timer.h"
+#include "log.h"
+
+/*
+
+    Scheduler.
+    Every CPU owns a KE_RUN_QUEUE in its PCPU and is the only one that touches it, always with interrupts disabled,
+    so no lock is needed. Picking the next thread is a bit scan of ReadyMask and the removal of a list head. The idle
+    thread of a CPU is never queued, it runs when the mask is empty.
+
+    A switch only saves what the Microsoft x64 calling convention says a callee must preserve (RBX, RBP, RDI, RSI,
+    R12 - R15 and XMM6 - XMM15): HwSwapContext is called like any other function, so the caller already saved the
+    rest. A preempted thread is switched away from inside the timer interrupt, after its TRAP_FRAME was built and
+    after the EOI, and it resumes there and returns with IRETQ when it is picked again.
+
+    A thread blocks by marking itself ktsBlocked and switching away; it is not in any run queue until KeReadyThread
+    puts it back. Only its own CPU touches the run queue, so a thread readied by another CPU goes to the Wakes list
+    of its CPU, under WakeLock, and KeWakeCpu makes the CPU move it to Ready. _KeSchedule collects the wakes too, so a
+    thread readied by another CPU before it even switched away is simply picked again.
+
+    The stack and the KTHREAD of a terminated thread can't be released while the thread still runs on them; the
+    thread that runs next puts them in the free list of the CPU, and the next KeCreateThread on that CPU reuses them.
+
+*/
+
+extern KGLOBAL gKernelGlobalData;
+
+VOID HwSwapContext(_Out_ QWORD *OldRsp, _In_ QWORD NewRsp);
+VOID HwThreadStartup(VOID);
+
+// What HwSwapContext leaves on the stack of a thread that is not running, lowest address first
+// (keep in sync with hwexcp.yasm!!)
+typedef struct _KE_SWITCH_FRAME
+{
+    BYTE        Xmm[10][16];        // XMM6 - XMM15
+    QWORD       _Padding;
+    QWORD       R15;
+    QWORD       R14;
+    QWORD       R13;
+    QWORD       R12;                // the KTHREAD, for HwThreadStartup
+    QWORD       Rsi;
+    QWORD       Rdi;
+    QWORD       Rbp;
+    QWORD       Rbx;
+    QWORD       ReturnAddress;
+} KE_SWITCH_FRAME;
+
+static_assert(sizeof(KE_SWITCH_FRAME) % 16 == 0, "The initial frame must keep the stack aligned!");
+
+static volatile DWORD gKeNextThreadId;
+
+
+static __forceinline
+VOID
+_KeEnqueue(
+    _Inout_ PPCPU Cpu,
+    _Inout_ PKTHREAD Thread
+)
+{
+    Thread->State = ktsReady;
+    InsertTailList(&Cpu->RunQueue.Ready[Thread->Priority], &Thread->Link);
+    Cpu->RunQueue.ReadyMask |= (1UL << Thread->Priority);
+    Cpu->RunQueue.ReadyCount++;
+}
+
+
+static __forceinline
+PKTHREAD
+_KeDequeueNext(
+    _Inout_ PPCPU Cpu
+)
+{
+    unsigned long priority;
+    PLIST_ENTRY pEntry;
+
+    if (!_BitScanReverse(&priority, Cpu->RunQueue.ReadyMask))
+    {
+        return Cpu->IdleThread;
+    }
+
+    pEntry = RemoveHeadList(&Cpu->RunQueue.Ready[priority]);
+    if (IsListEmpty(&Cpu->RunQueue.Ready[priority]))
+    {
+        Cpu->RunQueue.ReadyMask &= ~(1UL << priority);
+    }
+    Cpu->RunQueue.ReadyCount--;
+
+    return CONTAINING_RECORD(pEntry, KTHREAD, Link);
+}
+
+
+static
+VOID
+_KeFinishSwitch(
+    _Inout_ PPCPU Cpu
+)
+{
+    PKTHREAD pPrevious = Cpu->PreviousThread;
+
+    Cpu->PreviousThread = NULL;
+
+    // we are off its stack now; the adopted threads have no stack of their own to give back
+    if (pPrevious && ktsTerminated == pPrevious->State && pPrevious->StackTop)
+    {
+        InsertTailList(&Cpu->RunQueue.Free, &pPrevious->Link);
+    }
+}
+
+
+// Interrupts must be disabled
+static
+VOID
+_KeCollectWakes(
+    _Inout_ PPCPU Cpu
+)
+{
+    // a stale look is fine, the CPU that adds a thread wakes us up after it
+    if (IsListEmpty(&Cpu->RunQueue.Wakes))
+    {
+        return;
+    }
+
+    KeAcquireTicketLock(&Cpu->RunQueue.WakeLock);
+
+    while (!IsListEmpty(&Cpu->RunQueue.Wakes))
+    {
+        PKTHREAD pThread = CONTAINING_RECORD(RemoveHeadList(&Cpu->RunQueue.Wakes), KTHREAD, Link);
+
+        _KeEnqueue(Cpu, pThread);
+        if (pThread->Priority > Cpu->CurrentThread->Priority)
+        {
+            Cpu->NeedResched = TRUE;
+        }
+    }
+
+    KeReleaseTicketLock(&Cpu->RunQueue.WakeLock);
+}
+
+
+// Interrupts must be disabled
+static
+VOID
+_KeSchedule(
+    _Inout_ PPCPU Cpu
+)
+{
+    PKTHREAD pPrevious = Cpu->CurrentThread;
+    PKTHREAD pNext;
+
+    _KeCollectWakes(Cpu);
+
+    // nobody switches in the middle of an RCU read-side section
+    RcuQuiescentState();
+
+    Cpu->NeedResched = FALSE;
+
+    if (ktsRunning == pPrevious->State && pPrevious != Cpu->IdleThread)
+    {
+        _KeEnqueue(Cpu, pPrevious);
+    }
+
+    pNext = _KeDequeueNext(Cpu);
+    if (pNext == pPrevious)
+    {
+        pPrevious->State = ktsRunning;
+        return;
+    }
+
+    pNext->State = ktsRunning;
+    pNext->Quantum = KE_QUANTUM_TICKS;
+    pNext->Switches++;
+
+    // only the idle wait stops the tick, and nothing but the idle thread may run without it
+    if (Cpu->ClockEvent.TickStopped && pNext != Cpu->IdleThread)
+    {
+        TmrRestartTick();
+    }
+
+    Cpu->PreviousThread = pPrevious;
+    Cpu->CurrentThread = pNext;
+    Cpu->ContextSwitches++;
+
+    HwSwapContext(&pPrevious->Rsp, pNext->Rsp);
+
+    // back on pPrevious, switched to by someone else
+    _KeFinishSwitch(Cpu);
+}
+
+
+// First code run by every new thread, HwThreadStartup calls it with interrupts disabled
+VOID
+KeThreadStartup(
+    _In_ PKTHREAD Thread
+)
+{
+    _KeFinishSwitch(Thread->Cpu);
+    _enable();
+
+    Thread->Routine(Thread->Context);
+
+    KeExitThread();
+}
+
+
+// Called by the IRQ handlers before IRETQ, with interrupts disabled
+VOID
+KePreemptIfNeeded(
+    VOID
+)
+{
+    PPCPU pCpu;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    if (pCpu->CurrentThread && pCpu->NeedResched)
+    {
+        _KeSchedule(pCpu);
+    }
+}
+
+
+static
+VOID
+_KeIdleRoutine(
+    _In_opt_ PVOID Context
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+
+    UNREFERENCED_PARAMETER(Context);
+
+    while (TRUE)
+    {
+        _disable();
+        if (KeThreadsReady())
+        {
+            _KeSchedule(pCpu);
+            _enable();
+            continue;
+        }
+
+        if (KeDpcsPending())
+        {
+            KeRetireDpcs();
+            _enable();
+            continue;
+        }
+
+        // the work slot, for KeRunOnCpu from an AP; the APs serve theirs in _KeIdleLoop
+        if (pCpu->WorkRoutine)
+        {
+            _enable();
+            KeRunQueuedWork(pCpu);
+            continue;
+        }
+
+        if (KeTasksPending())
+        {
+            _enable();
+            KeHelpWithTasks();
+            continue;
+        }
+
+        // a wake up can't be lost between the check and the wait
+        KeIdleWait(pCpu);
+    }
+}
+
+
+static
+NTSTATUS
+_KeAllocThread(
+    _Inout_ PPCPU Cpu,
+    _In_ const CHAR *Name,
+    _In_ PFN_KeThreadRoutine Routine,
+    _In_opt_ PVOID Context,
+    _In_ BYTE Priority,
+    _Out_ PKTHREAD *Thread
+)
+{
+    PKTHREAD pThread = NULL;
+    KE_SWITCH_FRAME *pFrame;
+    QWORD stackTop = 0;
+    QWORD flags;
+    NTSTATUS status;
+
+    flags = __readeflags();
+    _disable();
+    if (!IsListEmpty(&Cpu->RunQueue.Free))
+    {
+        pThread = CONTAINING_RECORD(RemoveHeadList(&Cpu->RunQueue.Free), KTHREAD, Link);
+        stackTop = pThread->StackTop;
+    }
+    __writeeflags(flags);
+
+    if (!pThread)
+    {
+        status = KmAlloc(sizeof(KTHREAD), TAG_THREAD, (PVOID *)&pThread);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KmAlloc failed: 0x%08x\n", status);
+            return status;
+        }
+
+        status = MmStackAlloc(KE_THREAD_STACK_SIZE, &stackTop);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] MmStackAlloc failed: 0x%08x\n", status);
+            KmFreeAndNull((PVOID *)&pThread, TAG_THREAD);
+            return status;
+        }
+    }
+
+    memset(pThread, 0, sizeof(KTHREAD));
+    pThread->StackTop = stackTop;
+    pThread->Cpu = Cpu;
+    pThread->Id = (DWORD)_InterlockedIncrement((volatile long *)&gKeNextThreadId);
+    pThread->Priority = Priority;
+    pThread->State = ktsInitialized;
+    pThread->Routine = Routine;
+    pThread->Context = Context;
+
+    for (DWORD i = 0; i < KE_THREAD_NAME_LENGTH - 1 && Name[i]; i++)
+    {
+        pThread->Name[i] = Name[i];
+    }
+
+    // HwSwapContext "returns" to HwThreadStartup, which calls KeThreadStartup(R12)
+    pFrame = (KE_SWITCH_FRAME *)(stackTop - sizeof(KE_SWITCH_FRAME));
+    memset(pFrame, 0, sizeof(KE_SWITCH_FRAME));
+    pFrame->R12 = (QWORD)pThread;
+    pFrame->ReturnAddress = (QWORD)HwThreadStartup;
+    pThread->Rsp = (QWORD)pFrame;
+
+    *Thread = pThread;
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+KeInitScheduler(
+    _In_ BOOLEAN CurrentIsIdle
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+    PKTHREAD pCurrent = NULL;
+    PKTHREAD pIdle = NULL;
+    NTSTATUS status;
+
+    InitializeListHead(&pCpu->RunQueue.Free);
+    InitializeListHead(&pCpu->RunQueue.Wakes);
+    for (DWORD i = 0; i < KE_PRIORITY_COUNT; i++)
+    {
+        InitializeListHead(&pCpu->RunQueue.Ready[i]);
+    }
+    pCpu->RunQueue.ReadyMask = 0;
+    pCpu->RunQueue.ReadyCount = 0;
+
+    status = KmAlloc(sizeof(KTHREAD), TAG_THREAD, (PVOID *)&pCurrent);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KmAlloc failed: 0x%08x\n", status);
+        return status;
+    }
+
+    // the stack we run on is already in use, Rsp is saved on the first switch
+    memset(pCurrent, 0, sizeof(KTHREAD));
+    pCurrent->Cpu = pCpu;
+    pCurrent->Id = (DWORD)_InterlockedIncrement((volatile long *)&gKeNextThreadId);
+    pCurrent->Priority = CurrentIsIdle ? KE_PRIORITY_IDLE : KE_PRIORITY_NORMAL;
+    pCurrent->State = ktsRunning;
+    pCurrent->Quantum = KE_QUANTUM_TICKS;
+    memcpy(pCurrent->Name, CurrentIsIdle ? "idle" : "main", 5);
+
+    if (CurrentIsIdle)
+    {
+        pIdle = pCurrent;
+    }
+    else
+    {
+        status = _KeAllocThread(pCpu, "idle", _KeIdleRoutine, NULL, KE_PRIORITY_IDLE, &pIdle);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _KeAllocThread failed: 0x%08x\n", status);
+            KmFreeAndNull((PVOID *)&pCurrent, TAG_THREAD);
+            return status;
+        }
+    }
+
+    pCpu->IdleThread = pIdle;
+    pCpu->CurrentThread = pCurrent;
+
+    KeTimerInitCpu();
+
+    // the CPU counts as busy from here on, except for the time it waits in KeIdleWait
+    KeIdleInitCpu();
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+KeCreateThread(
+    _In_ const CHAR *Name,
+    _In_ PFN_KeThreadRoutine Routine,
+    _In_opt_ PVOID Context,
+    _In_ BYTE Priority,
+    _Out_opt_ PKTHREAD *Thread
+)
+{
+    PPCPU pCpu;
+    PKTHREAD pThread = NULL;
+    QWORD flags;
+    NTSTATUS status;
+
+    if (!Name)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Routine)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (Priority <= KE_PRIORITY_IDLE || Priority > KE_PRIORITY_MAX)
+    {
+        return STATUS_INVALID_PARAMETER_4;
+    }
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || !GetCurrentCpu()->CurrentThread)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    pCpu = GetCurrentCpu();
+
+    status = _KeAllocThread(pCpu, Name, Routine, Context, Priority, &pThread);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _KeAllocThread failed: 0x%08x\n", status);
+        return status;
+    }
+
+    if (Thread)
+    {
+        *Thread = pThread;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    _KeEnqueue(pCpu, pThread);
+
+    // a more important thread runs right away
+    if (Priority > pCpu->CurrentThread->Priority)
+    {
+        _KeSchedule(pCpu);
+    }
+
+    __writeeflags(flags);
+
+    return STATUS_SUCCESS;
+}
+
+
+PKTHREAD
+KeGetCurrentThread(
+    VOID
+)
+{
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return NULL;
+    }
+
+    return GetCurrentCpu()->CurrentThread;
+}
+
+
+VOID
+KeYield(
+    VOID
+)
+{
+    PPCPU pCpu;
+    QWORD flags;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pCpu = GetCurrentCpu();
+    if (pCpu->CurrentThread)
+    {
+        _KeSchedule(pCpu);
+    }
+
+    __writeeflags(flags);
+}
+
+
+VOID
+KeExitThread(
+    VOID
+)
+{
+    PPCPU pCpu;
+
+    _disable();
+
+    pCpu = GetCurrentCpu();
+    if (pCpu->CurrentThread == pCpu->IdleThread)
+    {
+        LogWithInfo("[ERROR] The idle thread of CPU %d can't exit\n", pCpu->Number);
+        _enable();
+        return;
+    }
+
+    pCpu->CurrentThread->State = ktsTerminated;
+    _KeSchedule(pCpu);
+
+    // a terminated thread is never picked again
+}
+
+
+VOID
+KeBlockCurrentThread(
+    VOID
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+
+    pCpu->CurrentThread->State = ktsBlocked;
+    _KeSchedule(pCpu);
+}
+
+
+VOID
+KeReadyThread(
+    _Inout_ PKTHREAD Thread
+)
+{
+    PPCPU pCpu;
+    PPCPU pTarget = Thread->Cpu;
+    QWORD flags = __readeflags();
+    NTSTATUS status;
+
+    _disable();
+
+    pCpu = GetCurrentCpu();
+    if (pTarget == pCpu)
+    {
+        _KeEnqueue(pCpu, Thread);
+
+        if (Thread->Priority > pCpu->CurrentThread->Priority)
+        {
+            pCpu->NeedResched = TRUE;
+
+            // IRQ handlers run with interrupts disabled, and a DPC runs on top of an interrupted thread
+            if ((flags & RFLAGS_IF) && !pCpu->DpcQueue.Active)
+            {
+                _KeSchedule(pCpu);
+            }
+        }
+
+        __writeeflags(flags);
+        return;
+    }
+
+    KeAcquireTicketLock(&pTarget->RunQueue.WakeLock);
+    InsertTailList(&pTarget->RunQueue.Wakes, &Thread->Link);
+    KeReleaseTicketLock(&pTarget->RunQueue.WakeLock);
+
+    __writeeflags(flags);
+
+    status = KeWakeCpu(pTarget);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeWakeCpu failed for CPU %d: 0x%08x\n", pTarget->Number, status);
+    }
+}
+
+
+BOOLEAN
+KeThreadsReady(
+    VOID
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+
+    return 0 != pCpu->RunQueue.ReadyMask || !IsListEmpty(&pCpu->RunQueue.Wakes);
+}
+
+
+BOOLEAN
+KeCanBlock(
+    VOID
+)
+{
+    PPCPU pCpu;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || !(__readeflags() & RFLAGS_IF))
+    {
+        return FALSE;
+    }
+
+    // threads don't migrate, the answer stays right even if we are preempted after the check
+    pCpu = GetCurrentCpu();
+
+    return pCpu->CurrentThread && pCpu->CurrentThread != pCpu->IdleThread && !pCpu->DpcQueue.Active;
+}
+
+
+VOID
+KeCollectWakes(
+    VOID
+)
+{
+    PPCPU pCpu;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    if (pCpu->CurrentThread)
+    {
+        _KeCollectWakes(pCpu);
+    }
+}
+
+
+VOID
+KeSchedulerTick(
+    VOID
+)
+{
+    PPCPU pCpu;
+    PKTHREAD pCurrent;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    pCurrent = pCpu->CurrentThread;
+    if (!pCurrent)
+    {
+        return;
+    }
+
+    if (pCurrent == pCpu->IdleThread)
+    {
+        pCpu->NeedResched = (0 != pCpu->RunQueue.ReadyMask);
+        return;
+    }
+
+    if (pCurrent->Quantum > 1)
+    {
+        pCurrent->Quantum--;
+        return;
+    }
+
+    // round robin among the threads of the same priority, the lower ones keep waiting
+    pCurrent->Quantum = KE_QUANTUM_TICKS;
+    if (pCpu->RunQueue.ReadyMask >> pCurrent->Priority)
+    {
+        pCpu->NeedResched = TRUE;
+    }
+}
+
+
+static
+VOID
+_KeDumpThread(
+    _In_ const KTHREAD *Thread
+)
+{
+    static const CHAR *states[] = { "INIT", "READY", "RUN", "BLOCK", "TERM" };
+
+    NLog("[THREAD] %3d %-16s %5d %4d %-5s %10d\n", Thread->Cpu->Number, Thread->Name, Thread->Id,
+        Thread->Priority, states[Thread->State], Thread->Switches);
+}
+
+
+VOID
+KeDumpThreads(
+    VOID
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+    QWORD flags = __readeflags();
+
+    // only the threads of the current CPU, the run queues of the others change under us
+    _disable();
+
+    NLog("[THREAD] %-3s %-16s %5s %4s %-5s %10s\n", "CPU", "NAME", "ID", "PRIO", "STATE", "SWITCHES");
+
+    _KeDumpThread(pCpu->CurrentThread);
+    if (pCpu->IdleThread != pCpu->CurrentThread)
+    {
+        _KeDumpThread(pCpu->IdleThread);
+    }
+
+    for (DWORD priority = 0; priority < KE_PRIORITY_COUNT; priority++)
+    {
+        for (PLIST_ENTRY pEntry = pCpu->RunQueue.Ready[priority].Flink;
+            pEntry != &pCpu->RunQueue.Ready[priority];
+            pEntry = pEntry->Flink)
+        {
+            _KeDumpThread(CONTAINING_RECORD(pEntry, KTHREAD, Link));
+        }
+    }
+
+    NLog("[THREAD] CPU %d: %d context switches, %d ready\n", pCpu->Number, pCpu->ContextSwitches,
+        pCpu->RunQueue.ReadyCount);
+
+    __writeeflags(flags);
+}
+
+
+//
+// Boot self test: yield, preemption and exit, on the current CPU
+//
+#define KE_SELFTEST_THREADS     2
+#define KE_SELFTEST_TURNS       64
+#define KE_SELFTEST_TIMEOUT_MS  1000
+
+typedef struct _KE_SELFTEST
+{
+    volatile INT32          Length;
+    DWORD                   Trace[KE_SELFTEST_THREADS * KE_SELFTEST_TURNS];   // the IDs of the yielding threads, in turn order
+    volatile BOOLEAN        Released;
+    volatile BOOLEAN        Preempted;                      // the spinner saw Released before its deadline
+} KE_SELFTEST;
+
+// threads that time out still use it after KeSelfTestThreads returned
+static KE_SELFTEST gKeSelfTest;
+
+
+static
+VOID
+_KeSelfTestYield(
+    _In_opt_ PVOID Context
+)
+{
+    KE_SELFTEST *pTest = (KE_SELFTEST *)Context;
+    DWORD id = KeGetCurrentThread()->Id;
+
+    for (DWORD i = 0; i < KE_SELFTEST_TURNS; i++)
+    {
+        pTest->Trace[_InterlockedIncrement((volatile long *)&pTest->Length) - 1] = id;
+        KeYield();
+    }
+
+    // returns, KeThreadStartup exits for us
+}
+
+
+static
+VOID
+_KeSelfTestSpin(
+    _In_opt_ PVOID Context
+)
+{
+    KE_SELFTEST *pTest = (KE_SELFTEST *)Context;
+    QWORD deadline = TmrGetTime() + KE_SELFTEST_TIMEOUT_MS;
+
+    // never yields, the releaser only runs if the tick takes the CPU from us
+    while (!pTest->Released && TmrGetTime() < deadline)
+    {
+        _mm_pause();
+    }
+
+    pTest->Preempted = pTest->Released;
+}
+
+
+static
+VOID
+_KeSelfTestRelease(
+    _In_opt_ PVOID Context
+)
+{
+    KE_SELFTEST *pTest = (KE_SELFTEST *)Context;
+
+    pTest->Released = TRUE;
+    KeExitThread();
+}
+
+
+static
+NTSTATUS
+_KeSelfTestRun(
+    _In_reads_(KE_SELFTEST_THREADS) const CHAR **Names,
+    _In_reads_(KE_SELFTEST_THREADS) const PFN_KeThreadRoutine *Routines
+)
+{
+    PKTHREAD threads[KE_SELFTEST_THREADS] = { 0 };
+    DWORD created = 0;
+    QWORD deadline;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // same priority as the main thread: nothing runs until we yield, then the test threads take turns with us
+    for (; created < KE_SELFTEST_THREADS; created++)
+    {
+        status = KeCreateThread(Names[created], Routines[created], &gKeSelfTest, KE_PRIORITY_NORMAL,
+            &threads[created]);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] KeCreateThread failed: 0x%08x\n", status);
+            break;
+        }
+    }
+
+    deadline = TmrGetTime() + 2 * KE_SELFTEST_TIMEOUT_MS;
+    for (DWORD i = 0; i < created; i++)
+    {
+        while (ktsTerminated != threads[i]->State)
+        {
+            if (TmrGetTime() >= deadline)
+            {
+                LogWithInfo("[ERROR] Thread %s did not exit\n", threads[i]->Name);
+                return STATUS_IO_TIMEOUT;
+            }
+
+            KeYield();
+        }
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+KeSelfTestThreads(
+    VOID
+)
+{
+    static const CHAR *yieldNames[KE_SELFTEST_THREADS] = { "yield-a", "yield-b" };
+    static const PFN_KeThreadRoutine yieldRoutines[KE_SELFTEST_THREADS] = { _KeSelfTestYield, _KeSelfTestYield };
+    static const CHAR *preemptNames[KE_SELFTEST_THREADS] = { "spin", "release" };
+    static const PFN_KeThreadRoutine preemptRoutines[KE_SELFTEST_THREADS] = { _KeSelfTestSpin, _KeSelfTestRelease };
+    DWORD alternated = 0;
+    NTSTATUS status;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY || !KeCanBlock())
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    memset(&gKeSelfTest, 0, sizeof(gKeSelfTest));
+
+    // every KeYield of a test thread hands the CPU to the other one, a tick may only swap a few turns
+    status = _KeSelfTestRun(yieldNames, yieldRoutines);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _KeSelfTestRun failed for the yield test: 0x%08x\n", status);
+        return status;
+    }
+
+    for (INT32 i = 1; i < gKeSelfTest.Length; i++)
+    {
+        alternated += gKeSelfTest.Trace[i] != gKeSelfTest.Trace[i - 1];
+    }
+
+    NLog("[THREAD] Self test: %d turns, %d of them alternated\n", gKeSelfTest.Length, alternated);
+
+    if (KE_SELFTEST_THREADS * KE_SELFTEST_TURNS != gKeSelfTest.Length || alternated < KE_SELFTEST_TURNS)
+    {
+        LogWithInfo("[ERROR] KeYield does not hand the CPU over\n");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // the spinner runs first and never gives the CPU up, the releaser needs a preemption to run at all
+    status = _KeSelfTestRun(preemptNames, preemptRoutines);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _KeSelfTestRun failed for the preemption test: 0x%08x\n", status);
+        return status;
+    }
+
+    NLog("[THREAD] Self test: spinner %s\n", gKeSelfTest.Preempted ? "preempted" : "NOT preempted");
+
+    return gKeSelfTest.Preempted ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
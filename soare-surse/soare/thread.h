@@ -0,0 +1,145 @@
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#include "winlists.h"
+#include "spinlock.h"
+
+//
+// Kernel threads. A thread runs on the CPU that created it; every CPU schedules its own threads by priority, round
+// robin inside a priority, and the timer tick preempts a thread once its quantum is used up.
+//
+#define KE_PRIORITY_COUNT       32      // one bit of KE_RUN_QUEUE.ReadyMask each
+#define KE_PRIORITY_IDLE        0       // only the idle thread
+#define KE_PRIORITY_LOW         4
+#define KE_PRIORITY_NORMAL      8
+#define KE_PRIORITY_HIGH        16
+#define KE_PRIORITY_MAX         (KE_PRIORITY_COUNT - 1)
+
+#define KE_QUANTUM_TICKS        4
+#define KE_THREAD_STACK_SIZE    (16 * PAGE_SIZE_4K)
+#define KE_THREAD_NAME_LENGTH   16
+
+typedef enum _KTHREAD_STATE
+{
+    ktsInitialized = 0,
+    ktsReady,                   // in a run queue
+    ktsRunning,
+    ktsBlocked,
+    ktsTerminated,              // its stack and KTHREAD are reused by the next thread created on the same CPU
+} KTHREAD_STATE;
+
+typedef VOID(*PFN_KeThreadRoutine)(_In_opt_ PVOID Context);
+
+typedef struct _KTHREAD
+{
+    QWORD                   Rsp;            // saved by HwSwapContext while the thread is not running
+    QWORD                   StackTop;       // 0 for the threads that were already running when the CPU was adopted
+    struct _PCPU *          Cpu;
+    LIST_ENTRY              Link;           // in a run queue or in the free list of its CPU
+    DWORD                   Id;
+    BYTE                    Priority;
+    BYTE                    State;          // KTHREAD_STATE
+    WORD                    Quantum;        // ticks left
+    PFN_KeThreadRoutine     Routine;
+    PVOID                   Context;
+    QWORD                   Switches;       // how many times it was switched to
+    CHAR                    Name[KE_THREAD_NAME_LENGTH];
+} KTHREAD, *PKTHREAD;
+
+// O(1) run queue: the highest set bit of ReadyMask is the highest priority with a non empty list
+typedef struct _KE_RUN_QUEUE
+{
+    DWORD                   ReadyMask;
+    DWORD                   ReadyCount;
+    LIST_ENTRY              Ready[KE_PRIORITY_COUNT];
+    LIST_ENTRY              Free;           // terminated threads
+    KE_TICKET_LOCK          WakeLock;       // guards Wakes, the only part the other CPUs touch
+    LIST_ENTRY              Wakes;          // readied by other CPUs, moved to Ready by this one
+} KE_RUN_QUEUE, *PKE_RUN_QUEUE;
+
+// Turns the current flow of control into a thread of the current CPU. The BSP keeps running it as its main thread
+// and gets a new idle thread; an AP keeps running it as its idle thread.
+NTSTATUS
+KeInitScheduler(
+    _In_ BOOLEAN CurrentIsIdle
+);
+
+NTSTATUS
+KeCreateThread(
+    _In_ const CHAR *Name,
+    _In_ PFN_KeThreadRoutine Routine,
+    _In_opt_ PVOID Context,
+    _In_ BYTE Priority,                 // KE_PRIORITY_LOW - KE_PRIORITY_MAX
+    _Out_opt_ PKTHREAD *Thread
+);
+
+PKTHREAD
+KeGetCurrentThread(
+    VOID
+);
+
+// Gives the CPU to the next ready thread of the same or of a higher priority, if there is one
+VOID
+KeYield(
+    VOID
+);
+
+VOID
+KeExitThread(
+    VOID
+);
+
+// Blocks the current thread until someone calls KeReadyThread for it; interrupts must be disabled, so that whoever
+// gets hold of the thread can't ready it before it is marked as blocked
+VOID
+KeBlockCurrentThread(
+    VOID
+);
+
+// Puts a blocked thread back in the run queue of its CPU, from any CPU; from a thread it switches right away if the
+// readied thread is more important, from an IRQ handler or a DPC the switch waits for KeIrqExit
+VOID
+KeReadyThread(
+    _Inout_ PKTHREAD Thread
+);
+
+// TRUE if the current flow of control may block: a thread other than the idle one, with interrupts enabled and not
+// in a DPC
+BOOLEAN
+KeCanBlock(
+    VOID
+);
+
+// TRUE if a thread of the current CPU waits to run, readied there or by another CPU; for the idle loops, with
+// interrupts disabled
+BOOLEAN
+KeThreadsReady(
+    VOID
+);
+
+// Moves the threads readied by other CPUs to the run queue; called by the IPI handler
+VOID
+KeCollectWakes(
+    VOID
+);
+
+// Called by the timer interrupt on every tick
+VOID
+KeSchedulerTick(
+    VOID
+);
+
+// The threads of the current CPU
+VOID
+KeDumpThreads(
+    VOID
+);
+
+// Boot self test of the scheduler on the current CPU: KeYield, preemption by the tick and thread exit; from a thread
+// that can block, with the tick running
+NTSTATUS
+KeSelfTestThreads(
+    VOID
+);
+
+#endif // !_THREAD_H_
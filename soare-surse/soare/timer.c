@@ -5,6 +5,14 @@
 #include "panic.h"
 #include "pic.h"
 #include "debugger.h"
+#include "thread.h"
+#include "dpc.h"
+#include "rcu.h"
+#include "ktimer.h"
+#include "timer.h"
+#include "lapic.h"
+#include "smp.h"
+#include "kernel.h"
 #include "log.h"
 
 //
@@ -40,13 +48,41 @@
 #define PIT_CMD_COUNTER1            0x40
 #define PIT_CMD_COUNTER2            0x80
 
+#define PIT_FREQUENCY               1193182ULL
+#define PIT_MAX_STALL_US            50000       // the counters are 16 bits wide, 65535 ticks are ~54.9 ms
+
+//
+// Port 0x61 (NMI status and control), gates counter 2
+//
+#define PIT_REG_GATE                0x61
+#define PIT_GATE_COUNTER2           0x01
+#define PIT_GATE_SPEAKER            0x02
+#define PIT_GATE_OUT2               0x20
+
+
+//
+// Clock events
+//
+#define CPUID_EDX_INVARIANT_TSC     (1 << 8)    // CPUID.80000007H
+#define TMR_TSC_CALIBRATION_US      50000
+#define TMR_LAPIC_CALIBRATION_MS    10
+
 
 static volatile SIZE_T gPitTickCount;
-static volatile SIZE_T gLastPitTickCount;
 static BOOLEAN gPitInited;
 static RTC_DATE_TIME gDateTime = { 0 };
+static KTIMER gPitSecondTimer;
+static KDPC gPitDpc;
+
+static QWORD gTmrTscBase;
+static QWORD gTmrTscPerMs;              // 0 without an invariant TSC, the time is counted in PIT ticks then
+static BOOLEAN gTmrTscDeadline;
+static QWORD gTmrLapicPerMs;            // one shot mode, LAPIC timer counts per ms
+
+extern KGLOBAL gKernelGlobalData;
 
 extern VOID IsrHndPic(VOID);
+extern VOID IsrHndLapicTimer(VOID);
 
 
 static
@@ -116,73 +152,249 @@ _PitStart(
     _PitSendData(PIT_CMD_COUNTER0 == Counter ? PIT_REG_COUNTER0 : PIT_REG_COUNTER2, divisor & 0xFF);
     _PitSendData(PIT_CMD_COUNTER0 == Counter ? PIT_REG_COUNTER0 : PIT_REG_COUNTER2, (divisor >> 8) & 0xFF);
     gPitTickCount = 0;
-    gLastPitTickCount = 0;
 }
 
 
+// Advances the clock on the header, out of the interrupt
+static
 VOID
-PitHandler(
-    _In_ PVOID Context
+_PitSecondDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID Context
 )
 {
+    UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Context);
-    gPitTickCount++;
 
-    if (gPitTickCount >= gLastPitTickCount + 5965)
+    if (gDateTime.Seconds < 59)
+    {
+        gDateTime.Seconds++;
+    }
+    else
     {
-        gLastPitTickCount = gPitTickCount;
+        gDateTime.Seconds = 0;
 
-        if (gDateTime.Seconds < 59)
+        if (gDateTime.Minutes < 59)
         {
-            gDateTime.Seconds++;
+            gDateTime.Minutes++;
         }
         else
         {
-            gDateTime.Seconds = 0;
+            gDateTime.Minutes = 0;
 
-            if (gDateTime.Minutes < 59)
+            if (gDateTime.Hours < 23)
             {
-                gDateTime.Minutes++;
+                gDateTime.Hours++;
             }
             else
             {
-                gDateTime.Minutes = 0;
+                static BYTE daysPerMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+                gDateTime.Hours = 1;
 
-                if (gDateTime.Hours < 23)
+                if (gDateTime.DayOfMonth < daysPerMonth[gDateTime.Month])
                 {
-                    gDateTime.Hours++;
+                    gDateTime.DayOfMonth++;
                 }
                 else
                 {
-                    static BYTE daysPerMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-                    gDateTime.Hours = 1;
+                    gDateTime.DayOfMonth = 0;
 
-                    if (gDateTime.DayOfMonth < daysPerMonth[gDateTime.Month])
+                    if (gDateTime.Month < 12)
                     {
-                        gDateTime.DayOfMonth++;
+                        gDateTime.Month++;
                     }
                     else
                     {
-                        gDateTime.DayOfMonth = 0;
-
-                        if (gDateTime.Month < 12)
-                        {
-                            gDateTime.Month++;
-                        }
-                        else
-                        {
-                            gDateTime.Month = 1;
-                            gDateTime.Year++;
-                        }
+                        gDateTime.Month = 1;
+                        gDateTime.Year++;
                     }
                 }
             }
         }
+    }
+
+    UpdateHeader(TRUE, "%02d:%02d:%02d %02d/%02d/%04d",
+        gDateTime.Hours, gDateTime.Minutes, gDateTime.Seconds,
+        gDateTime.DayOfMonth, gDateTime.Month, gDateTime.Year);
+}
+
+
+VOID
+PitHandler(
+    _In_ PVOID Context
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    gPitTickCount++;
+
+    KeTimerTick();
+    RcuTick();
+
+    // the switch itself happens in IsrHndPic, after the EOI and the DPCs
+    KeSchedulerTick();
+}
+
+
+// The time is kept by the TSC if it runs at the same rate in every power state
+static
+VOID
+_TmrCalibrateTsc(
+    VOID
+)
+{
+    INT32 regs[4] = { 0 };
+    QWORD start;
+
+    __cpuid(regs, 0x80000000);
+    if ((DWORD)regs[0] >= 0x80000007)
+    {
+        __cpuid(regs, 0x80000007);
+    }
+    else
+    {
+        regs[3] = 0;
+    }
+
+    if (0 == (regs[3] & CPUID_EDX_INVARIANT_TSC))
+    {
+        LogWithInfo("[TIMER] No invariant TSC, the PIT keeps the time and the tick never stops\n");
+        return;
+    }
+
+    start = __rdtsc();
+    TmrStallExecution(TMR_TSC_CALIBRATION_US);
+
+    gTmrTscBase = __rdtsc();
+    gTmrTscPerMs = (gTmrTscBase - start) / (TMR_TSC_CALIBRATION_US / 1000);
+
+    LogWithInfo("[TIMER] TSC: %lld cycles / ms\n", gTmrTscPerMs);
+}
+
+
+// LAPIC timer counts per ms, measured with the TSC; BSP, interrupts disabled
+static
+QWORD
+_TmrCalibrateLapicTimer(
+    VOID
+)
+{
+    QWORD start;
+    DWORD left;
+
+    LapicTimerSetup(LAPIC_TIMER_VECTOR, FALSE);
+    LapicTimerArm(0xFFFFFFFF);
+
+    start = __rdtsc();
+    while (__rdtsc() - start < TMR_LAPIC_CALIBRATION_MS * gTmrTscPerMs)
+    {
+        _mm_pause();
+    }
+
+    left = LapicTimerGetCount();
+    LapicTimerArm(0);
+
+    return (0xFFFFFFFF - left) / TMR_LAPIC_CALIBRATION_MS;
+}
+
+
+// Interrupts disabled
+static
+VOID
+_TmrArmClockEvent(
+    _Inout_ TMR_CLOCK_EVENT *Event,
+    _In_ QWORD Deadline
+)
+{
+    QWORD target;
+    QWORD now;
+    QWORD delta;
+
+    Event->Deadline = Deadline;
+
+    if (KE_TIMER_NO_EXPIRY == Deadline)
+    {
+        LapicTimerArm(0);
+        return;
+    }
+
+    target = gTmrTscBase + Deadline * gTmrTscPerMs;
+    if (gTmrTscDeadline)
+    {
+        LapicTimerArm(target);
+        return;
+    }
+
+    // rounded up; a count too long for the timer fires early, finds nothing due and arms it again
+    now = __rdtsc();
+    delta = target > now ? target - now : 0;
+    if (delta / gTmrTscPerMs >= 0xFFFFFFFF / gTmrLapicPerMs)
+    {
+        LapicTimerArm(0xFFFFFFFF);
+    }
+    else
+    {
+        LapicTimerArm(delta * gTmrLapicPerMs / gTmrTscPerMs + 1);
+    }
+}
+
+
+// The next tick or the first timer, only the timer while the tick is stopped; interrupts disabled
+static
+VOID
+_TmrReprogramClockEvent(
+    _Inout_ PPCPU Cpu
+)
+{
+    TMR_CLOCK_EVENT *pEvent = &Cpu->ClockEvent;
+    QWORD next = KeTimerNextExpiry(pEvent->TickStopped ? KE_TIMER_NO_EXPIRY : pEvent->NextTick);
+
+    if (next != pEvent->Deadline)
+    {
+        _TmrArmClockEvent(pEvent, next);
+    }
+}
+
+
+VOID
+TmrClockEventHandler(
+    _In_ PVOID Context
+)
+{
+    PPCPU pCpu = GetCurrentCpu();
+    TMR_CLOCK_EVENT *pEvent = &pCpu->ClockEvent;
+    QWORD now = TmrGetTime();
+
+    UNREFERENCED_PARAMETER(Context);
+
+    // the timer disarms itself when it fires
+    pEvent->Deadline = KE_TIMER_NO_EXPIRY;
+    pEvent->Events++;
+
+    KeTimerTick();
+
+    if (!pEvent->TickStopped && now >= pEvent->NextTick)
+    {
+        // the ticks missed with interrupts disabled are not made up for
+        pEvent->NextTick += TMR_MS_PER_TICK;
+        if (pEvent->NextTick <= now)
+        {
+            pEvent->NextTick = now + TMR_MS_PER_TICK;
+        }
 
-        UpdateHeader(TRUE, "%02d:%02d:%02d %02d/%02d/%04d",
-            gDateTime.Hours, gDateTime.Minutes, gDateTime.Seconds,
-            gDateTime.DayOfMonth, gDateTime.Month, gDateTime.Year);
+        pEvent->Ticks++;
+
+        if (pCpu->IsBsp)
+        {
+            RcuTick();
+        }
+
+        // the switch itself happens in IsrHndLapicTimer, after the EOI and the DPCs
+        KeSchedulerTick();
     }
+
+    _TmrReprogramClockEvent(pCpu);
+
+    LapicEoi();
 }
 
 
@@ -198,6 +410,20 @@ TmrInitializeTimer(
         return status;
     }
 
+    // before the first timer is set, the time starts over from 0 with the TSC
+    _TmrCalibrateTsc();
+
+    // the clock on the header moves once a second
+    KeInitializeDpc(&gPitDpc, _PitSecondDpc, NULL);
+    KeInitializeTimer(&gPitSecondTimer);
+
+    status = KeSetTimer(&gPitSecondTimer, 1000, 1000, &gPitDpc);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] KeSetTimer failed: 0x%08x\n", status);
+        return status;
+    }
+
     status = DtrInstallIrqHandler(IRQ2INTR(PIC_IRQ_TIMER), IsrHndPic);
     if (!NT_SUCCESS(status))
     {
@@ -206,7 +432,7 @@ TmrInitializeTimer(
     }
 
     {
-        DWORD divisor = 1193180 / 200;      // Fire 5965 times/s
+        DWORD divisor = 1193180 / TMR_TICKS_PER_SECOND;     // 5965 PIT clocks per tick
         __outbyte(0x43, 0x36);
         __outbyte(0x40, divisor & 0xFF);
         __outbyte(0x40, divisor >> 8);
@@ -216,3 +442,224 @@ TmrInitializeTimer(
 
     return STATUS_SUCCESS;
 }
+
+
+QWORD
+TmrGetTime(
+    VOID
+)
+{
+    // the TSCs of the CPUs are in sync, every one of them may read the time
+    if (gTmrTscPerMs)
+    {
+        return (__rdtsc() - gTmrTscBase) / gTmrTscPerMs;
+    }
+
+    return gPitTickCount * TMR_MS_PER_TICK;
+}
+
+
+NTSTATUS
+TmrStartClockEvents(
+    VOID
+)
+{
+    PPCPU pCpu;
+    TMR_CLOCK_EVENT *pEvent;
+    QWORD flags;
+    NTSTATUS status;
+
+    // a stopped tick needs a clock that runs on without it
+    if (!gTmrTscPerMs)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    pCpu = GetCurrentCpu();
+    pEvent = &pCpu->ClockEvent;
+
+    status = DtrInstallIrqHandler(LAPIC_TIMER_VECTOR, IsrHndLapicTimer);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] DtrInstallIrqHandler failed: 0x%08x\n", status);
+        return status;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    // every CPU has the same LAPIC timer, the BSP looks once for everybody
+    if (pCpu->IsBsp)
+    {
+        gTmrTscDeadline = LapicTimerHasTscDeadline();
+        if (!gTmrTscDeadline)
+        {
+            gTmrLapicPerMs = _TmrCalibrateLapicTimer();
+        }
+
+        LogWithInfo("[TIMER] LAPIC timer in %s mode, %lld counts / ms\n",
+            gTmrTscDeadline ? "TSC-deadline" : "one shot", gTmrTscDeadline ? gTmrTscPerMs : gTmrLapicPerMs);
+    }
+
+    if (!gTmrTscDeadline && !gTmrLapicPerMs)
+    {
+        __writeeflags(flags);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    LapicTimerSetup(LAPIC_TIMER_VECTOR, gTmrTscDeadline);
+
+    pEvent->TickStopped = FALSE;
+    pEvent->NextTick = TmrGetTime() + TMR_MS_PER_TICK;
+    pEvent->Deadline = KE_TIMER_NO_EXPIRY;
+    pEvent->Events = 0;
+    pEvent->Ticks = 0;
+    pEvent->Active = TRUE;
+    _TmrReprogramClockEvent(pCpu);
+
+    // the LAPIC timer of the BSP takes over from the PIT
+    if (pCpu->IsBsp)
+    {
+        PicDisableIrq(PIC_IRQ_TIMER);
+    }
+
+    __writeeflags(flags);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+TmrUpdateClockEvent(
+    _In_ QWORD Time
+)
+{
+    TMR_CLOCK_EVENT *pEvent;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pEvent = &GetCurrentCpu()->ClockEvent;
+    if (pEvent->Active && Time < pEvent->Deadline)
+    {
+        _TmrArmClockEvent(pEvent, Time);
+    }
+}
+
+
+VOID
+TmrStopTick(
+    VOID
+)
+{
+    PPCPU pCpu;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    if (!pCpu->ClockEvent.Active)
+    {
+        return;
+    }
+
+    // the ticks of the BSP move the grace periods forward
+    if (pCpu->IsBsp && RcuPending())
+    {
+        return;
+    }
+
+    pCpu->ClockEvent.TickStopped = TRUE;
+    _TmrReprogramClockEvent(pCpu);
+}
+
+
+VOID
+TmrRestartTick(
+    VOID
+)
+{
+    PPCPU pCpu;
+    QWORD flags;
+
+    if (gKernelGlobalData.Phase < KE_PHASE_PCPU_READY)
+    {
+        return;
+    }
+
+    pCpu = GetCurrentCpu();
+    if (!pCpu->ClockEvent.TickStopped)
+    {
+        return;
+    }
+
+    flags = __readeflags();
+    _disable();
+
+    pCpu->ClockEvent.TickStopped = FALSE;
+    pCpu->ClockEvent.NextTick = TmrGetTime() + TMR_MS_PER_TICK;
+    _TmrReprogramClockEvent(pCpu);
+
+    __writeeflags(flags);
+}
+
+
+VOID
+TmrDumpClockEvents(
+    VOID
+)
+{
+    QWORD uptime = TmrGetTime();
+
+    if (!gTmrTscPerMs)
+    {
+        NLog("[TIMER] PIT at %d Hz on the BSP, no clock events\n", TMR_TICKS_PER_SECOND);
+        return;
+    }
+
+    // a fixed rate tick would have interrupted every CPU uptime / TMR_MS_PER_TICK times
+    NLog("[TIMER] up %lld ms, %lld ticks at a fixed rate\n", uptime, uptime / TMR_MS_PER_TICK);
+    NLog("[TIMER] %-3s %12s %12s %12s\n", "CPU", "EVENTS", "TICKS", "TIMERS");
+
+    for (DWORD i = 0; i < KeGetCpuCount(); i++)
+    {
+        PPCPU pCpu = KeGetCpu(i);
+
+        NLog("[TIMER] %3d %12lld %12lld %12lld\n", i, pCpu->ClockEvent.Events, pCpu->ClockEvent.Ticks,
+            pCpu->Timers.Expired);
+    }
+}
+
+
+VOID
+TmrStallExecution(
+    _In_ DWORD Microseconds
+)
+{
+    // counter 2 is only wired to the speaker, so it can be polled without touching the system timer
+    while (Microseconds)
+    {
+        DWORD chunk = MIN(Microseconds, PIT_MAX_STALL_US);
+        WORD count = (WORD)MAX(1, (PIT_FREQUENCY * chunk) / 1000000);
+        BYTE gate = __inbyte(PIT_REG_GATE) & ~(PIT_GATE_COUNTER2 | PIT_GATE_SPEAKER);
+
+        __outbyte(PIT_REG_GATE, gate);
+
+        _PitSendCommand(PIT_CMD_COUNTER2 | PIT_CMD_RL_LSB_THEN_MSB | PIT_CMD_MODE_COUNTDOWN | PIT_CMD_BINARY_COUNTER);
+        _PitSendData(PIT_REG_COUNTER2, count & 0xFF);
+        _PitSendData(PIT_REG_COUNTER2, (count >> 8) & 0xFF);
+
+        // the count starts on the rising edge of the gate; OUT2 goes high at terminal count
+        __outbyte(PIT_REG_GATE, gate | PIT_GATE_COUNTER2);
+        while (0 == (__inbyte(PIT_REG_GATE) & PIT_GATE_OUT2))
+        {
+            _mm_pause();
+        }
+
+        Microseconds -= chunk;
+    }
+}
@@ -1,11 +1,74 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
+#include "defs.h"
 #include "rtc.h"
 
+#define TMR_TICKS_PER_SECOND        200         // the rate of the scheduler tick
+#define TMR_MS_PER_TICK             (1000 / TMR_TICKS_PER_SECOND)
+
+//
+// Clock events. Once the local APIC of a CPU is up, its timer replaces the PIT: it is armed in TSC-deadline mode (or
+// in one shot mode) for the next scheduler tick or for the first timer of the CPU, whichever comes first. An idle CPU
+// stops its tick and only wakes up for its timers. The time is kept by the TSC, which runs on while the tick is
+// stopped; without an invariant TSC the PIT stays the only tick, on the BSP.
+//
+
+// Per CPU, in the PCPU; touched only by its CPU, with interrupts disabled
+typedef struct _TMR_CLOCK_EVENT
+{
+    volatile BOOLEAN        Active;         // the LAPIC timer of this CPU ticks, the PIT doesn't
+    BOOLEAN                 TickStopped;    // idle, the clock event is armed for the timers only
+    BYTE                    _Padding[6];
+    QWORD                   NextTick;       // TmrGetTime of the next scheduler tick
+    QWORD                   Deadline;       // TmrGetTime the LAPIC timer is armed for, KE_TIMER_NO_EXPIRY if disarmed
+    QWORD                   Events;         // interrupts taken
+    QWORD                   Ticks;          // of those, scheduler ticks
+} TMR_CLOCK_EVENT;
+
 NTSTATUS
 TmrInitializeTimer(
     VOID
 );
 
+// Milliseconds since the timer was initialized; the same on every CPU
+QWORD
+TmrGetTime(
+    VOID
+);
+
+// Starts the LAPIC timer of the current CPU, after its local APIC was enabled; the one of the BSP stops the PIT
+NTSTATUS
+TmrStartClockEvents(
+    VOID
+);
+
+// Something is due at Time on the current CPU: fires the clock event earlier if needed; interrupts disabled
+VOID
+TmrUpdateClockEvent(
+    _In_ QWORD Time
+);
+
+// Called by the idle loops around the wait, with interrupts disabled: an idle CPU gets no ticks, only its timers
+VOID
+TmrStopTick(
+    VOID
+);
+
+VOID
+TmrRestartTick(
+    VOID
+);
+
+VOID
+TmrDumpClockEvents(
+    VOID
+);
+
+// Busy waits, interrupts are not needed
+VOID
+TmrStallExecution(
+    _In_ DWORD Microseconds
+);
+
 #endif // !_TIMER_H_
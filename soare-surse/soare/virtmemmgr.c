@@ -2,11 +2,16 @@
 #include "memdefs.h"
 #include "ntstatus.h"
 #include "mem.h"
+#include "memory.h"
 #include "log.h"
 #include "physmemmgr.h"
 #include "virtmemmgr.h"
 #include "kpool.h"
+#include "slab.h"
+#include "pooltag.h"
 #include "debugger.h"
+#include "spinlock.h"
+#include "smp.h"
 
 #define PTE_COUNT               512
 #define PTE_RECURSIVE_INDEX     511ULL
@@ -36,9 +41,15 @@ static_assert(0xffffff8000000000 == VAS_VMGR_PT, "Unexpected PT");
 #define VAS_LOWMEM              (0ULL)
 #define VAS_STACK               (ONE_TB * 2)
 #define VAS_POOL                (ONE_TB * 3)
-#define VAS_POOL_SIZE           (32 * ONE_MB)
+#define VAS_POOL_SIZE           (ONE_GB)        // reserved, committed on demand by the pool
+#define VAS_POOL_INITIAL        (4 * ONE_MB)
 #define VAS_ONDEMAND            (ONE_TB * 4)
 #define VAS_ONDEMAND_SIZE       (4 * ONE_MB)
+#define VAS_VIRTUAL             (ONE_TB * 5)
+#define VAS_VIRTUAL_SIZE        (ONE_TB)
+#define VAS_VIRTUAL_MAX_ALLOC   (ONE_GB)        // MmUnmapRangeAndNull takes a DWORD length
+
+#define MM_MAP_BATCH            64              // frames taken from the physical memory manager at once
 
 typedef QWORD       PTE, *PPTE;
 
@@ -69,6 +80,12 @@ static QWORD gVirtStackBase;
 static QWORD gVirtStackTop;
 static QWORD gNextStackBase;
 
+// Guards the dynamic windows (stacks, pool commits, ONDEMAND, VIRTUAL) and the page tables that describe them; taken
+// by the public functions, with the interrupts disabled. The _Mm* helpers below expect it to be held.
+static KE_MCS_LOCK gMmVaLock;
+
+static NTSTATUS _MmUnmapRangeAndNull(_Inout_ PVOID *Ptr, _In_ DWORD Length, _In_ DWORD Flags);
+
 
 QWORD
 MmStckMoveBspStackAndAdjustRsp(
@@ -76,6 +93,37 @@ MmStckMoveBspStackAndAdjustRsp(
 );
 
 
+// Every paging structure is allocated with this, so the frames they take are charged to TAG_PAGE_TABLES
+static
+NTSTATUS
+_MmAllocTableFrame(
+    _Out_ QWORD *Pa
+)
+{
+    NTSTATUS status = MmAllocPhysicalPage(Pa);
+    if (!NT_SUCCESS(status))
+    {
+        MmTagFailure(TAG_PAGE_TABLES);
+        return status;
+    }
+
+    MmTagCharge(TAG_PAGE_TABLES, PAGE_SIZE_4K);
+
+    return STATUS_SUCCESS;
+}
+
+
+static
+VOID
+_MmFreeTableFrame(
+    _In_ QWORD Pa
+)
+{
+    MmFreePhysicalPage(Pa);
+    MmTagCredit(TAG_PAGE_TABLES, PAGE_SIZE_4K);
+}
+
+
 static 
 NTSTATUS
 _MmPhase1GetNextTable(
@@ -90,7 +138,7 @@ _MmPhase1GetNextTable(
     if (!(pte & PTE_P))
     {
         QWORD pa = 0;
-        NTSTATUS status = MmAllocPhysicalPage(&pa);
+        NTSTATUS status = _MmAllocTableFrame(&pa);
         if (!NT_SUCCESS(status))
         {
             return status;
@@ -168,78 +216,167 @@ _MmPhase1MapContigousRegion(
 }
 
 
+//
+// Generic page table walker
+//
+// The range is split between the entries of each paging structure level. Non-present entries and large pages are
+// reported as a single item, so a sparse range is walked in a number of steps proportional to the number of paging
+// structures actually present, not to the number of 4K pages in it.
+//
+
+static const QWORD gMmLevelSpan[] = 
+{
+    0,                      // unused
+    PAGE_SIZE_4K,           // levelPt
+    PAGE_SIZE_2M,           // levelPd
+    PAGE_SIZE_1G,           // levelPdp
+    PAGE_SIZE_1G * 512,     // levelPml4
+};
+
+
+static __forceinline
+PPT
+_MmGetTableForLevel(
+    _In_ TABLE_LEVEL Level,
+    _In_ QWORD Va
+)
+{
+    switch (Level)
+    {
+    case levelPml4: return (PT *)VA2PML4(Va);
+    case levelPdp: return (PT *)VA2PDP(Va);
+    case levelPd: return (PT *)VA2PD(Va);
+    default: return (PT *)VA2PT(Va);
+    }
+}
+
+
 static
 BOOLEAN
-_MmIsVaRangeFree(
+_MmWalkTable(
+    _In_ TABLE_LEVEL Level,
     _In_ QWORD Start,
-    _In_ QWORD Length
+    _In_ QWORD End,
+    _In_ DWORD Flags,
+    _In_ PFN_MmWalkCallback Callback,
+    _Inout_opt_ PVOID Context
 )
 {
-    QWORD va = ROUND_DOWN(Start, PAGE_SIZE_4K);
-    QWORD vaEnd = va + ROUND_UP(Length, PAGE_SIZE_4K);
+    const QWORD span = gMmLevelSpan[Level];
+    PPT pTable = _MmGetTableForLevel(Level, Start);
+    QWORD va = Start;
 
-    while (va < vaEnd)
+    while (va < End)
     {
-        PPT pTable = (PT *)VA2PML4(va);
-        PTE pte = pTable->Entries[PML4_INDEX(va)];
+        QWORD entryStart = ROUND_DOWN(va, span);
+        QWORD entryEnd = MIN(entryStart + span, End);
+        WORD idx = (WORD)((va >> (PT_IDX_SHIFT + 9 * (Level - 1))) & 0x1FF);
+        PTE pte = pTable->Entries[idx];
+        MM_WALK_ENTRY entry;
+
+        entry.Level = (BYTE)Level;
+        entry.Va = va;
+        entry.Size = entryEnd - va;
+        entry.Pte = pte;
+        entry.PtePtr = &pTable->Entries[idx];
 
-        if (0 == (pte & PML4E_P))
+        if (0 == (pte & PTE_P))
         {
-            // the 512G range described by this PML4E is free
-            va = ROUND_DOWN(va, PAGE_SIZE_1G * 512) + PAGE_SIZE_1G * 512;
-            continue;
+            if (0 != (Flags & MM_WALK_FLG_HOLES))
+            {
+                entry.Type = mmWalkHole;
+                if (!Callback(&entry, Context))
+                {
+                    return FALSE;
+                }
+            }
         }
-
-        pTable = (PT *)VA2PDP(va);
-        pte = pTable->Entries[PDP_INDEX(va)];
-
-        if (0 == (pte & PDPE_P))
+        else if (levelPt == Level || ((levelPd == Level || levelPdp == Level) && 0 != (pte & PDE_PS)))
         {
-            // the entire 1G range described by this PML4E is free
-            va = ROUND_DOWN(va, PAGE_SIZE_1G) + PAGE_SIZE_1G;
-            continue;
+            entry.Type = mmWalkLeaf;
+            if (!Callback(&entry, Context))
+            {
+                return FALSE;
+            }
         }
-
-        if (0 != (pte & PDPE_PS))
+        else
         {
-            // this is a 1G page
-            return FALSE;
+            if (0 != (Flags & MM_WALK_FLG_TABLES))
+            {
+                entry.Type = mmWalkTable;
+                if (!Callback(&entry, Context))
+                {
+                    return FALSE;
+                }
+            }
+
+            if (!_MmWalkTable(Level - 1, va, entryEnd, Flags, Callback, Context))
+            {
+                return FALSE;
+            }
         }
 
-        pTable = (PT *)VA2PD(va);
-        pte = pTable->Entries[PD_INDEX(va)];
+        va = entryEnd;
+    }
 
-        if (0 == (pte & PDE_P))
-        {
-            // the entire 2M range described by this PML4E is free
-            va = ROUND_DOWN(va, PAGE_SIZE_2M) + PAGE_SIZE_2M;
-            continue;
-        }
+    return TRUE;
+}
 
-        if (0 != (pte & PDE_PS))
-        {
-            // this is a 2M page
-            return FALSE;
-        }
 
-        pTable = (PT *)VA2PT(va);
-        pte = pTable->Entries[PT_INDEX(va)];
+NTSTATUS
+MmWalkVaRange(
+    _In_ QWORD Start,
+    _In_ QWORD Length,
+    _In_ DWORD Flags,
+    _In_ PFN_MmWalkCallback Callback,
+    _Inout_opt_ PVOID Context
+)
+{
+    if (!Length || Start + Length < Start)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
 
-        if (0 == (pte & PTE_P))
-        {
-            // free 4K page
-            va += PAGE_SIZE_4K;
-            continue;
-        }
+    if (!Callback)
+    {
+        return STATUS_INVALID_PARAMETER_4;
+    }
 
-        if (0 != (pte & PDE_PS))
-        {
-            // this is a 4K page
-            return FALSE;
-        }
+    if (!_MmWalkTable(levelPml4, Start, Start + Length, Flags, Callback, Context))
+    {
+        return STATUS_CANCELLED;
     }
 
-    return TRUE;
+    return STATUS_SUCCESS;
+}
+
+
+static
+BOOLEAN
+_MmStopOnLeafCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    UNREFERENCED_PARAMETER(Entry);
+    UNREFERENCED_PARAMETER(Context);
+
+    // any present page means that the range is not free
+    return FALSE;
+}
+
+
+static
+BOOLEAN
+_MmIsVaRangeFree(
+    _In_ QWORD Start,
+    _In_ QWORD Length
+)
+{
+    QWORD va = ROUND_DOWN(Start, PAGE_SIZE_4K);
+    QWORD vaEnd = va + ROUND_UP(Length, PAGE_SIZE_4K);
+
+    return NT_SUCCESS(MmWalkVaRange(va, vaEnd - va, 0, _MmStopOnLeafCallback, NULL));
 }
 
 
@@ -250,11 +387,17 @@ _MmPreAllocVas(
     _In_ QWORD Base,
     _In_ DWORD Length,
     _In_ WORD Attributes,
-    _In_ BOOLEAN Empty
+    _In_ BOOLEAN Empty,
+    _In_ BOOLEAN LargePages             // back 2M aligned chunks with 2M pages when possible
 )
 {
     DWORD pteCount = SMALL_PAGE_COUNT(Length);
     QWORD nextVa = Base;
+    DWORD largeCount = 0;
+    QWORD frames[MM_MAP_BATCH];
+    DWORD framesNext = 0;
+    DWORD framesAvailable = 0;
+    NTSTATUS status = STATUS_SUCCESS;
 
     LogWithInfo("[VIRTMEM] Initializing VAS %s = [%018p, %018p) using %d 4K pages\n",
         Name ? Name : "", Base, Base + Length, pteCount);
@@ -267,15 +410,35 @@ _MmPreAllocVas(
         PPT pPt = (PT *)VA2PT(nextVa);
         PTE pte;
 
+        if (!Empty && LargePages && 0 == nextVa % PAGE_SIZE_2M && pteCount - p >= PTE_COUNT)
+        {
+            QWORD pa = 0;
+
+            // if there are no aligned contiguous frames left, or a PT is already in place (the chunk was mapped
+            // with 4K pages before), this chunk is mapped with 4K pages
+            if (NT_SUCCESS(MmAllocPhysicalRange(PTE_COUNT, PAGE_SIZE_2M, &pa)))
+            {
+                if (NT_SUCCESS(MmMapVaToPa(pa, nextVa, TRUE, Attributes | PDE_P)))
+                {
+                    largeCount++;
+                    nextVa += PAGE_SIZE_2M;
+                    p += PTE_COUNT - 1;
+                    continue;
+                }
+
+                MmFreePhysicalRange(pa, PAGE_SIZE_2M);
+            }
+        }
+
         pte = pPml4->Entries[PML4_INDEX(nextVa)];
         // no PDP, create one
         if (0 == (pte & PTE_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                return status;
+                goto _cleanup_and_exit;
             }
 
             pPml4->Entries[PML4_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_RW | PTE_US;
@@ -287,10 +450,10 @@ _MmPreAllocVas(
         if (0 == (pte & PTE_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                return status;
+                goto _cleanup_and_exit;
             }
 
             pPdp->Entries[PDP_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_RW | PTE_US;
@@ -302,10 +465,10 @@ _MmPreAllocVas(
         if (0 == (pte & PTE_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                return status;
+                goto _cleanup_and_exit;
             }
 
             pPd->Entries[PD_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_RW | PTE_US;
@@ -317,20 +480,29 @@ _MmPreAllocVas(
         if (0 != (pte & PTE_P))
         {
             LogWithInfo("[FATAL ERROR] VA %018p is already reserved. PTE = %018p\n", nextVa, pte);
-            return STATUS_INTERNAL_ERROR;
+            status = STATUS_INTERNAL_ERROR;
+            goto _cleanup_and_exit;
         }
         else
         {
             if (!Empty)
             {
-                QWORD pa = 0;
-                NTSTATUS status = MmAllocPhysicalPage(&pa);
-                if (!NT_SUCCESS(status))
+                // the frames are taken in batches; this is an upper bound, 2M chunks may still come; a frame used
+                // after a 2M chunk still has the colour of its VA, 2M is a multiple of the colour span
+                if (framesNext == framesAvailable)
                 {
-                    return status;
+                    framesNext = 0;
+                    framesAvailable = MIN(pteCount - p, MM_MAP_BATCH);
+
+                    status = MmAllocPhysicalPagesColoured(nextVa, framesAvailable, frames);
+                    if (!NT_SUCCESS(status))
+                    {
+                        framesAvailable = 0;
+                        goto _cleanup_and_exit;
+                    }
                 }
 
-                pPt->Entries[PT_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | Attributes | PTE_P;
+                pPt->Entries[PT_INDEX(nextVa)] = CLEAN_PHYADDR(frames[framesNext++]) | Attributes | PTE_P;
             }
             else
             {
@@ -341,7 +513,26 @@ _MmPreAllocVas(
         nextVa += PAGE_SIZE_4K;
     }
 
-    return STATUS_SUCCESS;
+    if (largeCount)
+    {
+        LogWithInfo("[VIRTMEM] VAS %s: %d 2M pages, %d 4K pages\n", Name ? Name : "",
+            largeCount, pteCount - largeCount * PTE_COUNT);
+    }
+
+_cleanup_and_exit:
+    if (framesNext < framesAvailable)
+    {
+        MmFreePhysicalPages(framesAvailable - framesNext, &frames[framesNext]);
+    }
+
+    // all or nothing: what was mapped before the failure goes back, the paging structures stay like on a decommit
+    if (!NT_SUCCESS(status) && !Empty && nextVa > Base)
+    {
+        PVOID ptr = (PVOID)Base;
+        _MmUnmapRangeAndNull(&ptr, (DWORD)(nextVa - Base), 0);
+    }
+
+    return status;
 }
 
 
@@ -378,15 +569,16 @@ MmMapContigousPhysicalRegion(
         if (!(pPml4->Entries[PML4_INDEX(nextVa)] & PML4E_P))
         {
             QWORD pa = 0;
-            status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                LogWithInfo("[ERROR] MmAllocPhysicalPage failed: 0x%08x\n", status);
+                LogWithInfo("[ERROR] _MmAllocTableFrame failed: 0x%08x\n", status);
                 return status;
             }
 
-            memset(pPml4, 0, sizeof(PT));
+            // zero the new table, not its parent; the recursive mapping reaches it once it is linked
             pPml4->Entries[PML4_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_US | PTE_RW;
+            memset((PVOID)VA2PDP(nextVa), 0, sizeof(PT));
         }
 
         pPdp = (PT *)VA2PDP(nextVa);
@@ -394,15 +586,15 @@ MmMapContigousPhysicalRegion(
         if (!(pPdp->Entries[PDP_INDEX(nextVa)] & PDPE_P))
         {
             QWORD pa = 0;
-            status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                LogWithInfo("[ERROR] MmAllocPhysicalPage failed: 0x%08x\n", status);
+                LogWithInfo("[ERROR] _MmAllocTableFrame failed: 0x%08x\n", status);
                 return status;
             }
 
-            memset(pPdp, 0, sizeof(PT));
             pPdp->Entries[PDP_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_US | PTE_RW;
+            memset((PVOID)VA2PD(nextVa), 0, sizeof(PT));
         }
 
         pPd = (PT *)VA2PD(nextVa);
@@ -410,15 +602,15 @@ MmMapContigousPhysicalRegion(
         if (!(pPd->Entries[PD_INDEX(nextVa)] & PDE_P))
         {
             QWORD pa = 0;
-            status = MmAllocPhysicalPage(&pa);
+            status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
-                LogWithInfo("[ERROR] MmAllocPhysicalPage failed: 0x%08x\n", status);
+                LogWithInfo("[ERROR] _MmAllocTableFrame failed: 0x%08x\n", status);
                 return status;
             }
 
-            memset(pPd, 0, sizeof(PT));
             pPd->Entries[PD_INDEX(nextVa)] = CLEAN_PHYADDR(pa) | PTE_P | PTE_US | PTE_RW;
+            memset((PVOID)VA2PT(nextVa), 0, sizeof(PT));
         }
 
         pPt = (PT *)VA2PT(nextVa);
@@ -465,7 +657,7 @@ MmMapVaToPa(
     {
         // the needed PDP is not present, create one
         QWORD pa = 0;
-        NTSTATUS status = MmAllocPhysicalPage(&pa);
+        NTSTATUS status = _MmAllocTableFrame(&pa);
         if (!NT_SUCCESS(status))
         {
             return status;
@@ -487,7 +679,7 @@ MmMapVaToPa(
     {
         // the needed PD is not present, create one
         QWORD pa = 0;
-        NTSTATUS status = MmAllocPhysicalPage(&pa);
+        NTSTATUS status = _MmAllocTableFrame(&pa);
         if (!NT_SUCCESS(status))
         {
             return status;
@@ -525,7 +717,7 @@ MmMapVaToPa(
         {
             // the needed PT is not present, create one
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            NTSTATUS status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
                 return status;
@@ -555,6 +747,56 @@ MmMapVaToPa(
 }
 
 
+NTSTATUS
+MmCommitRange(
+    _In_ QWORD VaBase,
+    _In_ DWORD Length
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    if (VaBase % PAGE_SIZE_4K)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Length || Length % PAGE_SIZE_4K)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+    status = _MmPreAllocVas("COMMIT", VaBase, Length, PTE_P | PTE_RW | PTE_US, FALSE, TRUE);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+NTSTATUS
+MmDecommitRange(
+    _In_ QWORD VaBase,
+    _In_ DWORD Length
+)
+{
+    PVOID ptr = (PVOID)VaBase;
+
+    if (!VaBase || VaBase % PAGE_SIZE_4K)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Length || Length % PAGE_SIZE_4K)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    // the paging structures are kept, the range will most likely be committed again
+    return MmUnmapRangeAndNull(&ptr, Length, 0);
+}
+
+
 NTSTATUS
 MmStackAlloc(
     _In_ DWORD Size,
@@ -562,6 +804,9 @@ MmStackAlloc(
 )
 {
     DWORD pages = SMALL_PAGE_COUNT(Size);
+    KE_MCS_HANDLE lock;
+    NTSTATUS status = STATUS_SUCCESS;
+    QWORD base;
 
     if (Size % PAGE_SIZE_4K)
     {
@@ -573,33 +818,66 @@ MmStackAlloc(
         return STATUS_INVALID_PARAMETER_2;
     }
 
-    if (gNextStackBase + Size >= gVirtStackTop)
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+    base = gNextStackBase;
+
+    if (base + PAGE_SIZE_4K + Size >= gVirtStackTop)
     {
-        return STATUS_NO_MEMORY;
+        status = STATUS_NO_MEMORY;
+        goto _cleanup_and_exit;
     }
 
-    for (DWORD i = 0; i < pages; i++)
+    // the page below every stack stays unmapped, an overflow faults there instead of running into the next stack
+    gNextStackBase += PAGE_SIZE_4K;
+
+    for (DWORD mapped = 0; mapped < pages; )
     {
-        QWORD pa = 0;
-        NTSTATUS status = MmAllocPhysicalPage(&pa);
+        QWORD frames[MM_MAP_BATCH];
+        DWORD count = MIN(pages - mapped, MM_MAP_BATCH);
+
+        status = MmAllocPhysicalPagesColoured(gNextStackBase, count, frames);
         if (!NT_SUCCESS(status))
         {
-            return status;
+            MmTagFailure(TAG_STACK);
+            goto _cleanup_and_exit;
         }
 
-        status = MmMapVaToPa(pa, gNextStackBase, FALSE, PTE_P | PTE_US | PTE_RW);
+        status = MmMapFrames(gNextStackBase, frames, count, PTE_P | PTE_US | PTE_RW);
         if (!NT_SUCCESS(status))
         {
-            LogWithInfo("[ERROR] MmMapVaToPa failed for %018p -> %018p: 0x%08x\n", pa, gNextStackBase, status);
-            return status;
+            LogWithInfo("[ERROR] MmMapFrames failed for %018p: 0x%08x\n", gNextStackBase, status);
+            MmFreePhysicalPages(count, frames);
+            goto _cleanup_and_exit;
         }
 
-        gNextStackBase += PAGE_SIZE_4K;
+        MmTagChargeMany(TAG_STACK, count, (QWORD)count * PAGE_SIZE_4K);
+
+        gNextStackBase += (QWORD)count * PAGE_SIZE_4K;
+        mapped += count;
     }
 
     *StackTop = gNextStackBase - PAGE_SIZE_4K;
 
-    return STATUS_SUCCESS;
+_cleanup_and_exit:
+    // all or nothing: the batches mapped before the failure go back, and so does their VA, guard page included
+    if (!NT_SUCCESS(status))
+    {
+        if (gNextStackBase > base + PAGE_SIZE_4K)
+        {
+            PVOID ptr = (PVOID)(base + PAGE_SIZE_4K);
+            DWORD mapped = (DWORD)((gNextStackBase - base) / PAGE_SIZE_4K) - 1;
+
+            _MmUnmapRangeAndNull(&ptr, mapped * PAGE_SIZE_4K, 0);
+            MmTagCreditMany(TAG_STACK, mapped, (QWORD)mapped * PAGE_SIZE_4K);
+        }
+
+        gNextStackBase = base;
+    }
+
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
 }
 
 
@@ -642,10 +920,10 @@ MmVirtualManagerInit(
     //Log("\t%d pages (%d MB)\n", pagesNeeded, ByteToMb(pagesNeeded * PAGE_SIZE_4K));
 
     pdbr = 0;
-    status = MmAllocPhysicalPage(&pdbr);
+    status = _MmAllocTableFrame(&pdbr);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] MmAllocPhysicalPage failed: 0x%08x\n", status);
+        LogWithInfo("[ERROR] _MmAllocTableFrame failed: 0x%08x\n", status);
         return status;
     }
 
@@ -701,26 +979,27 @@ MmVirtualManagerInit(
     magic = MmStckMoveBspStackAndAdjustRsp(rsp - sizeof(PVOID));
     Log("Magic: %018p\n", magic);
 
-    // init all the VAS
-    status = _MmPreAllocVas("POOL", VAS_POOL, VAS_POOL_SIZE, PTE_P | PTE_RW | PTE_US, FALSE);
+    // init all the VAS; the pool VAS is committed by the pool itself
+    status = _MmPreAllocVas("ONDEMAND", VAS_ONDEMAND, VAS_ONDEMAND_SIZE, PTE_P | PTE_RW | PTE_US, TRUE, FALSE);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] _MmPreAllocVas failed for %018p: 0x%08x\n", VAS_POOL, status);
+        LogWithInfo("[ERROR] _MmPreAllocVas failed for %018p: 0x%08x\n", VAS_ONDEMAND, status);
         return status;
     }
 
-    status = _MmPreAllocVas("ONDEMAND", VAS_ONDEMAND, VAS_ONDEMAND_SIZE, PTE_P | PTE_RW | PTE_US, TRUE);
+    // init the kernel pool allocator
+    status = KpInit((VOID *)VAS_POOL, VAS_POOL_SIZE, VAS_POOL_INITIAL);
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] _MmPreAllocVas failed for %018p: 0x%08x\n", VAS_ONDEMAND, status);
+        LogWithInfo("[ERROR] KpInit failed: 0x%08x\n", status);
         return status;
     }
 
-    // init the kernel pool allocator
-    status = KpInit((VOID *)VAS_POOL, 32 * ONE_MB, PAGE_SIZE_4K);
+    // and the small object allocator on top of it
+    status = KmInit();
     if (!NT_SUCCESS(status))
     {
-        LogWithInfo("[ERROR] KpInit failed: 0x%08x\n", status);
+        LogWithInfo("[ERROR] KmInit failed: 0x%08x\n", status);
         return status;
     }
 
@@ -728,61 +1007,49 @@ MmVirtualManagerInit(
 }
 
 
-NTSTATUS
-MmTranslateVa(
-    _In_ PVOID Va,
-    _Out_ QWORD *Pa,
-    _Out_ DWORD *PageSize
-)
+typedef struct _MM_TRANSLATE_CONTEXT
 {
-    PPT pTable = (PT *)VA2PML4(Va);
-    PTE pte = pTable->Entries[PML4_INDEX((QWORD)Va)];
-
-    if (0 == (pte & PML4E_P))
-    {
-        return STATUS_UNSUCCESSFUL;
-    }
+    QWORD       Pa;
+    DWORD       PageSize;
+    BOOLEAN     Found;
+} MM_TRANSLATE_CONTEXT;
 
-    pTable = (PT *)VA2PDP((QWORD)Va);
-    pte = pTable->Entries[PDP_INDEX((QWORD)Va)];
-
-    if (0 == (pte & PDPE_P))
-    {
-        return STATUS_UNSUCCESSFUL;
-    }
 
-    if (0 != (pte & PDPE_PS))
-    {
-        *PageSize = PAGE_SIZE_1G;
-        *Pa = (pte & ~OFFSET_1G_MASK) | ((QWORD)Va & OFFSET_1G_MASK);
-        return STATUS_SUCCESS;
-    }
+static
+BOOLEAN
+_MmTranslateCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    MM_TRANSLATE_CONTEXT *pCtx = (MM_TRANSLATE_CONTEXT *)Context;
+    QWORD pageSize = gMmLevelSpan[Entry->Level];
 
-    pTable = (PT *)VA2PD((QWORD)Va);
-    pte = pTable->Entries[PD_INDEX((QWORD)Va)];
+    pCtx->PageSize = (DWORD)pageSize;
+    pCtx->Pa = (CLEAN_PHYADDR(Entry->Pte) & ~(pageSize - 1)) | (Entry->Va & (pageSize - 1));
+    pCtx->Found = TRUE;
 
-    if (0 == (pte & PDE_P))
-    {
-        return STATUS_UNSUCCESSFUL;
-    }
+    return FALSE;
+}
 
-    if (0 != (pte & PDE_PS))
-    {
-        *PageSize = PAGE_SIZE_2M;
-        *Pa = (pte & ~OFFSET_2M_MASK) | ((QWORD)Va & OFFSET_2M_MASK);
-        return STATUS_SUCCESS;
-    }
 
-    pTable = (PT *)VA2PT((QWORD)Va);
-    pte = pTable->Entries[PT_INDEX((QWORD)Va)];
+NTSTATUS
+MmTranslateVa(
+    _In_ PVOID Va,
+    _Out_ QWORD *Pa,
+    _Out_ DWORD *PageSize
+)
+{
+    MM_TRANSLATE_CONTEXT ctx = { 0 };
 
-    if (0 == (pte & PTE_P))
+    MmWalkVaRange((QWORD)Va, 1, 0, _MmTranslateCallback, &ctx);
+    if (!ctx.Found)
     {
         return STATUS_UNSUCCESSFUL;
     }
 
-    *PageSize = PAGE_SIZE_4K;
-    *Pa = (pte & ~OFFSET_4K_MASK) | ((QWORD)Va & OFFSET_4K_MASK);
+    *PageSize = ctx.PageSize;
+    *Pa = ctx.Pa;
 
     return STATUS_SUCCESS;
 }
@@ -814,7 +1081,7 @@ _MmGetFirstFreePteInVas(
         if (0 == (pte & PML4E_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            NTSTATUS status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
                 return status;
@@ -830,7 +1097,7 @@ _MmGetFirstFreePteInVas(
         if (0 == (pte & PDPE_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            NTSTATUS status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
                 return status;
@@ -846,7 +1113,7 @@ _MmGetFirstFreePteInVas(
         if (0 == (pte & PDE_P))
         {
             QWORD pa = 0;
-            NTSTATUS status = MmAllocPhysicalPage(&pa);
+            NTSTATUS status = _MmAllocTableFrame(&pa);
             if (!NT_SUCCESS(status))
             {
                 return status;
@@ -880,6 +1147,42 @@ _MmGetFirstFreePteInVas(
 }
 
 
+typedef struct _MM_FREE_RANGE_CONTEXT
+{
+    QWORD       Needed;
+    QWORD       RunStart;
+    QWORD       RunLength;
+} MM_FREE_RANGE_CONTEXT;
+
+
+static
+BOOLEAN
+_MmFreeRangeCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    MM_FREE_RANGE_CONTEXT *pCtx = (MM_FREE_RANGE_CONTEXT *)Context;
+
+    if (mmWalkLeaf == Entry->Type)
+    {
+        // a mapped page breaks the current run
+        pCtx->RunLength = 0;
+        return TRUE;
+    }
+
+    // holes are reported in order, so this one continues the current run
+    if (0 == pCtx->RunLength)
+    {
+        pCtx->RunStart = Entry->Va;
+    }
+
+    pCtx->RunLength += Entry->Size;
+
+    return pCtx->RunLength < pCtx->Needed;
+}
+
+
 static
 NTSTATUS
 _MmGetFreeRangeInVas(
@@ -889,66 +1192,15 @@ _MmGetFreeRangeInVas(
     _Out_ QWORD *FirstFreeVa
 )
 {
-    QWORD vasPages = SMALL_PAGE_COUNT(VasLength);
-    QWORD neededPages = SMALL_PAGE_COUNT(RangeLength);
-    QWORD pagesLeft = neededPages;
-    QWORD va = VasBase;
-    QWORD start = 0;
+    MM_FREE_RANGE_CONTEXT ctx = { 0 };
+    NTSTATUS status;
 
-    for (QWORD p = 0; p < vasPages && 0 != pagesLeft; p++)
-    {
-        PPT pTable;
-        PTE pte;
+    ctx.Needed = SMALL_PAGE_COUNT(RangeLength) * PAGE_SIZE_4K;
 
-        // check PML4E
-        pTable = (PT *)VA2PML4(va);
-        pte = pTable->Entries[PML4_INDEX(va)];
-        if (0 == (pte & PTE_P))
-        {
-            pagesLeft = neededPages;
-            start = 0;
-            goto _next;
-        }
-
-        // check PDPE
-        pTable = (PT *)VA2PDP(va);
-        pte = pTable->Entries[PDP_INDEX(va)];
-        if (0 == (pte & PTE_P))
-        {
-            pagesLeft = neededPages;
-            start = 0;
-            goto _next;
-        }
-
-        // check PDE
-        pTable = (PT *)VA2PD(va);
-        pte = pTable->Entries[PD_INDEX(va)];
-        if (0 == (pte & PTE_P))
-        {
-            pagesLeft = neededPages;
-            start = 0;
-            goto _next;
-        }
-
-        // check PTE
-        pTable = (PT *)VA2PT(va);
-        pte = pTable->Entries[PT_INDEX(va)];
-        if (0 == (pte & PTE_P))
-        {
-            if (!start)
-            {
-                start = va;
-            }
-            pagesLeft--;
-        }
-
-    _next:
-        va += PAGE_SIZE_4K;
-    }
-
-    if (!pagesLeft && start)
+    status = MmWalkVaRange(VasBase, VasLength, MM_WALK_FLG_HOLES, _MmFreeRangeCallback, &ctx);
+    if (STATUS_CANCELLED == status)
     {
-        *FirstFreeVa = start;
+        *FirstFreeVa = ctx.RunStart;
         return STATUS_SUCCESS;
     }
 
@@ -956,9 +1208,9 @@ _MmGetFreeRangeInVas(
 }
 
 
-
+static
 NTSTATUS
-MmMapPhysicalPages(
+_MmMapPhysicalPages(
     _In_ QWORD PhysicalBase,
     _In_ DWORD RangeSize,
     _Out_ PVOID *Ptr,
@@ -1026,71 +1278,1123 @@ _cleanup_and_exit:
 
 
 NTSTATUS
-MmUnmapRangeAndNull(
-    _Inout_ PVOID *Ptr,
-    _In_ DWORD Length,
+MmMapPhysicalPages(
+    _In_ QWORD PhysicalBase,
+    _In_ DWORD RangeSize,
+    _Out_ PVOID *Ptr,
     _In_ DWORD Flags
 )
 {
-    QWORD pages;
-    QWORD qwPtr;
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
 
-    if (!Ptr || !*Ptr)
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+    status = _MmMapPhysicalPages(PhysicalBase, RangeSize, Ptr, Flags);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+//
+// Virtually contiguous allocations
+//
+// The VIRTUAL window hands out page granular ranges backed by frames taken in batches from anywhere in the bitmap,
+// so a large buffer never depends on physically contiguous memory. Every range is surrounded by unmapped guard pages:
+// an overrun faults instead of corrupting the next range, and the free path finds the end of a range by walking its
+// leaves up to the first hole, so the length doesn't have to be remembered anywhere. The start of a range is recorded
+// in its first PTE, with a bit the CPU ignores: only a pointer returned by MmAllocVirtual can be freed.
+//
+#define MM_PTE_RANGE_START      0x0200          // available to software
+
+typedef struct _MM_RANGE_LENGTH_CONTEXT
+{
+    QWORD       Length;
+    BOOLEAN     IsStart;        // the first page is the start of a range
+} MM_RANGE_LENGTH_CONTEXT;
+
+
+static
+NTSTATUS
+_MmEnsurePt(
+    _In_ QWORD Va,
+    _Out_ PPT *Pt
+)
+{
+    const TABLE_LEVEL levels[] = { levelPml4, levelPdp, levelPd };
+
+    for (DWORD i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
     {
-        return STATUS_INVALID_PARAMETER_1;
+        PPT pTable = _MmGetTableForLevel(levels[i], Va);
+        WORD idx = (WORD)((Va >> (PT_IDX_SHIFT + 9 * (levels[i] - 1))) & 0x1FF);
+
+        if (0 == (pTable->Entries[idx] & PTE_P))
+        {
+            QWORD pa = 0;
+            NTSTATUS status = _MmAllocTableFrame(&pa);
+            if (!NT_SUCCESS(status))
+            {
+                return status;
+            }
+
+            pTable->Entries[idx] = CLEAN_PHYADDR(pa) | PTE_P | PTE_RW | PTE_US;
+            memset(_MmGetTableForLevel(levels[i] - 1, Va), 0, sizeof(PT));
+        }
+        else if (0 != (pTable->Entries[idx] & PDE_PS))
+        {
+            return STATUS_PAGE_ALREADY_RESERVED;
+        }
     }
 
-    LogWithInfo("[PAMAP] Requested unmap for [%018p, %018p)\n", *Ptr, (QWORD)*Ptr + Length);
+    *Pt = (PT *)VA2PT(Va);
 
-    qwPtr = ROUND_DOWN((QWORD)*Ptr, PAGE_SIZE_4K);
-    Length = (DWORD)(ROUND_UP((QWORD)*Ptr + Length, PAGE_SIZE_4K) - qwPtr);
-    pages = SMALL_PAGE_COUNT(Length);
+    return STATUS_SUCCESS;
+}
 
-    LogWithInfo("[PAMAP] Will free [%018p, %018p)\n", qwPtr, qwPtr + Length);
 
-    for (QWORD p = 0; p < pages; p++)
+NTSTATUS
+MmMapFrames(
+    _In_ QWORD VaBase,
+    _In_ const QWORD *Frames,
+    _In_ DWORD Count,
+    _In_ WORD Attributes
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    DWORD mapped = 0;
+
+    if (!VaBase || VaBase % PAGE_SIZE_4K)
     {
-        QWORD va = qwPtr + p * PAGE_SIZE_4K;
-        PPT pPt = (PT *)VA2PT(va);
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Frames)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    while (mapped < Count && NT_SUCCESS(status))
+    {
+        QWORD va = VaBase + (QWORD)mapped * PAGE_SIZE_4K;
+        PPT pPt = NULL;
         WORD idx = PT_INDEX(va);
 
-        if (0 == (MAP_FLG_SKIP_PHYPAGE_CHECK & Flags))
+        // the upper levels are looked up once for every PT
+        status = _MmEnsurePt(va, &pPt);
+        if (!NT_SUCCESS(status))
         {
-            QWORD pa = CLEAN_PHYADDR(pPt->Entries[idx]);
-            MmFreePhysicalPage(pa);
+            break;
         }
 
-        pPt->Entries[idx] = 0ULL;
+        for (; idx < PTE_COUNT && mapped < Count; idx++, mapped++)
+        {
+            if (0 != (pPt->Entries[idx] & PTE_P))
+            {
+                status = STATUS_PAGE_ALREADY_RESERVED;
+                break;
+            }
+
+            pPt->Entries[idx] = CLEAN_PHYADDR(Frames[mapped]) | Attributes | PTE_P;
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // undo the entries written so far, the caller still owns the frames
+        for (DWORD i = 0; i < mapped; i++)
+        {
+            QWORD va = VaBase + (QWORD)i * PAGE_SIZE_4K;
+
+            ((PT *)VA2PT(va))->Entries[PT_INDEX(va)] = 0ULL;
+            __invlpg(va);
+        }
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+MmAllocVirtual(
+    _In_ DWORD Size,
+    _In_ DWORD Tag,
+    _Out_ PVOID *Ptr
+)
+{
+    NTSTATUS status;
+    DWORD pages = SMALL_PAGE_COUNT(Size);
+    QWORD base = 0;
+    DWORD mapped = 0;
+    KE_MCS_HANDLE lock;
+
+    if (!Size || Size > VAS_VIRTUAL_MAX_ALLOC)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    if (!Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_3;
+    }
+
+    // finding the range and mapping it must not be interleaved with another allocation
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+    status = _MmGetFreeRangeInVas(VAS_VIRTUAL, VAS_VIRTUAL_SIZE, (pages + 2) * PAGE_SIZE_4K, &base);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _MmGetFreeRangeInVas failed for %d pages: 0x%08x\n", pages, status);
+        goto _cleanup_and_exit;
+    }
+
+    // skip the leading guard page, the trailing one is the page after the range
+    base += PAGE_SIZE_4K;
+
+    while (mapped < pages)
+    {
+        QWORD frames[MM_MAP_BATCH];
+        DWORD count = MIN(pages - mapped, MM_MAP_BATCH);
+
+        status = MmAllocPhysicalPagesColoured(base + (QWORD)mapped * PAGE_SIZE_4K, count, frames);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] MmAllocPhysicalPagesColoured failed for %d pages: 0x%08x\n", count, status);
+            break;
+        }
+
+        status = MmMapFrames(base + (QWORD)mapped * PAGE_SIZE_4K, frames, count, PTE_RW | PTE_US);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] MmMapFrames failed for %018p: 0x%08x\n", base + (QWORD)mapped * PAGE_SIZE_4K, status);
+            MmFreePhysicalPages(count, frames);
+            break;
+        }
+
+        mapped += count;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // the batch that failed is not mapped, the previous ones are
+        if (mapped)
+        {
+            PVOID ptr = (PVOID)base;
+            _MmUnmapRangeAndNull(&ptr, mapped * PAGE_SIZE_4K, 0);
+        }
+
+        goto _cleanup_and_exit;
+    }
+
+    ((PT *)VA2PT(base))->Entries[PT_INDEX(base)] |= MM_PTE_RANGE_START;
+
+    MmTagCharge(Tag, (QWORD)pages * PAGE_SIZE_4K);
+    *Ptr = (PVOID)base;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    if (!NT_SUCCESS(status))
+    {
+        MmTagFailure(Tag);
+    }
+
+    return status;
+}
+
+
+static
+BOOLEAN
+_MmRangeLengthCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    MM_RANGE_LENGTH_CONTEXT *pCtx = (MM_RANGE_LENGTH_CONTEXT *)Context;
+
+    // the trailing guard page
+    if (mmWalkHole == Entry->Type)
+    {
+        return FALSE;
+    }
+
+    if (!pCtx->Length)
+    {
+        pCtx->IsStart = levelPt == Entry->Level && 0 != (Entry->Pte & MM_PTE_RANGE_START);
+        if (!pCtx->IsStart)
+        {
+            return FALSE;
+        }
+    }
+
+    pCtx->Length += Entry->Size;
+
+    return TRUE;
+}
+
+
+NTSTATUS
+MmFreeVirtualAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag
+)
+{
+    MM_RANGE_LENGTH_CONTEXT ctx = { 0 };
+    QWORD va;
+    NTSTATUS status;
+    KE_MCS_HANDLE lock;
+
+    if (!Ptr || !*Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    va = (QWORD)*Ptr;
+    if (va % PAGE_SIZE_4K || va < VAS_VIRTUAL + PAGE_SIZE_4K || va >= VAS_VIRTUAL + VAS_VIRTUAL_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    if (!Tag)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+    MmWalkVaRange(va, VAS_VIRTUAL + VAS_VIRTUAL_SIZE - va, MM_WALK_FLG_HOLES, _MmRangeLengthCallback, &ctx);
+    if (!ctx.IsStart || ctx.Length > VAS_VIRTUAL_MAX_ALLOC)
+    {
+        LogWithInfo("[ERROR] %018p is not the start of an allocated virtual range\n", va);
+        status = STATUS_INVALID_PARAMETER;
+        goto _cleanup_and_exit;
+    }
+
+    status = _MmUnmapRangeAndNull(Ptr, (DWORD)ctx.Length, 0);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _MmUnmapRangeAndNull failed for [%018p, %018p): 0x%08x\n", va, va + ctx.Length, status);
+        goto _cleanup_and_exit;
+    }
+
+    MmTagCredit(Tag, ctx.Length);
+    *Ptr = NULL;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+//
+// Huge page promotion
+//
+// A 2M aligned region that is fully mapped with 4K pages having the same attributes is collapsed into a single 2M
+// page. If the backing frames are not already a 2M aligned physically contiguous run, the contents are migrated to a
+// freshly allocated 2M frame. The PT that described the region is given back to the physical memory manager.
+//
+#define MM_PTE_ATTR_IGNORED     (PHYS_PAGE_MASK | PTE_A | PTE_D)
+#define MM_PROMOTE_BATCH        32
+
+typedef struct _MM_PROMOTION_STATS
+{
+    QWORD       Candidates;
+    QWORD       Promoted;           // collapsed in place, the frames were already contiguous
+    QWORD       Migrated;           // collapsed after copying the contents to a new 2M frame
+    QWORD       Failed;
+    QWORD       Split;              // 2M pages split back into 4K pages
+} MM_PROMOTION_STATS;
+
+static MM_PROMOTION_STATS gMmPromotionStats;
+
+typedef struct _MM_PROMOTE_CONTEXT
+{
+    QWORD       Regions[MM_PROMOTE_BATCH];
+    DWORD       Count;
+} MM_PROMOTE_CONTEXT;
+
+
+static
+NTSTATUS
+_MmSplitLargePage(
+    _In_ QWORD Va
+)
+{
+    NTSTATUS status;
+    PPT pPd = (PT *)VA2PD(Va);
+    WORD pdIdx = PD_INDEX(Va);
+    QWORD pde = pPd->Entries[pdIdx];
+    QWORD base = CLEAN_PHYADDR(pde) & ~(PAGE_SIZE_2M - 1);
+    QWORD attr = pde & ~(PHYS_PAGE_MASK | PDE_PS);
+    QWORD ptPa = 0;
+    PVOID pMap = NULL;
+    PPT pPt;
+
+    status = _MmAllocTableFrame(&ptPa);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _MmAllocTableFrame failed: 0x%08x\n", status);
+        return status;
+    }
+
+    // prepare the table in a temporary mapping, the recursive view only exists after the PDE is switched
+    status = _MmMapPhysicalPages(ptPa, PAGE_SIZE_4K, &pMap, MAP_FLG_SKIP_PHYPAGE_CHECK);
+    if (!NT_SUCCESS(status))
+    {
+        LogWithInfo("[ERROR] _MmMapPhysicalPages failed: 0x%08x\n", status);
+        _MmFreeTableFrame(ptPa);
+        return status;
+    }
 
-        __invlpg(va);
+    pPt = (PT *)pMap;
+    for (DWORD i = 0; i < PTE_COUNT; i++)
+    {
+        pPt->Entries[i] = (base + i * PAGE_SIZE_4K) | attr;
     }
 
+    _MmUnmapRangeAndNull(&pMap, PAGE_SIZE_4K, MAP_FLG_SKIP_PHYPAGE_CHECK);
+
+    pPd->Entries[pdIdx] = ptPa | (attr & (PDE_P | PDE_RW | PDE_US | PDE_PWT | PDE_PCD | PDE_XD));
+    KeFlushTlb(Va & ~(PAGE_SIZE_2M - 1), PAGE_SIZE_2M);
+
+    gMmPromotionStats.Split++;
+
     return STATUS_SUCCESS;
 }
 
 
-VOID
-MmDumpVas(
-    _In_ QWORD VaBase,
-    _In_ QWORD Length
+static
+BOOLEAN
+_MmPromoteCandidateCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
 )
 {
-    QWORD pages = SMALL_PAGE_COUNT(Length);
+    MM_PROMOTE_CONTEXT *pCtx = (MM_PROMOTE_CONTEXT *)Context;
 
-    for (QWORD p = 0; p < pages; p++)
+    // a PDE that points to a PT and covers a whole 2M region of the walked range
+    if (mmWalkTable == Entry->Type && levelPd == Entry->Level && PAGE_SIZE_2M == Entry->Size)
     {
-        QWORD va = VaBase + p * PAGE_SIZE_4K;
-        PPT pPml4 = (PT *)VA2PML4(va);
-        PPT pPdp = (PT *)VA2PDP(va);
-        PPT pPd = (PT *)VA2PD(va);
-        PPT pPt = (PT *)VA2PT(va);
+        pCtx->Regions[pCtx->Count++] = Entry->Va;
+        if (MM_PROMOTE_BATCH == pCtx->Count)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+static
+NTSTATUS
+_MmPromoteRegion(
+    _In_ QWORD Va
+)
+{
+    NTSTATUS status;
+    PPT pPd = (PT *)VA2PD(Va);
+    PPT pPt = (PT *)VA2PT(Va);
+    WORD pdIdx = PD_INDEX(Va);
+    QWORD first = pPt->Entries[0];
+    QWORD attr = first & ~MM_PTE_ATTR_IGNORED;
+    QWORD oldBase = CLEAN_PHYADDR(first);
+    QWORD newBase = 0;
+    QWORD accessed = 0;
+    QWORD ptPa = CLEAN_PHYADDR(pPd->Entries[pdIdx]);
+    QWORD rsp = (QWORD)_AddressOfReturnAddress();
+    BOOLEAN contiguous = (0 == oldBase % PAGE_SIZE_2M);
+    PVOID pCopy = NULL;
+    QWORD flags;
+
+    if (0 == (first & PTE_P) || 0 != (first & PTE_PAT))
+    {
+        // PAT is bit 12 in a 2M entry, keep these regions as they are
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    for (DWORD i = 0; i < PTE_COUNT; i++)
+    {
+        QWORD pte = pPt->Entries[i];
+
+        if ((pte & ~MM_PTE_ATTR_IGNORED) != attr)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (CLEAN_PHYADDR(pte) != oldBase + i * PAGE_SIZE_4K)
+        {
+            contiguous = FALSE;
+        }
+
+        accessed |= pte & (PTE_A | PTE_D);
+    }
+
+    gMmPromotionStats.Candidates++;
+
+    if (!contiguous)
+    {
+        // the stack we are running on can't be moved from under us
+        if (rsp >= Va && rsp < Va + PAGE_SIZE_2M)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        status = MmAllocPhysicalRange(PTE_COUNT, PAGE_SIZE_2M, &newBase);
+        if (!NT_SUCCESS(status))
+        {
+            gMmPromotionStats.Failed++;
+            return status;
+        }
+
+        status = _MmMapPhysicalPages(newBase, PAGE_SIZE_2M, &pCopy, MAP_FLG_SKIP_PHYPAGE_CHECK);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _MmMapPhysicalPages failed: 0x%08x\n", status);
+            MmFreePhysicalRange(newBase, PAGE_SIZE_2M);
+            gMmPromotionStats.Failed++;
+            return status;
+        }
+    }
+    else
+    {
+        newBase = oldBase;
+    }
+
+    // nothing on this CPU may write to the region between the copy and the switch
+    flags = __readeflags();
+    _disable();
+
+    if (!contiguous)
+    {
+        memcpy(pCopy, (PVOID)Va, PAGE_SIZE_2M);
+    }
+
+    pPd->Entries[pdIdx] = newBase | attr | accessed | PDE_PS;
+
+    // the PT is gone from the paging-structure caches only after a full flush, on every CPU, before it is freed
+    KeFlushTlb(Va, PAGE_SIZE_2M);
+
+    __writeeflags(flags);
+
+    _MmFreeTableFrame(ptPa);
+
+    if (!contiguous)
+    {
+        _MmUnmapRangeAndNull(&pCopy, PAGE_SIZE_2M, MAP_FLG_SKIP_PHYPAGE_CHECK);
+
+        for (DWORD i = 0; i < PTE_COUNT; i++)
+        {
+            // the old frames are found through the PT page, which is not reused until now
+            MmFreePhysicalPage(oldBase + i * PAGE_SIZE_4K);
+        }
+
+        gMmPromotionStats.Migrated++;
+    }
+    else
+    {
+        gMmPromotionStats.Promoted++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+MmPromoteLargePages(
+    _In_ QWORD VaBase,
+    _In_ QWORD Length,
+    _Out_opt_ DWORD *Promoted
+)
+{
+    NTSTATUS status;
+    QWORD start = ROUND_UP(VaBase, PAGE_SIZE_2M);
+    QWORD end = ROUND_DOWN(VaBase + Length, PAGE_SIZE_2M);
+    DWORD promoted = 0;
+    KE_MCS_HANDLE lock;
+
+    if (!Length || VaBase + Length < VaBase)
+    {
+        return STATUS_INVALID_PARAMETER_2;
+    }
+
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+    while (start < end)
+    {
+        MM_PROMOTE_CONTEXT ctx = { 0 };
+
+        status = MmWalkVaRange(start, end - start, MM_WALK_FLG_TABLES, _MmPromoteCandidateCallback, &ctx);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] MmWalkVaRange failed: 0x%08x\n", status);
+            KeReleaseMcsLockIrqRestore(&lock);
+            return status;
+        }
+
+        // the tables are changed only after the walk is done with them
+        for (DWORD i = 0; i < ctx.Count; i++)
+        {
+            if (NT_SUCCESS(_MmPromoteRegion(ctx.Regions[i])))
+            {
+                promoted++;
+            }
+        }
+
+        if (STATUS_CANCELLED != status)
+        {
+            break;
+        }
+
+        start = ctx.Regions[ctx.Count - 1] + PAGE_SIZE_2M;
+    }
+
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    if (Promoted)
+    {
+        *Promoted = promoted;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+MmPromoteKernelRegions(
+    VOID
+)
+{
+    DWORD pool = 0;
+
+    // not the stacks: their guard pages leave no 2M region fully mapped, and a 2M page would map the guards
+    MmPromoteLargePages(VAS_POOL, VAS_POOL_SIZE, &pool);
+
+    LogWithInfo("[VIRTMEM] Promoted %d pool regions to 2M pages\n", pool);
+}
+
+
+// The translations of [Va, End) may still be cached by the other CPUs, their frames are freed once none of them is
+static
+VOID
+_MmRetireFrames(
+    _In_ QWORD Va,
+    _In_ QWORD End,
+    _In_reads_(Count) const QWORD *Frames,
+    _In_ DWORD Count
+)
+{
+    if (End > Va)
+    {
+        KeFlushTlb(Va, End - Va);
+    }
+
+    if (Count)
+    {
+        MmFreePhysicalPages(Count, Frames);
+    }
+}
+
+
+static
+NTSTATUS
+_MmUnmapRangeAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Length,
+    _In_ DWORD Flags
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    QWORD frames[MM_MAP_BATCH];
+    DWORD count = 0;
+    QWORD pages;
+    QWORD qwPtr;
+    QWORD flushVa;
+    QWORD end;
+
+    if (!Ptr || !*Ptr)
+    {
+        return STATUS_INVALID_PARAMETER_1;
+    }
+
+    LogWithInfo("[PAMAP] Requested unmap for [%018p, %018p)\n", *Ptr, (QWORD)*Ptr + Length);
+
+    qwPtr = ROUND_DOWN((QWORD)*Ptr, PAGE_SIZE_4K);
+    Length = (DWORD)(ROUND_UP((QWORD)*Ptr + Length, PAGE_SIZE_4K) - qwPtr);
+    pages = SMALL_PAGE_COUNT(Length);
+    end = qwPtr + Length;
+
+    LogWithInfo("[PAMAP] Will free [%018p, %018p)\n", qwPtr, qwPtr + Length);
+
+    // the entries are cleared first; the frames go back in batches, after the shootdown of what was cleared so far
+    flushVa = qwPtr;
+
+    for (QWORD p = 0; p < pages; p++)
+    {
+        QWORD va = qwPtr + p * PAGE_SIZE_4K;
+        PPT pPt = (PT *)VA2PT(va);
+        WORD idx = PT_INDEX(va);
+        PPT pPd = (PT *)VA2PD(va);
+        QWORD pde = pPd->Entries[PD_INDEX(va)];
+        QWORD pte;
+
+        // the range may have been promoted to a 2M page in the meantime
+        if (0 != (pde & PDE_P) && 0 != (pde & PDE_PS))
+        {
+            if (0 == va % PAGE_SIZE_2M && pages - p >= PTE_COUNT)
+            {
+                pPd->Entries[PD_INDEX(va)] = 0ULL;
+
+                _MmRetireFrames(flushVa, va + PAGE_SIZE_2M, frames, count);
+                count = 0;
+                flushVa = va + PAGE_SIZE_2M;
+
+                if (0 == (MAP_FLG_SKIP_PHYPAGE_CHECK & Flags))
+                {
+                    MmFreePhysicalRange(CLEAN_PHYADDR(pde) & ~(PAGE_SIZE_2M - 1), PAGE_SIZE_2M);
+                }
+
+                p += PTE_COUNT - 1;
+                continue;
+            }
+
+            status = _MmSplitLargePage(va);
+            if (!NT_SUCCESS(status))
+            {
+                LogWithInfo("[ERROR] _MmSplitLargePage failed for %018p: 0x%08x\n", va, status);
+                end = va;
+                break;
+            }
+        }
+
+        pte = pPt->Entries[idx];
+        pPt->Entries[idx] = 0ULL;
+
+        if (0 == (MAP_FLG_SKIP_PHYPAGE_CHECK & Flags) && 0 != (pte & PTE_P))
+        {
+            frames[count++] = CLEAN_PHYADDR(pte);
+        }
+
+        if (MM_MAP_BATCH == count)
+        {
+            _MmRetireFrames(flushVa, va + PAGE_SIZE_4K, frames, count);
+            count = 0;
+            flushVa = va + PAGE_SIZE_4K;
+        }
+    }
+
+    // what was cleared before a failed split is gone as well
+    _MmRetireFrames(flushVa, end, frames, count);
+
+    return status;
+}
+
+
+NTSTATUS
+MmUnmapRangeAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Length,
+    _In_ DWORD Flags
+)
+{
+    KE_MCS_HANDLE lock;
+    NTSTATUS status;
+
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+    status = _MmUnmapRangeAndNull(Ptr, Length, Flags);
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+static
+BOOLEAN
+_MmDumpCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    static const PCHAR levelNames[] = { "", "PTE", "PDE", "PDPE", "PML4E" };
+
+    UNREFERENCED_PARAMETER(Context);
+
+    if (mmWalkTable == Entry->Type)
+    {
+        LogWithInfo("[%s] [%018p, %018p) -> table %018p\n", levelNames[Entry->Level],
+            Entry->Va, Entry->Va + Entry->Size, CLEAN_PHYADDR(Entry->Pte));
+    }
+    else
+    {
+        LogWithInfo("[%s] [%018p, %018p) -> %s page %018p (entry %018p @ %018p)\n", levelNames[Entry->Level],
+            Entry->Va, Entry->Va + Entry->Size,
+            levelPt == Entry->Level ? "4K" : levelPd == Entry->Level ? "2M" : "1G",
+            CLEAN_PHYADDR(Entry->Pte) & ~(gMmLevelSpan[Entry->Level] - 1), Entry->Pte, Entry->PtePtr);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+MmDumpVas(
+    _In_ QWORD VaBase,
+    _In_ QWORD Length
+)
+{
+    MmWalkVaRange(VaBase, Length, MM_WALK_FLG_TABLES, _MmDumpCallback, NULL);
+}
+
+
+//
+// Page table occupancy statistics
+//
+typedef struct _MM_VAS_STATS
+{
+    QWORD       Leaves[4];          // indexed by TABLE_LEVEL: 4K, 2M and 1G leaves
+    QWORD       Tables[5];          // indexed by the level of the table: PT, PD and PDP pages
+    QWORD       Accessed;
+    QWORD       Dirty;
+    QWORD       Regions2M;          // distinct 2M regions that are mapped with 4K pages
+    QWORD       Last2MRegion;
+} MM_VAS_STATS;
+
+
+static
+BOOLEAN
+_MmStatsCallback(
+    _In_ const MM_WALK_ENTRY *Entry,
+    _Inout_opt_ PVOID Context
+)
+{
+    MM_VAS_STATS *pStats = (MM_VAS_STATS *)Context;
+
+    if (mmWalkTable == Entry->Type)
+    {
+        // the entry points to a table of the next level
+        pStats->Tables[Entry->Level - 1]++;
+        return TRUE;
+    }
+
+    pStats->Leaves[Entry->Level]++;
+
+    if (0 != (Entry->Pte & PTE_A))
+    {
+        pStats->Accessed++;
+    }
+
+    if (0 != (Entry->Pte & PTE_D))
+    {
+        pStats->Dirty++;
+    }
+
+    if (levelPt == Entry->Level)
+    {
+        QWORD region = ROUND_DOWN(Entry->Va, PAGE_SIZE_2M) + PAGE_SIZE_2M;
+        if (region != pStats->Last2MRegion)
+        {
+            pStats->Last2MRegion = region;
+            pStats->Regions2M++;
+        }
+    }
+
+    return TRUE;
+}
+
+
+VOID
+MmDumpPagingStatistics(
+    VOID
+)
+{
+    static const struct
+    {
+        PCHAR   Name;
+        QWORD   Base;
+    } windows[] =
+    {
+        { "LOWMEM",     VAS_LOWMEM },
+        { "KERNEL",     VAS_KERNEL },
+        { "STACK",      VAS_STACK },
+        { "POOL",       VAS_POOL },
+        { "ONDEMAND",   VAS_ONDEMAND },
+        { "VIRTUAL",    VAS_VIRTUAL },
+    };
+    QWORD totalTables = 1;  // the PML4
+
+    NLog("[VIRTMEM] %-9s %8s %6s %6s %6s %6s %6s %8s %8s %8s\n",
+        "VAS", "4K", "2M", "1G", "PT", "PD", "PDP", "TLB", "TLB(2M)", "A/D");
+
+    for (DWORD i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+    {
+        MM_VAS_STATS stats = { 0 };
+        KE_MCS_HANDLE lock;
+        QWORD tables;
+
+        // the other CPUs may free or split the tables we walk through
+        KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+        MmWalkVaRange(windows[i].Base, VAS_MAX_SIZE, MM_WALK_FLG_TABLES, _MmStatsCallback, &stats);
+        KeReleaseMcsLockIrqRestore(&lock);
+
+        tables = stats.Tables[levelPt] + stats.Tables[levelPd] + stats.Tables[levelPdp];
+        totalTables += tables;
+
+        // TLB entries needed to cover the window as it is mapped now, and if every 4K-mapped 2M region were a 2M page
+        NLog("[VIRTMEM] %-9s %8d %6d %6d %6d %6d %6d %8d %8d %4d/%d\n", windows[i].Name,
+            stats.Leaves[levelPt], stats.Leaves[levelPd], stats.Leaves[levelPdp],
+            stats.Tables[levelPt], stats.Tables[levelPd], stats.Tables[levelPdp],
+            stats.Leaves[levelPt] + stats.Leaves[levelPd] + stats.Leaves[levelPdp],
+            stats.Regions2M + stats.Leaves[levelPd] + stats.Leaves[levelPdp],
+            stats.Accessed, stats.Dirty);
+    }
+
+    NLog("[VIRTMEM] Paging structures: %d pages (%d KB)\n", totalTables, ByteToKb(totalTables * PAGE_SIZE_4K));
+    NLog("[VIRTMEM] Huge pages: %d candidates, %d promoted in place, %d migrated, %d failed, %d split\n",
+        gMmPromotionStats.Candidates, gMmPromotionStats.Promoted, gMmPromotionStats.Migrated,
+        gMmPromotionStats.Failed, gMmPromotionStats.Split);
+}
+
+
+//
+// Page colouring benchmark
+//
+// The same walk is timed over three buffers of MM_COLOUR_BENCH_WAYS cache ways each: frames with the colour of their
+// VA, frames crowded on a few colours and frames from the first fit allocator. The walk touches one line of every
+// page before moving to the next line, so the prefetchers don't help and every page competes for the sets of its
+// colour: the crowded buffer only gets 1 / MM_COLOUR_BENCH_CROWDING of the cache.
+//
+#define MM_COLOUR_BENCH_WAYS        4
+#define MM_COLOUR_BENCH_CROWDING    16
+#define MM_COLOUR_BENCH_PASSES      8
+#define MM_BENCH_LINE               64
+
+typedef enum _MM_COLOUR_BENCH_KIND
+{
+    mmColourBenchVa = 0,            // the colour of the VA
+    mmColourBenchCrowded,           // the colour of the VA, modulo colours / MM_COLOUR_BENCH_CROWDING
+    mmColourBenchFirstFit,          // whatever the bitmap gives first
+} MM_COLOUR_BENCH_KIND;
+
+
+// Maps Pages pages at a new range of the VIRTUAL window, the frames are chosen by Kind
+static
+NTSTATUS
+_MmColourBenchMap(
+    _In_ MM_COLOUR_BENCH_KIND Kind,
+    _In_ DWORD Pages,
+    _Out_ QWORD *Va
+)
+{
+    NTSTATUS status;
+    QWORD base = 0;
+    DWORD mapped = 0;
+    DWORD crowded = MAX(MmGetPageColourCount() / MM_COLOUR_BENCH_CROWDING, 1);
+    KE_MCS_HANDLE lock;
+
+    KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+    status = _MmGetFreeRangeInVas(VAS_VIRTUAL, VAS_VIRTUAL_SIZE, (Pages + 2) * PAGE_SIZE_4K, &base);
+    if (!NT_SUCCESS(status))
+    {
+        goto _cleanup_and_exit;
+    }
+
+    base += PAGE_SIZE_4K;
+
+    for (; mapped < Pages; mapped++)
+    {
+        QWORD va = base + (QWORD)mapped * PAGE_SIZE_4K;
+        QWORD frame = 0;
+
+        if (mmColourBenchFirstFit == Kind)
+        {
+            status = MmAllocPhysicalPage(&frame);
+        }
+        else if (mmColourBenchCrowded == Kind)
+        {
+            status = MmAllocPhysicalPageColoured((QWORD)(MmGetPageColour(va) % crowded) * PAGE_SIZE_4K, &frame);
+        }
+        else
+        {
+            status = MmAllocPhysicalPageColoured(va, &frame);
+        }
+
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        status = MmMapFrames(va, &frame, 1, PTE_RW | PTE_US);
+        if (!NT_SUCCESS(status))
+        {
+            MmFreePhysicalPage(frame);
+            break;
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        if (mapped)
+        {
+            PVOID ptr = (PVOID)base;
+            _MmUnmapRangeAndNull(&ptr, mapped * PAGE_SIZE_4K, 0);
+        }
+
+        goto _cleanup_and_exit;
+    }
+
+    *Va = base;
+
+_cleanup_and_exit:
+    KeReleaseMcsLockIrqRestore(&lock);
+
+    return status;
+}
+
+
+// Cycles per access of the column major walk, after a pass that brings in what fits in the cache
+static
+QWORD
+_MmColourBenchWalk(
+    _In_ QWORD Va,
+    _In_ DWORD Pages
+)
+{
+    volatile QWORD sum = 0;
+    QWORD start = 0;
+
+    for (DWORD pass = 0; pass <= MM_COLOUR_BENCH_PASSES; pass++)
+    {
+        if (1 == pass)
+        {
+            start = __rdtsc();
+        }
+
+        for (DWORD line = 0; line < PAGE_SIZE_4K; line += MM_BENCH_LINE)
+        {
+            for (DWORD page = 0; page < Pages; page++)
+            {
+                sum += *(volatile QWORD *)(Va + (QWORD)page * PAGE_SIZE_4K + line);
+            }
+        }
+    }
+
+    return (__rdtsc() - start) / ((QWORD)MM_COLOUR_BENCH_PASSES * Pages * (PAGE_SIZE_4K / MM_BENCH_LINE));
+}
+
+
+VOID
+MmBenchmarkPageColouring(
+    VOID
+)
+{
+    static const PCHAR names[] = { "VA colour", "crowded", "first fit" };
+    DWORD pages = MmGetPageColourCount() * MM_COLOUR_BENCH_WAYS;
+
+    if (1 == MmGetPageColourCount())
+    {
+        NLog("[VIRTMEM] Page colouring benchmark skipped, the cache geometry is unknown\n");
+        return;
+    }
+
+    for (DWORD kind = mmColourBenchVa; kind <= mmColourBenchFirstFit; kind++)
+    {
+        QWORD va = 0;
+        PVOID ptr;
+        NTSTATUS status = _MmColourBenchMap((MM_COLOUR_BENCH_KIND)kind, pages, &va);
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] _MmColourBenchMap failed for %d pages: 0x%08x\n", pages, status);
+            return;
+        }
+
+        NLog("[VIRTMEM] Strided walk over %d pages, %-10s: %d cycles per access\n",
+            pages, names[kind], _MmColourBenchWalk(va, pages));
+
+        ptr = (PVOID)va;
+        MmUnmapRangeAndNull(&ptr, pages * PAGE_SIZE_4K, 0);
+    }
+}
+
+
+//
+// Large page benchmark
+//
+// A scratch range is committed the way the pool commits its window, once with 4K pages and once with 2M pages, and
+// the same random walk is timed over both. The range is larger than what the STLB covers with 4K pages, so the 4K
+// walk pays for page walks that the 2M one doesn't.
+//
+#define MM_TLB_BENCH_SIZE           (16 * ONE_MB)
+#define MM_TLB_BENCH_ACCESSES       (256 * 1024)
+
+
+static
+QWORD
+_MmTlbBenchWalk(
+    _In_ QWORD Va
+)
+{
+    volatile QWORD sum = 0;
+    QWORD seed = 0x9E3779B97F4A7C15ULL;
+    QWORD start = __rdtsc();
+
+    for (DWORD i = 0; i < MM_TLB_BENCH_ACCESSES; i++)
+    {
+        // xorshift, the same sequence for both walks
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        sum += *(volatile QWORD *)(Va + ROUND_DOWN(seed % MM_TLB_BENCH_SIZE, MM_BENCH_LINE));
+    }
+
+    return (__rdtsc() - start) / MM_TLB_BENCH_ACCESSES;
+}
+
+
+VOID
+MmBenchmarkLargePages(
+    VOID
+)
+{
+    for (DWORD large = 0; large < 2; large++)
+    {
+        MM_VAS_STATS stats = { 0 };
+        KE_MCS_HANDLE lock;
+        QWORD base = 0;
+        NTSTATUS status;
+        PVOID ptr;
+
+        KeAcquireMcsLockIrqSave(&gMmVaLock, &lock);
+
+        status = _MmGetFreeRangeInVas(VAS_VIRTUAL, VAS_VIRTUAL_SIZE, MM_TLB_BENCH_SIZE + 2 * PAGE_SIZE_2M, &base);
+        if (NT_SUCCESS(status))
+        {
+            // the 2M pages need a 2M aligned range; the slack keeps it away from the guard pages of its neighbours
+            base = ROUND_UP(base + PAGE_SIZE_4K, PAGE_SIZE_2M);
+            status = _MmPreAllocVas("BENCH", base, MM_TLB_BENCH_SIZE, PTE_P | PTE_RW | PTE_US, FALSE, (BOOLEAN)large);
+        }
+
+        KeReleaseMcsLockIrqRestore(&lock);
+
+        if (!NT_SUCCESS(status))
+        {
+            LogWithInfo("[ERROR] Failed to commit %d MB for the large page benchmark: 0x%08x\n",
+                ByteToMb(MM_TLB_BENCH_SIZE), status);
+            return;
+        }
+
+        MmWalkVaRange(base, MM_TLB_BENCH_SIZE, 0, _MmStatsCallback, &stats);
+
+        NLog("[VIRTMEM] Random walk over %d MB, %4d 4K + %2d 2M pages: %d cycles per access\n",
+            ByteToMb(MM_TLB_BENCH_SIZE), stats.Leaves[levelPt], stats.Leaves[levelPd], _MmTlbBenchWalk(base));
 
-        LogWithInfo("VA %018p -> PXE @ %018p, PDP @ %018p, PD @ %018p, PT @ %018p\n",
-            va, pPml4, pPdp, pPd, pPt);
-        LogWithInfo("\t\t PXE[%d] = %018p, PDP[%d] = %018p, PD[%d] = %018p, PT[%d] = %018p\n",
-            PML4_INDEX(va), pPml4->Entries[PML4_INDEX(va)], 
-            PDP_INDEX(va), pPdp->Entries[PDP_INDEX(va)],
-            PD_INDEX(va), pPd->Entries[PD_INDEX(va)], 
-            PT_INDEX(va), pPt->Entries[PT_INDEX(va)]);
+        ptr = (PVOID)base;
+        MmUnmapRangeAndNull(&ptr, MM_TLB_BENCH_SIZE, 0);
     }
 }
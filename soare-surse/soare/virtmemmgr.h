@@ -16,6 +16,58 @@ MmMapContigousPhysicalRegion(
     _In_ QWORD Size
 );
 
+NTSTATUS
+MmMapVaToPa(
+    _In_ QWORD PhysicalFrame,
+    _In_ QWORD VirtualAddress,
+    _In_ BOOLEAN LargePage,
+    _In_ WORD Attributes
+);
+
+// Backs [VaBase, VaBase + Length) with fresh frames, using 2M pages where possible
+NTSTATUS
+MmCommitRange(
+    _In_ QWORD VaBase,
+    _In_ DWORD Length
+);
+
+// Unmaps [VaBase, VaBase + Length) and frees the frames
+NTSTATUS
+MmDecommitRange(
+    _In_ QWORD VaBase,
+    _In_ DWORD Length
+);
+
+// Maps Count frames, which don't have to be contiguous, at [VaBase, VaBase + Count * 4K); all of them or none
+NTSTATUS
+MmMapFrames(
+    _In_ QWORD VaBase,
+    _In_ const QWORD *Frames,
+    _In_ DWORD Count,
+    _In_ WORD Attributes
+);
+
+// Virtually contiguous memory backed by frames that don't have to be contiguous; memory is not zeroed
+NTSTATUS
+MmAllocVirtual(
+    _In_ DWORD Size,
+    _In_ DWORD Tag,                     // MM_TAG, the rounded up size is charged to it
+    _Out_ PVOID *Ptr
+);
+
+// STATUS_INVALID_PARAMETER if *Ptr is not a pointer returned by MmAllocVirtual
+NTSTATUS
+MmFreeVirtualAndNull(
+    _Inout_ PVOID *Ptr,
+    _In_ DWORD Tag                      // must be the one given to MmAllocVirtual
+);
+
+NTSTATUS
+MmStackAlloc(
+    _In_ DWORD Size,
+    _Out_ QWORD *StackTop
+);
+
 NTSTATUS
 MmTranslateVa(
     _In_ PVOID Va,
@@ -40,10 +92,74 @@ MmUnmapRangeAndNull(
     _In_ DWORD Flags                    // MAP_FLG_* (must match the ones used at mapping)
 );
 
+NTSTATUS
+MmPromoteLargePages(
+    _In_ QWORD VaBase,
+    _In_ QWORD Length,
+    _Out_opt_ DWORD *Promoted           // number of 2M regions collapsed into 2M pages
+);
+
+VOID
+MmPromoteKernelRegions(
+    VOID
+);
+
+//
+// Page table walker
+//
+typedef enum _MM_WALK_ENTRY_TYPE
+{
+    mmWalkLeaf = 0,     // a present 4K, 2M or 1G page
+    mmWalkHole,         // a non-present entry, reported once for the whole range it covers
+    mmWalkTable,        // a present paging structure, reported before it is walked
+} MM_WALK_ENTRY_TYPE;
+
+typedef struct _MM_WALK_ENTRY
+{
+    MM_WALK_ENTRY_TYPE  Type;
+    BYTE                Level;      // 1 - PT, 2 - PD, 3 - PDP, 4 - PML4
+    QWORD               Va;         // first VA described by this entry (clipped to the walked range)
+    QWORD               Size;       // bytes described by this entry (clipped to the walked range)
+    QWORD               Pte;        // the value of the paging structure entry
+    QWORD *             PtePtr;     // where the entry lives (accessed through the recursive mapping)
+} MM_WALK_ENTRY, *PMM_WALK_ENTRY;
+
+// Return FALSE to stop the walk
+typedef BOOLEAN(*PFN_MmWalkCallback)(_In_ const MM_WALK_ENTRY *Entry, _Inout_opt_ PVOID Context);
+
+#define MM_WALK_FLG_HOLES       0x0001  // also report non-present ranges
+#define MM_WALK_FLG_TABLES      0x0002  // also report the paging structures that are walked
+
+NTSTATUS
+MmWalkVaRange(
+    _In_ QWORD Start,
+    _In_ QWORD Length,
+    _In_ DWORD Flags,                   // MM_WALK_FLG_*
+    _In_ PFN_MmWalkCallback Callback,
+    _Inout_opt_ PVOID Context
+);                                      // STATUS_CANCELLED if the callback stopped the walk
+
 VOID
 MmDumpVas(
     _In_ QWORD VaBase,
     _In_ QWORD Length
 );
 
+VOID
+MmDumpPagingStatistics(
+    VOID
+);
+
+// Times a strided walk over buffers backed by frames of matching, crowded and first fit colours
+VOID
+MmBenchmarkPageColouring(
+    VOID
+);
+
+// Times a random walk over a range committed like the pool window, with 4K and with 2M pages
+VOID
+MmBenchmarkLargePages(
+    VOID
+);
+
 #endif // !_VIRTMEMMGR_H_